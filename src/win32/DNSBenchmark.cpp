@@ -0,0 +1,381 @@
+//
+//  DNSBenchmark.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSBenchmark.h"
+
+#ifdef ZEROCONF_POLL_LOOP
+	#include "DNSPollEventLoop.h"
+#endif
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+
+// time for the daemon to forget the services of one run before the next
+static const uint32_t kSettleMs = 500;
+
+// TXT pairs are limited to 255 bytes, so larger records are padded with several keys
+static const size_t kPadChunk = 200;
+
+static const char kBackgroundPrefix[] = "zcbench bg ";
+static const char kProbePrefix[] = "zcbench probe ";
+
+
+static void AppendSummary(string &out, const char *key, const LatencySummary &summary)
+{
+	char buff[160];
+	sprintf(buff, ",\"%s\":{\"count\":%u,\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+			key, (unsigned)summary.count, summary.p50Ms, summary.p99Ms, summary.maxMs);
+	out += buff;
+}
+
+string BenchmarkResult::ToJSON(const string &label) const
+{
+	string out = "{";
+	if(!label.empty())
+	{
+		out += "\"label\":\"";
+		for(char c : label)
+		{
+			if(c == '"' || c == '\\')
+				out += '\\';
+			if((unsigned char)c >= 0x20)
+				out += c;
+		}
+		out += "\",";
+	}
+
+	char buff[160];
+	sprintf(buff, "\"services\":%u,\"txtSize\":%u,\"churnMs\":%u,\"samples\":%u,\"timeouts\":%u",
+			(unsigned)services, (unsigned)txtSize, (unsigned)churnMs, (unsigned)samples, (unsigned)timeouts);
+	out += buff;
+
+	AppendSummary(out, "registered", registered);
+	AppendSummary(out, "found", found);
+	AppendSummary(out, "lost", lost);
+	out += "}";
+	return out;
+}
+
+
+
+DNSBenchmark::DNSBenchmark(const BenchmarkConfig &config, BaseDNSEventLoop &loop, const Completion &completion)
+: config(config)
+, loop(loop)
+, completion(completion)
+, publisher(nullptr)
+, browser(nullptr)
+, run(0)
+, services(0)
+, txtSize(0)
+, churnMs(0)
+, stage(kStageIdle)
+, backgroundFound(0)
+, churnNext(0)
+, sample(0)
+, probe(nullptr)
+, probeRegistered(false)
+, probeFound(false)
+, timeouts(0)
+, stageTimer(0)
+, churnTimer(0)
+{
+
+}
+
+DNSBenchmark::~DNSBenchmark()
+{
+	Cancel(stageTimer);
+	Cancel(churnTimer);
+#ifdef ZEROCONF_POLL_LOOP
+	if(publisher)
+	{
+		static_cast<DNSPollEventLoop&>(loop).Unnest(&publisher->EventLoop());
+		static_cast<DNSPollEventLoop&>(loop).Unnest(&browser->EventLoop());
+	}
+#endif
+	delete publisher;
+	delete browser;
+}
+
+void DNSBenchmark::Start()
+{
+	// two managers, so that publishing and browsing use separate daemon connections like two peers would
+	publisher = new DNSServiceManager(this);
+	browser = new DNSServiceManager(this);
+#ifdef ZEROCONF_POLL_LOOP
+	// their loops only run when polled, which the host only does for loop
+	static_cast<DNSPollEventLoop&>(loop).Nest(&publisher->EventLoop());
+	static_cast<DNSPollEventLoop&>(loop).Nest(&browser->EventLoop());
+#endif
+
+	// completion always runs from a timer, even for an empty sweep
+	run = 0;
+	Schedule(stageTimer, 0, [this](){
+		StartRun();
+	});
+}
+
+void DNSBenchmark::Schedule(TimerHandle &timer, uint32_t milliseconds, const function<void()> &callback)
+{
+	Cancel(timer);
+	timer = loop.ScheduleTimer(milliseconds, [&timer, callback](){
+		timer = 0;
+		callback();
+	});
+}
+
+void DNSBenchmark::Cancel(TimerHandle &timer)
+{
+	loop.CancelTimer(timer);
+	timer = 0;
+}
+
+double DNSBenchmark::Since(Clock::time_point start)
+{
+	return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+LatencySummary DNSBenchmark::Summarize(vector<double> &samples)
+{
+	LatencySummary summary = {samples.size(), 0, 0, 0};
+	if(samples.empty())
+		return summary;
+
+	// nearest rank percentiles
+	sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	summary.p50Ms = samples[(size_t)ceil(0.50 * n) - 1];
+	summary.p99Ms = samples[(size_t)ceil(0.99 * n) - 1];
+	summary.maxMs = samples[n - 1];
+	return summary;
+}
+
+ServiceInfo DNSBenchmark::MakeService(const string &name) const
+{
+	ServiceInfo si;
+	si.setName(name.c_str());
+	si.setType(config.type.c_str());
+	si.port = 9;
+
+	size_t remaining = txtSize;
+	for(int key = 0; remaining > 0; key++)
+	{
+		size_t chunk = min(remaining, kPadChunk);
+		char keyName[16];
+		sprintf(keyName, "p%d", key);
+		si.setData(keyName, string(chunk, 'x').c_str());
+		remaining -= chunk;
+	}
+	return si;
+}
+
+void DNSBenchmark::StartRun()
+{
+	size_t txtCount = config.txtSizes.size();
+	size_t churnCount = config.churnIntervals.size();
+	size_t total = config.serviceCounts.size() * txtCount * churnCount;
+	if(run >= total)
+	{
+		// the completion may delete this benchmark
+		Completion done = completion;
+		vector<BenchmarkResult> finished;
+		finished.swap(results);
+		done(finished);
+		return;
+	}
+
+	services = config.serviceCounts[run / (txtCount * churnCount)];
+	txtSize = config.txtSizes[(run / churnCount) % txtCount];
+	churnMs = config.churnIntervals[run % churnCount];
+
+	sample = 0;
+	timeouts = 0;
+	churnNext = 0;
+	backgroundFound = 0;
+	registeredMs.clear();
+	foundMs.clear();
+	lostMs.clear();
+
+	ServiceInfo query;
+	query.setType(config.type.c_str());
+	if(browser->browse(query) == nullptr)
+	{
+		timeouts = config.samples;
+		FinishRun();
+		return;
+	}
+
+	stage = kStageSettling;
+	for(size_t i = 0; i < services; i++)
+	{
+		char name[64];
+		sprintf(name, "%s%u-%u", kBackgroundPrefix, (unsigned)run, (unsigned)i);
+		background.push_back(publisher->publish(MakeService(name)));
+	}
+
+	// measuring starts once every background service was found, or after the timeout
+	Schedule(stageTimer, services ? config.timeoutMs : 0, [this](){
+		StartSample();
+	});
+}
+
+void DNSBenchmark::FinishRun()
+{
+	Cancel(stageTimer);
+	Cancel(churnTimer);
+	stage = kStageIdle;
+	probe = nullptr;
+
+	publisher->unpublishAll();
+	browser->stopAllBrowsers();
+	background.clear();
+
+	BenchmarkResult result;
+	result.services = services;
+	result.txtSize = txtSize;
+	result.churnMs = churnMs;
+	result.samples = config.samples;
+	result.timeouts = timeouts;
+	result.registered = Summarize(registeredMs);
+	result.found = Summarize(foundMs);
+	result.lost = Summarize(lostMs);
+	results.push_back(result);
+
+	run++;
+	Schedule(stageTimer, kSettleMs, [this](){
+		StartRun();
+	});
+}
+
+void DNSBenchmark::StartSample()
+{
+	if(sample >= config.samples)
+	{
+		FinishRun();
+		return;
+	}
+
+	if(churnMs && !churnTimer && !background.empty())
+	{
+		Schedule(churnTimer, churnMs, [this](){
+			Churn();
+		});
+	}
+
+	char name[64];
+	sprintf(name, "%s%u-%u", kProbePrefix, (unsigned)run, (unsigned)sample);
+	probeName = name;
+	probeRegistered = false;
+	probeFound = false;
+	stage = kStageRegistering;
+
+	Schedule(stageTimer, config.timeoutMs, [this](){
+		FinishSample(true);
+	});
+
+	started = Clock::now();
+	probe = publisher->publish(MakeService(probeName));
+	if(probe == nullptr)
+		FinishSample(true);
+}
+
+void DNSBenchmark::FinishSample(bool timedOut)
+{
+	Cancel(stageTimer);
+	if(timedOut)
+		timeouts++;
+
+	if(probe)
+	{
+		publisher->unpublish(probe);
+		probe = nullptr;
+	}
+
+	stage = kStageIdle;
+	sample++;
+
+	// not from inside the callback that finished the sample
+	Schedule(stageTimer, 0, [this](){
+		StartSample();
+	});
+}
+
+void DNSBenchmark::Churn()
+{
+	size_t index = churnNext++ % background.size();
+
+	char name[64];
+	sprintf(name, "%s%u-%u", kBackgroundPrefix, (unsigned)run, (unsigned)index);
+	publisher->unpublish(background[index]);
+	background[index] = publisher->publish(MakeService(name));
+
+	Schedule(churnTimer, churnMs, [this](){
+		Churn();
+	});
+}
+
+void DNSBenchmark::Message(const ServiceInfo &srv, int errorCode, const char* phase)
+{
+	bool isProbe = probeName == srv.name();
+
+	if(srv.publisher)
+	{
+		if(!isProbe || srv.publisher != probe || stage != kStageRegistering)
+			return;
+
+		if(errorCode != 0)
+			FinishSample(true);
+		else if(!probeRegistered)
+		{
+			probeRegistered = true;
+			registeredMs.push_back(Since(started));
+		}
+		return;
+	}
+
+	if(errorCode != 0)
+		return;
+
+	if(strcmp(phase, "found") == 0)
+	{
+		if(stage == kStageSettling && strncmp(srv.name(), kBackgroundPrefix, sizeof(kBackgroundPrefix) - 1) == 0)
+		{
+			if(++backgroundFound >= services)
+			{
+				Schedule(stageTimer, 0, [this](){
+					StartSample();
+				});
+			}
+		}
+		else if(stage == kStageRegistering && isProbe && !probeFound)
+		{
+			probeFound = true;
+			foundMs.push_back(Since(started));
+
+			// now the way back: unpublish until the browser reports it lost
+			stage = kStageLosing;
+			Schedule(stageTimer, config.timeoutMs, [this](){
+				FinishSample(true);
+			});
+			started = Clock::now();
+			publisher->unpublish(probe);
+			probe = nullptr;
+		}
+	}
+	else if(strcmp(phase, "lost") == 0)
+	{
+		if(stage == kStageLosing && isProbe)
+		{
+			lostMs.push_back(Since(started));
+			FinishSample(false);
+		}
+	}
+}
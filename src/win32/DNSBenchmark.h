@@ -0,0 +1,147 @@
+//
+//  DNSBenchmark.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  End to end discovery latency: a publishing and a browsing manager in one
+//  process, talking through whatever daemon dns_sd reaches on this host.
+//  Every combination of background service count, TXT size and churn rate
+//  is measured separately.
+//
+
+
+#ifndef DNSBenchmark_h
+#define DNSBenchmark_h
+
+#include "DnsWrapper.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+
+struct BenchmarkConfig
+{
+	std::string type;
+	// swept dimensions, every combination is one result
+	std::vector<size_t> serviceCounts;
+	std::vector<size_t> txtSizes;
+	// ms between re-publications of a background service, 0 for none
+	std::vector<uint32_t> churnIntervals;
+	size_t samples;
+	// per stage of a sample, and for the background services to appear
+	uint32_t timeoutMs;
+
+	BenchmarkConfig()
+	: type("_zcbench._tcp")
+	, serviceCounts(1, 0)
+	, txtSizes(1, 0)
+	, churnIntervals(1, 0)
+	, samples(20)
+	, timeoutMs(5000)
+	{
+	}
+};
+
+struct LatencySummary
+{
+	size_t count;
+	double p50Ms;
+	double p99Ms;
+	double maxMs;
+};
+
+struct BenchmarkResult
+{
+	size_t services;
+	size_t txtSize;
+	uint32_t churnMs;
+	size_t samples;
+	size_t timeouts;
+
+	// publish() to "published", publish() to "found", unpublish() to "lost"
+	LatencySummary registered;
+	LatencySummary found;
+	LatencySummary lost;
+
+	// one JSON object without line breaks; label is left out when empty
+	std::string ToJSON(const std::string &label) const;
+};
+
+class DNSBenchmark : public DSNMessageBusBase
+{
+public:
+	typedef std::function<void(const std::vector<BenchmarkResult> &results)> Completion;
+
+	// Timers run on loop, which also calls completion; the benchmark may be
+	// deleted from inside completion.
+	DNSBenchmark(const BenchmarkConfig &config, BaseDNSEventLoop &loop, const Completion &completion);
+	virtual ~DNSBenchmark();
+
+	void Start();
+
+	virtual void Message(const ServiceInfo &srv, int errorCode, const char* phase) override;
+
+	// nearest rank percentiles, sorts samples in place
+	static LatencySummary Summarize(std::vector<double> &samples);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	enum Stage
+	{
+		kStageIdle,
+		kStageSettling,
+		kStageRegistering,
+		kStageLosing,
+	};
+
+	void StartRun();
+	void FinishRun();
+	void StartSample();
+	void FinishSample(bool timedOut);
+	void Churn();
+	void Schedule(TimerHandle &timer, uint32_t milliseconds, const std::function<void()> &callback);
+	void Cancel(TimerHandle &timer);
+
+	ServiceInfo MakeService(const std::string &name) const;
+	static double Since(Clock::time_point start);
+
+	BenchmarkConfig config;
+	BaseDNSEventLoop &loop;
+	Completion completion;
+
+	DNSServiceManager *publisher;
+	DNSServiceManager *browser;
+
+	// index into the sweep, and the combination being measured
+	size_t run;
+	size_t services;
+	size_t txtSize;
+	uint32_t churnMs;
+
+	Stage stage;
+	std::vector<PublisherHandle> background;
+	size_t backgroundFound;
+	size_t churnNext;
+
+	size_t sample;
+	std::string probeName;
+	PublisherHandle probe;
+	Clock::time_point started;
+	bool probeRegistered;
+	bool probeFound;
+
+	std::vector<double> registeredMs;
+	std::vector<double> foundMs;
+	std::vector<double> lostMs;
+	size_t timeouts;
+
+	TimerHandle stageTimer;
+	TimerHandle churnTimer;
+	std::vector<BenchmarkResult> results;
+};
+
+
+#endif /* DNSBenchmark_h */
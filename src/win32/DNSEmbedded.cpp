@@ -0,0 +1,1937 @@
+//
+//  DNSEmbedded.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSEmbedded.h"
+
+#ifdef ZEROCONF_EMBEDDED_MDNS
+
+#include "DNSPacket.h"
+#include "DNSSocket.h"
+
+#include <dns_sd.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if _WINDOWS
+	#include <iphlpapi.h>
+	#pragma comment(lib, "iphlpapi.lib")
+#else
+	#include <ifaddrs.h>
+	#include <net/if.h>
+	#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+// fits an Ethernet frame with IP and UDP headers
+static const size_t kMaxMessage = 1440;
+
+// RFC 6762 section 10: host and SRV records short, everything else long
+static const uint32_t kHostTTL = 120;
+static const uint32_t kServiceTTL = 4500;
+// responses to legacy unicast queries
+static const uint32_t kLegacyTTL = 10;
+
+static const int kProbeCount = 3;
+static const uint32_t kProbeIntervalMs = 250;
+static const int kAnnounceCount = 2;
+static const uint32_t kAnnounceIntervalMs = 1000;
+// a lost simultaneous probe is tried again after this long
+static const uint32_t kProbeDeferMs = 1000;
+
+static const uint32_t kQueryFirstIntervalMs = 1000;
+static const uint32_t kQueryMaxIntervalMs = 60 * 60 * 1000;
+// records said goodbye to, or flushed by a newer unique record, are dropped after this long
+static const uint32_t kGoodbyeMs = 1000;
+// refreshing queries go out at 80, 85, 90 and 95 percent of a record's lifetime
+static const int kRefreshCount = 4;
+// RFC 6762 section 10.4: a reconfirmed record is queried for a few times and
+// flushed if nobody answers for it by then
+static const int kReconfirmQueries = 2;
+static const uint32_t kReconfirmIntervalMs = 1000;
+static const uint32_t kReconfirmMs = 5000;
+
+static const char kServicesName[] = "_services._dns-sd._udp.local.";
+
+
+class DNSEmbeddedEngine;
+
+struct Registration;
+
+struct _DNSServiceRef_t
+{
+	enum Kind
+	{
+		kConnection,
+		kBrowse,
+		kResolve,
+		kAddrInfo,
+		kRegister,
+	};
+
+	typedef function<void(DNSServiceRef ref, DNSServiceFlags flags)> Event;
+
+	DNSEmbeddedEngine *engine;
+	Kind kind;
+	void *context;
+	DNSServiceBrowseReply browseReply;
+	DNSServiceResolveReply resolveReply;
+	DNSServiceGetAddrInfoReply addrReply;
+	DNSServiceRegisterReply registerReply;
+
+	// readable while events wait
+	DNSSocket sock;
+	sockaddr_in address;
+
+	// engine lock
+	deque<Event> events;
+	bool signalled;
+
+	// the browsed type, the resolved instance or the looked up host
+	DNSName query;
+	string regtype;
+	string domain;
+	bool wantA;
+	bool wantAAAA;
+	// last answer of a resolve
+	bool resolved;
+	DNSRecord lastSRV;
+	string lastTXT;
+	Registration *registration;
+
+	// callbacks that ProcessResult() runs may deallocate the ref
+	bool delivering;
+	bool deallocated;
+#ifdef __APPLE__
+	dispatch_source_t source;
+#endif
+
+	_DNSServiceRef_t(Kind kind, void *context)
+	: engine(nullptr)
+	, kind(kind)
+	, context(context)
+	, browseReply(nullptr)
+	, resolveReply(nullptr)
+	, addrReply(nullptr)
+	, registerReply(nullptr)
+	, sock(kNoSocket)
+	, signalled(false)
+	, wantA(false)
+	, wantAAAA(false)
+	, resolved(false)
+	, registration(nullptr)
+	, delivering(false)
+	, deallocated(false)
+#ifdef __APPLE__
+	, source(nullptr)
+#endif
+	{
+		memset(&address, 0, sizeof(address));
+	}
+};
+
+struct Registration
+{
+	enum State
+	{
+		kProbing,
+		kAnnouncing,
+		kLive,
+	};
+
+	DNSServiceRef ref;
+	DNSServiceFlags flags;
+	// requested instance name, and how often it was renamed after conflicts
+	string label;
+	int renames;
+	DNSName serviceType;
+	DNSName instance;
+	DNSName host;
+	uint16_t port;
+	string txt;
+	// PTR, service enumeration PTR, SRV, TXT
+	vector<DNSRecord> records;
+
+	State state;
+	int step;
+	chrono::steady_clock::time_point next;
+	bool announced;
+};
+
+
+class DNSEmbeddedEngine
+{
+public:
+	typedef chrono::steady_clock Clock;
+
+	static DNSEmbeddedEngine *Acquire();
+	static void Release(DNSEmbeddedEngine *engine);
+
+	DNSServiceErrorType Browse(DNSServiceRef ref);
+	DNSServiceErrorType Resolve(DNSServiceRef ref);
+	DNSServiceErrorType GetAddrInfo(DNSServiceRef ref);
+	DNSServiceErrorType Register(DNSServiceRef ref, DNSServiceFlags flags, const string &label, const DNSName &serviceType, const DNSName &host, uint16_t port, const string &txt);
+	void Reconfirm(const DNSRecord &record);
+
+	void AddRef(DNSServiceRef ref);
+	void RemoveRef(DNSServiceRef ref);
+	void TakeEvents(DNSServiceRef ref, deque<_DNSServiceRef_t::Event> &events);
+
+	const DNSName &HostName() const { return hostName; }
+
+	static DNSEmbeddedConfig config;
+
+private:
+	struct CacheEntry
+	{
+		DNSRecord record;
+		Clock::time_point received;
+		Clock::time_point expires;
+		int refreshes;
+		// queries still to go out for a reconfirmation, and when the next one is due
+		int reconfirms;
+		Clock::time_point reconfirmAt;
+	};
+
+	struct Question
+	{
+		DNSName name;
+		uint16_t type;
+		int users;
+		Clock::time_point next;
+		uint32_t intervalMs;
+	};
+
+	DNSEmbeddedEngine();
+	~DNSEmbeddedEngine();
+
+	bool Start();
+	void Stop();
+	void Run();
+	void Wake();
+	bool FindAddresses();
+
+	Clock::time_point Tick(Clock::time_point now);
+	void HandlePacket(const uint8_t *data, size_t length, const sockaddr_in &from, Clock::time_point now);
+	void HandleResponse(const DNSPacketReader &reader, Clock::time_point now);
+	void HandleQuery(const DNSPacketReader &reader, const sockaddr_in &from, Clock::time_point now);
+
+	// cache
+	void CacheRecord(const DNSRecord &record, Clock::time_point now);
+	// only, when given, is the one ref told about the change
+	void Changed(const DNSRecord &record, bool added, uint32_t ttl, DNSServiceRef only = nullptr);
+	void UpdateResolve(DNSServiceRef ref);
+	const CacheEntry *FindCached(const DNSName &name, uint16_t type) const;
+	bool Interested(const DNSName &name, uint16_t type) const;
+	void AnswerFromCache(DNSServiceRef ref, uint16_t type);
+
+	// querier
+	void Ask(const DNSName &name, uint16_t type);
+	void Unask(const DNSName &name, uint16_t type);
+	void SendQueries(Clock::time_point now);
+
+	// responder
+	void BuildRecords(Registration &registration);
+	void Step(Registration &registration, Clock::time_point now);
+	void Conflict(Registration &registration, Clock::time_point now);
+	void CollectAnswerable(vector<const DNSRecord*> &records) const;
+	void CollectAdditionals(const vector<const DNSRecord*> &answers, vector<const DNSRecord*> &additionals) const;
+	void SendRecords(const vector<const DNSRecord*> &records, bool goodbye);
+	void SendResponse(const vector<const DNSRecord*> &answers);
+	void Send(const DNSPacketWriter &writer, const sockaddr_in &to);
+	void Send(const DNSPacketWriter &writer);
+
+	void Push(DNSServiceRef ref, const _DNSServiceRef_t::Event &event);
+	void SignalRefs();
+	uint32_t RandomMs(uint32_t low, uint32_t high);
+
+	mutex lock;
+	size_t users;
+	thread worker;
+	bool stopping;
+
+	DNSSocket sock;
+	DNSSocket wake;
+	sockaddr_in wakeAddress;
+	sockaddr_in group;
+	// copy of config from when the engine started
+	DNSEmbeddedConfig settings;
+
+	DNSName hostName;
+	vector<DNSRecord> hostRecords;
+
+	vector<DNSServiceRef> refs;
+	list<Registration> registrations;
+	unordered_map<DNSName, vector<CacheEntry> > cache;
+	vector<Question> questions;
+
+	// shared records wait a little before they are multicast, so that
+	// answers of other responders can make them unnecessary
+	vector<DNSRecord> pendingAnswers;
+	Clock::time_point pendingAt;
+
+	minstd_rand generator;
+};
+
+DNSEmbeddedConfig DNSEmbeddedEngine::config;
+
+static mutex sEngineLock;
+static DNSEmbeddedEngine *sEngine = nullptr;
+
+
+void DNSEmbeddedConfigure(const DNSEmbeddedConfig &config)
+{
+	lock_guard<mutex> guard(sEngineLock);
+	DNSEmbeddedEngine::config = config;
+}
+
+
+static bool IsLocalDomain(const DNSName &name)
+{
+	DNSName local;
+	DNSNameFromDotted("local.", local);
+	DNSName parent = name;
+	while(parent.size() > local.size())
+	{
+		parent = DNSNameParent(parent);
+	}
+	return DNSNameEqual(parent, local);
+}
+
+// an uncompressed name that takes up exactly length bytes, as rdata passed to dns_sd holds it
+static bool ReadWireName(const uint8_t *data, size_t length, DNSName &name)
+{
+	size_t offset = 0;
+	while(offset < length)
+	{
+		uint8_t label = data[offset];
+		if(label == 0)
+		{
+			if(offset + 1 != length)
+				return false;
+			name.assign((const char*)data, length);
+			return true;
+		}
+		if(label > 63)
+			return false;
+		offset += 1 + label;
+	}
+	return false;
+}
+
+static string SanitizeLabel(const string &label)
+{
+	string clean;
+	for(char c : label)
+	{
+		if(c == '.')
+			break;
+		bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+		clean += valid ? c : '-';
+	}
+	if(clean.empty())
+		clean = "corona";
+	return clean.substr(0, 63);
+}
+
+
+
+DNSEmbeddedEngine::DNSEmbeddedEngine()
+: users(0)
+, stopping(false)
+, sock(kNoSocket)
+, wake(kNoSocket)
+, generator((unsigned)chrono::system_clock::now().time_since_epoch().count())
+{
+	memset(&wakeAddress, 0, sizeof(wakeAddress));
+	memset(&group, 0, sizeof(group));
+}
+
+DNSEmbeddedEngine::~DNSEmbeddedEngine()
+{
+	Stop();
+}
+
+DNSEmbeddedEngine *DNSEmbeddedEngine::Acquire()
+{
+	lock_guard<mutex> guard(sEngineLock);
+	if(sEngine == nullptr)
+	{
+		DNSEmbeddedEngine *engine = new DNSEmbeddedEngine();
+		if(!engine->Start())
+		{
+			delete engine;
+			return nullptr;
+		}
+		sEngine = engine;
+	}
+	sEngine->users++;
+	return sEngine;
+}
+
+void DNSEmbeddedEngine::Release(DNSEmbeddedEngine *engine)
+{
+	// the engine thread never takes sEngineLock, so it can be joined under it
+	lock_guard<mutex> guard(sEngineLock);
+	if(--engine->users > 0)
+		return;
+
+	if(sEngine == engine)
+		sEngine = nullptr;
+	delete engine;
+}
+
+bool DNSEmbeddedEngine::Start()
+{
+	settings = config;
+
+	if(!DNSSocketStartup())
+		return false;
+
+	group.sin_family = AF_INET;
+	group.sin_addr.s_addr = htonl(kMulticastDNSGroup);
+	group.sin_port = htons(settings.port);
+
+	wake = DNSSocketOpenLoopback(wakeAddress);
+	sock = DNSSocketOpenMulticast(settings.port, settings.interfaceAddress);
+	if(wake == kNoSocket || sock == kNoSocket)
+		return false;
+
+	if(!FindAddresses())
+		return false;
+
+	worker = thread([this](){
+		Run();
+	});
+	return true;
+}
+
+void DNSEmbeddedEngine::Stop()
+{
+	if(worker.joinable())
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		Wake();
+		worker.join();
+	}
+
+	DNSSocketClose(sock);
+	DNSSocketClose(wake);
+	sock = kNoSocket;
+	wake = kNoSocket;
+
+	DNSSocketCleanup();
+}
+
+void DNSEmbeddedEngine::Wake()
+{
+	char byte = 0;
+	sendto(wake, &byte, 1, 0, (const sockaddr*)&wakeAddress, sizeof(wakeAddress));
+}
+
+bool DNSEmbeddedEngine::FindAddresses()
+{
+	string label = settings.hostLabel;
+	if(label.empty())
+	{
+		char name[256] = {0};
+		gethostname(name, sizeof(name) - 1);
+		label = name;
+	}
+	DNSName local;
+	DNSNameFromDotted("local.", local);
+	hostName = DNSNamePrepend(SanitizeLabel(label), local);
+
+	hostRecords.clear();
+	DNSRecord record;
+	record.name = hostName;
+	record.unique = true;
+	record.ttl = kHostTTL;
+
+	if(!settings.interfaceAddress.empty())
+	{
+		in_addr address;
+		inet_pton(AF_INET, settings.interfaceAddress.c_str(), &address);
+		record.type = kDNSTypeA;
+		record.rdata.assign((const char*)&address, sizeof(address));
+		hostRecords.push_back(record);
+		return true;
+	}
+
+#if _WINDOWS
+	ULONG size = 16 * 1024;
+	vector<char> buffer(size);
+	ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
+	IP_ADAPTER_ADDRESSES *adapters = (IP_ADAPTER_ADDRESSES*)&buffer[0];
+	if(GetAdaptersAddresses(AF_UNSPEC, flags, NULL, adapters, &size) == ERROR_BUFFER_OVERFLOW)
+	{
+		buffer.resize(size);
+		adapters = (IP_ADAPTER_ADDRESSES*)&buffer[0];
+		if(GetAdaptersAddresses(AF_UNSPEC, flags, NULL, adapters, &size) != NO_ERROR)
+			adapters = nullptr;
+	}
+
+	for(IP_ADAPTER_ADDRESSES *adapter = adapters; adapter; adapter = adapter->Next)
+	{
+		if(adapter->OperStatus != IfOperStatusUp || adapter->IfType == IF_TYPE_SOFTWARE_LOOPBACK)
+			continue;
+
+		for(IP_ADAPTER_UNICAST_ADDRESS *unicast = adapter->FirstUnicastAddress; unicast; unicast = unicast->Next)
+		{
+			const sockaddr *address = unicast->Address.lpSockaddr;
+#else
+	ifaddrs *interfaces = nullptr;
+	if(getifaddrs(&interfaces) != 0)
+		interfaces = nullptr;
+
+	for(ifaddrs *iface = interfaces; iface; iface = iface->ifa_next)
+	{
+		if(!(iface->ifa_flags & IFF_UP) || (iface->ifa_flags & IFF_LOOPBACK))
+			continue;
+
+		{
+			const sockaddr *address = iface->ifa_addr;
+#endif
+			if(address == nullptr)
+				continue;
+
+			if(address->sa_family == AF_INET)
+			{
+				record.type = kDNSTypeA;
+				record.rdata.assign((const char*)&((const sockaddr_in*)address)->sin_addr, 4);
+			}
+			else if(address->sa_family == AF_INET6)
+			{
+				record.type = kDNSTypeAAAA;
+				record.rdata.assign((const char*)&((const sockaddr_in6*)address)->sin6_addr, 16);
+			}
+			else
+			{
+				continue;
+			}
+
+			bool known = false;
+			for(const auto &existing : hostRecords)
+			{
+				known = known || existing.SameAs(record);
+			}
+			if(!known)
+				hostRecords.push_back(record);
+		}
+	}
+
+#if !_WINDOWS
+	if(interfaces)
+		freeifaddrs(interfaces);
+#endif
+
+	// without a network the host is still reachable from itself
+	if(hostRecords.empty())
+	{
+		uint32_t loopback = htonl(INADDR_LOOPBACK);
+		record.type = kDNSTypeA;
+		record.rdata.assign((const char*)&loopback, 4);
+		hostRecords.push_back(record);
+	}
+	return true;
+}
+
+uint32_t DNSEmbeddedEngine::RandomMs(uint32_t low, uint32_t high)
+{
+	return low + (uint32_t)(generator() % (high - low + 1));
+}
+
+
+void DNSEmbeddedEngine::Run()
+{
+	vector<uint8_t> buffer(kMulticastDNSMaxReceive);
+	Clock::time_point deadline = Clock::now();
+
+	while(true)
+	{
+		long long waitMs = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+		bool woken = false;
+		bool readable = DNSSocketWait(sock, wake, waitMs, woken);
+
+		lock_guard<mutex> guard(lock);
+		if(stopping)
+			break;
+
+		if(woken)
+			DNSSocketDrain(wake);
+
+		if(readable)
+		{
+			while(true)
+			{
+				sockaddr_in from;
+				socklen_t fromLength = sizeof(from);
+				int received = (int)recvfrom(sock, (char*)&buffer[0], (int)buffer.size(), 0, (sockaddr*)&from, &fromLength);
+				if(received <= 0)
+					break;
+				if(from.sin_family == AF_INET)
+					HandlePacket(&buffer[0], (size_t)received, from, Clock::now());
+			}
+		}
+
+		deadline = Tick(Clock::now());
+		SignalRefs();
+	}
+}
+
+DNSEmbeddedEngine::Clock::time_point DNSEmbeddedEngine::Tick(Clock::time_point now)
+{
+	Clock::time_point deadline = now + chrono::seconds(60);
+
+	// expired records go, records someone still asks for are refreshed first
+	vector<DNSRecord> expired;
+	vector< pair<DNSName, uint16_t> > reconfirming;
+	for(auto bucket = cache.begin(); bucket != cache.end(); )
+	{
+		auto &entries = bucket->second;
+		for(auto entry = entries.begin(); entry != entries.end(); )
+		{
+			if(entry->expires <= now)
+			{
+				expired.push_back(entry->record);
+				entry = entries.erase(entry);
+				continue;
+			}
+
+			deadline = min(deadline, entry->expires);
+			if(entry->reconfirms > 0)
+			{
+				if(entry->reconfirmAt <= now)
+				{
+					reconfirming.push_back(make_pair(entry->record.name, entry->record.type));
+					entry->reconfirms--;
+					entry->reconfirmAt = now + chrono::milliseconds(kReconfirmIntervalMs);
+				}
+				if(entry->reconfirms > 0)
+					deadline = min(deadline, entry->reconfirmAt);
+			}
+			if(entry->refreshes < kRefreshCount && Interested(entry->record.name, entry->record.type))
+			{
+				auto lifetime = entry->expires - entry->received;
+				Clock::time_point refreshAt = entry->received + lifetime * (80 + 5 * entry->refreshes) / 100;
+				if(refreshAt <= now)
+				{
+					entry->refreshes++;
+					for(auto &question : questions)
+					{
+						if(question.type == entry->record.type && DNSNameEqual(question.name, entry->record.name))
+							question.next = now;
+					}
+				}
+				else
+				{
+					deadline = min(deadline, refreshAt);
+				}
+			}
+			++entry;
+		}
+
+		if(entries.empty())
+			bucket = cache.erase(bucket);
+		else
+			++bucket;
+	}
+
+	// Without known answers: the record is in doubt, so whoever still holds
+	// it has to answer. A reconfirmed record expires within seconds anyway,
+	// so regular queries leave it out as well.
+	if(!reconfirming.empty())
+	{
+		DNSPacketWriter writer(kMaxMessage);
+		writer.Reset(0, 0);
+		for(const auto &question : reconfirming)
+		{
+			if(!writer.AddQuestion(question.first, question.second, false))
+			{
+				Send(writer);
+				writer.Reset(0, 0);
+				writer.AddQuestion(question.first, question.second, false);
+			}
+		}
+		Send(writer);
+	}
+
+	for(const auto &record : expired)
+	{
+		Changed(record, false, 0);
+	}
+
+	for(auto &registration : registrations)
+	{
+		if(registration.state != Registration::kLive && registration.next <= now)
+			Step(registration, now);
+		if(registration.state != Registration::kLive)
+			deadline = min(deadline, registration.next);
+	}
+
+	SendQueries(now);
+	for(const auto &question : questions)
+	{
+		deadline = min(deadline, question.next);
+	}
+
+	if(!pendingAnswers.empty())
+	{
+		if(pendingAt <= now)
+		{
+			vector<const DNSRecord*> answers;
+			for(const auto &record : pendingAnswers)
+			{
+				answers.push_back(&record);
+			}
+			SendResponse(answers);
+			pendingAnswers.clear();
+		}
+		else
+		{
+			deadline = min(deadline, pendingAt);
+		}
+	}
+
+	return deadline;
+}
+
+
+void DNSEmbeddedEngine::HandlePacket(const uint8_t *data, size_t length, const sockaddr_in &from, Clock::time_point now)
+{
+	DNSPacketReader reader(data, length);
+	if(!reader.Parse())
+		return;
+
+	if(reader.IsResponse())
+	{
+		// RFC 6762 section 6: responses from anywhere but the mDNS port are not trusted
+		if(from.sin_port == htons(settings.port))
+			HandleResponse(reader, now);
+	}
+	else
+	{
+		HandleQuery(reader, from, now);
+	}
+}
+
+void DNSEmbeddedEngine::HandleResponse(const DNSPacketReader &reader, Clock::time_point now)
+{
+	for(const auto &raw : reader.Records())
+	{
+		DNSRecord record;
+		if(!reader.ReadRecord(raw, record))
+			continue;
+
+		// someone else answers with the same record, ours need not go out
+		for(auto pending = pendingAnswers.begin(); pending != pendingAnswers.end(); )
+		{
+			if(pending->SameAs(record) && record.ttl >= pending->ttl / 2)
+				pending = pendingAnswers.erase(pending);
+			else
+				++pending;
+		}
+
+		// a different unique record under one of our names is a conflict
+		if(record.unique && record.ttl > 0 && (record.type == kDNSTypeSRV || record.type == kDNSTypeTXT))
+		{
+			for(auto &registration : registrations)
+			{
+				if(!DNSNameEqual(record.name, registration.instance))
+					continue;
+
+				bool ours = false;
+				for(const auto &own : registration.records)
+				{
+					ours = ours || own.SameAs(record);
+				}
+				if(!ours)
+				{
+					Conflict(registration, now);
+					break;
+				}
+			}
+		}
+
+		CacheRecord(record, now);
+	}
+}
+
+void DNSEmbeddedEngine::HandleQuery(const DNSPacketReader &reader, const sockaddr_in &from, Clock::time_point now)
+{
+	// queries from other ports than the mDNS one are legacy unicast and get a plain DNS answer
+	bool legacy = from.sin_port != htons(settings.port);
+
+	vector<DNSRecord> knownAnswers;
+	vector<DNSRecord> proposed;
+	for(const auto &raw : reader.Records())
+	{
+		DNSRecord record;
+		if(!reader.ReadRecord(raw, record))
+			continue;
+		if(raw.section == DNSPacketReader::kAnswer)
+			knownAnswers.push_back(record);
+		else if(raw.section == DNSPacketReader::kAuthority)
+			proposed.push_back(record);
+	}
+
+	// known answers that follow a truncated query make pending answers unnecessary
+	for(const auto &known : knownAnswers)
+	{
+		for(auto pending = pendingAnswers.begin(); pending != pendingAnswers.end(); )
+		{
+			if(pending->SameAs(known) && known.ttl >= pending->ttl / 2)
+				pending = pendingAnswers.erase(pending);
+			else
+				++pending;
+		}
+	}
+
+	// Simultaneous probes: the lexicographically later proposal wins, the
+	// loser tries again a second later. Only the SRV records are compared.
+	for(const auto &record : proposed)
+	{
+		if(record.type != kDNSTypeSRV)
+			continue;
+
+		for(auto &registration : registrations)
+		{
+			if(registration.state != Registration::kProbing || !DNSNameEqual(record.name, registration.instance))
+				continue;
+
+			const DNSRecord &ours = registration.records[2];
+			if(ours.SameAs(record))
+				continue;
+
+			DNSName ourTarget = DNSNameKey(ours.target);
+			DNSName theirTarget = DNSNameKey(record.target);
+			bool lost = ours.priority != record.priority ? ours.priority < record.priority
+					  : ours.weight != record.weight ? ours.weight < record.weight
+					  : ours.port != record.port ? ours.port < record.port
+					  : ourTarget < theirTarget;
+			if(lost)
+			{
+				registration.step = 0;
+				registration.next = now + chrono::milliseconds(kProbeDeferMs);
+			}
+		}
+	}
+
+	vector<const DNSRecord*> answerable;
+	CollectAnswerable(answerable);
+
+	vector<const DNSRecord*> answers;
+	bool shared = false;
+	for(const auto &question : reader.Questions())
+	{
+		if(question.qclass != kDNSClassIN && question.qclass != kDNSClassANY)
+			continue;
+
+		for(const DNSRecord *record : answerable)
+		{
+			if(question.type != kDNSTypeANY && question.type != record->type)
+				continue;
+			if(!reader.NameEquals(question.name, record->name))
+				continue;
+
+			// RFC 6762 section 7.1: the asker already has it for at least half its lifetime
+			bool suppressed = false;
+			for(const auto &known : knownAnswers)
+			{
+				suppressed = suppressed || (known.SameAs(*record) && known.ttl >= record->ttl / 2);
+			}
+			if(suppressed || find(answers.begin(), answers.end(), record) != answers.end())
+				continue;
+
+			answers.push_back(record);
+			shared = shared || !record->unique;
+		}
+	}
+
+	if(answers.empty())
+		return;
+
+	if(legacy)
+	{
+		DNSPacketWriter writer(kMaxMessage);
+		writer.Reset(reader.ID(), kDNSFlagResponse | kDNSFlagAuthoritative);
+		for(const auto &question : reader.Questions())
+		{
+			DNSName name;
+			if(reader.ReadName(question.name, name))
+				writer.AddQuestion(name, question.type, false);
+		}
+		for(const DNSRecord *record : answers)
+		{
+			DNSRecord plain(*record);
+			plain.unique = false;
+			if(!writer.AddRecord(DNSPacketReader::kAnswer, plain, min(record->ttl, kLegacyTTL)))
+				break;
+		}
+		Send(writer, from);
+		return;
+	}
+
+	if(!shared)
+	{
+		// unique records answer at once, which is also how probes for our names are defended
+		SendResponse(answers);
+		return;
+	}
+
+	// RFC 6762 section 6: shared answers wait 20-120ms, or up to 500ms when more known answers follow
+	Clock::time_point at = now + chrono::milliseconds(reader.IsTruncated() ? RandomMs(400, 500) : RandomMs(20, 120));
+	if(pendingAnswers.empty() || at < pendingAt)
+		pendingAt = at;
+
+	for(const DNSRecord *record : answers)
+	{
+		bool queued = false;
+		for(const auto &pending : pendingAnswers)
+		{
+			queued = queued || pending.SameAs(*record);
+		}
+		if(!queued)
+			pendingAnswers.push_back(*record);
+	}
+	Wake();
+}
+
+
+void DNSEmbeddedEngine::CacheRecord(const DNSRecord &record, Clock::time_point now)
+{
+	vector<CacheEntry> &entries = cache[DNSNameKey(record.name)];
+
+	if(record.ttl == 0)
+	{
+		// RFC 6762 section 10.1: a goodbye leaves the record one more second
+		for(auto &entry : entries)
+		{
+			if(entry.record.SameAs(record))
+				entry.expires = min(entry.expires, now + chrono::milliseconds(kGoodbyeMs));
+		}
+		return;
+	}
+
+	// RFC 6762 section 10.2: the cache flush bit replaces older records of this name and type
+	if(record.unique)
+	{
+		for(auto &entry : entries)
+		{
+			if(entry.record.type == record.type && !entry.record.SameAs(record) && now - entry.received > chrono::milliseconds(kGoodbyeMs))
+				entry.expires = min(entry.expires, now + chrono::milliseconds(kGoodbyeMs));
+		}
+	}
+
+	for(auto &entry : entries)
+	{
+		if(entry.record.SameAs(record))
+		{
+			entry.record.ttl = record.ttl;
+			entry.received = now;
+			entry.expires = now + chrono::seconds(record.ttl);
+			entry.refreshes = 0;
+			entry.reconfirms = 0;
+			return;
+		}
+	}
+
+	CacheEntry entry;
+	entry.record = record;
+	entry.received = now;
+	entry.expires = now + chrono::seconds(record.ttl);
+	entry.refreshes = 0;
+	entry.reconfirms = 0;
+	entries.push_back(entry);
+
+	Changed(record, true, record.ttl);
+}
+
+const DNSEmbeddedEngine::CacheEntry *DNSEmbeddedEngine::FindCached(const DNSName &name, uint16_t type) const
+{
+	auto bucket = cache.find(DNSNameKey(name));
+	if(bucket == cache.end())
+		return nullptr;
+
+	// the freshest one, older ones may be on their way out after a flush
+	const CacheEntry *found = nullptr;
+	for(const auto &entry : bucket->second)
+	{
+		if(entry.record.type == type && (found == nullptr || entry.received > found->received))
+			found = &entry;
+	}
+	return found;
+}
+
+bool DNSEmbeddedEngine::Interested(const DNSName &name, uint16_t type) const
+{
+	for(const auto &question : questions)
+	{
+		if(question.type == type && DNSNameEqual(question.name, name))
+			return true;
+	}
+	return false;
+}
+
+void DNSEmbeddedEngine::Changed(const DNSRecord &record, bool added, uint32_t ttl, DNSServiceRef only)
+{
+	for(DNSServiceRef ref : refs)
+	{
+		if((only && ref != only) || !DNSNameEqual(ref->query, record.name))
+			continue;
+
+		switch(ref->kind)
+		{
+			case _DNSServiceRef_t::kBrowse:
+				if(record.type == kDNSTypePTR)
+				{
+					string instance = DNSNameFirstLabel(record.target);
+					string regtype = ref->regtype;
+					string domain = ref->domain;
+					DNSServiceFlags flags = added ? kDNSServiceFlagsAdd : 0;
+					Push(ref, [instance, regtype, domain, flags](DNSServiceRef ref, DNSServiceFlags more) {
+						ref->browseReply(ref, flags | more, kDNSServiceInterfaceIndexAny, kDNSServiceErr_NoError, instance.c_str(), regtype.c_str(), domain.c_str(), ref->context);
+					});
+				}
+				break;
+
+			case _DNSServiceRef_t::kResolve:
+				if(added && (record.type == kDNSTypeSRV || record.type == kDNSTypeTXT))
+					UpdateResolve(ref);
+				break;
+
+			case _DNSServiceRef_t::kAddrInfo:
+				if((record.type == kDNSTypeA && ref->wantA) || (record.type == kDNSTypeAAAA && ref->wantAAAA))
+				{
+					string hostname = DNSNameToDotted(record.name);
+					string rdata = record.rdata;
+					DNSServiceFlags flags = added ? kDNSServiceFlagsAdd : 0;
+					Push(ref, [hostname, rdata, flags, ttl](DNSServiceRef ref, DNSServiceFlags more) {
+						sockaddr_in6 storage;
+						memset(&storage, 0, sizeof(storage));
+						if(rdata.size() == 4)
+						{
+							sockaddr_in *address = (sockaddr_in*)&storage;
+							address->sin_family = AF_INET;
+							memcpy(&address->sin_addr, rdata.data(), 4);
+						}
+						else
+						{
+							storage.sin6_family = AF_INET6;
+							memcpy(&storage.sin6_addr, rdata.data(), 16);
+						}
+						ref->addrReply(ref, flags | more, kDNSServiceInterfaceIndexAny, kDNSServiceErr_NoError, hostname.c_str(), (const sockaddr*)&storage, ttl, ref->context);
+					});
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+void DNSEmbeddedEngine::UpdateResolve(DNSServiceRef ref)
+{
+	// like the daemon, a resolve answers once SRV and TXT are both known
+	const CacheEntry *srv = FindCached(ref->query, kDNSTypeSRV);
+	const CacheEntry *txt = FindCached(ref->query, kDNSTypeTXT);
+	if(srv == nullptr || txt == nullptr)
+		return;
+	if(ref->resolved && ref->lastSRV.SameAs(srv->record) && ref->lastTXT == txt->record.rdata)
+		return;
+
+	ref->resolved = true;
+	ref->lastSRV = srv->record;
+	ref->lastTXT = txt->record.rdata;
+
+	string fullname = DNSNameToDotted(ref->query);
+	string hosttarget = DNSNameToDotted(srv->record.target);
+	uint16_t port = htons(srv->record.port);
+	string bytes = txt->record.rdata;
+	Push(ref, [fullname, hosttarget, port, bytes](DNSServiceRef ref, DNSServiceFlags more) {
+		ref->resolveReply(ref, more, kDNSServiceInterfaceIndexAny, kDNSServiceErr_NoError, fullname.c_str(), hosttarget.c_str(), port,
+						  (uint16_t)bytes.size(), (const unsigned char*)bytes.data(), ref->context);
+	});
+}
+
+void DNSEmbeddedEngine::AnswerFromCache(DNSServiceRef ref, uint16_t type)
+{
+	auto bucket = cache.find(DNSNameKey(ref->query));
+	if(bucket == cache.end())
+		return;
+
+	Clock::time_point now = Clock::now();
+	for(const auto &entry : bucket->second)
+	{
+		if(entry.record.type != type || entry.expires <= now)
+			continue;
+
+		uint32_t remaining = (uint32_t)chrono::duration_cast<chrono::seconds>(entry.expires - now).count();
+		Changed(entry.record, true, remaining, ref);
+	}
+}
+
+
+void DNSEmbeddedEngine::Ask(const DNSName &name, uint16_t type)
+{
+	for(auto &question : questions)
+	{
+		if(question.type == type && DNSNameEqual(question.name, name))
+		{
+			question.users++;
+			return;
+		}
+	}
+
+	// RFC 6762 section 5.2: the first query after 20-120ms, then doubling intervals
+	Question question;
+	question.name = name;
+	question.type = type;
+	question.users = 1;
+	question.next = Clock::now() + chrono::milliseconds(RandomMs(20, 120));
+	question.intervalMs = kQueryFirstIntervalMs;
+	questions.push_back(question);
+	Wake();
+}
+
+void DNSEmbeddedEngine::Unask(const DNSName &name, uint16_t type)
+{
+	for(auto question = questions.begin(); question != questions.end(); ++question)
+	{
+		if(question->type == type && DNSNameEqual(question->name, name))
+		{
+			if(--question->users == 0)
+				questions.erase(question);
+			return;
+		}
+	}
+}
+
+void DNSEmbeddedEngine::SendQueries(Clock::time_point now)
+{
+	// questions due soon go along with the ones due now
+	Clock::time_point horizon = now + chrono::milliseconds(50);
+	vector<Question*> due;
+	for(auto &question : questions)
+	{
+		if(question.next <= horizon)
+			due.push_back(&question);
+	}
+	if(due.empty())
+		return;
+
+	bool anyDueNow = false;
+	for(Question *question : due)
+	{
+		anyDueNow = anyDueNow || question->next <= now;
+	}
+	if(!anyDueNow)
+		return;
+
+	DNSPacketWriter writer(kMaxMessage);
+	writer.Reset(0, 0);
+	for(Question *question : due)
+	{
+		if(!writer.AddQuestion(question->name, question->type, false))
+		{
+			Send(writer);
+			writer.Reset(0, 0);
+			writer.AddQuestion(question->name, question->type, false);
+		}
+		question->next = now + chrono::milliseconds(question->intervalMs);
+		question->intervalMs = min(question->intervalMs * 2, kQueryMaxIntervalMs);
+	}
+
+	// RFC 6762 section 7.1: records known for more than half their lifetime go along as known answers
+	for(Question *question : due)
+	{
+		auto bucket = cache.find(DNSNameKey(question->name));
+		if(bucket == cache.end())
+			continue;
+
+		for(const auto &entry : bucket->second)
+		{
+			if(entry.record.type != question->type || entry.expires <= now)
+				continue;
+
+			auto remaining = chrono::duration_cast<chrono::seconds>(entry.expires - now).count();
+			if(remaining * 2 < (long long)entry.record.ttl)
+				continue;
+
+			if(!writer.AddRecord(DNSPacketReader::kAnswer, entry.record, (uint32_t)remaining))
+			{
+				// the rest follows in another packet
+				writer.SetFlags(kDNSFlagTruncated);
+				Send(writer);
+				writer.Reset(0, 0);
+				writer.AddRecord(DNSPacketReader::kAnswer, entry.record, (uint32_t)remaining);
+			}
+		}
+	}
+
+	Send(writer);
+}
+
+
+void DNSEmbeddedEngine::BuildRecords(Registration &registration)
+{
+	string label = registration.label;
+	if(registration.renames > 0)
+	{
+		char suffix[16];
+		sprintf(suffix, " (%d)", registration.renames + 1);
+		label = label.substr(0, 63 - strlen(suffix)) + suffix;
+	}
+	registration.instance = DNSNamePrepend(label, registration.serviceType);
+	registration.records.clear();
+
+	DNSRecord ptr;
+	ptr.name = registration.serviceType;
+	ptr.type = kDNSTypePTR;
+	ptr.ttl = kServiceTTL;
+	ptr.target = registration.instance;
+	registration.records.push_back(ptr);
+
+	DNSRecord services;
+	DNSNameFromDotted(kServicesName, services.name);
+	services.type = kDNSTypePTR;
+	services.ttl = kServiceTTL;
+	services.target = registration.serviceType;
+	registration.records.push_back(services);
+
+	DNSRecord srv;
+	srv.name = registration.instance;
+	srv.type = kDNSTypeSRV;
+	srv.unique = true;
+	srv.ttl = kHostTTL;
+	srv.port = registration.port;
+	srv.target = registration.host;
+	registration.records.push_back(srv);
+
+	DNSRecord txt;
+	txt.name = registration.instance;
+	txt.type = kDNSTypeTXT;
+	txt.unique = true;
+	txt.ttl = kServiceTTL;
+	txt.rdata = registration.txt.empty() ? string(1, '\0') : registration.txt;
+	registration.records.push_back(txt);
+}
+
+void DNSEmbeddedEngine::Step(Registration &registration, Clock::time_point now)
+{
+	if(registration.state == Registration::kProbing)
+	{
+		if(registration.step < kProbeCount)
+		{
+			// RFC 6762 section 8.1: ANY for the name, with what we intend to claim in the authority section
+			DNSPacketWriter writer(kMaxMessage);
+			writer.Reset(0, 0);
+			writer.AddQuestion(registration.instance, kDNSTypeANY, registration.step == 0);
+			writer.AddRecord(DNSPacketReader::kAuthority, registration.records[2], registration.records[2].ttl);
+			writer.AddRecord(DNSPacketReader::kAuthority, registration.records[3], registration.records[3].ttl);
+			Send(writer);
+
+			registration.step++;
+			registration.next = now + chrono::milliseconds(kProbeIntervalMs);
+			return;
+		}
+
+		registration.state = Registration::kAnnouncing;
+		registration.step = 0;
+	}
+
+	vector<const DNSRecord*> records;
+	for(const auto &record : registration.records)
+	{
+		records.push_back(&record);
+	}
+	for(const auto &record : hostRecords)
+	{
+		records.push_back(&record);
+	}
+	SendRecords(records, false);
+
+	// our own browsers need not wait for the announcement to loop back
+	for(const auto &record : registration.records)
+	{
+		CacheRecord(record, now);
+	}
+	for(const auto &record : hostRecords)
+	{
+		CacheRecord(record, now);
+	}
+
+	if(registration.step == 0 && !registration.announced)
+	{
+		registration.announced = true;
+		string name = DNSNameFirstLabel(registration.instance);
+		string regtype = DNSServiceTypeOf(registration.serviceType);
+		string domain = DNSServiceDomainOf(registration.serviceType);
+		Push(registration.ref, [name, regtype, domain](DNSServiceRef ref, DNSServiceFlags more) {
+			ref->registerReply(ref, more | kDNSServiceFlagsAdd, kDNSServiceErr_NoError, name.c_str(), regtype.c_str(), domain.c_str(), ref->context);
+		});
+	}
+
+	registration.step++;
+	if(registration.step < kAnnounceCount)
+		registration.next = now + chrono::milliseconds(kAnnounceIntervalMs * registration.step);
+	else
+		registration.state = Registration::kLive;
+}
+
+void DNSEmbeddedEngine::Conflict(Registration &registration, Clock::time_point now)
+{
+	// gave the name up already
+	if(registration.records.empty())
+		return;
+
+	if(registration.state == Registration::kLive || registration.state == Registration::kAnnouncing)
+	{
+		// RFC 6762 section 9: probe again, whoever owns the name will defend it
+		registration.state = Registration::kProbing;
+		registration.step = 0;
+		registration.next = now;
+		return;
+	}
+
+	if(registration.flags & kDNSServiceFlagsNoAutoRename)
+	{
+		string name = DNSNameFirstLabel(registration.instance);
+		string regtype = DNSServiceTypeOf(registration.serviceType);
+		string domain = DNSServiceDomainOf(registration.serviceType);
+		Push(registration.ref, [name, regtype, domain](DNSServiceRef ref, DNSServiceFlags more) {
+			ref->registerReply(ref, more, kDNSServiceErr_NameConflict, name.c_str(), regtype.c_str(), domain.c_str(), ref->context);
+		});
+		// stays quiet until deallocated
+		registration.state = Registration::kLive;
+		registration.records.clear();
+		return;
+	}
+
+	registration.renames++;
+	registration.announced = false;
+	BuildRecords(registration);
+	registration.step = 0;
+	registration.next = now + chrono::milliseconds(RandomMs(0, kProbeIntervalMs));
+}
+
+void DNSEmbeddedEngine::CollectAnswerable(vector<const DNSRecord*> &records) const
+{
+	bool anyAnnounced = false;
+	for(const auto &registration : registrations)
+	{
+		if(registration.state == Registration::kProbing)
+			continue;
+
+		anyAnnounced = true;
+		for(const auto &record : registration.records)
+		{
+			records.push_back(&record);
+		}
+	}
+
+	if(anyAnnounced)
+	{
+		for(const auto &record : hostRecords)
+		{
+			records.push_back(&record);
+		}
+	}
+}
+
+void DNSEmbeddedEngine::CollectAdditionals(const vector<const DNSRecord*> &answers, vector<const DNSRecord*> &additionals) const
+{
+	// RFC 6763 section 12: what a browser will ask for next
+	vector<const DNSRecord*> answerable;
+	CollectAnswerable(answerable);
+
+	for(const DNSRecord *answer : answers)
+	{
+		const DNSName *owner = nullptr;
+		bool wantHost = false;
+		if(answer->type == kDNSTypePTR)
+		{
+			owner = &answer->target;
+			wantHost = true;
+		}
+		else if(answer->type == kDNSTypeSRV)
+		{
+			wantHost = true;
+		}
+
+		for(const DNSRecord *record : answerable)
+		{
+			bool wanted = false;
+			if(owner && (record->type == kDNSTypeSRV || record->type == kDNSTypeTXT) && DNSNameEqual(record->name, *owner))
+				wanted = true;
+			if(wantHost && (record->type == kDNSTypeA || record->type == kDNSTypeAAAA))
+				wanted = true;
+
+			if(wanted
+			   && find(answers.begin(), answers.end(), record) == answers.end()
+			   && find(additionals.begin(), additionals.end(), record) == additionals.end())
+			{
+				additionals.push_back(record);
+			}
+		}
+	}
+}
+
+void DNSEmbeddedEngine::SendRecords(const vector<const DNSRecord*> &records, bool goodbye)
+{
+	DNSPacketWriter writer(kMaxMessage);
+	writer.Reset(0, kDNSFlagResponse | kDNSFlagAuthoritative);
+	for(const DNSRecord *record : records)
+	{
+		uint32_t ttl = goodbye ? 0 : record->ttl;
+		if(!writer.AddRecord(DNSPacketReader::kAnswer, *record, ttl))
+		{
+			Send(writer);
+			writer.Reset(0, kDNSFlagResponse | kDNSFlagAuthoritative);
+			writer.AddRecord(DNSPacketReader::kAnswer, *record, ttl);
+		}
+	}
+	Send(writer);
+}
+
+void DNSEmbeddedEngine::SendResponse(const vector<const DNSRecord*> &answers)
+{
+	vector<const DNSRecord*> additionals;
+	CollectAdditionals(answers, additionals);
+
+	DNSPacketWriter writer(kMaxMessage);
+	writer.Reset(0, kDNSFlagResponse | kDNSFlagAuthoritative);
+	for(const DNSRecord *record : answers)
+	{
+		if(!writer.AddRecord(DNSPacketReader::kAnswer, *record, record->ttl))
+		{
+			Send(writer);
+			writer.Reset(0, kDNSFlagResponse | kDNSFlagAuthoritative);
+			writer.AddRecord(DNSPacketReader::kAnswer, *record, record->ttl);
+		}
+	}
+
+	// additional records only fill what room is left
+	for(const DNSRecord *record : additionals)
+	{
+		if(!writer.AddRecord(DNSPacketReader::kAdditional, *record, record->ttl))
+			break;
+	}
+	Send(writer);
+}
+
+void DNSEmbeddedEngine::Send(const DNSPacketWriter &writer, const sockaddr_in &to)
+{
+	if(writer.Empty())
+		return;
+	sendto(sock, (const char*)writer.Data(), (int)writer.Length(), 0, (const sockaddr*)&to, sizeof(to));
+}
+
+void DNSEmbeddedEngine::Send(const DNSPacketWriter &writer)
+{
+	Send(writer, group);
+}
+
+
+void DNSEmbeddedEngine::Push(DNSServiceRef ref, const _DNSServiceRef_t::Event &event)
+{
+	ref->events.push_back(event);
+}
+
+void DNSEmbeddedEngine::SignalRefs()
+{
+	for(DNSServiceRef ref : refs)
+	{
+		if(ref->events.empty() || ref->signalled)
+			continue;
+
+		// one byte makes the ref's socket readable, ProcessResult() takes it and every event
+		char byte = 0;
+		ref->signalled = true;
+		sendto(wake, &byte, 1, 0, (const sockaddr*)&ref->address, sizeof(ref->address));
+	}
+}
+
+void DNSEmbeddedEngine::AddRef(DNSServiceRef ref)
+{
+	lock_guard<mutex> guard(lock);
+	refs.push_back(ref);
+}
+
+void DNSEmbeddedEngine::TakeEvents(DNSServiceRef ref, deque<_DNSServiceRef_t::Event> &events)
+{
+	lock_guard<mutex> guard(lock);
+	events.swap(ref->events);
+	ref->signalled = false;
+}
+
+void DNSEmbeddedEngine::RemoveRef(DNSServiceRef ref)
+{
+	lock_guard<mutex> guard(lock);
+	refs.erase(remove(refs.begin(), refs.end(), ref), refs.end());
+	ref->events.clear();
+
+	switch(ref->kind)
+	{
+		case _DNSServiceRef_t::kBrowse:
+			Unask(ref->query, kDNSTypePTR);
+			break;
+
+		case _DNSServiceRef_t::kResolve:
+			Unask(ref->query, kDNSTypeSRV);
+			Unask(ref->query, kDNSTypeTXT);
+			break;
+
+		case _DNSServiceRef_t::kAddrInfo:
+			if(ref->wantA)
+				Unask(ref->query, kDNSTypeA);
+			if(ref->wantAAAA)
+				Unask(ref->query, kDNSTypeAAAA);
+			break;
+
+		case _DNSServiceRef_t::kRegister:
+			for(auto registration = registrations.begin(); registration != registrations.end(); ++registration)
+			{
+				if(&*registration != ref->registration)
+					continue;
+
+				if(registration->announced && !registration->records.empty())
+				{
+					// the enumeration PTR stays while other registrations of the type use it
+					bool sharedType = false;
+					for(const auto &other : registrations)
+					{
+						sharedType = sharedType || (&other != &*registration && DNSNameEqual(other.serviceType, registration->serviceType));
+					}
+
+					vector<const DNSRecord*> records;
+					for(const auto &record : registration->records)
+					{
+						if(sharedType && record.type == kDNSTypePTR && !DNSNameEqual(record.name, registration->serviceType))
+							continue;
+						records.push_back(&record);
+					}
+					SendRecords(records, true);
+
+					for(const DNSRecord *record : records)
+					{
+						DNSRecord goodbye(*record);
+						goodbye.ttl = 0;
+						CacheRecord(goodbye, Clock::now());
+					}
+				}
+				registrations.erase(registration);
+				break;
+			}
+			ref->registration = nullptr;
+			break;
+
+		default:
+			break;
+	}
+}
+
+DNSServiceErrorType DNSEmbeddedEngine::Browse(DNSServiceRef ref)
+{
+	lock_guard<mutex> guard(lock);
+	refs.push_back(ref);
+	Ask(ref->query, kDNSTypePTR);
+	AnswerFromCache(ref, kDNSTypePTR);
+	SignalRefs();
+	return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSEmbeddedEngine::Resolve(DNSServiceRef ref)
+{
+	lock_guard<mutex> guard(lock);
+	refs.push_back(ref);
+	Ask(ref->query, kDNSTypeSRV);
+	Ask(ref->query, kDNSTypeTXT);
+	UpdateResolve(ref);
+	SignalRefs();
+	return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSEmbeddedEngine::GetAddrInfo(DNSServiceRef ref)
+{
+	lock_guard<mutex> guard(lock);
+	refs.push_back(ref);
+	if(ref->wantA)
+	{
+		Ask(ref->query, kDNSTypeA);
+		AnswerFromCache(ref, kDNSTypeA);
+	}
+	if(ref->wantAAAA)
+	{
+		Ask(ref->query, kDNSTypeAAAA);
+		AnswerFromCache(ref, kDNSTypeAAAA);
+	}
+	SignalRefs();
+	return kDNSServiceErr_NoError;
+}
+
+void DNSEmbeddedEngine::Reconfirm(const DNSRecord &record)
+{
+	lock_guard<mutex> guard(lock);
+	auto bucket = cache.find(DNSNameKey(record.name));
+	if(bucket == cache.end())
+		return;
+
+	Clock::time_point now = Clock::now();
+	for(auto &entry : bucket->second)
+	{
+		// a reconfirmation already under way is not started over
+		if(!entry.record.SameAs(record) || entry.reconfirms > 0 || entry.expires <= now + chrono::milliseconds(kReconfirmMs))
+			continue;
+
+		entry.reconfirms = kReconfirmQueries;
+		entry.reconfirmAt = now;
+		entry.expires = now + chrono::milliseconds(kReconfirmMs);
+		Wake();
+	}
+}
+
+DNSServiceErrorType DNSEmbeddedEngine::Register(DNSServiceRef ref, DNSServiceFlags flags, const string &label, const DNSName &serviceType, const DNSName &host, uint16_t port, const string &txt)
+{
+	lock_guard<mutex> guard(lock);
+
+	Registration registration;
+	registration.ref = ref;
+	registration.flags = flags;
+	registration.label = label.empty() ? DNSNameFirstLabel(hostName) : label;
+	registration.renames = 0;
+	registration.serviceType = serviceType;
+	registration.host = host.empty() ? hostName : host;
+	registration.port = port;
+	registration.txt = txt;
+	registration.state = Registration::kProbing;
+	registration.step = 0;
+	// RFC 6762 section 8.1: the first probe after a random 0-250ms
+	registration.next = Clock::now() + chrono::milliseconds(RandomMs(0, kProbeIntervalMs));
+	registration.announced = false;
+	BuildRecords(registration);
+
+	registrations.push_back(registration);
+	ref->registration = &registrations.back();
+	refs.push_back(ref);
+	Wake();
+	return kDNSServiceErr_NoError;
+}
+
+
+
+// A ref with an engine and a socket of its own; callbacks are filled in by the caller.
+static DNSServiceErrorType CreateRef(_DNSServiceRef_t::Kind kind, void *context, DNSServiceRef &ref)
+{
+	DNSEmbeddedEngine *engine = DNSEmbeddedEngine::Acquire();
+	if(engine == nullptr)
+		return kDNSServiceErr_ServiceNotRunning;
+
+	ref = new _DNSServiceRef_t(kind, context);
+	ref->engine = engine;
+	ref->sock = DNSSocketOpenLoopback(ref->address);
+	if(ref->sock == kNoSocket)
+	{
+		delete ref;
+		ref = nullptr;
+		DNSEmbeddedEngine::Release(engine);
+		return kDNSServiceErr_NoMemory;
+	}
+	return kDNSServiceErr_NoError;
+}
+
+static void DestroyRef(DNSServiceRef ref)
+{
+	DNSSocketClose(ref->sock);
+	delete ref;
+}
+
+
+extern "C" {
+
+int DNSSD_API DNSServiceRefSockFD(DNSServiceRef sdRef)
+{
+	if(sdRef == nullptr)
+		return -1;
+	return (int)sdRef->sock;
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceProcessResult(DNSServiceRef sdRef)
+{
+	if(sdRef == nullptr)
+		return kDNSServiceErr_BadParam;
+
+	DNSSocketDrain(sdRef->sock);
+	deque<_DNSServiceRef_t::Event> events;
+	sdRef->engine->TakeEvents(sdRef, events);
+
+	sdRef->delivering = true;
+	while(!events.empty() && !sdRef->deallocated)
+	{
+		_DNSServiceRef_t::Event event = events.front();
+		events.pop_front();
+		event(sdRef, events.empty() ? 0 : kDNSServiceFlagsMoreComing);
+	}
+	sdRef->delivering = false;
+
+	if(sdRef->deallocated)
+	{
+#ifdef __APPLE__
+		// the dispatch source's cancel handler frees it
+		if(sdRef->source == nullptr)
+#endif
+			DestroyRef(sdRef);
+	}
+	return kDNSServiceErr_NoError;
+}
+
+void DNSSD_API DNSServiceRefDeallocate(DNSServiceRef sdRef)
+{
+	if(sdRef == nullptr)
+		return;
+
+	DNSEmbeddedEngine *engine = sdRef->engine;
+	engine->RemoveRef(sdRef);
+	sdRef->deallocated = true;
+
+#ifdef __APPLE__
+	if(sdRef->source)
+		dispatch_source_cancel(sdRef->source);
+	else
+#endif
+	if(!sdRef->delivering)
+		DestroyRef(sdRef);
+
+	DNSEmbeddedEngine::Release(engine);
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceCreateConnection(DNSServiceRef *sdRef)
+{
+	if(sdRef == nullptr)
+		return kDNSServiceErr_BadParam;
+
+	DNSServiceRef ref = nullptr;
+	DNSServiceErrorType err = CreateRef(_DNSServiceRef_t::kConnection, nullptr, ref);
+	if(err != kDNSServiceErr_NoError)
+		return err;
+
+	ref->engine->AddRef(ref);
+	*sdRef = ref;
+	return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceBrowse(DNSServiceRef *sdRef,
+											   DNSServiceFlags flags,
+											   uint32_t interfaceIndex,
+											   const char *regtype,
+											   const char *domain,
+											   DNSServiceBrowseReply callBack,
+											   void *context)
+{
+	DNSName fullType;
+	if(sdRef == nullptr || callBack == nullptr || !DNSNameFromServiceType(regtype, domain, fullType))
+		return kDNSServiceErr_BadParam;
+	if(!IsLocalDomain(fullType))
+		return kDNSServiceErr_Unsupported;
+
+	DNSServiceRef ref = nullptr;
+	DNSServiceErrorType err = CreateRef(_DNSServiceRef_t::kBrowse, context, ref);
+	if(err != kDNSServiceErr_NoError)
+		return err;
+
+	ref->browseReply = callBack;
+	ref->query = fullType;
+	ref->regtype = DNSServiceTypeOf(fullType);
+	ref->domain = DNSServiceDomainOf(fullType);
+	*sdRef = ref;
+	return ref->engine->Browse(ref);
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceResolve(DNSServiceRef *sdRef,
+												DNSServiceFlags flags,
+												uint32_t interfaceIndex,
+												const char *name,
+												const char *regtype,
+												const char *domain,
+												DNSServiceResolveReply callBack,
+												void *context)
+{
+	DNSName fullType;
+	if(sdRef == nullptr || callBack == nullptr || name == nullptr || !DNSNameFromServiceType(regtype, domain, fullType))
+		return kDNSServiceErr_BadParam;
+	if(!IsLocalDomain(fullType))
+		return kDNSServiceErr_Unsupported;
+
+	DNSServiceRef ref = nullptr;
+	DNSServiceErrorType err = CreateRef(_DNSServiceRef_t::kResolve, context, ref);
+	if(err != kDNSServiceErr_NoError)
+		return err;
+
+	ref->resolveReply = callBack;
+	ref->query = DNSNamePrepend(name, fullType);
+	*sdRef = ref;
+	return ref->engine->Resolve(ref);
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceGetAddrInfo(DNSServiceRef *sdRef,
+													DNSServiceFlags flags,
+													uint32_t interfaceIndex,
+													DNSServiceProtocol protocol,
+													const char *hostname,
+													DNSServiceGetAddrInfoReply callBack,
+													void *context)
+{
+	DNSName host;
+	if(sdRef == nullptr || callBack == nullptr || !DNSNameFromDotted(hostname, host))
+		return kDNSServiceErr_BadParam;
+	if(!IsLocalDomain(host))
+		return kDNSServiceErr_Unsupported;
+
+	DNSServiceRef ref = nullptr;
+	DNSServiceErrorType err = CreateRef(_DNSServiceRef_t::kAddrInfo, context, ref);
+	if(err != kDNSServiceErr_NoError)
+		return err;
+
+	ref->addrReply = callBack;
+	ref->query = host;
+	ref->wantA = protocol == 0 || (protocol & kDNSServiceProtocol_IPv4);
+	ref->wantAAAA = protocol == 0 || (protocol & kDNSServiceProtocol_IPv6);
+	*sdRef = ref;
+	return ref->engine->GetAddrInfo(ref);
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceRegister(DNSServiceRef *sdRef,
+												 DNSServiceFlags flags,
+												 uint32_t interfaceIndex,
+												 const char *name,
+												 const char *regtype,
+												 const char *domain,
+												 const char *host,
+												 uint16_t port,
+												 uint16_t txtLen,
+												 const void *txtRecord,
+												 DNSServiceRegisterReply callBack,
+												 void *context)
+{
+	DNSName fullType, target;
+	if(sdRef == nullptr || callBack == nullptr || !DNSNameFromServiceType(regtype, domain, fullType))
+		return kDNSServiceErr_BadParam;
+	if(host && *host && !DNSNameFromDotted(host, target))
+		return kDNSServiceErr_BadParam;
+	if(!IsLocalDomain(fullType))
+		return kDNSServiceErr_Unsupported;
+
+	DNSServiceRef ref = nullptr;
+	DNSServiceErrorType err = CreateRef(_DNSServiceRef_t::kRegister, context, ref);
+	if(err != kDNSServiceErr_NoError)
+		return err;
+
+	ref->registerReply = callBack;
+	string txt;
+	if(txtRecord && txtLen)
+		txt.assign((const char*)txtRecord, txtLen);
+
+	*sdRef = ref;
+	return ref->engine->Register(ref, flags, name ? name : "", fullType, target, ntohs(port), txt);
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceReconfirmRecord(DNSServiceFlags flags,
+														uint32_t interfaceIndex,
+														const char *fullname,
+														uint16_t rrtype,
+														uint16_t rrclass,
+														uint16_t rdlen,
+														const void *rdata)
+{
+	DNSRecord record;
+	record.type = rrtype;
+	if(fullname == nullptr || (rdata == nullptr && rdlen > 0) || !DNSNameFromDotted(fullname, record.name))
+		return kDNSServiceErr_BadParam;
+	if(rrclass != kDNSServiceClass_IN)
+		return kDNSServiceErr_Unsupported;
+
+	const uint8_t *bytes = (const uint8_t*)rdata;
+	switch(rrtype)
+	{
+		case kDNSTypePTR:
+			if(!ReadWireName(bytes, rdlen, record.target))
+				return kDNSServiceErr_BadParam;
+			break;
+
+		case kDNSTypeSRV:
+			if(rdlen < 7 || !ReadWireName(bytes + 6, rdlen - 6, record.target))
+				return kDNSServiceErr_BadParam;
+			record.priority = (uint16_t)(bytes[0] << 8 | bytes[1]);
+			record.weight = (uint16_t)(bytes[2] << 8 | bytes[3]);
+			record.port = (uint16_t)(bytes[4] << 8 | bytes[5]);
+			break;
+
+		default:
+			record.rdata.assign((const char*)bytes, rdlen);
+			break;
+	}
+
+	// nothing is cached while no ref keeps an engine running
+	lock_guard<mutex> guard(sEngineLock);
+	if(sEngine)
+		sEngine->Reconfirm(record);
+	return kDNSServiceErr_NoError;
+}
+
+#ifdef __APPLE__
+
+static void ProcessSource(void *context)
+{
+	DNSServiceProcessResult((DNSServiceRef)context);
+}
+
+static void CancelSource(void *context)
+{
+	DNSServiceRef ref = (DNSServiceRef)context;
+	dispatch_release(ref->source);
+	ref->source = nullptr;
+	if(!ref->delivering)
+		DestroyRef(ref);
+}
+
+DNSServiceErrorType DNSSD_API DNSServiceSetDispatchQueue(DNSServiceRef service, dispatch_queue_t queue)
+{
+	if(service == nullptr || service->source != nullptr)
+		return kDNSServiceErr_BadParam;
+
+	service->source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t)service->sock, 0, queue);
+	if(service->source == nullptr)
+		return kDNSServiceErr_NoMemory;
+
+	dispatch_set_context(service->source, service);
+	dispatch_source_set_event_handler_f(service->source, &ProcessSource);
+	dispatch_source_set_cancel_handler_f(service->source, &CancelSource);
+	dispatch_resume(service->source);
+	return kDNSServiceErr_NoError;
+}
+
+#endif
+
+}
+
+#endif /* ZEROCONF_EMBEDDED_MDNS */
@@ -0,0 +1,46 @@
+//
+//  DNSEmbedded.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Multicast DNS without a daemon. When ZEROCONF_EMBEDDED_MDNS is defined,
+//  DNSEmbedded.cpp provides the dns_sd calls the plugin makes in place of the
+//  client library: an engine thread in this process queries and responds over
+//  a UDP multicast socket of its own and keeps its own record cache. Every
+//  DNSServiceRef still has a socket that turns readable while callbacks are
+//  waiting, so the event loops drive it like a daemon connection.
+//
+
+
+#ifndef DNSEmbedded_h
+#define DNSEmbedded_h
+
+#ifdef ZEROCONF_EMBEDDED_MDNS
+
+#include <stdint.h>
+#include <string>
+
+
+struct DNSEmbeddedConfig
+{
+	// IPv4 address of the interface to multicast on, empty to leave it to the system
+	std::string interfaceAddress;
+	// 5353, except where no other responder should be reached, as in tests over loopback
+	uint16_t port;
+	// first label of the host name, the computer name when empty
+	std::string hostLabel;
+
+	DNSEmbeddedConfig()
+	: port(5353)
+	{
+	}
+};
+
+// Takes effect when the engine starts, which is with the first DNSServiceRef
+// created while no other one exists.
+void DNSEmbeddedConfigure(const DNSEmbeddedConfig &config);
+
+#endif /* ZEROCONF_EMBEDDED_MDNS */
+
+#endif /* DNSEmbedded_h */
@@ -0,0 +1,208 @@
+//
+//  DNSFreshness.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSFreshness.h"
+#include "DNSPacket.h"
+
+#include <dns_sd.h>
+
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+
+DNSFreshness::DNSFreshness(DNSServiceManager *owner)
+: owner(owner)
+, deadlineMs(0)
+, timer(0)
+{
+}
+
+DNSFreshness::~DNSFreshness()
+{
+	owner->EventLoop().CancelTimer(timer);
+}
+
+void DNSFreshness::Seen(const ServiceInfo &info)
+{
+	if(info.nameLength() == 0)
+		return;
+
+	Entry &entry = entries[info.instanceId()];
+	if(entry.browsers.empty())
+	{
+		entry.info.setName(info.name());
+		entry.info.setType(info.type());
+		entry.info.setDomain(info.domain());
+		entry.everReconfirmed = false;
+	}
+	entry.info.setHostname(info.hostname());
+	entry.info.port = info.port;
+	for(auto index : info.interfaces)
+	{
+		entry.info.addInterface(index);
+	}
+	entry.seen = Clock::now();
+
+	if(find(entry.browsers.begin(), entry.browsers.end(), info.browser) == entry.browsers.end())
+		entry.browsers.push_back(info.browser);
+
+	ScheduleCheck();
+}
+
+void DNSFreshness::Touch(uint64_t instanceId)
+{
+	auto entry = entries.find(instanceId);
+	if(entry != entries.end())
+		entry->second.seen = Clock::now();
+}
+
+void DNSFreshness::Forget(const ServiceInfo &info)
+{
+	auto entry = entries.find(info.instanceId());
+	if(entry == entries.end())
+		return;
+
+	vector<BrowserHandle> &browsers = entry->second.browsers;
+	browsers.erase(remove(browsers.begin(), browsers.end(), info.browser), browsers.end());
+	if(browsers.empty())
+		entries.erase(entry);
+}
+
+void DNSFreshness::ForgetBrowser(BrowserHandle browser)
+{
+	for(auto entry = entries.begin(); entry != entries.end(); )
+	{
+		vector<BrowserHandle> &browsers = entry->second.browsers;
+		browsers.erase(remove(browsers.begin(), browsers.end(), browser), browsers.end());
+		if(browsers.empty())
+			entry = entries.erase(entry);
+		else
+			++entry;
+	}
+}
+
+void DNSFreshness::Clear()
+{
+	entries.clear();
+	owner->EventLoop().CancelTimer(timer);
+	timer = 0;
+}
+
+bool DNSFreshness::Reconfirm(uint64_t instanceId)
+{
+	auto entry = entries.find(instanceId);
+	if(entry == entries.end())
+		return false;
+
+	Reconfirm(entry->second, Clock::now());
+	return true;
+}
+
+bool DNSFreshness::Reconfirm(Entry &entry, Clock::time_point now)
+{
+	uint32_t minIntervalMs = kMinIntervalMs;
+	if(entry.everReconfirmed && now - entry.reconfirmed < chrono::milliseconds(minIntervalMs))
+		return false;
+
+	entry.everReconfirmed = true;
+	entry.reconfirmed = now;
+	// a peer that answers keeps its records, it is not asked again for another deadline
+	entry.seen = now;
+	return ReconfirmRecords(entry.info);
+}
+
+void DNSFreshness::SetDeadline(uint32_t milliseconds)
+{
+	deadlineMs = milliseconds;
+	if(deadlineMs == 0)
+	{
+		owner->EventLoop().CancelTimer(timer);
+		timer = 0;
+		return;
+	}
+
+	// what was seen before the deadline was set only counts from now
+	Clock::time_point now = Clock::now();
+	for(auto &entry : entries)
+	{
+		entry.second.seen = now;
+	}
+	ScheduleCheck();
+}
+
+void DNSFreshness::ScheduleCheck()
+{
+	if(deadlineMs == 0 || timer != 0 || entries.empty())
+		return;
+
+	timer = owner->EventLoop().ScheduleTimer(min(deadlineMs, (uint32_t)kCheckMs), [this](){
+		timer = 0;
+		Check();
+	});
+}
+
+void DNSFreshness::Check()
+{
+	Clock::time_point now = Clock::now();
+	Clock::duration deadline = chrono::milliseconds((long long)deadlineMs);
+	for(auto &entry : entries)
+	{
+		if(now - entry.second.seen >= deadline)
+			Reconfirm(entry.second, now);
+	}
+	ScheduleCheck();
+}
+
+bool DNSFreshness::ReconfirmRecords(const ServiceInfo &info)
+{
+	// The daemon takes no wildcard here, records are asked for where they
+	// were heard. A backend that reports no interface, like the embedded
+	// engine, keeps one cache for all of them.
+	if(info.interfaces.empty())
+		return ReconfirmRecords(info, kDNSServiceInterfaceIndexAny);
+
+	bool reconfirmed = true;
+	for(auto index : info.interfaces)
+	{
+		if(!ReconfirmRecords(info, index))
+			reconfirmed = false;
+	}
+	return reconfirmed;
+}
+
+bool DNSFreshness::ReconfirmRecords(const ServiceInfo &info, uint32_t interfaceIndex)
+{
+	DNSName fullType;
+	if(info.nameLength() == 0 || !DNSNameFromServiceType(info.type(), info.domain(), fullType))
+		return false;
+
+	// PTR: the service type points at the instance
+	DNSName instance = DNSNamePrepend(info.name(), fullType);
+	string typeName = DNSNameToDotted(fullType);
+	DNSServiceErrorType err = DNSServiceReconfirmRecord(0, interfaceIndex, typeName.c_str(),
+														kDNSServiceType_PTR, kDNSServiceClass_IN,
+														(uint16_t)instance.size(), instance.data());
+
+	// SRV: priority and weight, which mDNS leaves at 0, the port as dns_sd
+	// reported it, in network byte order, and the target host
+	DNSName host;
+	if(info.port == -1 || info.hostnameLength() == 0 || !DNSNameFromDotted(info.hostname(), host))
+		return err == kDNSServiceErr_NoError;
+
+	string srv(4, '\0');
+	uint16_t port = (uint16_t)info.port;
+	srv.append((const char*)&port, sizeof(port));
+	srv += host;
+
+	string instanceName = DNSNameToDotted(instance);
+	DNSServiceErrorType srvErr = DNSServiceReconfirmRecord(0, interfaceIndex, instanceName.c_str(),
+														   kDNSServiceType_SRV, kDNSServiceClass_IN,
+														   (uint16_t)srv.size(), srv.data());
+	return err == kDNSServiceErr_NoError && srvErr == kDNSServiceErr_NoError;
+}
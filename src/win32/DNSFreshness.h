@@ -0,0 +1,83 @@
+//
+//  DNSFreshness.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  When each reported instance was last heard of. A peer that loses power
+//  sends no goodbye, and the daemon keeps its records until their TTLs run
+//  out, which for PTR and SRV records is more than an hour. Reconfirming
+//  them makes the daemon query for them at once and flush them within
+//  seconds if nobody answers, which browsers report as "lost". That is done
+//  for instances the app could not connect to, and for instances that were
+//  not heard of for longer than a deadline.
+//
+
+
+#ifndef DNSFreshness_h
+#define DNSFreshness_h
+
+#include "DnsWrapper.h"
+
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+class DNSFreshness
+{
+public:
+	explicit DNSFreshness(DNSServiceManager *owner);
+	~DNSFreshness();
+
+	// an instance went out as "found" or "updated", or was announced again unchanged
+	void Seen(const ServiceInfo &info);
+	// browse add of an instance that may be tracked
+	void Touch(uint64_t instanceId);
+	// "lost" from info.browser, the instance is kept while another browser reports it
+	void Forget(const ServiceInfo &info);
+	void ForgetBrowser(BrowserHandle browser);
+	void Clear();
+
+	// Reconfirms a tracked instance; false if no browser reports it. An
+	// instance is only reconfirmed once every kMinIntervalMs, asking again
+	// in between succeeds without doing anything.
+	bool Reconfirm(uint64_t instanceId);
+
+	// instances not seen for deadlineMs are reconfirmed, 0 turns that off
+	void SetDeadline(uint32_t deadlineMs);
+	uint32_t Deadline() const { return deadlineMs; }
+
+	// Asks the daemon to verify the PTR record of the instance and, once it
+	// is resolved, its SRV record, on every interface it was seen on.
+	static bool ReconfirmRecords(const ServiceInfo &info);
+	static bool ReconfirmRecords(const ServiceInfo &info, uint32_t interfaceIndex);
+
+	static const uint32_t kMinIntervalMs = 5000;
+	// how often deadlines are looked at
+	static const uint32_t kCheckMs = 1000;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Entry
+	{
+		// name, type, domain, hostname, port and interfaces only
+		ServiceInfo info;
+		std::vector<BrowserHandle> browsers;
+		Clock::time_point seen;
+		Clock::time_point reconfirmed;
+		bool everReconfirmed;
+	};
+
+	void ScheduleCheck();
+	void Check();
+	bool Reconfirm(Entry &entry, Clock::time_point now);
+
+	DNSServiceManager *owner;
+	std::unordered_map<uint64_t, Entry> entries;
+	uint32_t deadlineMs;
+	TimerHandle timer;
+};
+
+
+#endif /* DNSFreshness_h */
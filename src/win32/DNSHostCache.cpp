@@ -0,0 +1,252 @@
+//
+//  DNSHostCache.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSHostCache.h"
+#include "DNSTimeline.h"
+
+#include <ctype.h>
+#include <algorithm>
+
+using namespace std;
+
+
+DNSHostCache::DNSHostCache(DNSServiceManager *owner)
+: owner(owner)
+, nextLookup(0)
+{
+
+}
+
+DNSHostCache::~DNSHostCache()
+{
+	Clear();
+}
+
+string DNSHostCache::Key(const char *hostname)
+{
+	// host names compare case insensitively, and "host.local" equals "host.local."
+	string key(hostname);
+	for(auto &c : key)
+		c = (char)tolower((unsigned char)c);
+	if(!key.empty() && key[key.size() - 1] == '.')
+		key.resize(key.size() - 1);
+	return key;
+}
+
+HostLookupHandle DNSHostCache::Lookup(const char *hostname, const HostLookupCompletion &completion)
+{
+	if(hostname == nullptr || *hostname == '\0')
+	{
+		completion(AddressList());
+		return 0;
+	}
+
+	string key = Key(hostname);
+	Clock::time_point now = Clock::now();
+
+	auto cached = entries.find(key);
+	if(cached != entries.end())
+	{
+		if(cached->second.expires > now)
+		{
+			// hand out the remaining lifetime rather than the original TTL
+			AddressList addresses = cached->second.addresses;
+			uint32_t remaining = (uint32_t)chrono::duration_cast<chrono::seconds>(cached->second.expires - now).count();
+			for(auto &addr : addresses)
+				addr.ttl = min(addr.ttl, remaining);
+			completion(addresses);
+			return 0;
+		}
+		entries.erase(cached);
+	}
+
+	HostLookupHandle lookup = ++nextLookup;
+	if(lookup == 0)
+		lookup = ++nextLookup;
+
+	auto pending = inflight.find(key);
+	if(pending != inflight.end())
+	{
+		pending->second->waiting.push_back(make_pair(lookup, completion));
+		return lookup;
+	}
+
+	shared_ptr<Query> query = make_shared<Query>();
+	query->cache = this;
+	query->key = key;
+	query->hostname = hostname;
+	query->ref = 0;
+	query->timeout = 0;
+
+	DNSServiceErrorType ret = DNSServiceGetAddrInfo(&query->ref, 0, 0, 0, hostname, &DNSHostCache::callbackAddr, query.get());
+	if(ret != kDNSServiceErr_NoError)
+	{
+		completion(AddressList());
+		return 0;
+	}
+
+	DNS_TIMELINE_ASYNC_BEGIN("address lookup", query.get());
+
+	query->waiting.push_back(make_pair(lookup, completion));
+	inflight[key] = query;
+	owner->EventLoop().RegisterRef(query->ref);
+
+	Query *raw = query.get();
+	query->timeout = owner->EventLoop().ScheduleTimer(kQueryTimeoutMs, [this, raw](){
+		raw->timeout = 0;
+		Complete(raw);
+	});
+
+	return lookup;
+}
+
+void DNSHostCache::Cancel(HostLookupHandle lookup)
+{
+	if(lookup == 0)
+		return;
+
+	for(auto &pending : inflight)
+	{
+		// nobody is interested anymore, but an answer would still be worth caching
+		if(CancelWaiting(*pending.second, lookup))
+			return;
+	}
+	for(auto &query : completing)
+	{
+		if(CancelWaiting(*query, lookup))
+			return;
+	}
+}
+
+bool DNSHostCache::CancelWaiting(Query &query, HostLookupHandle lookup)
+{
+	for(auto w = query.waiting.begin(); w != query.waiting.end(); ++w)
+	{
+		if(w->first == lookup)
+		{
+			query.waiting.erase(w);
+			return true;
+		}
+	}
+	return false;
+}
+
+void DNSHostCache::Clear()
+{
+	CancelQueries();
+	entries.clear();
+}
+
+void DNSHostCache::CancelQueries()
+{
+	for(auto &pending : inflight)
+	{
+		Query *query = pending.second.get();
+		DNS_TIMELINE_ASYNC_END("address lookup", query);
+		owner->EventLoop().CancelTimer(query->timeout);
+		owner->EventLoop().TerminateRef(query->ref);
+	}
+	inflight.clear();
+
+	// completions not yet run are dropped as well
+	for(auto &query : completing)
+	{
+		query->waiting.clear();
+	}
+}
+
+void DNSHostCache::Purge(Clock::time_point now)
+{
+	for(auto it = entries.begin(); it != entries.end(); )
+	{
+		if(it->second.expires <= now)
+			it = entries.erase(it);
+		else
+			++it;
+	}
+}
+
+void DNSHostCache::Complete(Query *query)
+{
+	DNS_TIMELINE_ASYNC_END("address lookup", query);
+
+	owner->EventLoop().CancelTimer(query->timeout);
+	query->timeout = 0;
+	owner->EventLoop().TerminateRef(query->ref);
+	query->ref = 0;
+
+	// keep the query alive while the completions run, they may start new lookups
+	auto pending = inflight.find(query->key);
+	shared_ptr<Query> keep = pending->second;
+	inflight.erase(pending);
+	completing.push_back(keep);
+
+	if(!query->addresses.empty())
+	{
+		uint32_t ttl = query->addresses[0].ttl;
+		for(const auto &addr : query->addresses)
+			ttl = min(ttl, addr.ttl);
+
+		if(ttl > 0)
+		{
+			Clock::time_point now = Clock::now();
+			Purge(now);
+
+			Entry &entry = entries[query->key];
+			entry.addresses = query->addresses;
+			entry.expires = now + chrono::seconds(ttl);
+		}
+	}
+
+	// One at a time, so that a completion that stops another waiter, such as
+	// a listener stopping a browser of another service on the same host,
+	// cancels its completion before it runs.
+	while(!query->waiting.empty())
+	{
+		HostLookupCompletion completion = std::move(query->waiting.front().second);
+		query->waiting.erase(query->waiting.begin());
+		completion(query->addresses);
+	}
+
+	completing.erase(find(completing.begin(), completing.end(), keep));
+}
+
+void DNSSD_API DNSHostCache::callbackAddr(DNSServiceRef sdRef,
+										  DNSServiceFlags flags,
+										  uint32_t interfaceIndex,
+										  DNSServiceErrorType errorCode,
+										  const char *hostname,
+										  const struct sockaddr *address,
+										  uint32_t ttl,
+										  void *context
+										  )
+{
+	DNS_TIMELINE_SPAN("address callback");
+
+	Query *query = (Query*)context;
+
+	if(errorCode == kDNSServiceErr_ServiceNotRunning)
+	{
+		query->cache->owner->daemonLost();
+		return;
+	}
+
+	if(errorCode == kDNSServiceErr_NoError && (flags & kDNSServiceFlagsAdd))
+	{
+		ServiceAddress addr = ServiceAddress::FromSockaddr(address, ttl, interfaceIndex);
+		if(addr.family)
+		{
+			query->addresses.push_back(addr);
+		}
+	}
+
+	// answers that arrive together are one lookup, same as a single DNSServiceProcessResult() used to be
+	if(!(flags & kDNSServiceFlagsMoreComing))
+	{
+		query->cache->Complete(query);
+	}
+}
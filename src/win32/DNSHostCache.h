@@ -0,0 +1,94 @@
+//
+//  DNSHostCache.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Hostname to address cache shared by every browser and resolver of a
+//  manager. Hosts that advertise several services are only looked up once
+//  per TTL, and concurrent lookups of one host share a single query.
+//
+
+
+#ifndef DNSHostCache_h
+#define DNSHostCache_h
+
+#include "DnsWrapper.h"
+
+#include <dns_sd.h>
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+typedef uint32_t HostLookupHandle;
+typedef std::function<void(const AddressList &addresses)> HostLookupCompletion;
+
+class DNSHostCache
+{
+public:
+	explicit DNSHostCache(DNSServiceManager *owner);
+	~DNSHostCache();
+
+	// Calls completion with the addresses of hostname. Cached addresses are
+	// delivered before Lookup() returns and 0 is returned; otherwise the
+	// completion runs once the query answers or gives up, and the returned
+	// handle can be passed to Cancel() until then.
+	HostLookupHandle Lookup(const char *hostname, const HostLookupCompletion &completion);
+	void Cancel(HostLookupHandle lookup);
+
+	// drops cached addresses and in-flight queries without calling their completions
+	void Clear();
+	// drops in-flight queries only, what is cached stays valid
+	void CancelQueries();
+
+	// how long a query may wait for the first answer
+	static const uint32_t kQueryTimeoutMs = 500;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Entry
+	{
+		AddressList addresses;
+		Clock::time_point expires;
+	};
+
+	struct Query
+	{
+		DNSHostCache *cache;
+		std::string key;
+		std::string hostname;
+		DNSServiceRef ref;
+		TimerHandle timeout;
+		AddressList addresses;
+		std::vector< std::pair<HostLookupHandle, HostLookupCompletion> > waiting;
+	};
+
+	static std::string Key(const char *hostname);
+
+	void Complete(Query *query);
+	static bool CancelWaiting(Query &query, HostLookupHandle lookup);
+	void Purge(Clock::time_point now);
+
+	static void DNSSD_API callbackAddr(DNSServiceRef sdRef,
+									   DNSServiceFlags flags,
+									   uint32_t interfaceIndex,
+									   DNSServiceErrorType errorCode,
+									   const char *hostname,
+									   const struct sockaddr *address,
+									   uint32_t ttl,
+									   void *context
+									   );
+
+	DNSServiceManager *owner;
+	std::unordered_map<std::string, Entry> entries;
+	std::unordered_map<std::string, std::shared_ptr<Query> > inflight;
+	// answered queries whose completions are still running, Cancel() has to reach those too
+	std::vector< std::shared_ptr<Query> > completing;
+	HostLookupHandle nextLookup;
+};
+
+
+#endif /* DNSHostCache_h */
@@ -0,0 +1,106 @@
+//
+//  DNSMacEventLoop.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Event loop of non-Windows builds: refs and timers run on a serial dispatch
+//  queue, the main queue unless a worker shard brings its own.
+//
+
+
+#ifndef DNSMacEventLoop_h
+#define DNSMacEventLoop_h
+
+#include "DnsWrapper.h"
+
+#include <dns_sd.h>
+
+
+class MacEventLoop : public BaseDNSEventLoop
+{
+public:
+	virtual void RegisterRef(DNSServiceRef ref) override
+	{
+		DNSServiceSetDispatchQueue(ref, queue);
+	}
+
+	virtual void TerminateRef(DNSServiceRef ref) override
+	{
+		DNSServiceRefDeallocate(ref);
+	}
+
+	virtual TimerHandle ScheduleTimer(uint32_t milliseconds, const std::function<void()> &callback) override
+	{
+		TimerHandle timer = ++nextTimer;
+		if(timer == 0)
+			timer = ++nextTimer;
+		(*timers)[timer] = callback;
+
+		// a timer that fires after the loop is gone or after CancelTimer() finds nothing to run
+		PendingTimer *pending = new PendingTimer();
+		pending->timers = timers;
+		pending->timer = timer;
+		dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, (int64_t)milliseconds * NSEC_PER_MSEC), queue, pending, &MacEventLoop::FireTimer);
+		return timer;
+	}
+
+	virtual void CancelTimer(TimerHandle timer) override
+	{
+		timers->erase(timer);
+	}
+
+	virtual void Post(const std::function<void()> &task) override
+	{
+		dispatch_async_f(queue, new std::function<void()>(task), &MacEventLoop::RunPosted);
+	}
+
+	explicit MacEventLoop(dispatch_queue_t queue = dispatch_get_main_queue())
+	: queue(queue)
+	, timers(std::make_shared<TimerMap>())
+	, nextTimer(0)
+	{
+	}
+
+	virtual ~MacEventLoop(){}
+
+private:
+	typedef std::unordered_map<TimerHandle, std::function<void()> > TimerMap;
+
+	struct PendingTimer
+	{
+		std::weak_ptr<TimerMap> timers;
+		TimerHandle timer;
+	};
+
+	static void FireTimer(void *context)
+	{
+		PendingTimer *pending = (PendingTimer*)context;
+		std::shared_ptr<TimerMap> timers = pending->timers.lock();
+		if(timers)
+		{
+			auto it = timers->find(pending->timer);
+			if(it != timers->end())
+			{
+				std::function<void()> callback = it->second;
+				timers->erase(it);
+				callback();
+			}
+		}
+		delete pending;
+	}
+
+	static void RunPosted(void *context)
+	{
+		std::function<void()> *task = (std::function<void()>*)context;
+		(*task)();
+		delete task;
+	}
+
+	dispatch_queue_t queue;
+	std::shared_ptr<TimerMap> timers;
+	TimerHandle nextTimer;
+};
+
+
+#endif /* DNSMacEventLoop_h */
@@ -0,0 +1,559 @@
+//
+//  DNSPacket.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSPacket.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+
+static const size_t kHeaderLength = 12;
+static const size_t kMaxNameLength = 255;
+static const size_t kMaxLabelLength = 63;
+// compression pointers followed for one name; more than that is a loop
+static const int kMaxPointers = 32;
+
+
+static char LowerASCII(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+static bool AppendLabel(DNSName &name, const string &label)
+{
+	if(label.empty() || label.size() > kMaxLabelLength)
+		return false;
+	name += (char)label.size();
+	name += label;
+	return true;
+}
+
+bool DNSNameFromDotted(const char *dotted, DNSName &name)
+{
+	name.clear();
+	if(dotted == nullptr)
+		return false;
+
+	// the root
+	if(strcmp(dotted, ".") == 0)
+		dotted++;
+
+	string label;
+	const char *c = dotted;
+	while(*c)
+	{
+		if(*c == '.')
+		{
+			if(!AppendLabel(name, label))
+				return false;
+			label.clear();
+			c++;
+		}
+		else if(*c == '\\')
+		{
+			c++;
+			if(isdigit((unsigned char)c[0]) && isdigit((unsigned char)c[1]) && isdigit((unsigned char)c[2]))
+			{
+				int value = (c[0] - '0') * 100 + (c[1] - '0') * 10 + (c[2] - '0');
+				if(value > 255)
+					return false;
+				label += (char)value;
+				c += 3;
+			}
+			else if(*c)
+			{
+				label += *c++;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else
+		{
+			label += *c++;
+		}
+	}
+
+	if(!label.empty() && !AppendLabel(name, label))
+		return false;
+
+	name += '\0';
+	return name.size() <= kMaxNameLength;
+}
+
+string DNSNameToDotted(const DNSName &name)
+{
+	string dotted;
+	size_t pos = 0;
+	while(pos < name.size() && name[pos] != 0)
+	{
+		size_t len = (uint8_t)name[pos];
+		for(size_t i = pos + 1; i <= pos + len && i < name.size(); i++)
+		{
+			unsigned char c = (unsigned char)name[i];
+			if(c == '.' || c == '\\')
+			{
+				dotted += '\\';
+				dotted += (char)c;
+			}
+			else if(c < 0x20 || c == 0x7F)
+			{
+				char escaped[8];
+				sprintf(escaped, "\\%03d", (int)c);
+				dotted += escaped;
+			}
+			else
+			{
+				dotted += (char)c;
+			}
+		}
+		dotted += '.';
+		pos += 1 + len;
+	}
+
+	if(dotted.empty())
+		dotted = ".";
+	return dotted;
+}
+
+DNSName DNSNamePrepend(const string &label, const DNSName &parent)
+{
+	DNSName name;
+	AppendLabel(name, label.substr(0, kMaxLabelLength));
+	name += parent;
+	return name;
+}
+
+string DNSNameFirstLabel(const DNSName &name)
+{
+	if(name.empty())
+		return string();
+	return name.substr(1, (uint8_t)name[0]);
+}
+
+DNSName DNSNameParent(const DNSName &name)
+{
+	if(name.empty() || name[0] == 0)
+		return name;
+	return name.substr(1 + (uint8_t)name[0]);
+}
+
+DNSName DNSNameKey(const DNSName &name)
+{
+	// length bytes never reach 'A', so the whole name can be lowered
+	DNSName key(name);
+	for(auto &c : key)
+	{
+		c = LowerASCII(c);
+	}
+	return key;
+}
+
+bool DNSNameEqual(const DNSName &a, const DNSName &b)
+{
+	if(a.size() != b.size())
+		return false;
+	for(size_t i = 0; i < a.size(); i++)
+	{
+		if(LowerASCII(a[i]) != LowerASCII(b[i]))
+			return false;
+	}
+	return true;
+}
+
+bool DNSNameFromServiceType(const char *regtype, const char *domain, DNSName &fullType)
+{
+	if(regtype == nullptr)
+		return false;
+
+	// subtypes after a comma are not supported and only the main type is used
+	string main(regtype);
+	size_t comma = main.find(',');
+	if(comma != string::npos)
+		main.resize(comma);
+
+	DNSName type, domainName;
+	if(!DNSNameFromDotted(main.c_str(), type) || !DNSNameFromDotted((domain && *domain) ? domain : "local.", domainName))
+		return false;
+
+	// two labels, the second naming the transport
+	DNSName transport = DNSNameParent(type);
+	if(type.size() < 2 || transport.size() < 2 || DNSNameParent(transport).size() != 1)
+		return false;
+
+	fullType = type.substr(0, type.size() - 1) + domainName;
+	return fullType.size() <= 255;
+}
+
+string DNSServiceTypeOf(const DNSName &fullType)
+{
+	DNSName type = DNSNamePrepend(DNSNameFirstLabel(DNSNameParent(fullType)), DNSName(1, '\0'));
+	return DNSNameToDotted(DNSNamePrepend(DNSNameFirstLabel(fullType), type));
+}
+
+string DNSServiceDomainOf(const DNSName &fullType)
+{
+	return DNSNameToDotted(DNSNameParent(DNSNameParent(fullType)));
+}
+
+
+bool DNSRecord::SameAs(const DNSRecord &other) const
+{
+	if(type != other.type || !DNSNameEqual(name, other.name))
+		return false;
+
+	switch(type)
+	{
+		case kDNSTypePTR:
+			return DNSNameEqual(target, other.target);
+		case kDNSTypeSRV:
+			return priority == other.priority && weight == other.weight && port == other.port && DNSNameEqual(target, other.target);
+		default:
+			return rdata == other.rdata;
+	}
+}
+
+
+
+DNSPacketReader::DNSPacketReader(const uint8_t *data, size_t length)
+: data(data)
+, length(length)
+, id(0)
+, flags(0)
+{
+
+}
+
+bool DNSPacketReader::SkipName(size_t &offset) const
+{
+	while(offset < length)
+	{
+		uint8_t len = data[offset];
+		if((len & 0xC0) == 0xC0)
+		{
+			// a pointer ends the name
+			offset += 2;
+			return offset <= length;
+		}
+		if(len & 0xC0)
+			return false;
+
+		offset += 1 + len;
+		if(len == 0)
+			return true;
+	}
+	return false;
+}
+
+bool DNSPacketReader::Parse()
+{
+	questions.clear();
+	records.clear();
+
+	// offsets are kept in 16 bits, which is plenty for any multicast DNS message
+	if(length < kHeaderLength || length > 0xFFFF)
+		return false;
+
+	id = Read16(0);
+	flags = Read16(2);
+	size_t questionCount = Read16(4);
+	size_t recordCounts[3] = { Read16(6), Read16(8), Read16(10) };
+
+	size_t offset = kHeaderLength;
+	for(size_t i = 0; i < questionCount; i++)
+	{
+		Question question;
+		question.name = (uint16_t)offset;
+		if(!SkipName(offset) || offset + 4 > length)
+			return false;
+
+		question.type = Read16(offset);
+		uint16_t qclass = Read16(offset + 2);
+		question.qclass = qclass & ~kDNSClassTopBit;
+		question.unicastResponse = (qclass & kDNSClassTopBit) != 0;
+		questions.push_back(question);
+		offset += 4;
+	}
+
+	for(int section = kAnswer; section <= kAdditional; section++)
+	{
+		for(size_t i = 0; i < recordCounts[section]; i++)
+		{
+			Record record;
+			record.name = (uint16_t)offset;
+			if(!SkipName(offset) || offset + 10 > length)
+				return false;
+
+			record.type = Read16(offset);
+			uint16_t rrclass = Read16(offset + 2);
+			record.rrclass = rrclass & ~kDNSClassTopBit;
+			record.cacheFlush = (rrclass & kDNSClassTopBit) != 0;
+			record.ttl = ((uint32_t)Read16(offset + 4) << 16) | Read16(offset + 6);
+			record.rdlength = Read16(offset + 8);
+			record.rdata = (uint16_t)(offset + 10);
+			record.section = (Section)section;
+
+			offset += 10 + record.rdlength;
+			if(offset > length)
+				return false;
+			records.push_back(record);
+		}
+	}
+
+	return true;
+}
+
+bool DNSPacketReader::NameEquals(size_t offset, const DNSName &name) const
+{
+	size_t pos = 0;
+	int pointers = 0;
+	while(offset < length)
+	{
+		uint8_t len = data[offset];
+		if((len & 0xC0) == 0xC0)
+		{
+			if(offset + 1 >= length || ++pointers > kMaxPointers)
+				return false;
+			offset = ((len & 0x3F) << 8) | data[offset + 1];
+			continue;
+		}
+		if((len & 0xC0) || offset + 1 + len > length)
+			return false;
+
+		if(pos + 1 + len > name.size() || (uint8_t)name[pos] != len)
+			return false;
+		for(size_t i = 1; i <= len; i++)
+		{
+			if(LowerASCII((char)data[offset + i]) != LowerASCII(name[pos + i]))
+				return false;
+		}
+
+		pos += 1 + len;
+		if(len == 0)
+			return pos == name.size();
+		offset += 1 + len;
+	}
+	return false;
+}
+
+bool DNSPacketReader::ReadName(size_t offset, DNSName &name) const
+{
+	name.clear();
+	int pointers = 0;
+	while(offset < length)
+	{
+		uint8_t len = data[offset];
+		if((len & 0xC0) == 0xC0)
+		{
+			if(offset + 1 >= length || ++pointers > kMaxPointers)
+				return false;
+			offset = ((len & 0x3F) << 8) | data[offset + 1];
+			continue;
+		}
+		if((len & 0xC0) || offset + 1 + len > length)
+			return false;
+
+		name.append((const char*)data + offset, 1 + len);
+		if(name.size() > kMaxNameLength)
+			return false;
+		if(len == 0)
+			return true;
+		offset += 1 + len;
+	}
+	return false;
+}
+
+bool DNSPacketReader::ReadRecord(const Record &record, DNSRecord &out) const
+{
+	if(record.rrclass != kDNSClassIN)
+		return false;
+	if(!ReadName(record.name, out.name))
+		return false;
+
+	out.type = record.type;
+	out.unique = record.cacheFlush;
+	out.ttl = record.ttl;
+
+	// names in the data may not run past it
+	size_t end = record.rdata + record.rdlength;
+	size_t offset = record.rdata;
+	switch(record.type)
+	{
+		case kDNSTypePTR:
+			return SkipName(offset) && offset <= end && ReadName(record.rdata, out.target);
+
+		case kDNSTypeSRV:
+			if(record.rdlength < 7)
+				return false;
+			out.priority = Read16(record.rdata);
+			out.weight = Read16(record.rdata + 2);
+			out.port = Read16(record.rdata + 4);
+			offset += 6;
+			return SkipName(offset) && offset <= end && ReadName(record.rdata + 6, out.target);
+
+		case kDNSTypeA:
+			if(record.rdlength != 4)
+				return false;
+			break;
+
+		case kDNSTypeAAAA:
+			if(record.rdlength != 16)
+				return false;
+			break;
+	}
+
+	out.rdata.assign((const char*)data + record.rdata, record.rdlength);
+	return true;
+}
+
+
+
+DNSPacketWriter::DNSPacketWriter(size_t limit)
+: limit(limit)
+, questionCount(0)
+, answerCount(0)
+, authorityCount(0)
+, additionalCount(0)
+{
+	Reset(0, 0);
+}
+
+void DNSPacketWriter::Reset(uint16_t id, uint16_t flags)
+{
+	buffer.assign(kHeaderLength, '\0');
+	questionCount = 0;
+	answerCount = 0;
+	authorityCount = 0;
+	additionalCount = 0;
+	names.clear();
+
+	Patch16(0, id);
+	Patch16(2, flags);
+}
+
+void DNSPacketWriter::SetFlags(uint16_t flags)
+{
+	Patch16(2, flags);
+}
+
+void DNSPacketWriter::Write16(uint16_t value)
+{
+	buffer += (char)(value >> 8);
+	buffer += (char)(value & 0xFF);
+}
+
+void DNSPacketWriter::Write32(uint32_t value)
+{
+	Write16((uint16_t)(value >> 16));
+	Write16((uint16_t)(value & 0xFFFF));
+}
+
+void DNSPacketWriter::Patch16(size_t offset, uint16_t value)
+{
+	buffer[offset] = (char)(value >> 8);
+	buffer[offset + 1] = (char)(value & 0xFF);
+}
+
+void DNSPacketWriter::WriteName(const DNSName &name)
+{
+	DNSName key = DNSNameKey(name);
+	size_t pos = 0;
+	while(pos < key.size() && key[pos] != 0)
+	{
+		// the longest suffix already in the message ends the name as a pointer
+		DNSName suffix = key.substr(pos);
+		for(const auto &known : names)
+		{
+			if(known.first == suffix)
+			{
+				Write16(0xC000 | known.second);
+				return;
+			}
+		}
+
+		// pointers only reach the first 16k of the message
+		if(buffer.size() < 0x3FFF)
+			names.push_back(make_pair(suffix, (uint16_t)buffer.size()));
+
+		size_t len = (uint8_t)name[pos];
+		buffer.append(name, pos, 1 + len);
+		pos += 1 + len;
+	}
+	buffer += '\0';
+}
+
+bool DNSPacketWriter::Commit(size_t rollback, size_t knownNames, uint16_t &count, size_t countOffset)
+{
+	if(buffer.size() > limit)
+	{
+		buffer.resize(rollback);
+		names.erase(names.begin() + knownNames, names.end());
+		return false;
+	}
+
+	count++;
+	Patch16(countOffset, count);
+	return true;
+}
+
+bool DNSPacketWriter::AddQuestion(const DNSName &name, uint16_t type, bool unicastResponse)
+{
+	size_t rollback = buffer.size();
+	size_t knownNames = names.size();
+
+	WriteName(name);
+	Write16(type);
+	Write16(kDNSClassIN | (unicastResponse ? kDNSClassTopBit : 0));
+
+	return Commit(rollback, knownNames, questionCount, 4);
+}
+
+bool DNSPacketWriter::AddRecord(DNSPacketReader::Section section, const DNSRecord &record, uint32_t ttl)
+{
+	size_t rollback = buffer.size();
+	size_t knownNames = names.size();
+
+	WriteName(record.name);
+	Write16(record.type);
+	Write16(kDNSClassIN | (record.unique ? kDNSClassTopBit : 0));
+	Write32(ttl);
+
+	size_t lengthOffset = buffer.size();
+	Write16(0);
+	switch(record.type)
+	{
+		case kDNSTypePTR:
+			WriteName(record.target);
+			break;
+
+		case kDNSTypeSRV:
+			Write16(record.priority);
+			Write16(record.weight);
+			Write16(record.port);
+			WriteName(record.target);
+			break;
+
+		default:
+			buffer += record.rdata;
+			break;
+	}
+	Patch16(lengthOffset, (uint16_t)(buffer.size() - lengthOffset - 2));
+
+	switch(section)
+	{
+		case DNSPacketReader::kAnswer:
+			return Commit(rollback, knownNames, answerCount, 6);
+		case DNSPacketReader::kAuthority:
+			return Commit(rollback, knownNames, authorityCount, 8);
+		default:
+			return Commit(rollback, knownNames, additionalCount, 10);
+	}
+}
@@ -0,0 +1,200 @@
+//
+//  DNSPacket.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  DNS message wire format as multicast DNS uses it. The reader parses a
+//  received datagram in place: questions and records are offsets into the
+//  buffer, and names are only decompressed when the caller copies one out.
+//  The writer compresses every name against the names already written.
+//
+
+
+#ifndef DNSPacket_h
+#define DNSPacket_h
+
+#include "SmallVector.h"
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Uncompressed wire format: length prefixed labels ending with the root label.
+typedef std::string DNSName;
+
+// understands "\." and "\DDD" escapes, the trailing dot is optional
+bool DNSNameFromDotted(const char *dotted, DNSName &name);
+// escaped dotted form with a trailing dot, as dns_sd reports full names
+std::string DNSNameToDotted(const DNSName &name);
+DNSName DNSNamePrepend(const std::string &label, const DNSName &parent);
+std::string DNSNameFirstLabel(const DNSName &name);
+DNSName DNSNameParent(const DNSName &name);
+// ASCII lower case copy; names that are equal have equal keys
+DNSName DNSNameKey(const DNSName &name);
+bool DNSNameEqual(const DNSName &a, const DNSName &b);
+
+// dns_sd takes the type and domain apart; "_http._tcp" and "local." become
+// "_http._tcp.local.", an empty domain meaning "local."
+bool DNSNameFromServiceType(const char *regtype, const char *domain, DNSName &fullType);
+// the halves of a full service type as dns_sd reports them, "_http._tcp." and "local."
+std::string DNSServiceTypeOf(const DNSName &fullType);
+std::string DNSServiceDomainOf(const DNSName &fullType);
+
+
+enum
+{
+	kDNSTypeA = 1,
+	kDNSTypePTR = 12,
+	kDNSTypeTXT = 16,
+	kDNSTypeAAAA = 28,
+	kDNSTypeSRV = 33,
+	kDNSTypeANY = 255,
+
+	kDNSClassIN = 1,
+	kDNSClassANY = 255,
+	// top bit of the class: cache flush in records, unicast response in questions
+	kDNSClassTopBit = 0x8000,
+
+	kDNSFlagResponse = 0x8000,
+	kDNSFlagAuthoritative = 0x0400,
+	kDNSFlagTruncated = 0x0200,
+};
+
+// A record to send, or a record as the engine caches it. Only the fields of
+// its type are used.
+struct DNSRecord
+{
+	DNSName name;
+	uint16_t type;
+	// sent with the cache flush bit
+	bool unique;
+	uint32_t ttl;
+
+	// PTR and SRV
+	DNSName target;
+	// SRV, port in host byte order
+	uint16_t priority;
+	uint16_t weight;
+	uint16_t port;
+	// everything else, as it is on the wire
+	std::string rdata;
+
+	DNSRecord()
+	: type(0)
+	, unique(false)
+	, ttl(0)
+	, priority(0)
+	, weight(0)
+	, port(0)
+	{
+	}
+
+	// same name, type and data; the TTL does not matter
+	bool SameAs(const DNSRecord &other) const;
+};
+
+
+class DNSPacketReader
+{
+public:
+	enum Section
+	{
+		kAnswer,
+		kAuthority,
+		kAdditional,
+	};
+
+	struct Question
+	{
+		uint16_t name;
+		uint16_t type;
+		uint16_t qclass;
+		bool unicastResponse;
+	};
+
+	struct Record
+	{
+		uint16_t name;
+		uint16_t type;
+		uint16_t rrclass;
+		bool cacheFlush;
+		uint32_t ttl;
+		uint16_t rdata;
+		uint16_t rdlength;
+		Section section;
+	};
+
+	// data has to stay alive while the reader is used
+	DNSPacketReader(const uint8_t *data, size_t length);
+
+	// false for malformed packets, nothing of those may be used
+	bool Parse();
+
+	uint16_t ID() const { return id; }
+	bool IsResponse() const { return (flags & kDNSFlagResponse) != 0; }
+	bool IsTruncated() const { return (flags & kDNSFlagTruncated) != 0; }
+
+	const SmallVector<Question, 4> &Questions() const { return questions; }
+	const SmallVector<Record, 16> &Records() const { return records; }
+
+	// the name at offset, compressed or not, against an uncompressed one
+	bool NameEquals(size_t offset, const DNSName &name) const;
+	bool ReadName(size_t offset, DNSName &name) const;
+
+	// copies the record out, decompressing the names in its data; false for
+	// records that do not belong to the IN class or have malformed data
+	bool ReadRecord(const Record &record, DNSRecord &out) const;
+
+private:
+	bool SkipName(size_t &offset) const;
+	uint16_t Read16(size_t offset) const { return (uint16_t)((data[offset] << 8) | data[offset + 1]); }
+
+	const uint8_t *data;
+	size_t length;
+	uint16_t id;
+	uint16_t flags;
+	SmallVector<Question, 4> questions;
+	SmallVector<Record, 16> records;
+};
+
+
+class DNSPacketWriter
+{
+public:
+	// limit is the largest message the writer produces
+	explicit DNSPacketWriter(size_t limit);
+
+	void Reset(uint16_t id, uint16_t flags);
+	void SetFlags(uint16_t flags);
+
+	// Sections have to be written in order. When something does not fit the
+	// message is left as it was before the call and false is returned.
+	bool AddQuestion(const DNSName &name, uint16_t type, bool unicastResponse);
+	bool AddRecord(DNSPacketReader::Section section, const DNSRecord &record, uint32_t ttl);
+
+	bool Empty() const { return questionCount + answerCount + authorityCount + additionalCount == 0; }
+	const uint8_t *Data() const { return (const uint8_t*)buffer.data(); }
+	size_t Length() const { return buffer.size(); }
+
+private:
+	void WriteName(const DNSName &name);
+	void Write16(uint16_t value);
+	void Write32(uint32_t value);
+	void Patch16(size_t offset, uint16_t value);
+	bool Commit(size_t rollback, size_t knownNames, uint16_t &count, size_t countOffset);
+
+	size_t limit;
+	std::string buffer;
+	uint16_t questionCount;
+	uint16_t answerCount;
+	uint16_t authorityCount;
+	uint16_t additionalCount;
+	// lower case name suffixes already in the message and where they start
+	std::vector< std::pair<DNSName, uint16_t> > names;
+};
+
+
+#endif /* DNSPacket_h */
@@ -0,0 +1,516 @@
+//
+//  DNSPassive.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSPassive.h"
+#include "DnsServices.h"
+
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+
+
+// RFC 6762 section 10.1 and 10.2: goodbyes and flushed records linger for a second
+static const chrono::seconds kLingerTime(1);
+
+
+class DNSPassiveListener::Inbox : public enable_shared_from_this<DNSPassiveListener::Inbox>
+{
+public:
+	explicit Inbox(DNSPassiveListener *owner)
+	: owner(owner)
+	{
+	}
+
+	// called from the receiver, with the records of one response
+	void Push(vector<DNSRecord> &&records)
+	{
+		// as with the shard inbox, only the first of a batch posts a drain
+		lock_guard<mutex> guard(lock);
+		if(owner == nullptr)
+			return;
+		bool idle = packets.empty();
+		packets.push_back(std::move(records));
+		if(idle)
+		{
+			shared_ptr<Inbox> self = shared_from_this();
+			owner->owner->EventLoop().Post([self](){
+				self->Drain();
+			});
+		}
+	}
+
+	void Detach()
+	{
+		lock_guard<mutex> guard(lock);
+		owner = nullptr;
+		packets.clear();
+	}
+
+private:
+	void Drain()
+	{
+		deque< vector<DNSRecord> > batch;
+		{
+			lock_guard<mutex> guard(lock);
+			batch.swap(packets);
+		}
+
+		for(const auto &records : batch)
+		{
+			// the last browser may be stopped while a packet is delivered
+			DNSPassiveListener *target;
+			{
+				lock_guard<mutex> guard(lock);
+				target = owner;
+			}
+			if(target == nullptr)
+				return;
+			target->Handle(records);
+		}
+	}
+
+	mutex lock;
+	DNSPassiveListener *owner;
+	deque< vector<DNSRecord> > packets;
+};
+
+
+
+DNSPassiveListener::DNSPassiveListener(DNSServiceManager *owner)
+: owner(owner)
+, sock(kNoSocket)
+, wake(kNoSocket)
+, records(0)
+, expiryTimer(0)
+{
+	memset(&wakeAddress, 0, sizeof(wakeAddress));
+}
+
+DNSPassiveListener::~DNSPassiveListener()
+{
+	Stop();
+}
+
+bool DNSPassiveListener::Start()
+{
+	if(!DNSSocketStartup())
+		return false;
+
+	wake = DNSSocketOpenLoopback(wakeAddress);
+	sock = DNSSocketOpenMulticast(kMulticastDNSPort, string());
+	if(wake == kNoSocket || sock == kNoSocket)
+	{
+		Stop();
+		return false;
+	}
+
+	inbox = make_shared<Inbox>(this);
+	receiver = thread([this](){
+		Receive();
+	});
+	return true;
+}
+
+void DNSPassiveListener::Stop()
+{
+	if(receiver.joinable())
+	{
+		char byte = 0;
+		sendto(wake, &byte, 1, 0, (const sockaddr*)&wakeAddress, sizeof(wakeAddress));
+		receiver.join();
+	}
+	if(inbox)
+		inbox->Detach();
+	inbox.reset();
+
+	if(sock != kNoSocket || wake != kNoSocket)
+	{
+		DNSSocketClose(sock);
+		DNSSocketClose(wake);
+		sock = kNoSocket;
+		wake = kNoSocket;
+		DNSSocketCleanup();
+	}
+
+	owner->EventLoop().CancelTimer(expiryTimer);
+	expiryTimer = 0;
+	cache.clear();
+	records = 0;
+}
+
+void DNSPassiveListener::Receive()
+{
+	vector<uint8_t> buffer(kMulticastDNSMaxReceive);
+	while(true)
+	{
+		bool woken = false;
+		bool readable = DNSSocketWait(sock, wake, 60000, woken);
+		if(woken)
+			return;
+		if(!readable)
+			continue;
+
+		while(true)
+		{
+			sockaddr_in from;
+			socklen_t fromLength = sizeof(from);
+			int received = (int)recvfrom(sock, (char*)&buffer[0], (int)buffer.size(), 0, (sockaddr*)&from, &fromLength);
+			if(received <= 0)
+				break;
+
+			// RFC 6762 section 6: responses from any other port are ignored
+			if(from.sin_family != AF_INET || from.sin_port != htons(kMulticastDNSPort))
+				continue;
+
+			DNSPacketReader reader(&buffer[0], (size_t)received);
+			if(!reader.Parse() || !reader.IsResponse())
+				continue;
+
+			vector<DNSRecord> heard;
+			for(const auto &record : reader.Records())
+			{
+				if(record.type != kDNSTypePTR && record.type != kDNSTypeSRV && record.type != kDNSTypeTXT
+				   && record.type != kDNSTypeA && record.type != kDNSTypeAAAA)
+					continue;
+
+				DNSRecord copy;
+				if(reader.ReadRecord(record, copy))
+					heard.push_back(std::move(copy));
+			}
+			if(!heard.empty())
+				inbox->Push(std::move(heard));
+		}
+	}
+}
+
+bool DNSPassiveListener::AddBrowser(ServiceBrowser *browser)
+{
+	shared_ptr<Browsed> browsed = make_shared<Browsed>();
+	browsed->browser = browser;
+	if(!DNSNameFromServiceType(browser->type.c_str(), browser->domain.c_str(), browsed->fullType))
+		return false;
+
+	if(browsers.empty() && !Start())
+		return false;
+	browsers.push_back(browsed);
+
+	// like a live browser, nothing is reported from inside the call that started it
+	owner->EventLoop().ScheduleTimer(0, [this, browsed](){
+		if(browsed->browser == nullptr)
+			return;
+		vector<Change> changes;
+		Reconcile(browsed, Clock::now(), changes);
+		Deliver(changes);
+	});
+	return true;
+}
+
+void DNSPassiveListener::RemoveBrowser(ServiceBrowser *browser)
+{
+	for(auto browsed = browsers.begin(); browsed != browsers.end(); ++browsed)
+	{
+		if((*browsed)->browser == browser)
+		{
+			(*browsed)->browser = nullptr;
+			browsers.erase(browsed);
+			break;
+		}
+	}
+
+	if(browsers.empty())
+		Stop();
+}
+
+void DNSPassiveListener::Handle(const vector<DNSRecord> &heard)
+{
+	Clock::time_point now = Clock::now();
+	Clock::time_point linger = now + kLingerTime;
+
+	for(const auto &record : heard)
+	{
+		DNSName key = DNSNameKey(record.name);
+		vector<Entry> &entries = cache[key];
+
+		// a unique record replaces what was cached for its name and type
+		// before, but not what came with it in the same second
+		if(record.unique)
+		{
+			for(auto &entry : entries)
+			{
+				if(entry.record.type == record.type && now - entry.received > kLingerTime && !entry.record.SameAs(record))
+					entry.expires = min(entry.expires, linger);
+			}
+		}
+
+		Entry *known = nullptr;
+		for(auto &entry : entries)
+		{
+			if(entry.record.SameAs(record))
+				known = &entry;
+		}
+
+		if(record.ttl == 0)
+		{
+			if(known)
+				known->expires = min(known->expires, linger);
+		}
+		else if(known)
+		{
+			known->record.ttl = record.ttl;
+			known->received = now;
+			known->expires = now + chrono::seconds(record.ttl);
+		}
+		else if(records < kMaxRecords)
+		{
+			Entry added;
+			added.record = record;
+			added.received = now;
+			added.expires = now + chrono::seconds(record.ttl);
+			entries.push_back(added);
+			records++;
+		}
+
+		if(entries.empty())
+			cache.erase(key);
+	}
+
+	vector<Change> changes;
+	for(const auto &browsed : browsers)
+	{
+		Reconcile(browsed, now, changes);
+	}
+	ScheduleExpiry();
+	Deliver(changes);
+}
+
+void DNSPassiveListener::Expire()
+{
+	expiryTimer = 0;
+
+	Clock::time_point now = Clock::now();
+	for(auto bucket = cache.begin(); bucket != cache.end(); )
+	{
+		vector<Entry> &entries = bucket->second;
+		size_t before = entries.size();
+		entries.erase(remove_if(entries.begin(), entries.end(), [now](const Entry &entry){
+			return entry.expires <= now;
+		}), entries.end());
+		records -= before - entries.size();
+
+		if(entries.empty())
+			bucket = cache.erase(bucket);
+		else
+			++bucket;
+	}
+
+	vector<Change> changes;
+	for(const auto &browsed : browsers)
+	{
+		Reconcile(browsed, now, changes);
+	}
+	ScheduleExpiry();
+	Deliver(changes);
+}
+
+void DNSPassiveListener::ScheduleExpiry()
+{
+	bool any = false;
+	Clock::time_point deadline;
+	for(const auto &bucket : cache)
+	{
+		for(const auto &entry : bucket.second)
+		{
+			if(!any || entry.expires < deadline)
+				deadline = entry.expires;
+			any = true;
+		}
+	}
+
+	if(expiryTimer && any && deadline == expiryDeadline)
+		return;
+
+	owner->EventLoop().CancelTimer(expiryTimer);
+	expiryTimer = 0;
+	if(!any)
+		return;
+
+	expiryDeadline = deadline;
+	long long waitMs = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+	expiryTimer = owner->EventLoop().ScheduleTimer((uint32_t)max(0LL, waitMs) + 1, [this](){
+		Expire();
+	});
+}
+
+const DNSPassiveListener::Entry *DNSPassiveListener::Find(const DNSName &name, uint16_t type, Clock::time_point now) const
+{
+	auto bucket = cache.find(DNSNameKey(name));
+	if(bucket == cache.end())
+		return nullptr;
+
+	// the latest of several, as after a change that was not sent as unique
+	const Entry *found = nullptr;
+	for(const auto &entry : bucket->second)
+	{
+		if(entry.record.type == type && entry.expires > now && (found == nullptr || entry.received > found->received))
+			found = &entry;
+	}
+	return found;
+}
+
+void DNSPassiveListener::Reconcile(const shared_ptr<Browsed> &browsed, Clock::time_point now, vector<Change> &changes)
+{
+	unordered_map<DNSName, Reported> current;
+
+	auto pointers = cache.find(DNSNameKey(browsed->fullType));
+	if(pointers != cache.end())
+	{
+		for(const auto &pointer : pointers->second)
+		{
+			if(pointer.record.type != kDNSTypePTR || pointer.expires <= now)
+				continue;
+
+			const DNSName &instance = pointer.record.target;
+			DNSName key = DNSNameKey(instance);
+			if(current.count(key) || !DNSNameEqual(DNSNameParent(instance), pointer.record.name))
+				continue;
+
+			const Entry *srv = Find(instance, kDNSTypeSRV, now);
+			const Entry *txt = Find(instance, kDNSTypeTXT, now);
+			if(srv == nullptr || txt == nullptr)
+				continue;
+
+			Change change;
+			change.browsed = browsed;
+			change.name = DNSNameFirstLabel(instance);
+			change.lost = false;
+			change.hostname = DNSNameToDotted(srv->record.target);
+			change.port = srv->record.port;
+			change.txt = txt->record.rdata;
+
+			auto hosts = cache.find(DNSNameKey(srv->record.target));
+			if(hosts != cache.end())
+			{
+				for(const auto &host : hosts->second)
+				{
+					if((host.record.type == kDNSTypeA || host.record.type == kDNSTypeAAAA) && host.expires > now)
+					{
+						uint32_t ttl = (uint32_t)chrono::duration_cast<chrono::seconds>(host.expires - now).count();
+						change.addresses.push_back(make_pair(host.record.rdata, ttl));
+					}
+				}
+			}
+			if(change.addresses.empty())
+				continue;
+
+			// refreshed TTLs alone report nothing
+			vector<string> sorted;
+			for(const auto &address : change.addresses)
+			{
+				sorted.push_back(address.first);
+			}
+			sort(sorted.begin(), sorted.end());
+			char port[8];
+			sprintf(port, "%u", (unsigned)change.port);
+			string digest = change.hostname + '\0' + port + '\0' + change.txt;
+			for(const auto &address : sorted)
+			{
+				digest += '\0' + address;
+			}
+
+			Reported &reporting = current[key];
+			reporting.name = change.name;
+			reporting.digest = digest;
+			auto reported = browsed->reported.find(key);
+			if(reported == browsed->reported.end() || reported->second.digest != digest)
+				changes.push_back(std::move(change));
+		}
+	}
+
+	for(const auto &reported : browsed->reported)
+	{
+		if(current.count(reported.first))
+			continue;
+
+		Change change;
+		change.browsed = browsed;
+		change.name = reported.second.name;
+		change.lost = true;
+		change.port = 0;
+		changes.push_back(std::move(change));
+	}
+
+	browsed->reported.swap(current);
+}
+
+void DNSPassiveListener::Deliver(const vector<Change> &changes)
+{
+	for(const auto &change : changes)
+	{
+		ServiceBrowser *browser = change.browsed->browser;
+		if(browser == nullptr)
+			continue;
+
+		string regtype = DNSServiceTypeOf(change.browsed->fullType);
+		string domain = DNSServiceDomainOf(change.browsed->fullType);
+		const char *name = change.name.c_str();
+
+		if(change.lost)
+		{
+			browser->HandleBrowse(0, 0, kDNSServiceErr_NoError, name, regtype.c_str(), domain.c_str());
+			continue;
+		}
+
+		// the same path a resolve takes, so "found" and "updated" go out as for any browser
+		ServiceBrowser::Instance *instance = browser->FindInstance(name, regtype.c_str(), domain.c_str());
+		if(instance == nullptr)
+		{
+			browser->HandleBrowse(kDNSServiceFlagsAdd, 0, kDNSServiceErr_NoError, name, regtype.c_str(), domain.c_str());
+			instance = browser->FindInstance(name, regtype.c_str(), domain.c_str());
+		}
+		else if(instance->state == ServiceBrowser::kInstanceResolved || instance->state == ServiceBrowser::kInstanceProbing)
+		{
+			// a probe of the previous addresses is dropped along the way
+			browser->CancelResolve(*instance);
+			instance->info->addresses.clear();
+			instance->info->port = -1;
+			browser->StartResolve(*instance);
+		}
+		if(instance == nullptr || instance->state != ServiceBrowser::kInstanceResolving)
+			continue;
+
+		shared_ptr<ServiceInfo> info = instance->info;
+		browser->HandleResolve(info.get(), 0, 0, kDNSServiceErr_NoError, change.hostname.c_str(), htons(change.port),
+							   (uint16_t)change.txt.size(), (const unsigned char*)change.txt.data());
+
+		for(const auto &address : change.addresses)
+		{
+			sockaddr_in ipv4;
+			sockaddr_in6 ipv6;
+			const sockaddr *addr;
+			if(address.first.size() == 4)
+			{
+				memset(&ipv4, 0, sizeof(ipv4));
+				ipv4.sin_family = AF_INET;
+				memcpy(&ipv4.sin_addr, address.first.data(), 4);
+				addr = (const sockaddr*)&ipv4;
+			}
+			else
+			{
+				memset(&ipv6, 0, sizeof(ipv6));
+				ipv6.sin6_family = AF_INET6;
+				memcpy(&ipv6.sin6_addr, address.first.data(), 16);
+				addr = (const sockaddr*)&ipv6;
+			}
+			browser->HandleAddr(info.get(), kDNSServiceFlagsAdd, 0, kDNSServiceErr_NoError, change.hostname.c_str(), addr, address.second);
+		}
+
+		browser->HandleResolveDone(info.get(), kDNSServiceErr_NoError);
+	}
+}
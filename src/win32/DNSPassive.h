@@ -0,0 +1,121 @@
+//
+//  DNSPassive.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Passive discovery: services are put together from the multicast DNS
+//  responses other hosts send anyway, announcements and answers to other
+//  hosts' queries, without ever sending a query. A thread receives on the
+//  multicast DNS port next to whatever responder the host runs and hands the
+//  records to the owner's event loop, where they are cached by TTL and fed to
+//  the passive browsers like resolve results. An instance is reported once
+//  its PTR, SRV, TXT and at least one address have been heard.
+//
+
+
+#ifndef DNSPassive_h
+#define DNSPassive_h
+
+#include "DnsWrapper.h"
+#include "DNSPacket.h"
+#include "DNSSocket.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class ServiceBrowser;
+
+class DNSPassiveListener
+{
+public:
+	explicit DNSPassiveListener(DNSServiceManager *owner);
+	~DNSPassiveListener();
+
+	// Browser has to be a non-live one of the owner. The receiver starts with
+	// the first browser, and what is already cached is reported on the next
+	// turn of the loop; false if the multicast DNS port can't be joined.
+	bool AddBrowser(ServiceBrowser *browser);
+	// the receiver stops and the cache is dropped with the last browser
+	void RemoveBrowser(ServiceBrowser *browser);
+	bool Empty() const { return browsers.empty(); }
+
+	// records heard beyond this are dropped until others expire
+	static const size_t kMaxRecords = 4096;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	class Inbox;
+
+	struct Entry
+	{
+		DNSRecord record;
+		Clock::time_point received;
+		Clock::time_point expires;
+	};
+
+	struct Reported
+	{
+		std::string name;
+		// everything the report carried but the TTLs
+		std::string digest;
+	};
+
+	struct Browsed
+	{
+		// null once removed
+		ServiceBrowser *browser;
+		DNSName fullType;
+		// by lower case instance name
+		std::unordered_map<DNSName, Reported> reported;
+	};
+
+	// An instance to report, copied out of the cache so that listeners may
+	// stop browsers, or every browser, while the changes are delivered.
+	struct Change
+	{
+		std::shared_ptr<Browsed> browsed;
+		std::string name;
+		bool lost;
+		std::string hostname;
+		uint16_t port;
+		std::string txt;
+		// A and AAAA data with the seconds they have left
+		std::vector< std::pair<std::string, uint32_t> > addresses;
+	};
+
+	bool Start();
+	void Stop();
+	void Receive();
+
+	void Handle(const std::vector<DNSRecord> &records);
+	void Expire();
+	void ScheduleExpiry();
+
+	const Entry *Find(const DNSName &name, uint16_t type, Clock::time_point now) const;
+	void Reconcile(const std::shared_ptr<Browsed> &browsed, Clock::time_point now, std::vector<Change> &changes);
+	void Deliver(const std::vector<Change> &changes);
+
+	DNSServiceManager *owner;
+	std::shared_ptr<Inbox> inbox;
+
+	// receiver thread
+	DNSSocket sock;
+	DNSSocket wake;
+	sockaddr_in wakeAddress;
+	std::thread receiver;
+
+	// owner's thread
+	std::unordered_map< DNSName, std::vector<Entry> > cache;
+	size_t records;
+	std::vector< std::shared_ptr<Browsed> > browsers;
+	TimerHandle expiryTimer;
+	Clock::time_point expiryDeadline;
+};
+
+
+#endif /* DNSPassive_h */
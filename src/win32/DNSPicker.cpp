@@ -0,0 +1,315 @@
+//
+//  DNSPicker.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSPicker.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+
+const double DNSPicker::kMaxWeight = 1e15;
+
+
+bool DNSPicker::Ranked::operator<(const Ranked &other) const
+{
+	if(load != other.load)
+		return load < other.load;
+	if(weight != other.weight)
+		return weight > other.weight;
+	return slot < other.slot;
+}
+
+
+DNSPicker::DNSPicker()
+: schema(nullptr)
+, picks(0)
+, generator((unsigned)chrono::system_clock::now().time_since_epoch().count())
+{
+
+}
+
+void DNSPicker::Update(const ServiceInfo &info)
+{
+	uint64_t id = info.instanceId();
+	auto known = byInstance.find(id);
+
+	uint32_t slot;
+	if(known != byInstance.end())
+	{
+		slot = known->second;
+	}
+	else
+	{
+		if(freeSlots.empty())
+		{
+			slot = (uint32_t)slots.size();
+			slots.push_back(Slot());
+		}
+		else
+		{
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		slots[slot].used = true;
+		slots[slot].position = (uint32_t)dense.size();
+		dense.push_back(slot);
+		byInstance[id] = slot;
+	}
+
+	slots[slot].info = info;
+	for(auto &index : indexes)
+	{
+		Set(index, slot);
+	}
+}
+
+void DNSPicker::Remove(const ServiceInfo &info)
+{
+	auto known = byInstance.find(info.instanceId());
+	if(known == byInstance.end())
+		return;
+
+	uint32_t slot = known->second;
+	byInstance.erase(known);
+
+	for(auto &index : indexes)
+	{
+		Clear(index, slot);
+	}
+
+	uint32_t position = slots[slot].position;
+	uint32_t last = dense.back();
+	dense[position] = last;
+	slots[last].position = position;
+	dense.pop_back();
+
+	slots[slot].used = false;
+	slots[slot].info = ServiceInfo();
+	freeSlots.push_back(slot);
+}
+
+const ServiceInfo *DNSPicker::Pick(const char *weightKey, const char *loadKey, Strategy strategy)
+{
+	if(dense.empty())
+		return nullptr;
+
+	Index &index = FindIndex(weightKey, loadKey);
+	uint32_t slot = dense[0];
+
+	switch(strategy)
+	{
+		case kLeastLoaded:
+			slot = index.byLoad.begin()->slot;
+			break;
+
+		case kWeightedRandom:
+			// with nothing weighing anything every instance is as likely
+			if(!SampleWeighted(index, slot))
+				slot = dense[uniform_int_distribution<size_t>(0, dense.size() - 1)(generator)];
+			break;
+
+		case kPowerOfTwoChoices:
+			if(dense.size() > 1)
+			{
+				size_t first = uniform_int_distribution<size_t>(0, dense.size() - 1)(generator);
+				size_t second = uniform_int_distribution<size_t>(0, dense.size() - 2)(generator);
+				if(second >= first)
+					second++;
+
+				Ranked a = { index.loads[dense[first]], index.weights[dense[first]], dense[first] };
+				Ranked b = { index.loads[dense[second]], index.weights[dense[second]], dense[second] };
+				slot = (b < a) ? b.slot : a.slot;
+			}
+			break;
+	}
+
+	return &slots[slot].info;
+}
+
+DNSPicker::Index &DNSPicker::FindIndex(const char *weightKey, const char *loadKey)
+{
+	picks++;
+	for(auto &index : indexes)
+	{
+		if(index.weightKey == weightKey && index.loadKey == loadKey)
+		{
+			index.lastUsed = picks;
+			return index;
+		}
+	}
+
+	if(indexes.size() >= kMaxIndexes)
+	{
+		auto oldest = min_element(indexes.begin(), indexes.end(), [](const Index &a, const Index &b){
+			return a.lastUsed < b.lastUsed;
+		});
+		indexes.erase(oldest);
+	}
+
+	indexes.push_back(Index());
+	Index &index = indexes.back();
+	index.weightKey = weightKey;
+	index.loadKey = loadKey;
+	index.lastUsed = picks;
+	Build(index);
+	return index;
+}
+
+void DNSPicker::Build(Index &index)
+{
+	index.weights.assign(slots.size(), 0);
+	index.loads.assign(slots.size(), 0);
+	index.byLoad.clear();
+
+	size_t capacity = 1;
+	while(capacity < slots.size())
+	{
+		capacity <<= 1;
+	}
+	index.tree.assign(capacity + 1, 0);
+	index.total = 0;
+
+	for(uint32_t slot : dense)
+	{
+		Set(index, slot);
+	}
+}
+
+void DNSPicker::Set(Index &index, uint32_t slot)
+{
+	if(index.weights.size() < slots.size())
+	{
+		index.weights.resize(slots.size(), 0);
+		index.loads.resize(slots.size(), 0);
+	}
+
+	// the tree grows by rebuilding it twice as large
+	if(index.tree.size() - 1 < slots.size())
+	{
+		size_t capacity = (index.tree.size() - 1) * 2;
+		while(capacity < slots.size())
+		{
+			capacity <<= 1;
+		}
+		index.tree.assign(capacity + 1, 0);
+		index.total = 0;
+		for(uint32_t used : dense)
+		{
+			AddWeight(index, used, index.weights[used]);
+		}
+	}
+
+	Clear(index, slot);
+
+	const ServiceInfo &info = slots[slot].info;
+	Ranked ranked;
+	ranked.weight = min(max(0.0, Number(info, index.weightKey, 1)), kMaxWeight);
+	ranked.load = Number(info, index.loadKey, 0);
+	ranked.slot = slot;
+
+	index.weights[slot] = ranked.weight;
+	index.loads[slot] = ranked.load;
+	AddWeight(index, slot, ranked.weight);
+	index.byLoad.insert(ranked);
+}
+
+void DNSPicker::Clear(Index &index, uint32_t slot)
+{
+	if(slot >= index.weights.size())
+		return;
+
+	Ranked ranked = { index.loads[slot], index.weights[slot], slot };
+	index.byLoad.erase(ranked);
+	AddWeight(index, slot, -index.weights[slot]);
+	index.weights[slot] = 0;
+	index.loads[slot] = 0;
+}
+
+void DNSPicker::AddWeight(Index &index, uint32_t slot, double delta)
+{
+	if(delta == 0)
+		return;
+
+	for(size_t i = slot + 1; i < index.tree.size(); i += i & (0 - i))
+	{
+		index.tree[i] += delta;
+	}
+	index.total += delta;
+}
+
+bool DNSPicker::SampleWeighted(Index &index, uint32_t &slot)
+{
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		if(index.total <= 0)
+			return false;
+
+		// walks down the tree to the first slot whose running sum passes target
+		double target = uniform_real_distribution<double>(0, index.total)(generator);
+		size_t capacity = index.tree.size() - 1;
+		size_t position = 0;
+		for(size_t step = capacity; step > 0; step >>= 1)
+		{
+			if(position + step <= capacity && index.tree[position + step] <= target)
+			{
+				position += step;
+				target -= index.tree[position];
+			}
+		}
+
+		if(position < slots.size() && slots[position].used && index.weights[position] > 0)
+		{
+			slot = (uint32_t)position;
+			return true;
+		}
+
+		// rounding from many updates led astray, the sums start over
+		index.tree.assign(index.tree.size(), 0);
+		index.total = 0;
+		for(uint32_t used : dense)
+		{
+			AddWeight(index, used, index.weights[used]);
+		}
+	}
+	return false;
+}
+
+double DNSPicker::Number(const ServiceInfo &info, const string &key, double fallback) const
+{
+	const char *value;
+	size_t length;
+	if(key.empty() || !info.getData(key.c_str(), &value, &length) || length == 0)
+		return fallback;
+
+	// a long value goes on in continuations, as ServiceInfo::getValue() reads it
+	string joined;
+	if(info.joinValue(key.data(), key.size(), value, length, joined))
+	{
+		value = joined.data();
+		length = joined.size();
+	}
+
+	double number;
+	DNSSchema::Type type = schema ? schema->TypeOf(key.data(), key.size()) : DNSSchema::kString;
+	if(!DNSSchema::Decode(type, value, length, number))
+	{
+		string text(value, length);
+		char *end = nullptr;
+		number = strtod(text.c_str(), &end);
+		if(end == text.c_str())
+			return fallback;
+	}
+
+	// a binary f32 or f64 may hold these as well as text does; neither can be summed or drawn from
+	if(number != number || fabs(number) == HUGE_VAL)
+		return fallback;
+	return number;
+}
@@ -0,0 +1,120 @@
+//
+//  DNSPicker.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Picks one of the instances a browser currently reports, by numeric TXT
+//  values such as "load" and "weight". The instances are kept up to date from
+//  "found", "updated" and "lost", and every pair of keys a pick asks for gets
+//  an index that follows them: instances ordered by load for the least loaded
+//  one, and a Fenwick tree of the weights for weighted random picks. A pick
+//  is then O(1) or O(log n) however many instances there are.
+//
+
+
+#ifndef DNSPicker_h
+#define DNSPicker_h
+
+#include "DnsWrapper.h"
+#include "DNSSchema.h"
+
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+class DNSPicker
+{
+public:
+	enum Strategy
+	{
+		// lowest load, the highest weight among equal loads
+		kLeastLoaded,
+		// chance in proportion to weight
+		kWeightedRandom,
+		// the less loaded of two chosen at random
+		kPowerOfTwoChoices,
+	};
+
+	DNSPicker();
+
+	// "found" and "updated"
+	void Update(const ServiceInfo &info);
+	// "lost"
+	void Remove(const ServiceInfo &info);
+	size_t Size() const { return dense.size(); }
+
+	// typed values are read as the schema says, null for text only; the
+	// schema has to outlive the picker and is set before the first pick
+	void SetSchema(const DNSSchema *schema) { this->schema = schema; }
+
+	// Null when there is no instance. The first pick with a pair of keys
+	// builds its index, the others only read it. A missing or malformed
+	// weight counts as 1 and a missing load as 0, and so do values that are
+	// not finite; negative weights count as 0. The instance stays valid until the next Update() or Remove().
+	const ServiceInfo *Pick(const char *weightKey, const char *loadKey, Strategy strategy);
+
+	// key pairs followed at once, the least recently picked one is dropped beyond
+	static const size_t kMaxIndexes = 4;
+	// larger weights count as this, so that the sum of any number of them stays finite
+	static const double kMaxWeight;
+
+private:
+	struct Slot
+	{
+		ServiceInfo info;
+		bool used;
+		// in dense
+		uint32_t position;
+	};
+
+	struct Ranked
+	{
+		double load;
+		double weight;
+		uint32_t slot;
+
+		bool operator<(const Ranked &other) const;
+	};
+
+	struct Index
+	{
+		std::string weightKey;
+		std::string loadKey;
+		uint64_t lastUsed;
+
+		// by slot
+		std::vector<double> weights;
+		std::vector<double> loads;
+		// 1-based Fenwick tree over weights, sized to a power of two
+		std::vector<double> tree;
+		double total;
+		std::set<Ranked> byLoad;
+	};
+
+	Index &FindIndex(const char *weightKey, const char *loadKey);
+	void Build(Index &index);
+	void Set(Index &index, uint32_t slot);
+	void Clear(Index &index, uint32_t slot);
+	void AddWeight(Index &index, uint32_t slot, double delta);
+	bool SampleWeighted(Index &index, uint32_t &slot);
+
+	double Number(const ServiceInfo &info, const std::string &key, double fallback) const;
+
+	std::vector<Slot> slots;
+	std::vector<uint32_t> freeSlots;
+	// slots in use, for uniform picks
+	std::vector<uint32_t> dense;
+	std::unordered_map<uint64_t, uint32_t> byInstance;
+
+	std::vector<Index> indexes;
+	const DNSSchema *schema;
+	uint64_t picks;
+	std::minstd_rand generator;
+};
+
+
+#endif /* DNSPicker_h */
@@ -0,0 +1,254 @@
+//
+//  DNSPollEventLoop.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSPollEventLoop.h"
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+static void Watch(int epollFd, int fd)
+{
+	epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+
+DNSPollEventLoop::DNSPollEventLoop()
+: epollFd(epoll_create1(EPOLL_CLOEXEC))
+, timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+, postFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+, nextTimer(0)
+, armed(Clock::time_point::max())
+{
+	Watch(epollFd, timerFd);
+	Watch(epollFd, postFd);
+}
+
+DNSPollEventLoop::~DNSPollEventLoop()
+{
+	for(auto &e : mapping)
+	{
+		DNSServiceRefDeallocate(e.second);
+	}
+	mapping.clear();
+
+	close(postFd);
+	close(timerFd);
+	close(epollFd);
+}
+
+void DNSPollEventLoop::RegisterRef(DNSServiceRef ref)
+{
+	if(!ref)
+		return;
+
+	int fd = DNSServiceRefSockFD(ref);
+	if(fd < 0)
+		return;
+	mapping[fd] = ref;
+	Watch(epollFd, fd);
+}
+
+void DNSPollEventLoop::TerminateRef(DNSServiceRef ref)
+{
+	if(!ref)
+		return;
+
+	int fd = DNSServiceRefSockFD(ref);
+	if(mapping.erase(fd))
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	DNSServiceRefDeallocate(ref);
+}
+
+void DNSPollEventLoop::Nest(BaseDNSEventLoop *inner)
+{
+	int fd = inner->Descriptor();
+	if(fd < 0)
+		return;
+	nested[fd] = inner;
+	Watch(epollFd, fd);
+}
+
+void DNSPollEventLoop::Unnest(BaseDNSEventLoop *inner)
+{
+	int fd = inner->Descriptor();
+	if(nested.erase(fd))
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+TimerHandle DNSPollEventLoop::ScheduleTimer(uint32_t milliseconds, const function<void()> &callback)
+{
+	// 0 is never a valid handle
+	TimerHandle timer = ++nextTimer;
+	if(timer == 0)
+		timer = ++nextTimer;
+
+	Clock::time_point deadline = Clock::now() + chrono::milliseconds(milliseconds);
+	timers[Deadline(deadline, timer)] = callback;
+	deadlines[timer] = deadline;
+
+	if(deadline < armed)
+		Arm(deadline);
+	return timer;
+}
+
+void DNSPollEventLoop::CancelTimer(TimerHandle timer)
+{
+	auto deadline = deadlines.find(timer);
+	if(deadline == deadlines.end())
+		return;
+
+	// the timerfd may still go off for it, which only costs an empty Poll()
+	timers.erase(Deadline(deadline->second, timer));
+	deadlines.erase(deadline);
+}
+
+void DNSPollEventLoop::Post(const function<void()> &task)
+{
+	{
+		lock_guard<mutex> lock(postedLock);
+		posted.push_back(task);
+	}
+	Signal();
+}
+
+size_t DNSPollEventLoop::Poll(uint32_t maxEvents, uint32_t maxMs)
+{
+	Clock::time_point start = Clock::now();
+	size_t ran = 0;
+	auto spent = [&]() {
+		return (maxEvents && ran >= maxEvents)
+			|| (maxMs && Clock::now() - start >= chrono::milliseconds(maxMs));
+	};
+
+	// posted tasks first, they carry results other threads already waited for
+	uint64_t count;
+	while(read(postFd, &count, sizeof(count)) > 0)
+	{
+	}
+
+	vector< function<void()> > tasks;
+	{
+		lock_guard<mutex> lock(postedLock);
+		tasks.swap(posted);
+	}
+	size_t task = 0;
+	for(; task < tasks.size() && !spent(); task++)
+	{
+		tasks[task]();
+		ran++;
+	}
+	if(task < tasks.size())
+	{
+		{
+			lock_guard<mutex> lock(postedLock);
+			posted.insert(posted.begin(), tasks.begin() + task, tasks.end());
+		}
+		Signal();
+	}
+
+	// only timers that were due on the way in, a 0 ms timer set by one of
+	// them waits for the next Poll()
+	while(read(timerFd, &count, sizeof(count)) > 0)
+	{
+	}
+
+	Clock::time_point now = Clock::now();
+	vector<Deadline> due;
+	for(auto &timer : timers)
+	{
+		if(timer.first.first > now)
+			break;
+		due.push_back(timer.first);
+	}
+	for(auto &deadline : due)
+	{
+		if(spent())
+			break;
+		auto timer = timers.find(deadline);
+		if(timer == timers.end())
+			continue;
+
+		function<void()> callback = std::move(timer->second);
+		timers.erase(timer);
+		deadlines.erase(deadline.second);
+		callback();
+		ran++;
+	}
+
+	if(!spent())
+	{
+		epoll_event events[kMaxReady];
+		int ready = epoll_wait(epollFd, events, kMaxReady, 0);
+		for(int i = 0; i < ready && !spent(); i++)
+		{
+			int fd = events[i].data.fd;
+			if(fd == timerFd || fd == postFd)
+				continue;
+
+			auto inner = nested.find(fd);
+			if(inner != nested.end())
+			{
+				// its own epoll set, readable only while it has work, so this never blocks
+				inner->second->Poll(0, 0);
+				ran++;
+				continue;
+			}
+
+			// An earlier callback may have terminated the ref or read what was
+			// waiting; DNSServiceProcessResult() would then block.
+			auto ref = mapping.find(fd);
+			pollfd check = { fd, POLLIN, 0 };
+			if(ref == mapping.end() || poll(&check, 1, 0) <= 0)
+				continue;
+
+			DNSServiceErrorType err = DNSServiceProcessResult(ref->second);
+			if(err == kDNSServiceErr_ServiceNotRunning && daemonLost)
+			{
+				// the socket closed with the daemon, the manager terminates the ref
+				daemonLost();
+			}
+			ran++;
+		}
+	}
+
+	// refs left over stay readable by themselves, timers need the timerfd
+	Arm(timers.empty() ? Clock::time_point::max() : timers.begin()->first.first);
+	return ran;
+}
+
+void DNSPollEventLoop::Arm(Clock::time_point deadline)
+{
+	armed = deadline;
+
+	itimerspec spec = {};
+	if(deadline != Clock::time_point::max())
+	{
+		// a deadline already past still has to wake the host, and 0 would disarm
+		long long ns = chrono::duration_cast<chrono::nanoseconds>(deadline - Clock::now()).count();
+		if(ns < 1)
+			ns = 1;
+		spec.it_value.tv_sec = (time_t)(ns / 1000000000);
+		spec.it_value.tv_nsec = (long)(ns % 1000000000);
+	}
+	timerfd_settime(timerFd, 0, &spec, nullptr);
+}
+
+void DNSPollEventLoop::Signal()
+{
+	uint64_t one = 1;
+	ssize_t written = write(postFd, &one, sizeof(one));
+	(void)written;
+}
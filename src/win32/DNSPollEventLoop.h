@@ -0,0 +1,81 @@
+//
+//  DNSPollEventLoop.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Event loop of builds with ZEROCONF_POLL_LOOP, for Linux hosts that have no
+//  main loop to hand the refs to. Nothing runs until the host calls Poll().
+//  The sockets of the refs, a timerfd armed for the earliest timer and an
+//  eventfd for posted tasks all sit in one epoll set, whose descriptor the
+//  host adds to its own poll or epoll set: it is readable whenever Poll()
+//  has something to do.
+//
+
+
+#ifndef DNSPollEventLoop_h
+#define DNSPollEventLoop_h
+
+#include "DnsWrapper.h"
+
+#include <dns_sd.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+class DNSPollEventLoop : public BaseDNSEventLoop
+{
+public:
+	DNSPollEventLoop();
+	virtual ~DNSPollEventLoop();
+
+	virtual void RegisterRef(DNSServiceRef ref) override;
+	virtual void TerminateRef(DNSServiceRef ref) override;
+	virtual TimerHandle ScheduleTimer(uint32_t milliseconds, const std::function<void()> &callback) override;
+	virtual void CancelTimer(TimerHandle timer) override;
+	virtual void Post(const std::function<void()> &task) override;
+
+	virtual size_t Poll(uint32_t maxEvents, uint32_t maxMs) override;
+	virtual int Descriptor() const override { return epollFd; }
+
+	// Polls inner whenever it has something to do, for the loops of other
+	// managers in the process, which the host does not know about. inner has
+	// to be taken out again before it is deleted.
+	void Nest(BaseDNSEventLoop *inner);
+	void Unnest(BaseDNSEventLoop *inner);
+
+	// ready refs looked at per epoll_wait()
+	static const int kMaxReady = 64;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	typedef std::pair<Clock::time_point, TimerHandle> Deadline;
+
+	void Arm(Clock::time_point deadline);
+	void Signal();
+
+	int epollFd;
+	int timerFd;
+	int postFd;
+
+	std::unordered_map<int, DNSServiceRef> mapping;
+	std::unordered_map<int, BaseDNSEventLoop*> nested;
+
+	// by deadline, then by handle, so timers due at once run in the order they were set
+	std::map<Deadline, std::function<void()> > timers;
+	std::unordered_map<TimerHandle, Clock::time_point> deadlines;
+	TimerHandle nextTimer;
+	// what the timerfd is set to, time_point::max() when it is not
+	Clock::time_point armed;
+
+	std::mutex postedLock;
+	std::vector< std::function<void()> > posted;
+};
+
+
+#endif /* DNSPollEventLoop_h */
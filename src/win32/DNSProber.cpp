@@ -0,0 +1,426 @@
+//
+//  DNSProber.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSProber.h"
+#include "DnsServices.h"
+
+#include <string.h>
+#include <algorithm>
+
+#if _WINDOWS
+	#pragma comment(lib, "Ws2_32.lib")
+#else
+	#include <errno.h>
+	#include <poll.h>
+#endif
+
+using namespace std;
+
+
+// how long the worker sleeps with nothing to do before it looks again
+static const long long kIdleWaitMs = 60000;
+
+static bool ConnectPending()
+{
+#if _WINDOWS
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EINPROGRESS;
+#endif
+}
+
+// poll() rather than select(), which cannot take descriptors past FD_SETSIZE
+static int PollSockets(vector<pollfd> &sockets, long long timeoutMs)
+{
+#if _WINDOWS
+	return WSAPoll(sockets.data(), (ULONG)sockets.size(), (INT)timeoutMs);
+#else
+	return poll(sockets.data(), (nfds_t)sockets.size(), (int)timeoutMs);
+#endif
+}
+
+// fe80::/10, which only means something together with an interface
+static bool IsLinkLocal(const ServiceAddress &address)
+{
+	return address.family == ServiceAddress::kFamilyIPv6 && address.bytes[0] == 0xFE && (address.bytes[1] & 0xC0) == 0x80;
+}
+
+
+DNSProber::DNSProber(DNSServiceManager *owner)
+: owner(owner)
+, wake(kNoSocket)
+, nextProbe(0)
+{
+	memset(&wakeAddress, 0, sizeof(wakeAddress));
+}
+
+DNSProber::~DNSProber()
+{
+	Stop();
+}
+
+bool DNSProber::Start()
+{
+	if(!DNSSocketStartup())
+		return false;
+
+	wake = DNSSocketOpenLoopback(wakeAddress);
+	if(wake == kNoSocket)
+	{
+		DNSSocketCleanup();
+		return false;
+	}
+
+	shared = make_shared<Shared>();
+	shared->stopping = false;
+	shared->owner = this;
+	worker = thread([this](){
+		Run();
+	});
+	return true;
+}
+
+void DNSProber::Stop()
+{
+	if(worker.joinable())
+	{
+		{
+			lock_guard<mutex> guard(shared->lock);
+			shared->stopping = true;
+		}
+		Wake();
+		worker.join();
+	}
+	if(shared)
+	{
+		lock_guard<mutex> guard(shared->lock);
+		shared->owner = nullptr;
+		shared->pending.clear();
+	}
+	shared.reset();
+
+	if(wake != kNoSocket)
+	{
+		DNSSocketClose(wake);
+		wake = kNoSocket;
+		DNSSocketCleanup();
+	}
+
+	jobs.clear();
+}
+
+void DNSProber::Wake()
+{
+	char byte = 0;
+	sendto(wake, &byte, 1, 0, (const sockaddr*)&wakeAddress, sizeof(wakeAddress));
+}
+
+ProbeHandle DNSProber::Probe(const AddressList &addresses, uint16_t port, uint32_t timeoutMs, const ProbeCompletion &completion)
+{
+	Clock::time_point now = Clock::now();
+	Purge(now);
+
+	Job job;
+	job.addresses = addresses;
+	job.remaining = 0;
+	job.completion = completion;
+
+	vector<Target> targets;
+	for(size_t i = 0; i < job.addresses.size(); i++)
+	{
+		ServiceAddress &address = job.addresses[i];
+		auto result = known.find(Key(address, port));
+		if(result != known.end())
+		{
+			address.reachability = result->second.reachable ? ServiceAddress::kReachable : ServiceAddress::kUnreachable;
+			address.rttUs = result->second.rttUs;
+			continue;
+		}
+
+		// no way to say which interface to connect on, so it stays unknown rather than unreachable
+		if(IsLinkLocal(address) && address.interfaceIndex == 0)
+			continue;
+
+		Target target = { 0, i, address, port, timeoutMs };
+		targets.push_back(target);
+	}
+
+	// without a worker nothing more can be learned, the rest stays unknown
+	if(targets.empty() || (!worker.joinable() && !Start()))
+	{
+		Sort(job.addresses);
+		completion(job.addresses);
+		return 0;
+	}
+
+	ProbeHandle probe = ++nextProbe;
+	if(probe == 0)
+		probe = ++nextProbe;
+
+	job.remaining = targets.size();
+	jobs[probe] = std::move(job);
+	{
+		lock_guard<mutex> guard(shared->lock);
+		for(auto &target : targets)
+		{
+			target.probe = probe;
+			shared->pending.push_back(target);
+		}
+	}
+	Wake();
+	return probe;
+}
+
+void DNSProber::Cancel(ProbeHandle probe)
+{
+	if(probe == 0 || jobs.erase(probe) == 0)
+		return;
+
+	// connections already made finish anyway and only feed the results
+	lock_guard<mutex> guard(shared->lock);
+	auto &pending = shared->pending;
+	pending.erase(remove_if(pending.begin(), pending.end(), [probe](const Target &target){
+		return target.probe == probe;
+	}), pending.end());
+}
+
+void DNSProber::Clear()
+{
+	jobs.clear();
+	known.clear();
+	if(shared)
+	{
+		lock_guard<mutex> guard(shared->lock);
+		shared->pending.clear();
+	}
+}
+
+void DNSProber::Run()
+{
+	struct Connect
+	{
+		Target target;
+		DNSSocket sock;
+		Clock::time_point started;
+		Clock::time_point deadline;
+	};
+	vector<Connect> connecting;
+
+	while(true)
+	{
+		vector<Target> starting;
+		{
+			lock_guard<mutex> guard(shared->lock);
+			if(shared->stopping)
+				break;
+			while(connecting.size() + starting.size() < kMaxConnects && !shared->pending.empty())
+			{
+				starting.push_back(shared->pending.front());
+				shared->pending.pop_front();
+			}
+		}
+
+		vector<Result> results;
+		for(const auto &target : starting)
+		{
+			sockaddr_in ipv4;
+			sockaddr_in6 ipv6;
+			const sockaddr *address;
+			socklen_t length;
+			if(target.address.family == ServiceAddress::kFamilyIPv6)
+			{
+				memset(&ipv6, 0, sizeof(ipv6));
+				ipv6.sin6_family = AF_INET6;
+				ipv6.sin6_port = target.port;
+				memcpy(&ipv6.sin6_addr, target.address.bytes, 16);
+				ipv6.sin6_scope_id = target.address.interfaceIndex;
+				address = (const sockaddr*)&ipv6;
+				length = sizeof(ipv6);
+			}
+			else
+			{
+				memset(&ipv4, 0, sizeof(ipv4));
+				ipv4.sin_family = AF_INET;
+				ipv4.sin_port = target.port;
+				memcpy(&ipv4.sin_addr, target.address.bytes, 4);
+				address = (const sockaddr*)&ipv4;
+				length = sizeof(ipv4);
+			}
+
+			Connect connect;
+			connect.target = target;
+			connect.started = Clock::now();
+			connect.deadline = connect.started + chrono::milliseconds(target.timeoutMs);
+			connect.sock = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+			bool pending = false;
+			bool connected = false;
+			if(connect.sock != kNoSocket && DNSSocketSetNonBlocking(connect.sock))
+			{
+				connected = ::connect(connect.sock, address, length) == 0;
+				pending = !connected && ConnectPending();
+			}
+
+			if(pending)
+			{
+				connecting.push_back(connect);
+				continue;
+			}
+
+			// answered or refused right away, usually this host itself
+			uint32_t rttUs = (uint32_t)chrono::duration_cast<chrono::microseconds>(Clock::now() - connect.started).count();
+			Result result = { target.probe, target.index, target.address, target.port, connected, connected ? rttUs : 0 };
+			results.push_back(result);
+			DNSSocketClose(connect.sock);
+		}
+
+		if(results.empty())
+		{
+			vector<pollfd> sockets;
+			sockets.reserve(connecting.size() + 1);
+			pollfd woken = { wake, POLLIN, 0 };
+			sockets.push_back(woken);
+
+			long long waitMs = kIdleWaitMs;
+			Clock::time_point now = Clock::now();
+			for(const auto &connect : connecting)
+			{
+				pollfd entry = { connect.sock, POLLOUT, 0 };
+				sockets.push_back(entry);
+				// rounded up, so that a deadline is never polled for just before it passes
+				long long left = chrono::duration_cast<chrono::milliseconds>(connect.deadline - now).count() + 1;
+				waitMs = min(waitMs, max(0LL, left));
+			}
+
+			if(PollSockets(sockets, waitMs) < 0)
+			{
+				for(auto &entry : sockets)
+				{
+					entry.revents = 0;
+				}
+			}
+
+			if(sockets[0].revents & POLLIN)
+				DNSSocketDrain(wake);
+
+			// sockets[i + 1] belongs to connecting[i], and both shrink together
+			now = Clock::now();
+			for(size_t i = 0; i < connecting.size(); )
+			{
+				Connect &connect = connecting[i];
+				bool answered = sockets[i + 1].revents != 0;
+				if(!answered && now < connect.deadline)
+				{
+					i++;
+					continue;
+				}
+
+				// writable also means failed on some systems, the pending error tells
+				bool reachable = false;
+				if(answered)
+				{
+					int error = 0;
+					socklen_t length = sizeof(error);
+					reachable = getsockopt(connect.sock, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == 0 && error == 0;
+				}
+
+				uint32_t rttUs = (uint32_t)chrono::duration_cast<chrono::microseconds>(now - connect.started).count();
+				Result result = { connect.target.probe, connect.target.index, connect.target.address, connect.target.port, reachable, reachable ? rttUs : 0 };
+				results.push_back(result);
+
+				DNSSocketClose(connect.sock);
+				connecting[i] = connecting.back();
+				connecting.pop_back();
+				sockets[i + 1] = sockets.back();
+				sockets.pop_back();
+			}
+		}
+
+		if(!results.empty())
+		{
+			shared_ptr<Shared> link = shared;
+			owner->EventLoop().Post([link, results](){
+				DNSProber *target;
+				{
+					lock_guard<mutex> guard(link->lock);
+					target = link->owner;
+				}
+				if(target)
+					target->Deliver(results);
+			});
+		}
+	}
+
+	for(const auto &connect : connecting)
+	{
+		DNSSocketClose(connect.sock);
+	}
+}
+
+void DNSProber::Deliver(const vector<Result> &results)
+{
+	uint32_t resultMs = kResultMs;
+	Clock::time_point expires = Clock::now() + chrono::milliseconds(resultMs);
+	for(const auto &result : results)
+	{
+		Known &entry = known[Key(result.address, result.port)];
+		entry.reachable = result.reachable;
+		entry.rttUs = result.rttUs;
+		entry.expires = expires;
+
+		auto job = jobs.find(result.probe);
+		if(job == jobs.end())
+			continue;
+
+		ServiceAddress &address = job->second.addresses[result.index];
+		address.reachability = result.reachable ? ServiceAddress::kReachable : ServiceAddress::kUnreachable;
+		address.rttUs = result.rttUs;
+		if(--job->second.remaining > 0)
+			continue;
+
+		// the completion may probe or cancel, so the job is out of the map first
+		Job done = std::move(job->second);
+		jobs.erase(job);
+		Sort(done.addresses);
+		done.completion(done.addresses);
+	}
+}
+
+void DNSProber::Purge(Clock::time_point now)
+{
+	for(auto entry = known.begin(); entry != known.end(); )
+	{
+		if(entry->second.expires <= now)
+			entry = known.erase(entry);
+		else
+			++entry;
+	}
+}
+
+string DNSProber::Key(const ServiceAddress &address, uint16_t port)
+{
+	string key;
+	key.reserve(23);
+	key.push_back((char)address.family);
+	key.append((const char*)&port, sizeof(port));
+	key.append((const char*)address.bytes, address.Length());
+	// the same link-local address on two links is two hosts
+	if(IsLinkLocal(address))
+		key.append((const char*)&address.interfaceIndex, sizeof(address.interfaceIndex));
+	return key;
+}
+
+void DNSProber::Sort(AddressList &addresses)
+{
+	stable_sort(addresses.begin(), addresses.end(), [](const ServiceAddress &a, const ServiceAddress &b){
+		bool aReachable = a.reachability == ServiceAddress::kReachable;
+		bool bReachable = b.reachability == ServiceAddress::kReachable;
+		if(aReachable != bReachable)
+			return aReachable;
+		return aReachable && a.rttUs < b.rttUs;
+	});
+}
@@ -0,0 +1,131 @@
+//
+//  DNSProber.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Reachability probes for resolved addresses, shared by every browser of a
+//  manager. A worker thread opens non-blocking TCP connections to all the
+//  addresses of an instance at once and times how long each takes to be
+//  accepted or refused; results are kept for a few seconds, so services on
+//  one host and quick re-announcements do not probe it again.
+//
+
+
+#ifndef DNSProber_h
+#define DNSProber_h
+
+#include "DnsWrapper.h"
+#include "DNSSocket.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+typedef uint32_t ProbeHandle;
+typedef std::function<void(const AddressList &addresses)> ProbeCompletion;
+
+class DNSProber
+{
+public:
+	explicit DNSProber(DNSServiceManager *owner);
+	// stops the worker, waiting for it, without calling any completion
+	~DNSProber();
+
+	// Connects to port, in network byte order as dns_sd reports it, on every
+	// address and calls completion with the addresses marked reachable or
+	// unreachable: the reachable ones first, fastest first, the others in
+	// their original order. An address gets timeoutMs to accept. When every
+	// address has a recent result the completion runs before Probe() returns
+	// and 0 is returned; otherwise the handle can be passed to Cancel() until
+	// the completion runs.
+	ProbeHandle Probe(const AddressList &addresses, uint16_t port, uint32_t timeoutMs, const ProbeCompletion &completion);
+	void Cancel(ProbeHandle probe);
+
+	// drops recent results and pending probes without calling their completions
+	void Clear();
+
+	// how long a result stands for its address and port
+	static const uint32_t kResultMs = 10000;
+	// connections in flight at once
+	static const size_t kMaxConnects = 60;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Target
+	{
+		ProbeHandle probe;
+		size_t index;
+		ServiceAddress address;
+		uint16_t port;
+		uint32_t timeoutMs;
+	};
+
+	struct Result
+	{
+		ProbeHandle probe;
+		size_t index;
+		ServiceAddress address;
+		uint16_t port;
+		bool reachable;
+		uint32_t rttUs;
+	};
+
+	struct Job
+	{
+		AddressList addresses;
+		size_t remaining;
+		ProbeCompletion completion;
+	};
+
+	struct Known
+	{
+		bool reachable;
+		uint32_t rttUs;
+		Clock::time_point expires;
+	};
+
+	// What the owner and the worker share. Results are posted to the loop
+	// with a reference to it, and owner is cleared on the owner's thread once
+	// the prober is gone, so late results are dropped there.
+	struct Shared
+	{
+		std::mutex lock;
+		std::deque<Target> pending;
+		bool stopping;
+		DNSProber *owner;
+	};
+
+	bool Start();
+	void Stop();
+	void Run();
+	void Wake();
+
+	void Deliver(const std::vector<Result> &results);
+	void Purge(Clock::time_point now);
+
+	static std::string Key(const ServiceAddress &address, uint16_t port);
+	static void Sort(AddressList &addresses);
+
+	DNSServiceManager *owner;
+	std::shared_ptr<Shared> shared;
+
+	// worker thread
+	DNSSocket wake;
+	sockaddr_in wakeAddress;
+	std::thread worker;
+
+	// owner's thread
+	std::unordered_map<ProbeHandle, Job> jobs;
+	std::unordered_map<std::string, Known> known;
+	ProbeHandle nextProbe;
+};
+
+
+#endif /* DNSProber_h */
@@ -0,0 +1,791 @@
+//
+//  DNSRegistry.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSRegistry.h"
+#include "DnsServices.h"
+#include "DNSFreshness.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
+
+#if !_WINDOWS
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#ifdef __linux__
+		#include <limits.h>
+		#include <linux/futex.h>
+		#include <sys/syscall.h>
+	#endif
+#endif
+
+using namespace std;
+
+
+// "ZCR" and the layout version
+static const uint32_t kMagic = 0x5A435203;
+
+// a subscriber slot being set up, its event does not exist yet
+static const uint32_t kSlotClaiming = 0xFFFFFFFF;
+
+struct DNSRegistry::Segment
+{
+	uint32_t magic;
+	// even while no table is written; the current table is (sequence / 2) % 2
+	std::atomic<uint32_t> sequence;
+	uint32_t length[2];
+	// process ids of the subscribers to wake, 0 for free slots
+	std::atomic<uint32_t> subscribers[kMaxSubscribers];
+	uint8_t tables[2][kTableBytes];
+};
+
+// followed by the name, type, domain, hostname, TXT bytes and addresses
+struct Record
+{
+	uint32_t length;
+	int32_t port;
+	// of the instance, so that readers can tell what changed from the record alone
+	uint64_t instanceId;
+	uint64_t contentHash;
+	uint16_t nameLength;
+	uint16_t typeLength;
+	uint16_t domainLength;
+	uint16_t hostnameLength;
+	uint16_t txtLength;
+	uint16_t addressCount;
+};
+
+static size_t RecordLength(const ServiceInfo &info)
+{
+	return sizeof(Record) + info.nameLength() + info.typeLength() + info.domainLength() + info.hostnameLength()
+		+ info.txtLength() + info.addresses.size() * sizeof(ServiceAddress);
+}
+
+static uint8_t *WriteRecord(uint8_t *out, const ServiceInfo &info)
+{
+	Record record;
+	record.length = (uint32_t)RecordLength(info);
+	record.port = info.port;
+	record.instanceId = info.instanceId();
+	record.contentHash = info.contentHash();
+	record.nameLength = (uint16_t)info.nameLength();
+	record.typeLength = (uint16_t)info.typeLength();
+	record.domainLength = (uint16_t)info.domainLength();
+	record.hostnameLength = (uint16_t)info.hostnameLength();
+	// ServiceInfo::setData() keeps TXT records within ServiceInfo::kMaxTXTLength
+	record.txtLength = (uint16_t)info.txtLength();
+	record.addressCount = (uint16_t)info.addresses.size();
+
+	memcpy(out, &record, sizeof(record));
+	out += sizeof(record);
+	memcpy(out, info.name(), record.nameLength);
+	out += record.nameLength;
+	memcpy(out, info.type(), record.typeLength);
+	out += record.typeLength;
+	memcpy(out, info.domain(), record.domainLength);
+	out += record.domainLength;
+	memcpy(out, info.hostname(), record.hostnameLength);
+	out += record.hostnameLength;
+	memcpy(out, info.txtBytes(), record.txtLength);
+	out += record.txtLength;
+	for(const auto &address : info.addresses)
+	{
+		memcpy(out, &address, sizeof(address));
+		out += sizeof(address);
+	}
+	return out;
+}
+
+static void ParseRecord(const uint8_t *in, const Record &record, ServiceInfo &info)
+{
+	string text;
+	info.port = record.port;
+
+	text.assign((const char*)in, record.nameLength);
+	info.setName(text.c_str());
+	in += record.nameLength;
+	text.assign((const char*)in, record.typeLength);
+	info.setType(text.c_str());
+	in += record.typeLength;
+	text.assign((const char*)in, record.domainLength);
+	info.setDomain(text.c_str());
+	in += record.domainLength;
+	text.assign((const char*)in, record.hostnameLength);
+	info.setHostname(text.c_str());
+	in += record.hostnameLength;
+	info.ReadTXT(in, record.txtLength);
+	in += record.txtLength;
+	for(uint16_t i = 0; i < record.addressCount; i++)
+	{
+		ServiceAddress address;
+		memcpy(&address, in, sizeof(address));
+		info.addresses.push_back(address);
+		in += sizeof(address);
+	}
+}
+
+// Walks the records in place and calls f(record, body) for each. The table
+// may be overwritten meanwhile, so every length is checked against what is
+// left; false means it made no sense.
+template<typename F>
+static bool ForEachRecord(const uint8_t *data, size_t length, F f)
+{
+	size_t offset = 0;
+	while(offset < length)
+	{
+		Record record;
+		if(length - offset < sizeof(record))
+			return false;
+		memcpy(&record, data + offset, sizeof(record));
+
+		size_t strings = (size_t)record.nameLength + record.typeLength + record.domainLength + record.hostnameLength;
+		if(record.length > length - offset
+		   || record.length != sizeof(record) + strings + record.txtLength + record.addressCount * sizeof(ServiceAddress))
+			return false;
+
+		f(record, data + offset + sizeof(record));
+		offset += record.length;
+	}
+	return true;
+}
+
+#ifdef __linux__
+static void FutexWait(std::atomic<uint32_t> *word, uint32_t value, uint32_t timeoutMs)
+{
+	timespec timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void FutexWakeAll(std::atomic<uint32_t> *word)
+{
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+
+
+DNSRegistry::DNSRegistry(DNSServiceManager *owner, DSNMessageBusBase *bus)
+: owner(owner)
+, bus(bus)
+, segment(nullptr)
+#if _WINDOWS
+, mapping(NULL)
+, lockFile(INVALID_HANDLE_VALUE)
+, changed(NULL)
+, stopped(NULL)
+, slot(-1)
+#else
+, lockFile(-1)
+#endif
+, alive(make_shared<bool>(true))
+, flushTimer(0)
+, confirmTimer(0)
+, failTimer(0)
+, takeoverTimer(0)
+, refreshTimer(0)
+{
+
+}
+
+DNSRegistry::~DNSRegistry()
+{
+	Stop();
+}
+
+bool DNSRegistry::Start(const ServiceInfo &info, const BrowseDuty &browseDuty, const BrowseProbe &browseProbe)
+{
+	duty = browseDuty;
+	probe = browseProbe;
+	if(!Open(info))
+		return false;
+
+	if(TryOwn())
+	{
+		if(!BecomeOwner())
+		{
+			Stop();
+			return false;
+		}
+		return true;
+	}
+
+	StartWatching();
+	refreshTimer = owner->EventLoop().ScheduleTimer(0, [this](){
+		refreshTimer = 0;
+		Refresh();
+	});
+	ScheduleTakeover();
+	return true;
+}
+
+void DNSRegistry::Stop()
+{
+	*alive = false;
+
+	owner->EventLoop().CancelTimer(flushTimer);
+	owner->EventLoop().CancelTimer(confirmTimer);
+	owner->EventLoop().CancelTimer(failTimer);
+	owner->EventLoop().CancelTimer(takeoverTimer);
+	owner->EventLoop().CancelTimer(refreshTimer);
+	flushTimer = confirmTimer = failTimer = takeoverTimer = refreshTimer = 0;
+
+	StopWatching();
+	owner->Freshness().ForgetBrowser(this);
+
+	if(browser)
+	{
+		browser->bus = nullptr;
+		browser->stop();
+		browser.reset();
+	}
+
+	// the table stays in the segment for whoever takes over
+	Close();
+}
+
+bool DNSRegistry::Open(const ServiceInfo &info)
+{
+	query = info;
+	query.setName("");
+
+	// the same id for every spelling of the type and domain
+	char id[17];
+	sprintf(id, "%016llx", (unsigned long long)query.instanceId());
+	name = id;
+
+#if _WINDOWS
+	string mappingName = "Local\\ZeroConfRegistry-" + name;
+	mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)sizeof(Segment), mappingName.c_str());
+	if(mapping == NULL)
+		return false;
+	segment = (Segment*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Segment));
+#else
+	string mappingName = "/zcreg-" + name;
+	int fd = shm_open(mappingName.c_str(), O_RDWR | O_CREAT, 0600);
+	if(fd < 0)
+		return false;
+
+	// a new segment is all zeros, which reads as an empty registry
+	struct stat status;
+	if(fstat(fd, &status) != 0 || (status.st_size < (off_t)sizeof(Segment) && ftruncate(fd, sizeof(Segment)) != 0))
+	{
+		close(fd);
+		return false;
+	}
+	void *mapped = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	segment = mapped == MAP_FAILED ? nullptr : (Segment*)mapped;
+#endif
+
+	if(segment == nullptr)
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void DNSRegistry::Close()
+{
+#if _WINDOWS
+	for(auto &wakeup : wakeups)
+	{
+		if(wakeup.second)
+			CloseHandle(wakeup.second);
+	}
+	wakeups.clear();
+
+	if(lockFile != INVALID_HANDLE_VALUE)
+		CloseHandle(lockFile);
+	lockFile = INVALID_HANDLE_VALUE;
+
+	if(segment)
+		UnmapViewOfFile(segment);
+	if(mapping)
+		CloseHandle(mapping);
+	mapping = NULL;
+#else
+	if(lockFile >= 0)
+		close(lockFile);
+	lockFile = -1;
+
+	if(segment)
+		munmap(segment, sizeof(Segment));
+#endif
+	segment = nullptr;
+}
+
+bool DNSRegistry::TryOwn()
+{
+	// the lock goes with the process, however it ends
+#if _WINDOWS
+	char directory[MAX_PATH + 1];
+	DWORD length = GetTempPathA(sizeof(directory), directory);
+	if(length == 0 || length > MAX_PATH)
+		return false;
+	string path = string(directory) + "zeroconf-registry-" + name + ".lock";
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+							  NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	if(!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped))
+	{
+		CloseHandle(file);
+		return false;
+	}
+#else
+	string path = "/tmp/zeroconf-registry-" + name + ".lock";
+	int file = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+	if(file < 0)
+		return false;
+
+	if(flock(file, LOCK_EX | LOCK_NB) != 0)
+	{
+		close(file);
+		return false;
+	}
+#endif
+
+	lockFile = file;
+	return true;
+}
+
+bool DNSRegistry::BecomeOwner()
+{
+	StopWatching();
+
+	// What the last owner left is kept, so that the other processes see no
+	// change, until this browser has had the time to report it again.
+	unordered_set<uint64_t> present;
+	if(!Read(nullptr, present, table))
+		table.clear();
+	for(const auto &info : table)
+	{
+		unconfirmed[info.instanceId()] = true;
+	}
+
+	browser = owner->startBrowser(query, this, duty, probe);
+	if(!browser)
+		return false;
+
+	segment->magic = kMagic;
+	if(!unconfirmed.empty())
+	{
+		confirmTimer = owner->EventLoop().ScheduleTimer(kConfirmMs, [this](){
+			confirmTimer = 0;
+			Confirm();
+		});
+	}
+	return true;
+}
+
+void DNSRegistry::Confirm()
+{
+	table.erase(remove_if(table.begin(), table.end(), [this](const ServiceInfo &info){
+		return unconfirmed.count(info.instanceId()) != 0;
+	}), table.end());
+	unconfirmed.clear();
+
+	Publish();
+	Deliver();
+}
+
+void DNSRegistry::ScheduleTakeover()
+{
+	takeoverTimer = owner->EventLoop().ScheduleTimer(kTakeoverMs, [this](){
+		takeoverTimer = 0;
+		Takeover();
+	});
+}
+
+void DNSRegistry::Takeover()
+{
+	if(!TryOwn())
+	{
+		ScheduleTakeover();
+		return;
+	}
+
+	if(BecomeOwner())
+		return;
+
+	ServiceInfo failed(query);
+	failed.browser = this;
+	if(bus)
+		bus->Message(failed, kDNSServiceErr_Unknown, "browseError");
+	owner->browseFailed(this);
+}
+
+void DNSRegistry::Message(const ServiceInfo &srv, int errorCode, const char* phase)
+{
+	ServiceInfo info(srv);
+	info.browser = this;
+
+	if(strcmp(phase, "browseError") == 0)
+	{
+		if(bus)
+			bus->Message(info, errorCode, phase);
+		// the browser is still in its callback, so it is stopped on the next turn
+		if(failTimer == 0)
+		{
+			failTimer = owner->EventLoop().ScheduleTimer(0, [this](){
+				failTimer = 0;
+				owner->browseFailed(this);
+			});
+		}
+		return;
+	}
+
+	// a failed resolve is only news to this process
+	if(errorCode != kDNSServiceErr_NoError)
+	{
+		if(bus)
+			bus->Message(info, errorCode, phase);
+		return;
+	}
+
+	uint64_t id = info.instanceId();
+	auto known = find_if(table.begin(), table.end(), [id](const ServiceInfo &entry){
+		return entry.instanceId() == id;
+	});
+
+	if(strcmp(phase, "lost") == 0)
+	{
+		if(known != table.end())
+			table.erase(known);
+	}
+	else if(known != table.end())
+	{
+		*known = std::move(info);
+	}
+	else
+	{
+		table.push_back(std::move(info));
+	}
+	unconfirmed.erase(id);
+
+	// a burst of changes goes out as one table
+	if(flushTimer == 0)
+	{
+		flushTimer = owner->EventLoop().ScheduleTimer(0, [this](){
+			flushTimer = 0;
+			Publish();
+			Deliver();
+		});
+	}
+}
+
+void DNSRegistry::Publish()
+{
+	// a table an earlier owner died writing counts as never begun
+	uint32_t sequence = segment->sequence.load(memory_order_relaxed) & ~1u;
+	segment->sequence.store(sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	size_t half = ((sequence >> 1) + 1) & 1;
+	uint8_t *out = segment->tables[half];
+	size_t used = 0;
+	for(const auto &info : table)
+	{
+		size_t length = RecordLength(info);
+		if(used + length > kTableBytes)
+			break;
+		WriteRecord(out + used, info);
+		used += length;
+	}
+	segment->length[half] = (uint32_t)used;
+
+	segment->sequence.store(sequence + 2, memory_order_release);
+	Notify();
+}
+
+bool DNSRegistry::Read(const unordered_map<uint64_t, Reported> *known, unordered_set<uint64_t> &present, vector<ServiceInfo> &changed) const
+{
+	present.clear();
+	changed.clear();
+	if(segment->magic != kMagic)
+		return true;
+
+	for(int attempt = 0; attempt < 4; attempt++)
+	{
+		uint32_t before = segment->sequence.load(memory_order_acquire);
+		size_t half = (before >> 1) & 1;
+		size_t length = min((size_t)segment->length[half], sizeof(segment->tables[half]));
+		present.clear();
+		changed.clear();
+		bool parsed = ForEachRecord(segment->tables[half], length, [&](const Record &record, const uint8_t *body) {
+			present.insert(record.instanceId);
+			if(known)
+			{
+				auto reported = known->find(record.instanceId);
+				if(reported != known->end() && reported->second.hash == record.contentHash)
+					return;
+			}
+			changed.push_back(ServiceInfo());
+			ParseRecord(body, record, changed.back());
+		});
+
+		// only a write that began on this same table spoils the read
+		atomic_thread_fence(memory_order_acquire);
+		uint32_t after = segment->sequence.load(memory_order_relaxed);
+		if(parsed && after - (before & ~1u) <= 2)
+			return true;
+	}
+	return false;
+}
+
+void DNSRegistry::Refresh()
+{
+	unordered_set<uint64_t> present;
+	vector<ServiceInfo> changed;
+	if(!Read(&reported, present, changed))
+	{
+		// the owner kept rewriting it, there is another go once it settles
+		if(refreshTimer == 0)
+		{
+			refreshTimer = owner->EventLoop().ScheduleTimer(kPollMs, [this](){
+				refreshTimer = 0;
+				Refresh();
+			});
+		}
+		return;
+	}
+
+	Deliver(changed, present);
+}
+
+void DNSRegistry::Deliver()
+{
+	unordered_set<uint64_t> present;
+	for(const auto &info : table)
+	{
+		present.insert(info.instanceId());
+	}
+	Deliver(table, present);
+}
+
+void DNSRegistry::Deliver(const vector<ServiceInfo> &candidates, const unordered_set<uint64_t> &present)
+{
+	vector< pair<ServiceInfo, const char*> > events;
+	for(const auto &info : candidates)
+	{
+		uint64_t id = info.instanceId();
+		// what a new owner inherited only goes out once its browser confirms it
+		if(unconfirmed.count(id) && !reported.count(id))
+			continue;
+
+		uint64_t hash = info.contentHash();
+		auto known = reported.find(id);
+		if(known == reported.end())
+		{
+			Reported added = { info, hash };
+			reported[id] = added;
+			events.push_back(make_pair(info, "found"));
+		}
+		else if(known->second.hash != hash)
+		{
+			known->second.info = info;
+			known->second.hash = hash;
+			events.push_back(make_pair(info, "updated"));
+		}
+	}
+
+	for(auto known = reported.begin(); known != reported.end(); )
+	{
+		if(present.count(known->first) == 0)
+		{
+			events.push_back(make_pair(known->second.info, "lost"));
+			known = reported.erase(known);
+		}
+		else
+		{
+			++known;
+		}
+	}
+
+	// listeners may stop this registry
+	shared_ptr<bool> running = alive;
+	for(auto &event : events)
+	{
+		if(!*running)
+			return;
+		event.first.browser = this;
+		if(strcmp(event.second, "lost") == 0)
+			owner->Freshness().Forget(event.first);
+		else
+			owner->Freshness().Seen(event.first);
+		if(bus)
+			bus->Message(event.first, kDNSServiceErr_NoError, event.second);
+	}
+}
+
+void DNSRegistry::StartWatching()
+{
+#if _WINDOWS
+	// the slot is taken before its event exists, the owner skips it until then
+	uint32_t pid = (uint32_t)GetCurrentProcessId();
+	for(size_t i = 0; i < kMaxSubscribers && slot < 0; i++)
+	{
+		uint32_t expected = 0;
+		if(segment->subscribers[i].compare_exchange_strong(expected, kSlotClaiming))
+			slot = (int)i;
+	}
+	if(slot >= 0)
+	{
+		char eventName[96];
+		sprintf(eventName, "Local\\ZeroConfRegistry-%s-%d-%u", name.c_str(), slot, pid);
+		changed = CreateEventA(NULL, FALSE, FALSE, eventName);
+		segment->subscribers[slot].store(changed ? pid : 0);
+		if(changed == NULL)
+			slot = -1;
+	}
+	stopped = CreateEventA(NULL, TRUE, FALSE, NULL);
+#endif
+
+	link = make_shared<Link>();
+	link->registry = this;
+	link->posted = false;
+	link->stopping = false;
+	watcher = thread([this](){
+		Watch();
+	});
+}
+
+void DNSRegistry::StopWatching()
+{
+	if(watcher.joinable())
+	{
+		{
+			lock_guard<mutex> guard(link->lock);
+			link->stopping = true;
+		}
+#if _WINDOWS
+		SetEvent(stopped);
+#elif defined(__linux__)
+		FutexWakeAll(&segment->sequence);
+#endif
+		watcher.join();
+	}
+	if(link)
+	{
+		lock_guard<mutex> guard(link->lock);
+		link->registry = nullptr;
+	}
+	link.reset();
+
+#if _WINDOWS
+	if(slot >= 0)
+		segment->subscribers[slot].store(0);
+	slot = -1;
+	if(changed)
+		CloseHandle(changed);
+	if(stopped)
+		CloseHandle(stopped);
+	changed = stopped = NULL;
+#endif
+}
+
+void DNSRegistry::Watch()
+{
+	uint32_t seen = segment->sequence.load(memory_order_acquire);
+	while(true)
+	{
+		{
+			lock_guard<mutex> guard(link->lock);
+			if(link->stopping)
+				return;
+		}
+
+		// every platform also looks on its own now and then, for lost wakeups
+#if _WINDOWS
+		if(changed)
+		{
+			HANDLE handles[2] = { changed, stopped };
+			WaitForMultipleObjects(2, handles, FALSE, kPollMs);
+		}
+		else
+		{
+			WaitForSingleObject(stopped, kPollMs);
+		}
+#elif defined(__linux__)
+		FutexWait(&segment->sequence, seen, kPollMs);
+#else
+		this_thread::sleep_for(chrono::milliseconds(kPollMs));
+#endif
+
+		uint32_t sequence = segment->sequence.load(memory_order_acquire);
+		if(sequence == seen)
+			continue;
+		seen = sequence;
+
+		// one refresh at a time, it reads whatever is current by then
+		lock_guard<mutex> guard(link->lock);
+		if(link->posted || link->registry == nullptr)
+			continue;
+		link->posted = true;
+		shared_ptr<Link> shared = link;
+		owner->EventLoop().Post([shared](){
+			DNSRegistry *registry;
+			{
+				lock_guard<mutex> guard(shared->lock);
+				shared->posted = false;
+				registry = shared->registry;
+			}
+			if(registry)
+				registry->Refresh();
+		});
+	}
+}
+
+void DNSRegistry::Notify()
+{
+#if _WINDOWS
+	if(wakeups.size() < kMaxSubscribers)
+		wakeups.resize(kMaxSubscribers, make_pair(0u, (HANDLE)NULL));
+
+	for(size_t i = 0; i < kMaxSubscribers; i++)
+	{
+		uint32_t pid = segment->subscribers[i].load();
+		auto &wakeup = wakeups[i];
+		if(wakeup.second && wakeup.first != pid)
+		{
+			CloseHandle(wakeup.second);
+			wakeup.second = NULL;
+		}
+		if(pid == 0 || pid == kSlotClaiming)
+			continue;
+
+		if(wakeup.second == NULL)
+		{
+			char eventName[96];
+			sprintf(eventName, "Local\\ZeroConfRegistry-%s-%u-%u", name.c_str(), (unsigned)i, pid);
+			wakeup.first = pid;
+			wakeup.second = OpenEventA(EVENT_MODIFY_STATE, FALSE, eventName);
+			if(wakeup.second == NULL)
+			{
+				// the subscriber is gone without giving its slot back
+				segment->subscribers[i].compare_exchange_strong(pid, 0);
+				continue;
+			}
+		}
+		SetEvent(wakeup.second);
+	}
+#elif defined(__linux__)
+	FutexWakeAll(&segment->sequence);
+#endif
+}
@@ -0,0 +1,159 @@
+//
+//  DNSRegistry.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Browsing shared by the processes of one host. Whichever process first
+//  holds the lock file of a type and domain owns the registry: it runs the
+//  only browser and writes every resolved instance into a shared memory
+//  segment. The other processes subscribe, are woken when the table changes
+//  and read it in place, without a daemon subscription or resolve of their
+//  own: every record carries its instance id and content hash, and only the
+//  instances that are new or changed since the last read are copied out.
+//  Each process reports "found", "updated" and "lost" from the table as a
+//  browser would, and a subscriber takes over when the owner goes away.
+//
+//  The segment holds two tables under a sequence counter. The owner writes
+//  the table that is not current and then bumps the counter; a reader picks
+//  the current table from the counter and only retries if the owner started
+//  writing that same table again while it was being read.
+//
+
+
+#ifndef DNSRegistry_h
+#define DNSRegistry_h
+
+#include "DnsWrapper.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if _WINDOWS
+	#include <windows.h>
+#endif
+
+class DNSRegistry : public DSNMessageBusBase
+{
+public:
+	DNSRegistry(DNSServiceManager *owner, DSNMessageBusBase *bus);
+	virtual ~DNSRegistry();
+
+	// Joins or creates the registry of query's type and domain. duty and
+	// probe apply to the browser while this process owns it. What the table
+	// already holds is reported on the next turn of the loop.
+	bool Start(const ServiceInfo &query, const BrowseDuty &duty, const BrowseProbe &probe);
+	// stops reporting; an owner hands the registry over to a subscriber
+	void Stop();
+
+	bool Owning() const { return browser != nullptr; }
+	// the browser this process runs as the owner, null for a subscriber
+	ServiceBrowser *Browser() const { return browser.get(); }
+
+	// messages of the owner's browser
+	virtual void Message(const ServiceInfo &srv, int errorCode, const char* phase) override;
+
+	// bytes of each of the two tables; instances beyond are left out
+	static const size_t kTableBytes = 256 * 1024;
+	// processes that can be woken on Windows, the others notice changes within kPollMs
+	static const size_t kMaxSubscribers = 32;
+	static const uint32_t kPollMs = 100;
+	// how often a subscriber tries to take over
+	static const uint32_t kTakeoverMs = 1000;
+	// how long a new owner keeps instances its browser has not reported again
+	static const uint32_t kConfirmMs = 3000;
+
+private:
+	struct Segment;
+
+	struct Reported
+	{
+		ServiceInfo info;
+		uint64_t hash;
+	};
+
+	// what the watcher thread shares with the owner's thread
+	struct Link
+	{
+		std::mutex lock;
+		DNSRegistry *registry;
+		bool posted;
+		bool stopping;
+	};
+
+	bool Open(const ServiceInfo &query);
+	void Close();
+	bool TryOwn();
+	bool BecomeOwner();
+	void Confirm();
+	void ScheduleTakeover();
+	void Takeover();
+
+	void StartWatching();
+	void StopWatching();
+	void Watch();
+	void Notify();
+
+	void Publish();
+	// Ids of the instances in the current table go to present, and copies of
+	// those known does not have with the same hash go to changed; all of
+	// them without known.
+	bool Read(const std::unordered_map<uint64_t, Reported> *known, std::unordered_set<uint64_t> &present, std::vector<ServiceInfo> &changed) const;
+	void Refresh();
+	// reports the owner's table
+	void Deliver();
+	// reports candidates that are new or changed, and what is no longer present as lost
+	void Deliver(const std::vector<ServiceInfo> &candidates, const std::unordered_set<uint64_t> &present);
+
+	DNSServiceManager *owner;
+	DSNMessageBusBase *bus;
+	ServiceInfo query;
+	BrowseDuty duty;
+	BrowseProbe probe;
+
+	Segment *segment;
+	std::string name;
+#if _WINDOWS
+	HANDLE mapping;
+	HANDLE lockFile;
+	HANDLE changed;
+	HANDLE stopped;
+	// slot in the segment's subscriber list, -1 when there is none
+	int slot;
+	// events of the subscribers by slot, with the process they were opened for
+	std::vector< std::pair<uint32_t, HANDLE> > wakeups;
+#else
+	int lockFile;
+#endif
+
+	std::shared_ptr<Link> link;
+	std::thread watcher;
+
+	// cleared by Stop(), for listeners that stop the registry
+	std::shared_ptr<bool> alive;
+
+	// the owner's own table; subscribers keep only what they reported
+	std::vector<ServiceInfo> table;
+	// by instanceId()
+	std::unordered_map<uint64_t, Reported> reported;
+
+	// owner only
+	std::shared_ptr<ServiceBrowser> browser;
+	// inherited instances the browser has not reported yet
+	std::unordered_map<uint64_t, bool> unconfirmed;
+	TimerHandle flushTimer;
+	TimerHandle confirmTimer;
+	TimerHandle failTimer;
+
+	// subscriber only
+	TimerHandle takeoverTimer;
+	TimerHandle refreshTimer;
+};
+
+
+#endif /* DNSRegistry_h */
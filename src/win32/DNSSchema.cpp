@@ -0,0 +1,190 @@
+//
+//  DNSSchema.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSSchema.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+
+static const struct
+{
+	const char *name;
+	DNSSchema::Type type;
+	size_t width;
+	double min;
+	double max;
+}
+kTypes[] = {
+	{ "string", DNSSchema::kString, 0, 0, 0 },
+	{ "bool", DNSSchema::kBool, 1, 0, 1 },
+	{ "u8", DNSSchema::kU8, 1, 0, 255.0 },
+	{ "i8", DNSSchema::kI8, 1, -128.0, 127.0 },
+	{ "u16", DNSSchema::kU16, 2, 0, 65535.0 },
+	{ "i16", DNSSchema::kI16, 2, -32768.0, 32767.0 },
+	{ "u32", DNSSchema::kU32, 4, 0, 4294967295.0 },
+	{ "i32", DNSSchema::kI32, 4, -2147483648.0, 2147483647.0 },
+	{ "f32", DNSSchema::kF32, 4, 0, 0 },
+	{ "f64", DNSSchema::kF64, 8, 0, 0 },
+};
+
+
+// tag byte of an encoded value is this plus its type: DC1 to EM, which text does not start with
+static const uint8_t kTagBase = 0x10;
+
+
+static void AppendBigEndian(uint64_t bits, size_t width, string &out)
+{
+	for(size_t i = width; i > 0; i--)
+	{
+		out.push_back((char)(uint8_t)(bits >> ((i - 1) * 8)));
+	}
+}
+
+static uint64_t ReadBigEndian(const char *value, size_t width)
+{
+	uint64_t bits = 0;
+	for(size_t i = 0; i < width; i++)
+	{
+		bits = (bits << 8) | (uint8_t)value[i];
+	}
+	return bits;
+}
+
+
+bool DNSSchema::Add(const char *key, const char *typeName)
+{
+	for(auto &t : kTypes)
+	{
+		if(strcmp(t.name, typeName) == 0)
+		{
+			types[key] = t.type;
+			return true;
+		}
+	}
+	return false;
+}
+
+DNSSchema::Type DNSSchema::TypeOf(const char *key, size_t keyLength) const
+{
+	if(types.empty())
+		return kString;
+	auto type = types.find(string(key, keyLength));
+	return type == types.end() ? kString : type->second;
+}
+
+size_t DNSSchema::Width(Type type)
+{
+	return kTypes[type].width;
+}
+
+bool DNSSchema::Encode(Type type, double number, string &out)
+{
+	if(type == kString)
+		return false;
+
+	size_t start = out.size();
+	out.push_back((char)(kTagBase + type));
+	switch(type)
+	{
+		case kBool:
+			out.push_back(number != 0 ? 1 : 0);
+			return true;
+
+		case kF32:
+		{
+			float f = (float)number;
+			uint32_t bits;
+			memcpy(&bits, &f, sizeof(bits));
+			AppendBigEndian(bits, sizeof(bits), out);
+			return true;
+		}
+
+		case kF64:
+		{
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(bits));
+			AppendBigEndian(bits, sizeof(bits), out);
+			return true;
+		}
+
+		default:
+		{
+			double integer = number < 0 ? ceil(number) : floor(number);
+			if(!(integer >= kTypes[type].min && integer <= kTypes[type].max))
+			{
+				out.resize(start);
+				return false;
+			}
+			// two's complement of the signed types comes from the cast
+			uint64_t bits = integer < 0 ? (uint64_t)(int64_t)integer : (uint64_t)integer;
+			AppendBigEndian(bits, kTypes[type].width, out);
+			return true;
+		}
+	}
+}
+
+static bool ParseText(DNSSchema::Type type, const char *value, size_t valueLength, double &number)
+{
+	string text(value, valueLength);
+	if(type == DNSSchema::kBool && (text == "true" || text == "false"))
+	{
+		number = text == "true" ? 1 : 0;
+		return true;
+	}
+
+	char *end = nullptr;
+	number = strtod(text.c_str(), &end);
+	if(text.empty() || end != text.c_str() + text.size() || number != number || fabs(number) == HUGE_VAL)
+		return false;
+	if(type == DNSSchema::kBool)
+		number = number != 0 ? 1 : 0;
+	return true;
+}
+
+bool DNSSchema::Decode(Type type, const char *value, size_t valueLength, double &number)
+{
+	if(type == kString)
+		return false;
+	if(valueLength != kTypes[type].width + 1 || (uint8_t)value[0] != kTagBase + type)
+		return ParseText(type, value, valueLength, number);
+
+	uint64_t bits = ReadBigEndian(value + 1, valueLength - 1);
+	switch(type)
+	{
+		case kBool:
+			number = bits != 0 ? 1 : 0;
+			break;
+		case kI8:
+			number = (int8_t)(uint8_t)bits;
+			break;
+		case kI16:
+			number = (int16_t)(uint16_t)bits;
+			break;
+		case kI32:
+			number = (int32_t)(uint32_t)bits;
+			break;
+		case kF32:
+		{
+			uint32_t bits32 = (uint32_t)bits;
+			float f;
+			memcpy(&f, &bits32, sizeof(f));
+			number = f;
+			break;
+		}
+		case kF64:
+			memcpy(&number, &bits, sizeof(number));
+			break;
+		default:
+			number = (double)bits;
+			break;
+	}
+	return true;
+}
@@ -0,0 +1,65 @@
+//
+//  DNSSchema.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Types of TXT values that publisher and browser agree on. A typed value
+//  travels as a tag byte naming its type followed by its fixed size binary
+//  encoding, big endian, rather than as text: "load" as a u16 takes 3 bytes
+//  whatever its value and is read back as a number without parsing. The tag
+//  is a control character no text value starts with, so values of
+//  publishers that send text are told apart and parsed as text instead.
+//  Keys the schema does not name stay strings.
+//
+
+
+#ifndef DNSSchema_h
+#define DNSSchema_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+
+class DNSSchema
+{
+public:
+	enum Type
+	{
+		kString,
+		kBool,
+		kU8,
+		kI8,
+		kU16,
+		kI16,
+		kU32,
+		kI32,
+		kF32,
+		kF64,
+	};
+
+	// false for a type name that is not one of "string", "bool", "u8",
+	// "i8", "u16", "i16", "u32", "i32", "f32" and "f64"
+	bool Add(const char *key, const char *typeName);
+	Type TypeOf(const char *key, size_t keyLength) const;
+	bool Empty() const { return types.empty(); }
+
+	// bytes the binary encoding of type takes after its tag, 0 for strings
+	static size_t Width(Type type);
+
+	// Appends the tagged encoding of number to out; false if the type is a
+	// string or an integer type that cannot hold it. Integers are truncated.
+	static bool Encode(Type type, double number, std::string &out);
+	// Reads a value of a numeric or bool type, bools as 0 and 1. A value
+	// without the tag of type is parsed as text: a decimal number, or for
+	// bools also "true" and "false". False if it is neither.
+	static bool Decode(Type type, const char *value, size_t valueLength, double &number);
+
+private:
+	std::unordered_map<std::string, Type> types;
+};
+
+
+#endif /* DNSSchema_h */
@@ -0,0 +1,297 @@
+//
+//  DNSShard.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSShard.h"
+#include "DnsServices.h"
+#include "DNSTimeline.h"
+
+#include <atomic>
+
+#if defined(_WINDOWS) || defined(ZEROCONF_POLL_LOOP)
+	#include <future>
+#endif
+#ifdef ZEROCONF_POLL_LOOP
+	#include <poll.h>
+#endif
+
+using namespace std;
+
+
+// Handles of sharded browsers count up from 1 rather than being addresses
+// the allocator hands out again. Low values are never the address of a
+// browser of the owner's, so both kinds of handle can share its maps.
+static atomic<uintptr_t> nextHandle(0);
+
+
+DNSShardInbox::DNSShardInbox(DNSServiceManager *owner)
+: owner(owner)
+{
+
+}
+
+void DNSShardInbox::Push(const ServiceInfo &info, int errorCode, const char *phase)
+{
+	Message message;
+	message.info = info;
+	message.info.ref = 0;
+	message.errorCode = errorCode;
+	message.phase = phase;
+
+	// Posting under the lock keeps Detach() from returning while a post to
+	// the owner's loop is still under way. One drain takes every message
+	// queued before it runs, so only the first of a batch posts.
+	lock_guard<mutex> guard(lock);
+	bool idle = messages.empty();
+	messages.push_back(std::move(message));
+	if(idle && owner)
+	{
+		shared_ptr<DNSShardInbox> self = shared_from_this();
+		owner->EventLoop().Post([self](){
+			self->Drain();
+		});
+	}
+}
+
+void DNSShardInbox::Detach()
+{
+	lock_guard<mutex> guard(lock);
+	owner = nullptr;
+	messages.clear();
+}
+
+void DNSShardInbox::Drain()
+{
+	deque<Message> batch;
+	{
+		lock_guard<mutex> guard(lock);
+		batch.swap(messages);
+	}
+
+	for(auto &message : batch)
+	{
+		// a listener may stop the owner while the batch is delivered
+		DNSServiceManager *target;
+		{
+			lock_guard<mutex> guard(lock);
+			target = owner;
+		}
+		if(target == nullptr)
+			return;
+		target->shardMessage(message.info, message.errorCode, message.phase);
+	}
+}
+
+
+
+DNSShard::DNSShard(const shared_ptr<DNSShardInbox> &inbox)
+: inbox(inbox)
+, manager(nullptr)
+#if defined(ZEROCONF_POLL_LOOP)
+, stopping(false)
+#elif !defined(_WINDOWS)
+, queue(nullptr)
+#endif
+{
+
+}
+
+#ifdef _WINDOWS
+
+bool DNSShard::Start()
+{
+	// the manager is created on the worker so that its loop's window belongs to that thread
+	promise<void> ready;
+	future<void> started = ready.get_future();
+	worker = thread([this, &ready](){
+		manager = new DNSServiceManager(this);
+		ready.set_value();
+
+		MSG msg;
+		while(GetMessage(&msg, NULL, 0, 0) > 0)
+		{
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+
+		delete manager;
+		manager = nullptr;
+		DNSTimeline::ReleaseThread();
+	});
+	started.wait();
+	return true;
+}
+
+DNSShard::~DNSShard()
+{
+	if(worker.joinable())
+	{
+		Post([](){
+			PostQuitMessage(0);
+		});
+		worker.join();
+	}
+}
+
+#elif defined(ZEROCONF_POLL_LOOP)
+
+bool DNSShard::Start()
+{
+	// the worker is the host of its loop: it waits on the loop's descriptor and polls
+	promise<void> ready;
+	future<void> started = ready.get_future();
+	worker = thread([this, &ready](){
+		manager = new DNSServiceManager(this);
+		ready.set_value();
+
+		BaseDNSEventLoop &loop = manager->EventLoop();
+		while(!stopping)
+		{
+			pollfd fd = { loop.Descriptor(), POLLIN, 0 };
+			poll(&fd, 1, -1);
+			loop.Poll(0, 0);
+		}
+
+		delete manager;
+		manager = nullptr;
+		DNSTimeline::ReleaseThread();
+	});
+	started.wait();
+	return true;
+}
+
+DNSShard::~DNSShard()
+{
+	if(worker.joinable())
+	{
+		Post([this](){
+			stopping = true;
+		});
+		worker.join();
+	}
+}
+
+#else
+
+bool DNSShard::Start()
+{
+	queue = dispatch_queue_create("com.coronalabs.zeroconf.shard", DISPATCH_QUEUE_SERIAL);
+	if(queue == nullptr)
+		return false;
+
+	manager = new DNSServiceManager(this, new PlatformEventLoop(queue));
+	return true;
+}
+
+void DNSShard::DestroyManager(void *context)
+{
+	DNSShard *shard = (DNSShard*)context;
+	delete shard->manager;
+	shard->manager = nullptr;
+}
+
+DNSShard::~DNSShard()
+{
+	if(queue)
+	{
+		dispatch_sync_f(queue, this, &DNSShard::DestroyManager);
+		dispatch_release(queue);
+	}
+}
+
+#endif
+
+void DNSShard::Post(const function<void()> &task)
+{
+	manager->EventLoop().Post(task);
+}
+
+shared_ptr<DNSShard::Placement> DNSShard::Find(BrowserHandle browser) const
+{
+	for(const auto &placement : placed)
+	{
+		if(placement->handle == browser)
+			return placement;
+	}
+	return nullptr;
+}
+
+BrowserHandle DNSShard::Browse(const ServiceInfo &info, const BrowseDuty &duty, const BrowseProbe &probe)
+{
+	shared_ptr<Placement> placement = make_shared<Placement>();
+	placement->handle = (BrowserHandle)++nextHandle;
+	placement->inner = nullptr;
+	placed.push_back(placement);
+
+	ServiceInfo query(info);
+	Post([this, placement, query, duty, probe](){
+		placement->inner = manager->browse(query, duty, probe);
+		if(placement->inner)
+		{
+			byInner[placement->inner] = placement.get();
+		}
+		else
+		{
+			ServiceInfo failed(query);
+			failed.browser = placement->handle;
+			inbox->Push(failed, kDNSServiceErr_Unknown, "browseError");
+		}
+	});
+
+	return placement->handle;
+}
+
+bool DNSShard::StopBrowser(BrowserHandle browser)
+{
+	shared_ptr<Placement> placement = Find(browser);
+	if(!placement)
+		return false;
+
+	placed.remove(placement);
+	Post([this, placement](){
+		if(placement->inner)
+		{
+			byInner.erase(placement->inner);
+			manager->stopBrowser(placement->inner);
+			placement->inner = nullptr;
+		}
+	});
+	return true;
+}
+
+bool DNSShard::WakeBrowser(BrowserHandle browser)
+{
+	shared_ptr<Placement> placement = Find(browser);
+	if(!placement)
+		return false;
+
+	Post([this, placement](){
+		if(placement->inner)
+			manager->wakeBrowser(placement->inner);
+	});
+	return true;
+}
+
+void DNSShard::Message(const ServiceInfo &srv, int errorCode, const char* phase)
+{
+	auto it = byInner.find(srv.browser);
+	if(it == byInner.end())
+		return;
+
+	// reported under the handle the owner handed out
+	Placement *placement = it->second;
+	ServiceInfo info(srv);
+	info.browser = placement->handle;
+
+	// the worker's manager stops a failed browser right after this message
+	if(strcmp(phase, "browseError") == 0)
+	{
+		byInner.erase(it);
+		placement->inner = nullptr;
+	}
+
+	inbox->Push(info, errorCode, phase);
+}
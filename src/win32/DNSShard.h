@@ -0,0 +1,113 @@
+//
+//  DNSShard.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Worker shard of a DNSServiceManager: a manager of its own, with its own
+//  daemon connection and event loop on a thread of its own, running part of
+//  the browsers. Its messages are merged back in arrival order through an
+//  inbox that the owning manager drains on its own thread.
+//
+
+
+#ifndef DNSShard_h
+#define DNSShard_h
+
+#include "DnsWrapper.h"
+
+#include <deque>
+#include <mutex>
+
+#if defined(_WINDOWS) || defined(ZEROCONF_POLL_LOOP)
+	#include <thread>
+#else
+	#include <dns_sd.h>
+#endif
+
+
+class DNSShardInbox : public std::enable_shared_from_this<DNSShardInbox>
+{
+public:
+	explicit DNSShardInbox(DNSServiceManager *owner);
+
+	// called from the workers
+	void Push(const ServiceInfo &info, int errorCode, const char *phase);
+
+	// stops delivery, drains that are already posted find no one to deliver to
+	void Detach();
+
+private:
+	struct Message
+	{
+		ServiceInfo info;
+		int errorCode;
+		// always a string literal
+		const char *phase;
+	};
+
+	void Drain();
+
+	std::mutex lock;
+	DNSServiceManager *owner;
+	std::deque<Message> messages;
+};
+
+
+class DNSShard : public DSNMessageBusBase
+{
+public:
+	explicit DNSShard(const std::shared_ptr<DNSShardInbox> &inbox);
+	// stops the worker's browsers and waits for it to finish
+	virtual ~DNSShard();
+
+	bool Start();
+
+	// The handle is returned right away and browsing starts on the worker;
+	// a browse that fails there is reported as "browseError". Handles are
+	// never reused, so messages of a stopped browser still on their way
+	// through the inbox cannot be taken for those of a newer one.
+	BrowserHandle Browse(const ServiceInfo &info, const BrowseDuty &duty, const BrowseProbe &probe);
+	bool StopBrowser(BrowserHandle browser);
+	bool WakeBrowser(BrowserHandle browser);
+
+	// browsers running on this shard
+	size_t Load() const { return placed.size(); }
+
+	// worker thread
+	virtual void Message(const ServiceInfo &srv, int errorCode, const char* phase) override;
+
+private:
+	struct Placement
+	{
+		// what the owner knows the browser by, see Browse()
+		BrowserHandle handle;
+		// handle of the worker's browser, only touched on the worker
+		BrowserHandle inner;
+	};
+
+	std::shared_ptr<Placement> Find(BrowserHandle browser) const;
+	void Post(const std::function<void()> &task);
+
+	std::shared_ptr<DNSShardInbox> inbox;
+	DNSServiceManager *manager;
+
+	// owner's thread
+	std::list< std::shared_ptr<Placement> > placed;
+	// worker thread
+	std::unordered_map<BrowserHandle, Placement*> byInner;
+
+#ifdef _WINDOWS
+	std::thread worker;
+#elif defined(ZEROCONF_POLL_LOOP)
+	std::thread worker;
+	// worker thread, set by a posted task to end it
+	bool stopping;
+#else
+	dispatch_queue_t queue;
+	static void DestroyManager(void *context);
+#endif
+};
+
+
+#endif /* DNSShard_h */
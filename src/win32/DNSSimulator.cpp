@@ -0,0 +1,187 @@
+//
+//  DNSSimulator.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSSimulator.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+
+// TXT pairs are limited to 255 bytes, so larger records are split over several keys
+static const size_t kDataChunk = 200;
+
+static const uint16_t kSimulatedPort = 9;
+
+
+DNSSimulator::DNSSimulator(const SimulationConfig &config, BaseDNSEventLoop &loop, DSNMessageBusBase *bus)
+: config(config)
+, loop(loop)
+, bus(bus)
+, random(config.seed ? config.seed : 1)
+, running(false)
+, owed(0)
+, timer(0)
+, found(0)
+, lost(0)
+, updated(0)
+, alive(make_shared<bool>(true))
+{
+}
+
+DNSSimulator::~DNSSimulator()
+{
+	*alive = false;
+	Stop();
+}
+
+void DNSSimulator::Start()
+{
+	instances.resize(config.services);
+	for(size_t i = 0; i < instances.size(); i++)
+	{
+		ServiceInfo &info = instances[i].info;
+		instances[i].present = false;
+
+		char buff[64];
+		sprintf(buff, "Simulated %u", (unsigned)(i + 1));
+		info.setName(buff);
+		info.setType(config.type.c_str());
+		info.setDomain(ServiceInfo::kDefaultDomain);
+		sprintf(buff, "simulated-%u.local.", (unsigned)(i + 1));
+		info.setHostname(buff);
+		info.port = kSimulatedPort;
+		info.browser = Handle();
+
+		// 10.0.0.0/8 fits more hosts than anyone would simulate
+		ServiceAddress address;
+		memset(&address, 0, sizeof(address));
+		address.family = ServiceAddress::kFamilyIPv4;
+		address.bytes[0] = 10;
+		address.bytes[1] = (uint8_t)((i + 1) >> 16);
+		address.bytes[2] = (uint8_t)((i + 1) >> 8);
+		address.bytes[3] = (uint8_t)(i + 1);
+		address.ttl = 120;
+		info.addresses.push_back(address);
+
+		FillData(info);
+	}
+
+	running = true;
+	started = lastTick = Clock::now();
+	owed = 0;
+
+	// the burst comes from the loop too, never from inside Start()
+	timer = loop.ScheduleTimer(0, [this](){
+		timer = 0;
+		Burst();
+	});
+}
+
+void DNSSimulator::Stop()
+{
+	running = false;
+	loop.CancelTimer(timer);
+	timer = 0;
+}
+
+void DNSSimulator::Burst()
+{
+	shared_ptr<bool> guard = alive;
+	for(auto &instance : instances)
+	{
+		instance.present = true;
+		found++;
+		Emit(instance.info, "found");
+		if(!*guard || !running)
+			return;
+	}
+
+	lastTick = Clock::now();
+	timer = loop.ScheduleTimer(kTickMs, [this](){
+		timer = 0;
+		Tick();
+	});
+}
+
+void DNSSimulator::Tick()
+{
+	Clock::time_point now = Clock::now();
+	owed += config.churnPerSec * chrono::duration<double>(now - lastTick).count();
+	lastTick = now;
+
+	shared_ptr<bool> guard = alive;
+	while(owed >= 1 && !instances.empty())
+	{
+		owed -= 1;
+		Churn();
+		if(!*guard || !running)
+			return;
+	}
+
+	if(config.durationMs && now - started >= chrono::milliseconds((long long)config.durationMs))
+	{
+		running = false;
+		return;
+	}
+
+	timer = loop.ScheduleTimer(kTickMs, [this](){
+		timer = 0;
+		Tick();
+	});
+}
+
+void DNSSimulator::Churn()
+{
+	Instance &instance = instances[random() % instances.size()];
+	if(!instance.present)
+	{
+		instance.present = true;
+		found++;
+		Emit(instance.info, "found");
+	}
+	else if(random() % 2)
+	{
+		instance.present = false;
+		lost++;
+		Emit(instance.info, "lost");
+	}
+	else
+	{
+		FillData(instance.info);
+		updated++;
+		Emit(instance.info, "updated");
+	}
+}
+
+void DNSSimulator::Emit(const ServiceInfo &info, const char *phase)
+{
+	bus->Message(info, 0, phase);
+}
+
+void DNSSimulator::FillData(ServiceInfo &info)
+{
+	static const char kLetters[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+	size_t remaining = config.txtBytes;
+	for(int key = 0; remaining > 0; key++)
+	{
+		size_t chunk = min(remaining, kDataChunk);
+		string value(chunk, ' ');
+		for(auto &c : value)
+		{
+			c = kLetters[random() % (sizeof(kLetters) - 1)];
+		}
+
+		char keyName[16];
+		sprintf(keyName, "k%d", key);
+		info.setData(keyName, value.c_str());
+		remaining -= chunk;
+	}
+}
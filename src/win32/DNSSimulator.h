@@ -0,0 +1,109 @@
+//
+//  DNSSimulator.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Synthetic browse events for stress testing listeners. A simulation makes
+//  up a population of services, reports all of them "found" in one turn of
+//  the loop and then keeps losing, finding again and updating random ones at
+//  a steady rate. Events go to the bus exactly as a browser's would, with the
+//  simulation as their browser, so budgets, coalescing and pickers all apply.
+//  The same seed always produces the same events.
+//
+
+
+#ifndef DNSSimulator_h
+#define DNSSimulator_h
+
+#include "DnsWrapper.h"
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+struct SimulationConfig
+{
+	std::string type;
+	size_t services;
+	double churnPerSec;
+	size_t txtBytes;
+	uint32_t seed;
+	// ms after which no more events are made up, 0 to run until stopped
+	uint32_t durationMs;
+
+	SimulationConfig()
+	: type("_simulated._tcp")
+	, services(100)
+	, churnPerSec(0)
+	, txtBytes(0)
+	, seed(1)
+	, durationMs(0)
+	{
+	}
+};
+
+class DNSSimulator
+{
+public:
+	// Events go to bus from timers on loop; the bus may delete the simulator
+	// from inside Message().
+	DNSSimulator(const SimulationConfig &config, BaseDNSEventLoop &loop, DSNMessageBusBase *bus);
+	~DNSSimulator();
+
+	void Start();
+	// no more events after this, whatever is queued by the bus stays there
+	void Stop();
+
+	BrowserHandle Handle() { return this; }
+	bool Running() const { return running; }
+
+	size_t Found() const { return found; }
+	size_t Lost() const { return lost; }
+	size_t Updated() const { return updated; }
+
+	// how often the churn timer fires, events due in between go out together
+	static const uint32_t kTickMs = 10;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Instance
+	{
+		ServiceInfo info;
+		bool present;
+	};
+
+	void Burst();
+	void Tick();
+	void Churn();
+	void Emit(const ServiceInfo &info, const char *phase);
+	void FillData(ServiceInfo &info);
+
+	SimulationConfig config;
+	BaseDNSEventLoop &loop;
+	DSNMessageBusBase *bus;
+
+	std::minstd_rand random;
+	std::vector<Instance> instances;
+
+	bool running;
+	Clock::time_point started;
+	Clock::time_point lastTick;
+	// fraction of an event carried over to the next tick
+	double owed;
+	TimerHandle timer;
+
+	size_t found;
+	size_t lost;
+	size_t updated;
+
+	// cleared by the destructor, for buses that delete the simulator
+	std::shared_ptr<bool> alive;
+};
+
+
+#endif /* DNSSimulator_h */
@@ -0,0 +1,167 @@
+//
+//  DNSSocket.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSSocket.h"
+
+#include <string.h>
+#include <algorithm>
+
+#if _WINDOWS
+	#pragma comment(lib, "Ws2_32.lib")
+
+	#ifndef SIO_UDP_CONNRESET
+		#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR, 12)
+	#endif
+#else
+	#include <fcntl.h>
+	#include <sys/select.h>
+	#include <unistd.h>
+#endif
+
+
+bool DNSSocketStartup()
+{
+#if _WINDOWS
+	WSADATA wsaData;
+	return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#else
+	return true;
+#endif
+}
+
+void DNSSocketCleanup()
+{
+#if _WINDOWS
+	WSACleanup();
+#endif
+}
+
+void DNSSocketClose(DNSSocket sock)
+{
+	if(sock == kNoSocket)
+		return;
+#if _WINDOWS
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+bool DNSSocketSetNonBlocking(DNSSocket sock)
+{
+#if _WINDOWS
+	u_long enabled = 1;
+	if(ioctlsocket(sock, FIONBIO, &enabled) != 0)
+		return false;
+
+	// otherwise a datagram to a closed port fails the next receive with WSAECONNRESET
+	BOOL reset = FALSE;
+	DWORD returned = 0;
+	WSAIoctl(sock, SIO_UDP_CONNRESET, &reset, sizeof(reset), NULL, 0, &returned, NULL, NULL);
+	return true;
+#else
+	int flags = fcntl(sock, F_GETFL, 0);
+	return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+DNSSocket DNSSocketOpenLoopback(sockaddr_in &address)
+{
+	DNSSocket sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(sock == kNoSocket)
+		return kNoSocket;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(address);
+	if(bind(sock, (sockaddr*)&address, sizeof(address)) != 0
+	   || getsockname(sock, (sockaddr*)&address, &length) != 0
+	   || !DNSSocketSetNonBlocking(sock))
+	{
+		DNSSocketClose(sock);
+		return kNoSocket;
+	}
+	return sock;
+}
+
+void DNSSocketDrain(DNSSocket sock)
+{
+	char buffer[64];
+	while(recv(sock, buffer, sizeof(buffer), 0) > 0)
+	{
+	}
+}
+
+DNSSocket DNSSocketOpenMulticast(uint16_t port, const std::string &interfaceAddress)
+{
+	in_addr iface;
+	iface.s_addr = htonl(INADDR_ANY);
+	if(!interfaceAddress.empty() && inet_pton(AF_INET, interfaceAddress.c_str(), &iface) != 1)
+		return kNoSocket;
+
+	DNSSocket sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(sock == kNoSocket)
+		return kNoSocket;
+
+	// other responders on this host listen on the same port
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse));
+#endif
+
+	sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(port);
+
+	ip_mreq membership;
+	membership.imr_multiaddr.s_addr = htonl(kMulticastDNSGroup);
+	membership.imr_interface = iface;
+
+	if(bind(sock, (sockaddr*)&local, sizeof(local)) != 0
+	   || setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) != 0
+	   || !DNSSocketSetNonBlocking(sock))
+	{
+		DNSSocketClose(sock);
+		return kNoSocket;
+	}
+
+#if _WINDOWS
+	DWORD ttl = 255;
+	DWORD loop = 1;
+#else
+	unsigned char ttl = 255;
+	unsigned char loop = 1;
+#endif
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+	// other processes on this host, and this one, see what is sent
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop));
+	if(iface.s_addr != htonl(INADDR_ANY))
+		setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&iface, sizeof(iface));
+
+	return sock;
+}
+
+bool DNSSocketWait(DNSSocket sock, DNSSocket wake, long long timeoutMs, bool &woken)
+{
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET(sock, &readable);
+	FD_SET(wake, &readable);
+
+	timeoutMs = std::max(0LL, timeoutMs);
+	timeval timeout;
+	timeout.tv_sec = (long)(timeoutMs / 1000);
+	timeout.tv_usec = (long)(timeoutMs % 1000) * 1000;
+	select((int)std::max(sock, wake) + 1, &readable, NULL, NULL, &timeout);
+
+	woken = FD_ISSET(wake, &readable) != 0;
+	return FD_ISSET(sock, &readable) != 0;
+}
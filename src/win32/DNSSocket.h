@@ -0,0 +1,61 @@
+//
+//  DNSSocket.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  The few socket calls the multicast DNS code needs, the same on Windows
+//  and elsewhere.
+//
+
+
+#ifndef DNSSocket_h
+#define DNSSocket_h
+
+#include <stdint.h>
+#include <string>
+
+#if _WINDOWS
+	#include <Winsock2.h>
+	#include <ws2ipdef.h>
+	#include <WS2tcpip.h>
+
+	typedef SOCKET DNSSocket;
+	static const DNSSocket kNoSocket = INVALID_SOCKET;
+#else
+	#include <arpa/inet.h>
+	#include <netinet/in.h>
+	#include <sys/socket.h>
+
+	typedef int DNSSocket;
+	static const DNSSocket kNoSocket = -1;
+#endif
+
+
+// 224.0.0.251
+static const uint32_t kMulticastDNSGroup = 0xE00000FB;
+static const uint16_t kMulticastDNSPort = 5353;
+// the largest message multicast DNS allows
+static const size_t kMulticastDNSMaxReceive = 9000;
+
+// WSAStartup() and WSACleanup() where they are needed
+bool DNSSocketStartup();
+void DNSSocketCleanup();
+
+void DNSSocketClose(DNSSocket sock);
+bool DNSSocketSetNonBlocking(DNSSocket sock);
+
+// UDP socket on an ephemeral loopback port, for waking a thread or an event loop
+DNSSocket DNSSocketOpenLoopback(sockaddr_in &address);
+void DNSSocketDrain(DNSSocket sock);
+
+// Non-blocking UDP socket on port that shares it with other responders and
+// receives the multicast DNS group on the interface with the given IPv4
+// address, or on the system's choice when it is empty.
+DNSSocket DNSSocketOpenMulticast(uint16_t port, const std::string &interfaceAddress);
+
+// waits until sock or wake is readable, or timeoutMs passed; returns whether sock is
+bool DNSSocketWait(DNSSocket sock, DNSSocket wake, long long timeoutMs, bool &woken);
+
+
+#endif /* DNSSocket_h */
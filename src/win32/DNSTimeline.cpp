@@ -0,0 +1,382 @@
+//
+//  DNSTimeline.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSTimeline.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+	#define DNS_TIMELINE_THREAD_LOCAL __declspec(thread)
+#else
+	#define DNS_TIMELINE_THREAD_LOCAL __thread
+#endif
+
+using namespace std;
+
+namespace
+{
+	enum Phase
+	{
+		kPhaseBegin,
+		kPhaseEnd,
+		kPhaseAsyncBegin,
+		kPhaseAsyncEnd,
+	};
+
+	struct Event
+	{
+		uint64_t timestamp;
+		const char *name;
+		uint64_t id;
+		uint32_t thread;
+		uint32_t phase;
+	};
+
+	// Written only by its own thread. The dumper trusts slots older than
+	// head - capacity to be stable and discards anything that may have been
+	// overwritten while it was copying.
+	struct ThreadBuffer
+	{
+		// power of two, so the write index wraps with a mask
+		explicit ThreadBuffer(uint64_t capacity)
+		: thread(0)
+		, head(0)
+		, tail(0)
+		, capacity(capacity)
+		, events(new Event[(size_t)capacity])
+		{
+		}
+
+		~ThreadBuffer()
+		{
+			delete [] events;
+		}
+
+		uint32_t thread;
+		atomic<uint64_t> head;
+		atomic<uint64_t> tail;
+		const uint64_t capacity;
+		Event *events;
+	};
+
+	const chrono::steady_clock::time_point sOrigin = chrono::steady_clock::now();
+
+	mutex sRegistryLock;
+	vector<ThreadBuffer*> sBuffers;
+	// handed back by threads that ended, still in sBuffers
+	vector<ThreadBuffer*> sReleased;
+	uint64_t sCapacity = DNSTimeline::kDefaultCapacity;
+	uint32_t sNextThread = 0;
+
+	DNS_TIMELINE_THREAD_LOCAL ThreadBuffer *sThreadBuffer = nullptr;
+
+	ThreadBuffer *LocalBuffer()
+	{
+		if(sThreadBuffer == nullptr)
+		{
+			lock_guard<mutex> lock(sRegistryLock);
+			ThreadBuffer *buffer;
+			if(!sReleased.empty())
+			{
+				buffer = sReleased.back();
+				sReleased.pop_back();
+			}
+			else
+			{
+				buffer = new ThreadBuffer(sCapacity);
+				sBuffers.push_back(buffer);
+			}
+			// a new track, entries of the previous owner keep theirs
+			buffer->thread = ++sNextThread;
+			sThreadBuffer = buffer;
+		}
+		return sThreadBuffer;
+	}
+
+	void DropReleased()
+	{
+		for(auto buffer : sReleased)
+		{
+			sBuffers.erase(find(sBuffers.begin(), sBuffers.end(), buffer));
+			delete buffer;
+		}
+		sReleased.clear();
+	}
+
+	void Push(Phase phase, const char *name, uint64_t id)
+	{
+		ThreadBuffer *buffer = LocalBuffer();
+		uint64_t head = buffer->head.load(memory_order_relaxed);
+
+		Event &e = buffer->events[head & (buffer->capacity - 1)];
+		e.timestamp = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sOrigin).count();
+		e.name = name;
+		e.id = id;
+		e.thread = buffer->thread;
+		e.phase = phase;
+
+		buffer->head.store(head + 1, memory_order_release);
+	}
+
+	vector<Event> Snapshot()
+	{
+		vector<Event> events;
+
+		lock_guard<mutex> lock(sRegistryLock);
+		for(auto buffer : sBuffers)
+		{
+			uint64_t capacity = buffer->capacity;
+			uint64_t head = buffer->head.load(memory_order_acquire);
+			uint64_t tail = buffer->tail.load(memory_order_relaxed);
+			uint64_t first = max(tail, head > capacity ? head - capacity : 0);
+
+			size_t start = events.size();
+			for(uint64_t i = first; i < head; i++)
+				events.push_back(buffer->events[i & (capacity - 1)]);
+
+			// the slot at after may be half written already, so it counts as overwritten too
+			uint64_t after = buffer->head.load(memory_order_acquire);
+			if(after + 1 > capacity && after + 1 - capacity > first)
+			{
+				size_t overwritten = (size_t)min(after + 1 - capacity - first, head - first);
+				events.erase(events.begin() + start, events.begin() + start + overwritten);
+			}
+		}
+
+		stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) {
+			return a.timestamp < b.timestamp;
+		});
+		return events;
+	}
+
+	bool WriteChromeJSON(FILE *file, const vector<Event> &events)
+	{
+		fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+		bool first = true;
+		for(const auto &e : events)
+		{
+			static const char *kPhases[] = { "B", "E", "b", "e" };
+			fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"zeroconf\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+					first ? "" : ",\n", e.name, kPhases[e.phase], e.timestamp / 1000.0, e.thread);
+			if(e.phase == kPhaseAsyncBegin || e.phase == kPhaseAsyncEnd)
+				fprintf(file, ",\"id\":\"0x%llx\"", (unsigned long long)e.id);
+			fputc('}', file);
+			first = false;
+		}
+		fputs("\n]}\n", file);
+		return ferror(file) == 0;
+	}
+
+	// Minimal protobuf encoding of perfetto.protos.Trace
+	void PutVarint(string &out, uint64_t value)
+	{
+		while(value >= 0x80)
+		{
+			out.push_back((char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((char)value);
+	}
+
+	void PutUint(string &out, uint32_t field, uint64_t value)
+	{
+		PutVarint(out, field << 3);
+		PutVarint(out, value);
+	}
+
+	void PutBytes(string &out, uint32_t field, const string &bytes)
+	{
+		PutVarint(out, (field << 3) | 2);
+		PutVarint(out, bytes.size());
+		out += bytes;
+	}
+
+	enum
+	{
+		kTracePacket = 1,
+
+		kPacketTimestamp = 8,
+		kPacketSequenceId = 10,
+		kPacketTrackEvent = 11,
+		kPacketTrackDescriptor = 60,
+
+		kEventType = 9,
+		kEventTrackUuid = 11,
+		kEventCategories = 22,
+		kEventName = 23,
+
+		kDescriptorUuid = 1,
+		kDescriptorName = 2,
+		kDescriptorThread = 4,
+
+		kThreadPid = 1,
+		kThreadTid = 2,
+
+		kSliceBegin = 1,
+		kSliceEnd = 2,
+
+		kSequenceId = 1,
+	};
+
+	uint64_t AsyncTrack(uint64_t id)
+	{
+		return (id * 0x9E3779B97F4A7C15ull) | 0x8000000000000000ull;
+	}
+
+	bool WritePerfetto(FILE *file, const vector<Event> &events)
+	{
+		string out, packet, body, nested;
+
+		vector<uint32_t> threads;
+		vector<uint64_t> asyncTracks;
+		for(const auto &e : events)
+		{
+			if(e.phase == kPhaseAsyncBegin)
+				asyncTracks.push_back(e.id);
+			else if(e.phase == kPhaseBegin)
+				threads.push_back(e.thread);
+		}
+		sort(threads.begin(), threads.end());
+		threads.erase(unique(threads.begin(), threads.end()), threads.end());
+		sort(asyncTracks.begin(), asyncTracks.end());
+		asyncTracks.erase(unique(asyncTracks.begin(), asyncTracks.end()), asyncTracks.end());
+
+		for(auto thread : threads)
+		{
+			nested.clear();
+			PutUint(nested, kThreadPid, 1);
+			PutUint(nested, kThreadTid, thread);
+			body.clear();
+			PutUint(body, kDescriptorUuid, thread);
+			PutBytes(body, kDescriptorThread, nested);
+			packet.clear();
+			PutBytes(packet, kPacketTrackDescriptor, body);
+			PutBytes(out, kTracePacket, packet);
+		}
+
+		for(auto id : asyncTracks)
+		{
+			char name[40];
+			sprintf(name, "instance 0x%llx", (unsigned long long)id);
+			body.clear();
+			PutUint(body, kDescriptorUuid, AsyncTrack(id));
+			PutBytes(body, kDescriptorName, name);
+			packet.clear();
+			PutBytes(packet, kPacketTrackDescriptor, body);
+			PutBytes(out, kTracePacket, packet);
+		}
+
+		for(const auto &e : events)
+		{
+			bool async = (e.phase == kPhaseAsyncBegin || e.phase == kPhaseAsyncEnd);
+			bool begin = (e.phase == kPhaseBegin || e.phase == kPhaseAsyncBegin);
+
+			body.clear();
+			PutUint(body, kEventType, begin ? kSliceBegin : kSliceEnd);
+			PutUint(body, kEventTrackUuid, async ? AsyncTrack(e.id) : e.thread);
+			if(begin)
+			{
+				PutBytes(body, kEventCategories, "zeroconf");
+				PutBytes(body, kEventName, e.name);
+			}
+
+			packet.clear();
+			PutUint(packet, kPacketTimestamp, e.timestamp);
+			PutUint(packet, kPacketSequenceId, kSequenceId);
+			PutBytes(packet, kPacketTrackEvent, body);
+			PutBytes(out, kTracePacket, packet);
+		}
+
+		return fwrite(out.data(), 1, out.size(), file) == out.size();
+	}
+}
+
+
+namespace DNSTimeline
+{
+	atomic<bool> sEnabled(false);
+
+	void SetEnabled(bool enabled)
+	{
+		sEnabled.store(enabled);
+	}
+
+	void SetCapacity(uint32_t events)
+	{
+		uint64_t capacity = 1;
+		while(capacity < events)
+			capacity <<= 1;
+
+		lock_guard<mutex> lock(sRegistryLock);
+		if(capacity == sCapacity)
+			return;
+		sCapacity = capacity;
+		DropReleased();
+	}
+
+	void ReleaseThread()
+	{
+		if(sThreadBuffer == nullptr)
+			return;
+
+		lock_guard<mutex> lock(sRegistryLock);
+		if(sThreadBuffer->capacity == sCapacity)
+			sReleased.push_back(sThreadBuffer);
+		else
+		{
+			sBuffers.erase(find(sBuffers.begin(), sBuffers.end(), sThreadBuffer));
+			delete sThreadBuffer;
+		}
+		sThreadBuffer = nullptr;
+	}
+
+	void Begin(const char *name)
+	{
+		Push(kPhaseBegin, name, 0);
+	}
+
+	void End(const char *name)
+	{
+		Push(kPhaseEnd, name, 0);
+	}
+
+	void AsyncBegin(const char *name, const void *id)
+	{
+		Push(kPhaseAsyncBegin, name, (uint64_t)(uintptr_t)id);
+	}
+
+	void AsyncEnd(const char *name, const void *id)
+	{
+		Push(kPhaseAsyncEnd, name, (uint64_t)(uintptr_t)id);
+	}
+
+	void Clear()
+	{
+		lock_guard<mutex> lock(sRegistryLock);
+		for(auto buffer : sBuffers)
+		{
+			buffer->tail.store(buffer->head.load(memory_order_acquire), memory_order_relaxed);
+		}
+	}
+
+	bool Dump(const char *path, Format format)
+	{
+		vector<Event> events = Snapshot();
+
+		FILE *file = fopen(path, "wb");
+		if(file == nullptr)
+			return false;
+
+		bool ok = (format == kFormatPerfetto) ? WritePerfetto(file, events) : WriteChromeJSON(file, events);
+		return (fclose(file) == 0) && ok;
+	}
+}
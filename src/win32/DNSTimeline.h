@@ -0,0 +1,93 @@
+//
+//  DNSTimeline.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Opt-in timeline of service lifecycle stages. Events go into a fixed size
+//  ring buffer owned by the emitting thread and are written out on demand as
+//  Chrome trace-event JSON or a Perfetto protobuf trace. Threads the plugin
+//  starts hand their buffer back when they end, for the next one to reuse.
+//
+
+
+#ifndef DNSTimeline_h
+#define DNSTimeline_h
+
+#include <stdint.h>
+#include <atomic>
+
+
+namespace DNSTimeline
+{
+	enum Format
+	{
+		kFormatChromeJSON,
+		kFormatPerfetto,
+	};
+
+	extern std::atomic<bool> sEnabled;
+
+	inline bool IsEnabled()
+	{
+		return sEnabled.load(std::memory_order_relaxed);
+	}
+
+	void SetEnabled(bool enabled);
+
+	// Entries each thread keeps, rounded up to a power of two. Buffers
+	// already in use keep their size; those handed back are dropped along
+	// with what they hold if they no longer match.
+	void SetCapacity(uint32_t events);
+	static const uint32_t kDefaultCapacity = 1 << 12;
+
+	// Called by a thread that is about to end, after its last event. What it
+	// recorded stays in the dump until the buffer's next owner overwrites it.
+	void ReleaseThread();
+
+	// Names must be string literals, only the pointer is stored.
+	void Begin(const char *name);
+	void End(const char *name);
+
+	// Spans that start and end in different callbacks, tied together by id.
+	void AsyncBegin(const char *name, const void *id);
+	void AsyncEnd(const char *name, const void *id);
+
+	// Drops everything recorded so far.
+	void Clear();
+
+	bool Dump(const char *path, Format format);
+
+	class Span
+	{
+	public:
+		explicit Span(const char *name)
+		: name(IsEnabled() ? name : nullptr)
+		{
+			if(this->name)
+				Begin(this->name);
+		}
+
+		~Span()
+		{
+			if(name)
+				End(name);
+		}
+
+	private:
+		Span(const Span&);
+		Span &operator=(const Span&);
+
+		const char *name;
+	};
+}
+
+#define DNS_TIMELINE_CONCAT2(a, b) a##b
+#define DNS_TIMELINE_CONCAT(a, b) DNS_TIMELINE_CONCAT2(a, b)
+#define DNS_TIMELINE_SPAN(name) DNSTimeline::Span DNS_TIMELINE_CONCAT(timelineSpan, __LINE__)(name)
+
+#define DNS_TIMELINE_ASYNC_BEGIN(name, id) do { if(DNSTimeline::IsEnabled()) DNSTimeline::AsyncBegin(name, id); } while(0)
+#define DNS_TIMELINE_ASYNC_END(name, id) do { if(DNSTimeline::IsEnabled()) DNSTimeline::AsyncEnd(name, id); } while(0)
+
+
+#endif /* DNSTimeline_h */
@@ -0,0 +1,622 @@
+//
+//  DNSTrace.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "DNSTrace.h"
+#include "DnsServices.h"
+
+#if _WINDOWS
+	#include <Winsock2.h>
+	#include <ws2ipdef.h>
+	#include <WS2tcpip.h>
+#else
+	#include <arpa/inet.h>
+	#include <netinet/in.h>
+	#include <sys/socket.h>
+#endif
+
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+	const uint8_t kTraceMagic[4] = { 'Z', 'C', 'T', 'R' };
+	const uint8_t kTraceVersion = 1;
+
+	const size_t kFlushThreshold = 64 * 1024;
+
+	enum TraceRecordKind
+	{
+		kTraceBrowseStart = 1,
+		kTraceBrowseStop,
+		kTraceBrowse,
+		kTraceResolve,
+		kTraceAddr,
+		kTraceResolveDone,
+		// same payload as kTraceBrowseStart
+		kTracePrivateBrowseStart,
+	};
+
+	const char *OrEmpty(const char *str, bool isNull)
+	{
+		return isNull ? nullptr : str;
+	}
+}
+
+
+DNSTraceRecorder::DNSTraceRecorder()
+: file(nullptr)
+, nextBrowserId(1)
+{
+
+}
+
+DNSTraceRecorder::~DNSTraceRecorder()
+{
+	Close();
+}
+
+bool DNSTraceRecorder::Open(const char *path)
+{
+	Close();
+
+	file = fopen(path, "wb");
+	if(file == nullptr)
+		return false;
+
+	buffer.reserve(kFlushThreshold * 2);
+	WriteBytes(kTraceMagic, sizeof(kTraceMagic));
+	buffer.push_back(kTraceVersion);
+	lastRecord = chrono::steady_clock::now();
+	return true;
+}
+
+void DNSTraceRecorder::Close()
+{
+	if(file == nullptr)
+		return;
+
+	Flush();
+	fclose(file);
+	file = nullptr;
+	browserIds.clear();
+	nextBrowserId = 1;
+}
+
+void DNSTraceRecorder::Flush()
+{
+	if(file && !buffer.empty())
+	{
+		fwrite(buffer.data(), 1, buffer.size(), file);
+		fflush(file);
+	}
+	buffer.clear();
+}
+
+uint32_t DNSTraceRecorder::BeginRecord(uint8_t kind, const ServiceBrowser *browser)
+{
+	if(buffer.size() >= kFlushThreshold)
+		Flush();
+
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	uint64_t delta = (uint64_t)chrono::duration_cast<chrono::microseconds>(now - lastRecord).count();
+	lastRecord = now;
+
+	uint32_t id = 0;
+	auto it = browserIds.find(browser);
+	if(it != browserIds.end())
+	{
+		id = it->second;
+	}
+	else if(kind == kTraceBrowseStart || kind == kTracePrivateBrowseStart)
+	{
+		id = nextBrowserId++;
+		browserIds[browser] = id;
+	}
+
+	buffer.push_back(kind);
+	WriteVarint(delta);
+	WriteVarint(id);
+	return id;
+}
+
+void DNSTraceRecorder::WriteVarint(uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		buffer.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	buffer.push_back((uint8_t)value);
+}
+
+void DNSTraceRecorder::WriteSigned(int64_t value)
+{
+	WriteVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void DNSTraceRecorder::WriteString(const char *str)
+{
+	if(str == nullptr)
+	{
+		WriteVarint(0);
+		return;
+	}
+	size_t len = strlen(str);
+	WriteVarint(len + 1);
+	WriteBytes(str, len);
+}
+
+void DNSTraceRecorder::WriteBytes(const void *bytes, size_t len)
+{
+	const uint8_t *b = (const uint8_t*)bytes;
+	buffer.insert(buffer.end(), b, b + len);
+}
+
+void DNSTraceRecorder::WriteInstance(const ServiceInfo &info)
+{
+	WriteString(info.name());
+	WriteString(info.type());
+	WriteString(info.domain());
+}
+
+void DNSTraceRecorder::WriteAddress(const ServiceAddress &address)
+{
+	// family byte (0 for none), the raw address, then the TTL
+	buffer.push_back(address.family);
+	if(address.family)
+		WriteBytes(address.bytes, address.Length());
+	WriteVarint(address.ttl);
+}
+
+void DNSTraceRecorder::RecordBrowseStart(const ServiceBrowser *browser, const char *type, const char *domain, bool isPrivate)
+{
+	if(!IsOpen() || browserIds.count(browser))
+		return;
+
+	BeginRecord(isPrivate ? kTracePrivateBrowseStart : kTraceBrowseStart, browser);
+	WriteString(type);
+	WriteString(domain);
+}
+
+void DNSTraceRecorder::RecordBrowseStop(const ServiceBrowser *browser)
+{
+	if(!IsOpen() || !browserIds.count(browser))
+		return;
+
+	BeginRecord(kTraceBrowseStop, browser);
+	browserIds.erase(browser);
+}
+
+void DNSTraceRecorder::RecordBrowse(const ServiceBrowser *browser,
+									uint32_t flags,
+									uint32_t interfaceIndex,
+									int32_t errorCode,
+									const char *serviceName,
+									const char *regtype,
+									const char *replyDomain)
+{
+	if(!IsOpen())
+		return;
+
+	BeginRecord(kTraceBrowse, browser);
+	WriteVarint(flags);
+	WriteVarint(interfaceIndex);
+	WriteSigned(errorCode);
+	WriteString(serviceName);
+	WriteString(regtype);
+	WriteString(replyDomain);
+}
+
+void DNSTraceRecorder::RecordResolve(const ServiceBrowser *browser,
+									 const ServiceInfo &info,
+									 uint32_t flags,
+									 uint32_t interfaceIndex,
+									 int32_t errorCode,
+									 const char *hosttarget,
+									 uint16_t port,
+									 uint16_t txtLen,
+									 const unsigned char *txtRecord)
+{
+	if(!IsOpen())
+		return;
+
+	BeginRecord(kTraceResolve, browser);
+	WriteVarint(flags);
+	WriteVarint(interfaceIndex);
+	WriteSigned(errorCode);
+	WriteInstance(info);
+	WriteString(hosttarget);
+	WriteVarint(port);
+	WriteVarint(txtRecord ? txtLen : 0);
+	if(txtRecord)
+		WriteBytes(txtRecord, txtLen);
+}
+
+void DNSTraceRecorder::RecordAddr(const ServiceBrowser *browser,
+								  const ServiceInfo &info,
+								  uint32_t flags,
+								  uint32_t interfaceIndex,
+								  int32_t errorCode,
+								  const char *hostname,
+								  const struct sockaddr *address,
+								  uint32_t ttl)
+{
+	if(!IsOpen())
+		return;
+
+	BeginRecord(kTraceAddr, browser);
+	WriteVarint(flags);
+	WriteVarint(interfaceIndex);
+	WriteSigned(errorCode);
+	WriteInstance(info);
+	WriteString(hostname);
+	WriteAddress(ServiceAddress::FromSockaddr(address, ttl, interfaceIndex));
+}
+
+void DNSTraceRecorder::RecordAddr(const ServiceBrowser *browser,
+								  const ServiceInfo &info,
+								  const char *hostname,
+								  const ServiceAddress &address)
+{
+	if(!IsOpen())
+		return;
+
+	BeginRecord(kTraceAddr, browser);
+	WriteVarint(kDNSServiceFlagsAdd);
+	WriteVarint(address.interfaceIndex);
+	WriteSigned(kDNSServiceErr_NoError);
+	WriteInstance(info);
+	WriteString(hostname);
+	WriteAddress(address);
+}
+
+void DNSTraceRecorder::RecordResolveDone(const ServiceBrowser *browser, const ServiceInfo &info, int32_t errorCode)
+{
+	if(!IsOpen())
+		return;
+
+	BeginRecord(kTraceResolveDone, browser);
+	WriteInstance(info);
+	WriteSigned(errorCode);
+}
+
+
+
+DNSTraceReplayer::DNSTraceReplayer(DNSServiceManager &manager)
+: manager(manager)
+, pos(0)
+, nextTimestamp(0)
+, malformed(false)
+, replayed(0)
+, speed(0)
+, timer(0)
+{
+
+}
+
+DNSTraceReplayer::~DNSTraceReplayer()
+{
+	if(timer)
+		manager.EventLoop().CancelTimer(timer);
+	StopBrowsers();
+}
+
+bool DNSTraceReplayer::Open(const char *path)
+{
+	if(timer)
+		manager.EventLoop().CancelTimer(timer);
+	timer = 0;
+	finished = nullptr;
+	StopBrowsers();
+	data.clear();
+	pos = 0;
+	nextTimestamp = 0;
+	malformed = false;
+	replayed = 0;
+
+	FILE *file = fopen(path, "rb");
+	if(file == nullptr)
+		return false;
+
+	uint8_t chunk[16 * 1024];
+	size_t read;
+	while((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+	{
+		data.insert(data.end(), chunk, chunk + read);
+	}
+	fclose(file);
+
+	if(data.size() < sizeof(kTraceMagic) + 1
+	   || memcmp(data.data(), kTraceMagic, sizeof(kTraceMagic)) != 0
+	   || data[sizeof(kTraceMagic)] != kTraceVersion)
+	{
+		data.clear();
+		return false;
+	}
+
+	pos = sizeof(kTraceMagic) + 1;
+	PeekTimestamp();
+	return true;
+}
+
+bool DNSTraceReplayer::Finished() const
+{
+	return malformed || pos >= data.size();
+}
+
+bool DNSTraceReplayer::ReadVarint(uint64_t &value)
+{
+	value = 0;
+	for(int shift = 0; shift < 64; shift += 7)
+	{
+		if(pos >= data.size())
+			return false;
+		uint8_t b = data[pos++];
+		value |= (uint64_t)(b & 0x7f) << shift;
+		if((b & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool DNSTraceReplayer::ReadSigned(int64_t &value)
+{
+	uint64_t raw;
+	if(!ReadVarint(raw))
+		return false;
+	value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+	return true;
+}
+
+bool DNSTraceReplayer::ReadString(string &str, bool &isNull)
+{
+	uint64_t len;
+	const uint8_t *bytes;
+	if(!ReadVarint(len))
+		return false;
+	isNull = (len == 0);
+	if(isNull)
+	{
+		str.clear();
+		return true;
+	}
+	if(!ReadBytes(bytes, (size_t)(len - 1)))
+		return false;
+	str.assign((const char*)bytes, (size_t)(len - 1));
+	return true;
+}
+
+bool DNSTraceReplayer::ReadBytes(const uint8_t *&bytes, size_t len)
+{
+	if(len > data.size() - pos)
+		return false;
+	bytes = data.data() + pos;
+	pos += len;
+	return true;
+}
+
+bool DNSTraceReplayer::PeekTimestamp()
+{
+	if(Finished())
+		return false;
+
+	size_t save = pos;
+	uint64_t delta;
+	pos++;
+	bool ok = ReadVarint(delta);
+	pos = save;
+	if(!ok)
+	{
+		malformed = true;
+		return false;
+	}
+	nextTimestamp += delta;
+	return true;
+}
+
+bool DNSTraceReplayer::DispatchRecord()
+{
+	uint8_t kind = data[pos++];
+	uint64_t delta, browserId;
+	if(!ReadVarint(delta) || !ReadVarint(browserId))
+		return false;
+
+	ServiceBrowser *browser = nullptr;
+	auto it = browsers.find(browserId);
+	if(it != browsers.end())
+		browser = it->second;
+
+	uint64_t flags = 0, interfaceIndex = 0;
+	int64_t errorCode = 0;
+	string name, type, domain, host;
+	bool nameNull, typeNull, domainNull, hostNull;
+
+	switch(kind)
+	{
+		case kTraceBrowseStart:
+		{
+			if(!ReadString(type, typeNull) || !ReadString(domain, domainNull))
+				return false;
+			ServiceInfo info;
+			info.setType(type.c_str());
+			info.setDomain(domain.c_str());
+			browsers[browserId] = manager.replayBrowser(info);
+			break;
+		}
+		case kTracePrivateBrowseStart:
+			// a waiter's or registry's browser, whose events never reached the bus; with no
+			// browser behind the id its records are read and skipped
+			if(!ReadString(type, typeNull) || !ReadString(domain, domainNull))
+				return false;
+			break;
+		case kTraceBrowseStop:
+			if(browser)
+			{
+				StopBrowser(browser);
+				browsers.erase(browserId);
+			}
+			break;
+		case kTraceBrowse:
+			if(!ReadVarint(flags) || !ReadVarint(interfaceIndex) || !ReadSigned(errorCode)
+			   || !ReadString(name, nameNull) || !ReadString(type, typeNull) || !ReadString(domain, domainNull))
+				return false;
+			if(browser)
+				browser->HandleBrowse((DNSServiceFlags)flags, (uint32_t)interfaceIndex, (DNSServiceErrorType)errorCode,
+									  OrEmpty(name.c_str(), nameNull), OrEmpty(type.c_str(), typeNull), OrEmpty(domain.c_str(), domainNull));
+			break;
+		case kTraceResolve:
+		{
+			uint64_t port, txtLen;
+			const uint8_t *txt = nullptr;
+			if(!ReadVarint(flags) || !ReadVarint(interfaceIndex) || !ReadSigned(errorCode)
+			   || !ReadString(name, nameNull) || !ReadString(type, typeNull) || !ReadString(domain, domainNull)
+			   || !ReadString(host, hostNull) || !ReadVarint(port) || !ReadVarint(txtLen) || !ReadBytes(txt, (size_t)txtLen))
+				return false;
+			ServiceInfo *info = browser ? browser->FindResolving(name.c_str(), type.c_str(), domain.c_str()) : nullptr;
+			if(info)
+				browser->HandleResolve(info, (DNSServiceFlags)flags, (uint32_t)interfaceIndex, (DNSServiceErrorType)errorCode,
+									   OrEmpty(host.c_str(), hostNull), (uint16_t)port, (uint16_t)txtLen, txtLen ? txt : nullptr);
+			break;
+		}
+		case kTraceAddr:
+		{
+			uint64_t ttl;
+			const uint8_t *family, *raw = nullptr;
+			if(!ReadVarint(flags) || !ReadVarint(interfaceIndex) || !ReadSigned(errorCode)
+			   || !ReadString(name, nameNull) || !ReadString(type, typeNull) || !ReadString(domain, domainNull)
+			   || !ReadString(host, hostNull) || !ReadBytes(family, 1))
+				return false;
+
+			sockaddr_in v4;
+			sockaddr_in6 v6;
+			const sockaddr *address = nullptr;
+			if(*family == 4)
+			{
+				if(!ReadBytes(raw, 4))
+					return false;
+				memset(&v4, 0, sizeof(v4));
+				v4.sin_family = AF_INET;
+				memcpy(&v4.sin_addr, raw, 4);
+				address = (const sockaddr*)&v4;
+			}
+			else if(*family == 6)
+			{
+				if(!ReadBytes(raw, 16))
+					return false;
+				memset(&v6, 0, sizeof(v6));
+				v6.sin6_family = AF_INET6;
+				memcpy(&v6.sin6_addr, raw, 16);
+				address = (const sockaddr*)&v6;
+			}
+			if(!ReadVarint(ttl))
+				return false;
+
+			ServiceInfo *info = browser ? browser->FindResolving(name.c_str(), type.c_str(), domain.c_str()) : nullptr;
+			if(info)
+				browser->HandleAddr(info, (DNSServiceFlags)flags, (uint32_t)interfaceIndex, (DNSServiceErrorType)errorCode,
+									OrEmpty(host.c_str(), hostNull), address, (uint32_t)ttl);
+			break;
+		}
+		case kTraceResolveDone:
+		{
+			if(!ReadString(name, nameNull) || !ReadString(type, typeNull) || !ReadString(domain, domainNull) || !ReadSigned(errorCode))
+				return false;
+			ServiceInfo *info = browser ? browser->FindResolving(name.c_str(), type.c_str(), domain.c_str()) : nullptr;
+			if(info)
+				browser->HandleResolveDone(info, (DNSServiceErrorType)errorCode);
+			break;
+		}
+		default:
+			return false;
+	}
+
+	replayed++;
+	return true;
+}
+
+bool DNSTraceReplayer::Pump(uint64_t traceMicros)
+{
+	while(!Finished() && nextTimestamp <= traceMicros)
+	{
+		if(!DispatchRecord())
+		{
+			malformed = true;
+			break;
+		}
+		PeekTimestamp();
+	}
+
+	if(Finished())
+	{
+		StopBrowsers();
+		return false;
+	}
+	return true;
+}
+
+size_t DNSTraceReplayer::Run()
+{
+	while(Pump(nextTimestamp))
+	{
+	}
+	StopBrowsers();
+	return replayed;
+}
+
+void DNSTraceReplayer::Play(double playSpeed, const function<void(size_t)> &done)
+{
+	speed = playSpeed;
+	start = chrono::steady_clock::now();
+	finished = done;
+	ScheduleNext();
+}
+
+void DNSTraceReplayer::ScheduleNext()
+{
+	// rounded up, a timer that fires before the record is due would only come back
+	chrono::steady_clock::time_point due = start + chrono::microseconds((int64_t)(nextTimestamp / speed));
+	int64_t wait = chrono::duration_cast<chrono::microseconds>(due - chrono::steady_clock::now()).count();
+	uint32_t ms = wait > 0 ? (uint32_t)((wait + 999) / 1000) : 0;
+
+	timer = manager.EventLoop().ScheduleTimer(ms, [this]() {
+		timer = 0;
+		Tick();
+	});
+}
+
+void DNSTraceReplayer::Tick()
+{
+	int64_t elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+	if(Pump((uint64_t)(elapsed * speed)))
+	{
+		ScheduleNext();
+		return;
+	}
+
+	// the callback is free to delete this
+	function<void(size_t)> done = std::move(finished);
+	finished = nullptr;
+	if(done)
+		done(replayed);
+}
+
+void DNSTraceReplayer::StopBrowser(ServiceBrowser *browser)
+{
+	manager.stopBrowser(browser);
+	if(browserStopped)
+		browserStopped(browser);
+}
+
+void DNSTraceReplayer::StopBrowsers()
+{
+	for(auto &b : browsers)
+	{
+		StopBrowser(b.second);
+	}
+	browsers.clear();
+}
@@ -0,0 +1,157 @@
+//
+//  DNSTrace.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Binary recording of dns_sd browse/resolve/address callbacks and a driver
+//  that feeds such a recording back through ServiceBrowser and the message bus.
+//
+
+
+#ifndef DNSTrace_h
+#define DNSTrace_h
+
+#include "DnsWrapper.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+struct sockaddr;
+
+// Trace file layout: "ZCTR", version byte, then records of
+//   kind:u8, delta time in microseconds:varint, browser id:varint, payload.
+// Integers are LEB128 varints (error codes zig-zag encoded), strings are
+// varint (length + 1) followed by the bytes, with 0 standing for NULL.
+class DNSTraceRecorder
+{
+public:
+	DNSTraceRecorder();
+	~DNSTraceRecorder();
+
+	bool Open(const char *path);
+	void Close();
+	bool IsOpen() const { return file != nullptr; }
+
+	// a private browser reports to a bus of its own, a waiter's or a registry's;
+	// its records are kept in the trace but not replayed
+	void RecordBrowseStart(const ServiceBrowser *browser, const char *type, const char *domain, bool isPrivate);
+	void RecordBrowseStop(const ServiceBrowser *browser);
+
+	void RecordBrowse(const ServiceBrowser *browser,
+					  uint32_t flags,
+					  uint32_t interfaceIndex,
+					  int32_t errorCode,
+					  const char *serviceName,
+					  const char *regtype,
+					  const char *replyDomain);
+
+	void RecordResolve(const ServiceBrowser *browser,
+					   const ServiceInfo &info,
+					   uint32_t flags,
+					   uint32_t interfaceIndex,
+					   int32_t errorCode,
+					   const char *hosttarget,
+					   uint16_t port,
+					   uint16_t txtLen,
+					   const unsigned char *txtRecord);
+
+	void RecordAddr(const ServiceBrowser *browser,
+					const ServiceInfo &info,
+					uint32_t flags,
+					uint32_t interfaceIndex,
+					int32_t errorCode,
+					const char *hostname,
+					const struct sockaddr *address,
+					uint32_t ttl);
+
+	// address served by the host cache rather than a callback of its own
+	void RecordAddr(const ServiceBrowser *browser,
+					const ServiceInfo &info,
+					const char *hostname,
+					const ServiceAddress &address);
+
+	void RecordResolveDone(const ServiceBrowser *browser, const ServiceInfo &info, int32_t errorCode);
+
+private:
+	uint32_t BeginRecord(uint8_t kind, const ServiceBrowser *browser);
+	void WriteVarint(uint64_t value);
+	void WriteSigned(int64_t value);
+	void WriteString(const char *str);
+	void WriteBytes(const void *bytes, size_t len);
+	void WriteInstance(const ServiceInfo &info);
+	void WriteAddress(const ServiceAddress &address);
+	void Flush();
+
+	FILE *file;
+	std::vector<uint8_t> buffer;
+	std::chrono::steady_clock::time_point lastRecord;
+	std::unordered_map<const ServiceBrowser*, uint32_t> browserIds;
+	uint32_t nextBrowserId;
+};
+
+
+class DNSTraceReplayer
+{
+public:
+	explicit DNSTraceReplayer(DNSServiceManager &manager);
+	~DNSTraceReplayer();
+
+	bool Open(const char *path);
+
+	// Trace time of the next record in microseconds, relative to the first one.
+	uint64_t NextTimestamp() const { return nextTimestamp; }
+	bool Finished() const;
+
+	// Dispatches every record stamped at or before traceMicros.
+	// Returns false once the trace is exhausted or malformed.
+	bool Pump(uint64_t traceMicros);
+
+	// Replays the whole trace on the calling thread without waiting between
+	// records.
+	size_t Run();
+
+	// Replays the trace from timers on the manager's loop and returns right
+	// away. speed of 1 keeps the original timing, 2 runs twice as fast; it
+	// must be more than 0. finished gets the number of replayed records and
+	// may delete the replayer.
+	void Play(double speed, const std::function<void(size_t)> &finished);
+
+	size_t RecordsReplayed() const { return replayed; }
+
+	// called with each replayed browser once it is stopped, for whoever keeps state about it
+	void SetBrowserStoppedHandler(const std::function<void(BrowserHandle)> &handler) { browserStopped = handler; }
+
+private:
+	bool ReadVarint(uint64_t &value);
+	bool ReadSigned(int64_t &value);
+	bool ReadString(std::string &str, bool &isNull);
+	bool ReadBytes(const uint8_t *&bytes, size_t len);
+	bool PeekTimestamp();
+	bool DispatchRecord();
+	void StopBrowser(ServiceBrowser *browser);
+	void StopBrowsers();
+	void ScheduleNext();
+	void Tick();
+
+	DNSServiceManager &manager;
+	std::vector<uint8_t> data;
+	size_t pos;
+	uint64_t nextTimestamp;
+	bool malformed;
+	size_t replayed;
+	std::unordered_map<uint64_t, ServiceBrowser*> browsers;
+
+	double speed;
+	std::chrono::steady_clock::time_point start;
+	TimerHandle timer;
+	std::function<void(size_t)> finished;
+	std::function<void(BrowserHandle)> browserStopped;
+};
+
+
+#endif /* DNSTrace_h */
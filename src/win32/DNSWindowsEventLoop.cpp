@@ -2,11 +2,15 @@
 #include <dns_sd.h>
 
 #define WM_DNS_SD_EVENT ( WM_USER + 0x101 )
+#define WM_DNS_SD_POSTED ( WM_USER + 0x102 )
 
 
 DNSWindowsEventLoop::DNSWindowsEventLoop()
 	: m_hWnd(NULL)
+	, nextTimer(0)
 {
+	// the window belongs to the constructing thread, which is the thread Post() runs tasks on
+	CreateMessageWindow();
 }
 
 DNSWindowsEventLoop::~DNSWindowsEventLoop()
@@ -18,9 +22,16 @@ DNSWindowsEventLoop::~DNSWindowsEventLoop()
 	}
 	mapping.clear();
 
+	for (auto &t : timers)
+	{
+		KillTimer(m_hWnd, t.first);
+	}
+	timers.clear();
+
 	if (m_hWnd)
 	{
 		DestroyWindow(m_hWnd);
+		// fails while windows of other loops still use the class
 		::UnregisterClassW(L"DNSEventLoopWindow", 0);
 	}
 }
@@ -45,7 +56,13 @@ LRESULT DNSWindowsEventLoop::OnProcessMessage(HWND windowHandle, UINT messageId,
 				if (it != e->mapping.end())
 				{
 					DNSServiceRef ref = it->second;
-					if (DNSServiceProcessResult(ref) != kDNSServiceErr_NoError)
+					DNSServiceErrorType err = DNSServiceProcessResult(ref);
+					if (err == kDNSServiceErr_ServiceNotRunning && e->daemonLost)
+					{
+						// the socket closed with the daemon, the manager terminates the ref
+						e->daemonLost();
+					}
+					if (err != kDNSServiceErr_NoError)
 						result = -1;
 					else
 						result = 0;
@@ -53,6 +70,38 @@ LRESULT DNSWindowsEventLoop::OnProcessMessage(HWND windowHandle, UINT messageId,
 				break;
 			}
 		}
+	case WM_DNS_SD_POSTED:
+		if (messageId == WM_DNS_SD_POSTED)
+		{
+			DNSWindowsEventLoop *e = (DNSWindowsEventLoop *)::GetWindowLongPtr(windowHandle, GWLP_USERDATA);
+			if (e)
+			{
+				std::vector< std::function<void()> > tasks;
+				{
+					std::lock_guard<std::mutex> lock(e->postedLock);
+					tasks.swap(e->posted);
+				}
+				for (auto &task : tasks)
+				{
+					task();
+				}
+				result = 0;
+				break;
+			}
+		}
+	case WM_TIMER:
+		if (messageId == WM_TIMER)
+		{
+			DNSWindowsEventLoop *e = (DNSWindowsEventLoop *)::GetWindowLongPtr(windowHandle, GWLP_USERDATA);
+			if (e)
+			{
+				UINT_PTR id = (UINT_PTR)wParam;
+				KillTimer(windowHandle, id);
+				e->FireTimer(id);
+				result = 0;
+				break;
+			}
+		}
 	default:
 		result = ::DefWindowProc(windowHandle, messageId, wParam, lParam);
 		break;
@@ -61,37 +110,38 @@ LRESULT DNSWindowsEventLoop::OnProcessMessage(HWND windowHandle, UINT messageId,
 	return result;
 }
 
-void DNSWindowsEventLoop::RegisterRef(DNSServiceRef ref)
+bool DNSWindowsEventLoop::CreateMessageWindow()
 {
-	if (!ref)
-		return;
-
 	if (m_hWnd == NULL)
 	{
-		static const wchar_t *sClassName = nullptr;
-		if (!sClassName)
+		HMODULE moduleHandle = nullptr;
+		DWORD flags = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
+		::GetModuleHandleExW(flags, (LPCWSTR)&DNSWindowsEventLoop::OnProcessMessage, &moduleHandle);
+
+		// every loop has a window of its own; the class is shared and may already be registered
+		WNDCLASSEXW settings{};
+		settings.cbSize = sizeof(settings);
+		settings.lpszClassName = L"DNSEventLoopWindow";
+		settings.hInstance = moduleHandle;
+		settings.lpfnWndProc = &DNSWindowsEventLoop::OnProcessMessage;
+		if (::RegisterClassExW(&settings) || ::GetLastError() == ERROR_CLASS_ALREADY_EXISTS)
 		{
-			HMODULE moduleHandle = nullptr;
-			DWORD flags = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
-			::GetModuleHandleExW(flags, (LPCWSTR)sClassName, &moduleHandle);
-
-			WNDCLASSEXW settings{};
-			settings.cbSize = sizeof(settings);
-			settings.lpszClassName = L"DNSEventLoopWindow";
-			settings.hInstance = moduleHandle;
-			settings.lpfnWndProc = &DNSWindowsEventLoop::OnProcessMessage;
-			if (::RegisterClassExW(&settings))
+			m_hWnd = ::CreateWindowExW(0, settings.lpszClassName, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, 0, moduleHandle, 0);
+			if (m_hWnd)
 			{
-				sClassName = settings.lpszClassName;
-				m_hWnd = ::CreateWindowEx(0, sClassName, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, 0, 0, 0);
-				if (m_hWnd)
-				{
-					SetWindowLongPtr(m_hWnd, GWLP_USERDATA, (LONG_PTR)this);
-				}
+				SetWindowLongPtr(m_hWnd, GWLP_USERDATA, (LONG_PTR)this);
 			}
 		}
 	}
-	if (m_hWnd)
+	return m_hWnd != NULL;
+}
+
+void DNSWindowsEventLoop::RegisterRef(DNSServiceRef ref)
+{
+	if (!ref)
+		return;
+
+	if (CreateMessageWindow())
 	{
 		SOCKET sock = DNSServiceRefSockFD(ref);
 		mapping[sock] = ref;
@@ -99,6 +149,55 @@ void DNSWindowsEventLoop::RegisterRef(DNSServiceRef ref)
 	}
 }
 
+TimerHandle DNSWindowsEventLoop::ScheduleTimer(uint32_t milliseconds, const std::function<void()> &callback)
+{
+	if (!CreateMessageWindow())
+		return 0;
+
+	// 0 is never a valid handle
+	TimerHandle timer = ++nextTimer;
+	if (timer == 0)
+		timer = ++nextTimer;
+
+	// WM_TIMER only comes once the queue is otherwise empty, so a steady stream
+	// of messages would hold back a timer that is due right away; those go
+	// with the posted tasks instead, and stay in timers to be cancelled
+	if (milliseconds == 0)
+	{
+		timers[(UINT_PTR)timer] = callback;
+		Post([this, timer]() {
+			FireTimer((UINT_PTR)timer);
+		});
+		return timer;
+	}
+
+	if (!SetTimer(m_hWnd, (UINT_PTR)timer, milliseconds, NULL))
+		return 0;
+
+	timers[(UINT_PTR)timer] = callback;
+	return timer;
+}
+
+void DNSWindowsEventLoop::FireTimer(UINT_PTR id)
+{
+	const auto &it = timers.find(id);
+	if (it != timers.end())
+	{
+		std::function<void()> callback = it->second;
+		timers.erase(it);
+		callback();
+	}
+}
+
+void DNSWindowsEventLoop::CancelTimer(TimerHandle timer)
+{
+	if (!timer || !m_hWnd)
+		return;
+
+	KillTimer(m_hWnd, (UINT_PTR)timer);
+	timers.erase((UINT_PTR)timer);
+}
+
 void DNSWindowsEventLoop::TerminateRef(DNSServiceRef ref)
 {
 	if (!ref)
@@ -112,3 +211,30 @@ void DNSWindowsEventLoop::TerminateRef(DNSServiceRef ref)
 	DNSServiceRefDeallocate(ref);
 }
 
+void DNSWindowsEventLoop::Post(const std::function<void()> &task)
+{
+	{
+		std::lock_guard<std::mutex> lock(postedLock);
+		posted.push_back(task);
+	}
+	PostMessage(m_hWnd, WM_DNS_SD_POSTED, 0, 0);
+}
+
+size_t DNSWindowsEventLoop::Poll(uint32_t maxEvents, uint32_t maxMs)
+{
+	if (!m_hWnd)
+		return 0;
+
+	DWORD start = GetTickCount();
+	size_t ran = 0;
+	MSG msg;
+	while ((maxEvents == 0 || ran < maxEvents)
+		   && (maxMs == 0 || GetTickCount() - start < maxMs)
+		   && PeekMessage(&msg, m_hWnd, 0, 0, PM_REMOVE))
+	{
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+		ran++;
+	}
+	return ran;
+}
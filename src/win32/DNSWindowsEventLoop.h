@@ -2,7 +2,9 @@
 
 #include "DnsWrapper.h"
 #include <windows.h>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 class DNSWindowsEventLoop :
 	public BaseDNSEventLoop
@@ -12,9 +14,21 @@ public:
 	virtual ~DNSWindowsEventLoop();
 	virtual void RegisterRef(DNSServiceRef ref) override;
 	virtual void TerminateRef(DNSServiceRef ref) override;
+	virtual TimerHandle ScheduleTimer(uint32_t milliseconds, const std::function<void()> &callback) override;
+	virtual void CancelTimer(TimerHandle timer) override;
+	virtual void Post(const std::function<void()> &task) override;
+	// pumps the messages of the loop's window, for hosts without a message loop of their own
+	virtual size_t Poll(uint32_t maxEvents, uint32_t maxMs) override;
 private:
 	static LRESULT CALLBACK OnProcessMessage(HWND windowHandle, UINT messageId, WPARAM wParam, LPARAM lParam);
+	bool CreateMessageWindow();
+	// runs and forgets the timer unless it was cancelled
+	void FireTimer(UINT_PTR id);
 	HWND m_hWnd;
 	std::unordered_map<SOCKET, DNSServiceRef> mapping;
+	std::unordered_map<UINT_PTR, std::function<void()> > timers;
+	TimerHandle nextTimer;
+	std::mutex postedLock;
+	std::vector< std::function<void()> > posted;
 };
 
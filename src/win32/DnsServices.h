@@ -0,0 +1,276 @@
+//
+//  DnsServices.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Browser and publisher objects owned by DNSServiceManager. Not part of the
+//  public interface; shared between DnsWrapper.cpp and the trace replayer.
+//
+
+
+#ifndef DnsServices_h
+#define DnsServices_h
+
+#include "DnsWrapper.h"
+#include "DNSHostCache.h"
+#include "DNSProber.h"
+
+#include <dns_sd.h>
+
+#ifdef _WINDOWS
+	#include "DNSWindowsEventLoop.h"
+	typedef DNSWindowsEventLoop PlatformEventLoop;
+#elif defined(ZEROCONF_POLL_LOOP)
+	#include "DNSPollEventLoop.h"
+	typedef DNSPollEventLoop PlatformEventLoop;
+#else
+	#include "DNSMacEventLoop.h"
+	typedef MacEventLoop PlatformEventLoop;
+#endif
+
+
+class ServiceBrowser
+{
+public:
+	typedef ServiceBrowser Self;
+
+	enum InstanceState
+	{
+		kInstanceDiscovered,
+		kInstanceResolving,
+		// resolved, waiting for the reachability probes before it is reported
+		kInstanceProbing,
+		kInstanceResolved,
+		kInstanceLost,
+	};
+
+	// Every instance seen by this browser, from its first add until it is
+	// lost. dns_sd reports an instance once per interface, so it only counts
+	// as lost once every add has been matched by a remove.
+	struct Instance
+	{
+		std::shared_ptr<ServiceInfo> info;
+		InstanceState state;
+		int adds;
+		HostLookupHandle lookup;
+		ProbeHandle probing;
+		// whether "found" went out, and the contentHash() it carried
+		bool reported;
+		uint64_t hash;
+	};
+
+	std::list<Instance> instances;
+
+	std::string type;
+	std::string domain;
+	DSNMessageBusBase *bus;
+	DNSServiceManager *owner;
+
+	DNSServiceRef browserRef;
+
+	// replayed and passive browsers never talk to the daemon, their callbacks
+	// come from a trace or from DNSPassiveListener
+	bool live;
+
+	enum DutyPhase
+	{
+		kDutyActive,
+		kDutyIdle,
+		kDutyPulse,
+	};
+
+	BrowseDuty duty;
+	DutyPhase dutyPhase;
+	TimerHandle dutyTimer;
+	// go back to continuous browsing once the current pulse has reconciled the instances
+	bool wakeAfterPulse;
+
+	BrowseProbe probe;
+
+	bool browse();
+	ServiceBrowser(DSNMessageBusBase *bus, DNSServiceManager *owner);
+	void stop();
+	void wake();
+
+	bool StartBrowsing();
+	void NoteChurn();
+	void EnterActive();
+	void EnterIdle();
+	void BeginPulse();
+	void EndPulse();
+
+	// drops the refs of a dead daemon but keeps the instances
+	void Suspend();
+	// browses again and confirms the kept instances like a pulse does
+	bool Revalidate();
+
+	void HandleBrowse(DNSServiceFlags flags,
+					  uint32_t interfaceIndex,
+					  DNSServiceErrorType errorCode,
+					  const char *serviceName,
+					  const char *regtype,
+					  const char *replyDomain);
+
+	void HandleResolve(ServiceInfo *info,
+					   DNSServiceFlags flags,
+					   uint32_t interfaceIndex,
+					   DNSServiceErrorType errorCode,
+					   const char *hosttarget,
+					   uint16_t port,
+					   uint16_t txtLen,
+					   const unsigned char *txtRecord);
+
+	void HandleAddr(ServiceInfo *info,
+					DNSServiceFlags flags,
+					uint32_t interfaceIndex,
+					DNSServiceErrorType errorCode,
+					const char *hostname,
+					const struct sockaddr *address,
+					uint32_t ttl);
+
+	void HandleResolveDone(ServiceInfo *info, DNSServiceErrorType errorCode);
+
+	// probes the addresses of a resolved instance, then reports it
+	void StartProbe(Instance &instance);
+	// "found" or "updated" for a resolved instance, or the failed resolve
+	void Report(Instance &instance, DNSServiceErrorType errorCode);
+
+	// records the end of a live resolve and reports it
+	void FinishResolve(ServiceInfo *info, DNSServiceErrorType errorCode);
+
+	// instance whose resolve is still running, for the trace replayer
+	ServiceInfo *FindResolving(const char *name, const char *regtype, const char *domain) const;
+
+	Instance *FindInstance(const char *name, const char *regtype, const char *domain);
+	Instance *FindInstance(const ServiceInfo *info);
+	void StartResolve(Instance &instance);
+	void CancelResolve(Instance &instance);
+	void RemoveInstance(const ServiceInfo *info);
+	void LoseInstance(Instance &instance);
+
+	static void DNSSD_API callbackBrowse(DNSServiceRef sdRef,
+								   DNSServiceFlags flags,
+								   uint32_t interfaceIndex,
+								   DNSServiceErrorType errorCode,
+								   const char *serviceName,
+								   const char *regtype,
+								   const char *replyDomain,
+								   void *context
+								   );
+
+
+	static void DNSSD_API callbackResolve(DNSServiceRef sdRef,
+										  DNSServiceFlags flags,
+										  uint32_t interfaceIndex,
+										  DNSServiceErrorType errorCode,
+										  const char *fullname,
+										  const char *hosttarget,
+										  uint16_t port,
+										  uint16_t txtLen,
+										  const unsigned char *txtRecord,
+										  void *context
+										  );
+
+};
+
+class ServicePublisher
+{
+
+public:
+
+	typedef ServicePublisher Self;
+
+	DSNMessageBusBase *bus;
+	ServiceInfo info;
+	DNSServiceManager *owner;
+
+	// "published" went out for the current name, a re-registration under it is not reported again
+	bool announced;
+
+	ServicePublisher(DSNMessageBusBase* bus, DNSServiceManager *owner);
+
+	bool publish();
+	void unpublish();
+
+	static void DNSSD_API callbackRegister(DNSServiceRef sdRef,
+										   DNSServiceFlags flags,
+										   DNSServiceErrorType errorCode,
+										   const char *name,
+										   const char *regtype,
+										   const char *domain,
+										   void *context);
+};
+
+// Resolves one instance whose name is already known, skipping the browse.
+class ServiceResolver
+{
+public:
+	typedef ServiceResolver Self;
+
+	DSNMessageBusBase *bus;
+	ServiceInfo info;
+	DNSServiceManager *owner;
+	uint32_t timeoutMs;
+	TimerHandle timeout;
+	HostLookupHandle lookup;
+
+	ServiceResolver(DSNMessageBusBase *bus, DNSServiceManager *owner);
+
+	bool resolve();
+	void stop();
+
+	// drops the ref of a dead daemon, the timeout keeps running
+	void Suspend();
+	void Restart();
+
+	static void DNSSD_API callbackResolve(DNSServiceRef sdRef,
+										  DNSServiceFlags flags,
+										  uint32_t interfaceIndex,
+										  DNSServiceErrorType errorCode,
+										  const char *fullname,
+										  const char *hosttarget,
+										  uint16_t port,
+										  uint16_t txtLen,
+										  const unsigned char *txtRecord,
+										  void *context
+										  );
+
+private:
+	bool Start();
+	void Finish(DNSServiceErrorType errorCode);
+};
+
+// Private browser sink that filters services natively and completes once
+// enough of them match, so unrelated events never reach Lua.
+class ServiceWaiter : public DSNMessageBusBase
+{
+public:
+	ServiceWaiter(DNSServiceManager *owner, const WaitRequest &request, const WaitCompletion &completion);
+	virtual ~ServiceWaiter();
+
+	bool start();
+	// stops browsing without calling the completion
+	void cancel();
+
+	virtual void Message(const ServiceInfo &srv, int errorCode, const char* phase) override;
+
+	ServiceBrowser *Browser() const { return browser.get(); }
+
+private:
+	bool Matches(const ServiceInfo &info) const;
+	void Finish(int errorCode);
+
+	DNSServiceManager *owner;
+	WaitRequest request;
+	WaitCompletion completion;
+
+	std::shared_ptr<ServiceBrowser> browser;
+	std::vector<ServiceInfo> found;
+	TimerHandle timeout;
+	TimerHandle finish;
+	bool done;
+};
+
+
+#endif /* DnsServices_h */
@@ -7,192 +7,495 @@
 //
 
 #include "DnsWrapper.h"
+#include "DnsServices.h"
+#include "DNSTrace.h"
+#include "DNSTimeline.h"
+#include "DNSHostCache.h"
+#include "DNSShard.h"
+#include "DNSPassive.h"
+#include "DNSProber.h"
+#include "DNSRegistry.h"
+#include "DNSFreshness.h"
+
+#include <cstring>
+#include <stdio.h>
+#include <ctype.h>
+#include <algorithm>
 
 #if _WINDOWS
 	#include <Winsock2.h>
 	#include <ws2ipdef.h>
 	#include <WS2tcpip.h>
 	#pragma comment(lib, "Ws2_32.lib")
-	#pragma comment(lib, "dnssdStatic.lib")
+	#ifndef ZEROCONF_EMBEDDED_MDNS
+		// with the embedded backend DNSEmbedded.cpp provides the dns_sd calls instead
+		#pragma comment(lib, "dnssdStatic.lib")
+	#endif
 #else
 	#include <arpa/inet.h>
 #endif
 
-#include <dns_sd.h>
 
-#ifndef _WINDOWS
 
-class MacEventLoop : public BaseDNSEventLoop
-{
-public:
-	virtual void RegisterRef(DNSServiceRef ref) override
-	{
-		DNSServiceSetDispatchQueue(ref, dispatch_get_main_queue());
-	}
-
-	virtual void TerminateRef(DNSServiceRef ref) override
-	{
-		DNSServiceRefDeallocate(ref);
-	}
-	virtual ~MacEventLoop(){}
-};
 
-typedef MacEventLoop PlatformEventLoop;
+using namespace std;
 
-#else
-#include "DNSWindowsEventLoop.h"
 
-typedef DNSWindowsEventLoop PlatformEventLoop;
+const char *ServiceInfo::kDefaultType = "_corona._tcp";
+const char *ServiceInfo::kDefaultDomain = "local";
 
-#endif
+ServiceAddress ServiceAddress::FromSockaddr(const struct sockaddr *address, uint32_t ttl, uint32_t interfaceIndex)
+{
+	ServiceAddress ret;
+	memset(&ret, 0, sizeof(ret));
+	ret.ttl = ttl;
+	ret.interfaceIndex = interfaceIndex;
+	if(address == nullptr)
+		return ret;
 
+	switch (address->sa_family)
+	{
+		case AF_INET:
+			ret.family = kFamilyIPv4;
+			memcpy(ret.bytes, &(((const sockaddr_in*)address)->sin_addr), 4);
+			break;
+		case AF_INET6:
+			ret.family = kFamilyIPv6;
+			memcpy(ret.bytes, &(((const sockaddr_in6*)address)->sin6_addr), 16);
+			if(((const sockaddr_in6*)address)->sin6_scope_id)
+				ret.interfaceIndex = ((const sockaddr_in6*)address)->sin6_scope_id;
+			break;
+	}
+	return ret;
+}
 
+const char *ServiceAddress::ToString(char *buff) const
+{
+	buff[0] = 0;
+	switch (family)
+	{
+		case kFamilyIPv4:
+			inet_ntop(AF_INET, (void*)bytes, buff, kMaxString);
+			break;
+		case kFamilyIPv6:
+			inet_ntop(AF_INET6, (void*)bytes, buff, kMaxString);
+			break;
+	}
+	return buff;
+}
 
+ServiceInfo::ServiceInfo()
+: port(-1)
+, ref(0)
+, browser(nullptr)
+, publisher(nullptr)
+, storage(1, '\0')
+, garbage(0)
+{
+	Span empty = {0, 0};
+	fType = fName = fDomain = fHostname = fTXT = empty;
+	setType(kDefaultType);
+	setDomain(kDefaultDomain);
+}
 
-using namespace std;
+ServiceInfo::ServiceInfo(const ServiceInfo &other)
+: port(other.port)
+, addresses(other.addresses)
+, interfaces(other.interfaces)
+, ref(other.ref)
+, browser(other.browser)
+, publisher(other.publisher)
+, storage(other.storage)
+, garbage(other.garbage)
+, fType(other.fType)
+, fName(other.fName)
+, fDomain(other.fDomain)
+, fHostname(other.fHostname)
+, fTXT(other.fTXT)
+{
+	if(garbage)
+		compact();
+}
 
-class ServiceBrowser
+ServiceInfo::ServiceInfo(ServiceInfo &&other)
+: port(other.port)
+, addresses(std::move(other.addresses))
+, interfaces(std::move(other.interfaces))
+, ref(other.ref)
+, browser(other.browser)
+, publisher(other.publisher)
+, storage(std::move(other.storage))
+, garbage(other.garbage)
+, fType(other.fType)
+, fName(other.fName)
+, fDomain(other.fDomain)
+, fHostname(other.fHostname)
+, fTXT(other.fTXT)
 {
-public:
-	typedef ServiceBrowser Self;
+	Span empty = {0, 0};
+	other.storage.assign(1, '\0');
+	other.garbage = 0;
+	other.fType = other.fName = other.fDomain = other.fHostname = other.fTXT = empty;
+}
 
-	list< shared_ptr<ServiceInfo> > resolving;
+ServiceInfo &ServiceInfo::operator=(const ServiceInfo &other)
+{
+	if(this != &other)
+	{
+		ServiceInfo copy(other);
+		*this = std::move(copy);
+	}
+	return *this;
+}
 
-	string type;
-	string domain;
-	DSNMessageBusBase *bus;
-	DNSServiceManager *owner;
+ServiceInfo &ServiceInfo::operator=(ServiceInfo &&other)
+{
+	if(this != &other)
+	{
+		port = other.port;
+		addresses = std::move(other.addresses);
+		interfaces = std::move(other.interfaces);
+		ref = other.ref;
+		browser = other.browser;
+		publisher = other.publisher;
+		storage.swap(other.storage);
+		garbage = other.garbage;
+		fType = other.fType;
+		fName = other.fName;
+		fDomain = other.fDomain;
+		fHostname = other.fHostname;
+		fTXT = other.fTXT;
+
+		Span empty = {0, 0};
+		other.storage.assign(1, '\0');
+		other.garbage = 0;
+		other.fType = other.fName = other.fDomain = other.fHostname = other.fTXT = empty;
+	}
+	return *this;
+}
 
-	DNSServiceRef browserRef;
+void ServiceInfo::set(Span &span, const char *value)
+{
+	size_t len = value ? strlen(value) : 0;
 
-	bool browse();
-	ServiceBrowser(DSNMessageBusBase *bus, DNSServiceManager *owner);
-	void stop();
+	// value may point into our own buffer, which appending could reallocate
+	if(len && value >= storage.data() && value < storage.data() + storage.size())
+	{
+		string copy(value, len);
+		set(span, copy.c_str());
+		return;
+	}
 
-	static void DNSSD_API callbackBrowse(DNSServiceRef sdRef,
-								   DNSServiceFlags flags,
-								   uint32_t interfaceIndex,
-								   DNSServiceErrorType errorCode,
-								   const char *serviceName,
-								   const char *regtype,
-								   const char *replyDomain,
-								   void *context
-								   );
+	if(len <= span.length && span.length)
+	{
+		memcpy(&storage[span.offset], value, len);
+		storage[span.offset + len] = '\0';
+		garbage += span.length - len;
+		span.length = (uint32_t)len;
+		return;
+	}
 
+	if(span.length)
+		garbage += span.length + 1;
 
-	static void DNSSD_API callbackResolve(DNSServiceRef sdRef,
-										  DNSServiceFlags flags,
-										  uint32_t interfaceIndex,
-										  DNSServiceErrorType errorCode,
-										  const char *fullname,
-										  const char *hosttarget,
-										  uint16_t port,
-										  uint16_t txtLen,
-										  const unsigned char *txtRecord,
-										  void *context
-										  );
+	if(len == 0)
+	{
+		span.offset = 0;
+		span.length = 0;
+		return;
+	}
 
-	static void DNSSD_API callbackAddr(DNSServiceRef sdRef,
-									   DNSServiceFlags flags,
-									   uint32_t interfaceIndex,
-									   DNSServiceErrorType errorCode,
-									   const char *hostname,
-									   const struct sockaddr *address,
-									   uint32_t ttl,
-									   void *context
-									   );
+	span.offset = (uint32_t)storage.size();
+	span.length = (uint32_t)len;
+	storage.append(value, len);
+	storage.push_back('\0');
 
-};
+	if(garbage > storage.size() / 2)
+		compact();
+}
 
-class ServicePublisher
+void ServiceInfo::setTXT(const char *bytes, size_t len)
 {
+	garbage += fTXT.length;
+	fTXT.offset = 0;
+	fTXT.length = 0;
+	if(len == 0)
+		return;
 
-public:
+	if(bytes >= storage.data() && bytes < storage.data() + storage.size())
+	{
+		string copy(bytes, len);
+		setTXT(copy.data(), len);
+		return;
+	}
 
-	typedef ServicePublisher Self;
+	fTXT.offset = (uint32_t)storage.size();
+	fTXT.length = (uint32_t)len;
+	storage.append(bytes, len);
 
-	DSNMessageBusBase *bus;
-	ServiceInfo info;
-	DNSServiceManager *owner;
+	if(garbage > storage.size() / 2)
+		compact();
+}
 
-	ServicePublisher(DSNMessageBusBase* bus, DNSServiceManager *owner);
+void ServiceInfo::compact()
+{
+	string packed;
+	packed.reserve(storage.size() - garbage);
+	packed.push_back('\0');
 
-	bool publish();
-	void unpublish();
+	Span *strings[] = { &fType, &fName, &fDomain, &fHostname };
+	for(Span *span : strings)
+	{
+		if(span->length == 0)
+			continue;
+		uint32_t offset = (uint32_t)packed.size();
+		packed.append(storage, span->offset, span->length);
+		packed.push_back('\0');
+		span->offset = offset;
+	}
+	if(fTXT.length)
+	{
+		uint32_t offset = (uint32_t)packed.size();
+		packed.append(storage, fTXT.offset, fTXT.length);
+		fTXT.offset = offset;
+	}
 
-	static void DNSSD_API callbackRegister(DNSServiceRef sdRef,
-										   DNSServiceFlags flags,
-										   DNSServiceErrorType errorCode,
-										   const char *name,
-										   const char *regtype,
-										   const char *domain,
-										   void *context);
-};
+	storage.swap(packed);
+	garbage = 0;
+}
 
+bool ServiceInfo::sameInstance(const char *instanceName, const char *instanceType, const char *instanceDomain) const
+{
+	return strcmp(name(), instanceName ? instanceName : "") == 0
+		&& strcmp(type(), instanceType ? instanceType : "") == 0
+		&& strcmp(domain(), instanceDomain ? instanceDomain : "") == 0;
+}
 
-const char *ServiceInfo::kDefaultType = "_corona._tcp";
-const char *ServiceInfo::kDefaultDomain = "local";
+void ServiceInfo::addInterface(uint32_t index)
+{
+	if(index == 0)
+		return;
+	for(auto known : interfaces)
+	{
+		if(known == index)
+			return;
+	}
+	interfaces.push_back(index);
+}
 
-ServiceInfo::ServiceInfo()
-: port(-1)
-, ref(0)
-, domain(kDefaultDomain)
-, type(kDefaultType)
-, browser(nullptr)
-, publisher(nullptr)
+namespace
 {
+	const uint64_t kFNVOffset = 14695981039346656037ull;
+	const uint64_t kFNVPrime = 1099511628211ull;
+
+	uint64_t HashBytes(uint64_t hash, const void *bytes, size_t len)
+	{
+		const uint8_t *p = (const uint8_t*)bytes;
+		for(size_t i = 0; i < len; i++)
+		{
+			hash ^= p[i];
+			hash *= kFNVPrime;
+		}
+		return hash;
+	}
 
+	// lower case, without the trailing dot of a fully qualified name, and terminated
+	uint64_t HashName(uint64_t hash, const char *str, size_t len)
+	{
+		if(len && str[len - 1] == '.')
+			len--;
+		for(size_t i = 0; i < len; i++)
+		{
+			hash ^= (uint8_t)tolower((unsigned char)str[i]);
+			hash *= kFNVPrime;
+		}
+		return HashBytes(hash, "", 1);
+	}
 }
 
+uint64_t ServiceInfo::instanceId() const
+{
+	uint64_t hash = kFNVOffset;
+	hash = HashName(hash, name(), nameLength());
+	hash = HashName(hash, type(), typeLength());
+	hash = HashName(hash, domain(), domainLength());
+	return hash;
+}
 
-void ServiceInfo::setData(const char *key, const char *value)
+uint64_t ServiceInfo::contentHash() const
 {
-	if(strlen(key) > 0)
+	uint64_t hash = kFNVOffset;
+	int32_t p = port;
+	hash = HashBytes(hash, &p, sizeof(p));
+	hash = HashName(hash, hostname(), hostnameLength());
+
+	AddressList sorted(addresses);
+	std::sort(sorted.begin(), sorted.end(), [](const ServiceAddress &a, const ServiceAddress &b) {
+		if(a.family != b.family)
+			return a.family < b.family;
+		return memcmp(a.bytes, b.bytes, sizeof(a.bytes)) < 0;
+	});
+	for(const auto &addr : sorted)
 	{
-		data[key] = value;
+		hash = HashBytes(hash, &addr.family, 1);
+		hash = HashBytes(hash, addr.bytes, addr.Length());
+		// an address that became reachable or stopped being so is news, its RTT is not
+		hash = HashBytes(hash, &addr.reachability, 1);
 	}
+
+	hash = HashBytes(hash, txtBytes(), txtLength());
+	return hash;
 }
 
-vector<uint8_t> ServiceInfo::TXTData() const
+bool ServiceInfo::setData(const char *key, const char *value)
+{
+	return setData(key, value, strlen(value));
+}
+
+bool ServiceInfo::setData(const char *key, const char *value, size_t valueLen)
 {
+	size_t keyLen = strlen(key);
+	if(keyLen == 0 || keyLen >= 255)
+		return false;
 
-	vector<uint8_t> ret;
-	if (data.size() > 0)
+	// rebuild the record without the previous value of this key
+	string txt;
+	txt.reserve(fTXT.length + keyLen + valueLen + 2);
+	forEachData([&](const char *k, size_t kLen, const char *v, size_t vLen) {
+		size_t baseLen;
+		if(kLen == keyLen && memcmp(k, key, keyLen) == 0)
+			return;
+		if(isContinuation(k, kLen, &baseLen) && baseLen == keyLen && memcmp(k, key, keyLen) == 0)
+			return;
+		size_t l = vLen ? kLen + 1 + vLen : kLen;
+		txt.push_back((char)l);
+		txt.append(k, kLen);
+		if(vLen)
+		{
+			txt.push_back('=');
+			txt.append(v, vLen);
+		}
+	});
+
+	if(valueLen == 0)
 	{
+		txt.push_back((char)keyLen);
+		txt.append(key, keyLen);
+	}
+
+	// each string holds as much of the value as fits after its key
+	string chunkKey(key, keyLen);
+	for(unsigned index = 1; valueLen > 0; index++)
+	{
+		// a key this long leaves no room for the value, and nothing is stored rather than part of it
+		if(chunkKey.size() + 1 >= 255)
+			return false;
+		size_t chunk = min(valueLen, 255 - chunkKey.size() - 1);
+		txt.push_back((char)(chunkKey.size() + 1 + chunk));
+		txt += chunkKey;
+		txt.push_back('=');
+		txt.append(value, chunk);
+		value += chunk;
+		valueLen -= chunk;
+
+		char suffix[16];
+		sprintf(suffix, "*%u", index);
+		chunkKey.assign(key, keyLen);
+		chunkKey += suffix;
+	}
 
-		int txtLen = 0;
-		for(const auto &k: data)
-			txtLen += k.first.length() + k.second.size() + 2;
+	if(txt.size() > kMaxTXTLength)
+		return false;
 
-		ret.reserve(txtLen);
+	setTXT(txt.data(), txt.size());
+	return true;
+}
 
-		for(const auto &k: data)
+bool ServiceInfo::getData(const char *key, const char **value, size_t *valueLength) const
+{
+	size_t keyLen = strlen(key);
+	bool found = false;
+	forEachData([&](const char *k, size_t kLen, const char *v, size_t vLen) {
+		if(kLen == keyLen && memcmp(k, key, keyLen) == 0)
 		{
-			if(k.second.length()>0)
-			{
-				size_t l = k.first.length() + 1 + k.second.length();
-				if (l>=255)
-					continue;
+			*value = v;
+			*valueLength = vLen;
+			found = true;
+		}
+	});
+	return found;
+}
 
-				ret.push_back(l);
+bool ServiceInfo::getValue(const char *key, string &value) const
+{
+	const char *v;
+	size_t vLen;
+	if(!getData(key, &v, &vLen))
+		return false;
+	if(!joinValue(key, strlen(key), v, vLen, value))
+		value.assign(v, vLen);
+	return true;
+}
 
-				copy(k.first.c_str(), k.first.c_str()+k.first.length(), back_inserter(ret));
+bool ServiceInfo::isContinuation(const char *key, size_t keyLength, size_t *baseLength)
+{
+	size_t c = keyLength;
+	while(c > 0 && key[c - 1] >= '0' && key[c - 1] <= '9')
+		c--;
+	if(c == keyLength || c < 2 || key[c - 1] != '*' || key[c] == '0')
+		return false;
+	*baseLength = c - 1;
+	return true;
+}
 
-				ret.push_back('=');
+bool ServiceInfo::hasKey(const char *key, size_t keyLength) const
+{
+	bool found = false;
+	forEachData([&](const char *k, size_t kLen, const char *, size_t) {
+		if(kLen == keyLength && memcmp(k, key, keyLength) == 0)
+			found = true;
+	});
+	return found;
+}
 
-				copy(k.second.c_str(), k.second.c_str()+k.second.length(), back_inserter(ret));
-			}
-			else
-			{
-				size_t l = k.first.length();
-				if (l>=255)
-					continue;
+bool ServiceInfo::joinValue(const char *key, size_t keyLength, const char *value, size_t valueLength, string &joined) const
+{
+	string chunkKey;
+	bool continued = false;
+	for(unsigned index = 1; ; index++)
+	{
+		char suffix[16];
+		sprintf(suffix, "*%u", index);
+		chunkKey.assign(key, keyLength);
+		chunkKey += suffix;
+
+		const char *chunk;
+		size_t chunkLength;
+		if(!getData(chunkKey.c_str(), &chunk, &chunkLength))
+			return continued;
+
+		if(!continued)
+			joined.assign(value, valueLength);
+		continued = true;
+		joined.append(chunk, chunkLength);
+	}
+}
 
-				ret.push_back(l);
+size_t ServiceInfo::dataCount() const
+{
+	size_t count = 0;
+	forEachData([&count](const char *, size_t, const char *, size_t) {
+		count++;
+	});
+	return count;
+}
 
-				copy(k.first.c_str(), k.first.c_str()+k.first.length(), back_inserter(ret));
-			}
-		}
+vector<uint8_t> ServiceInfo::TXTData() const
+{
+	vector<uint8_t> ret;
+	if (fTXT.length > 0)
+	{
+		ret.assign(txtBytes(), txtBytes() + txtLength());
 	}
 	else
 	{
@@ -203,34 +506,13 @@ vector<uint8_t> ServiceInfo::TXTData() const
 
 void ServiceInfo::ReadTXT(const unsigned char *sz, int len)
 {
-	data.empty();
-	if( sz == nullptr || len == 0 )
-		return;
-
-	int c = 0;
-	while(c<len)
+	if( sz == nullptr || len <= 0 )
 	{
-		int pairLen = sz[c];
-		c+=1;
-		if (pairLen > 0 && len>=c+pairLen)
-		{
-			string pair(sz+c, sz+c+pairLen);
-
-			string::size_type pos = pair.find('=');
-			if(pos != pair.npos)
-			{
-				string key = pair.substr(0, pos);
-				string val = pair.substr(pos+1);
-				data[key] = val;
-			}
-			else
-			{
-				data[pair] = "";
-			}
-
-			c+=pairLen;
-		}
+		setTXT(nullptr, 0);
+		return;
 	}
+
+	setTXT((const char*)sz, len);
 }
 
 
@@ -238,6 +520,7 @@ void ServiceInfo::ReadTXT(const unsigned char *sz, int len)
 ServicePublisher::ServicePublisher(DSNMessageBusBase *bus, DNSServiceManager *owner)
 : bus(bus)
 , owner(owner)
+, announced(false)
 {
 
 }
@@ -246,18 +529,23 @@ ServicePublisher::ServicePublisher(DSNMessageBusBase *bus, DNSServiceManager *ow
 bool ServicePublisher::publish()
 {
 	const char* cName = NULL;
-	if(!info.name.empty())
-		cName = info.name.c_str();
+	if(info.nameLength())
+		cName = info.name();
 
 	const char* cDomain = NULL;
-	if(!info.domain.empty())
-		cDomain = info.domain.c_str();
+	if(info.domainLength())
+		cDomain = info.domain();
 
-	vector<uint8_t> data = info.TXTData();
+	static const uint8_t kEmptyTXT = 0;
+	const uint8_t *txt = info.txtLength() ? info.txtBytes() : &kEmptyTXT;
+	uint16_t txtLen = info.txtLength() ? (uint16_t)info.txtLength() : 1;
 
 	info.publisher = this;
 
-	DNSServiceErrorType ret = DNSServiceRegister(&info.ref, 0, 0, cName, info.type.c_str(), cDomain, 0, info.port, data.size(), data.data(), &Self::callbackRegister, this);
+	// setData() never grows a record this far, but a truncated length would register garbage
+	DNSServiceErrorType ret = kDNSServiceErr_BadParam;
+	if(info.txtLength() <= ServiceInfo::kMaxTXTLength)
+		ret = DNSServiceRegister(&info.ref, 0, 0, cName, info.type(), cDomain, 0, info.port, txtLen, txt, &Self::callbackRegister, this);
 
 	if(ret == kDNSServiceErr_NoError)
 	{
@@ -274,6 +562,7 @@ bool ServicePublisher::publish()
 void ServicePublisher::unpublish()
 {
 	owner->EventLoop().TerminateRef(info.ref);
+	info.ref = 0;
 }
 
 void DNSSD_API ServicePublisher::callbackRegister(DNSServiceRef sdRef,
@@ -285,9 +574,20 @@ void DNSSD_API ServicePublisher::callbackRegister(DNSServiceRef sdRef,
 												  void *context)
 {
 	Self *t = (Self*)context;
+	if(errorCode == kDNSServiceErr_ServiceNotRunning && t->owner)
+	{
+		t->owner->daemonLost();
+		return;
+	}
+
+	// registered again after a daemon restart, and still under the same name
+	bool unchanged = t->announced && errorCode == kDNSServiceErr_NoError && name && strcmp(t->info.name(), name) == 0;
+
 	if(name)
-		t->info.name = name;
-	if(t->bus)
+		t->info.setName(name);
+	if(errorCode == kDNSServiceErr_NoError)
+		t->announced = true;
+	if(t->bus && !unchanged)
 		t->bus->Message(t->info, errorCode, "published");
 
 	if(errorCode != kDNSServiceErr_NoError && t->owner)
@@ -304,11 +604,29 @@ ServiceBrowser::ServiceBrowser(DSNMessageBusBase* bus, DNSServiceManager *owner)
 , browserRef(0)
 , bus(bus)
 , owner(owner)
+, live(true)
+, dutyPhase(kDutyActive)
+, dutyTimer(0)
+, wakeAfterPulse(false)
 {
 
 }
 
 bool ServiceBrowser::browse()
+{
+	if(!StartBrowsing())
+		return false;
+
+	if(owner->Recorder())
+		owner->Recorder()->RecordBrowseStart(this, type.c_str(), domain.c_str(), bus != owner->Bus());
+
+	if(duty.enabled && live)
+		EnterActive();
+
+	return true;
+}
+
+bool ServiceBrowser::StartBrowsing()
 {
 	const char* cDomain = NULL;
 	if(!domain.empty())
@@ -326,177 +644,934 @@ bool ServiceBrowser::browse()
 
 void ServiceBrowser::stop()
 {
-	for(auto &info : resolving)
+	if(live && owner->Recorder())
+		owner->Recorder()->RecordBrowseStop(this);
+
+	owner->EventLoop().CancelTimer(dutyTimer);
+	dutyTimer = 0;
+	if(dutyPhase == kDutyIdle)
+		DNS_TIMELINE_ASYNC_END("browse idle", this);
+
+	for(auto &instance : instances)
 	{
-		owner->EventLoop().TerminateRef(info->ref);
+		CancelResolve(instance);
 	}
-	resolving.clear();
+	instances.clear();
+	owner->Freshness().ForgetBrowser(this);
 
 	owner->EventLoop().TerminateRef(browserRef);
+	browserRef = 0;
 }
 
-void ServiceBrowser::callbackBrowse(DNSServiceRef sdRef,
-									DNSServiceFlags flags,
-									uint32_t interfaceIndex,
-									DNSServiceErrorType errorCode,
-									const char *serviceName,
-									const char *regtype,
-									const char *replyDomain,
-									void *context
-									)
+void ServiceBrowser::wake()
 {
+	if(!duty.enabled || !live)
+		return;
 
-	Self *browser = (ServiceBrowser*)context;
-	shared_ptr<ServiceInfo> toResolve = make_shared<ServiceInfo>();
+	switch(dutyPhase)
+	{
+		case kDutyIdle:
+			owner->EventLoop().CancelTimer(dutyTimer);
+			dutyTimer = 0;
+			wakeAfterPulse = true;
+			BeginPulse();
+			break;
+		case kDutyPulse:
+			wakeAfterPulse = true;
+			break;
+		case kDutyActive:
+			EnterActive();
+			break;
+	}
+}
 
-	if(serviceName)
-		toResolve->name = serviceName;
-	if(regtype)
-		toResolve->type = regtype;
-	if(replyDomain)
-		toResolve->domain = replyDomain;
+void ServiceBrowser::NoteChurn()
+{
+	if(!duty.enabled || !live)
+		return;
 
-	toResolve->browser = browser;
+	// a pulse still has to finish reconciling before browsing continuously
+	if(dutyPhase == kDutyPulse)
+		wakeAfterPulse = true;
+	else if(dutyPhase == kDutyActive)
+		EnterActive();
+}
 
-	if (errorCode!=kDNSServiceErr_NoError)
-	{
-		if(browser->bus)
-			browser->bus->Message(*toResolve, errorCode, "browseError");
-		if(browser->owner)
-			browser->owner->browseFailed(browser);
-	}
-	else
-		if(flags & kDNSServiceFlagsAdd)
-		{
-			DNSServiceErrorType ret = DNSServiceResolve(&toResolve->ref, 0, 0, serviceName, regtype, replyDomain, &Self::callbackResolve, toResolve.get());
+void ServiceBrowser::EnterActive()
+{
+	dutyPhase = kDutyActive;
+	owner->EventLoop().CancelTimer(dutyTimer);
+	dutyTimer = owner->EventLoop().ScheduleTimer(duty.stableMs, [this](){
+		dutyTimer = 0;
+		EnterIdle();
+	});
+}
 
-			if(ret == kDNSServiceErr_NoError)
-			{
-				browser->resolving.push_back(toResolve);
-				browser->owner->EventLoop().RegisterRef(toResolve->ref);
-			}
-		}
-		else
-		{
-			if(browser->bus)
-				browser->bus->Message(*toResolve, errorCode, "lost");
-		}
+void ServiceBrowser::EnterIdle()
+{
+	// instances are kept, and resolves already running are left to finish
+	owner->EventLoop().TerminateRef(browserRef);
+	browserRef = 0;
+
+	DNS_TIMELINE_ASYNC_BEGIN("browse idle", this);
+	dutyPhase = kDutyIdle;
+	dutyTimer = owner->EventLoop().ScheduleTimer(duty.intervalMs, [this](){
+		dutyTimer = 0;
+		BeginPulse();
+	});
 }
 
-void DNSSD_API ServiceBrowser::callbackResolve(DNSServiceRef sdRef,
-											   DNSServiceFlags flags,
-											   uint32_t interfaceIndex,
-											   DNSServiceErrorType errorCode,
-											   const char *fullname,
-											   const char *hosttarget,
-											   uint16_t port,
-											   uint16_t txtLen,
-											   const unsigned char *txtRecord,
-											   void *context
-											   )
+void ServiceBrowser::BeginPulse()
 {
-	ServiceInfo *info = (ServiceInfo*)context;
-	ServiceBrowser *browser = (ServiceBrowser*)info->browser;
-	info->ReadTXT(txtRecord, txtLen);
-	info->hostname = hosttarget;
-	info->port = port;
+	DNS_TIMELINE_ASYNC_END("browse idle", this);
 
-	if(errorCode == kDNSServiceErr_NoError)
+	// A new browse announces every instance again. Whatever stays silent
+	// until the end of the pulse disappeared while the browser was idle.
+	for(auto &instance : instances)
 	{
-		DNSServiceRef addRef = 0;
-		DNSServiceGetAddrInfo(&addRef, 0, 0, 0, hosttarget, &Self::callbackAddr, info);
-
-		int sock = DNSServiceRefSockFD(addRef);
-		fd_set read_set;
-		FD_ZERO(&read_set);
-		FD_SET(sock, &read_set);
-		timeval ti = {0,500000};
-		int r = select(sock+1, &read_set, 0, 0, &ti);
-		if(r>0) {
-			DNSServiceProcessResult(addRef);
-		}
-		DNSServiceRefDeallocate(addRef);
+		instance.adds = 0;
 	}
 
-	if(browser && browser->bus)
-	{
-		browser->bus->Message(*info, errorCode, "found");
-	}
-	if(browser)
-	{
-		browser->owner->EventLoop().TerminateRef(info->ref);
-	}
-	info->ref = 0;
-	if(browser)
+	dutyPhase = kDutyPulse;
+	if(!StartBrowsing())
 	{
-		browser->resolving.remove_if([info](shared_ptr<ServiceInfo> &i){
-			return i.get()==info;
-		});
+		EnterIdle();
+		return;
 	}
+
+	dutyTimer = owner->EventLoop().ScheduleTimer(duty.pulseMs, [this](){
+		dutyTimer = 0;
+		EndPulse();
+	});
 }
 
-void DNSSD_API ServiceBrowser::callbackAddr(DNSServiceRef sdRef,
-								   DNSServiceFlags flags,
-								   uint32_t interfaceIndex,
-								   DNSServiceErrorType errorCode,
-								   const char *hostname,
-								   const struct sockaddr *address,
-								   uint32_t ttl,
-								   void *context
-								   )
+void ServiceBrowser::EndPulse()
 {
-	ServiceInfo *info = (ServiceInfo*)context;
-//	char host[NI_MAXHOST], serv[NI_MAXSERV];
-//	if(0==getnameinfo(address, 0, host, NI_MAXHOST, serv, NI_MAXSERV, 0)) {
-//		info->addresses.push_back(host);
-//	}
-	char buff[70];
-	switch (address->sa_family)
+	vector< shared_ptr<ServiceInfo> > silent;
+	for(auto &instance : instances)
 	{
-		case AF_INET:
-			inet_ntop(AF_INET, &(((sockaddr_in*)address)->sin_addr), buff, 70);
-			break;
-		case AF_INET6:
-			inet_ntop(AF_INET6, &(((sockaddr_in6*)address)->sin6_addr), buff, INET6_ADDRSTRLEN);
-			break;
-		default:
-			buff[0] = 0;
+		if(instance.adds == 0)
+			silent.push_back(instance.info);
 	}
-	if(buff[0])
+
+	if(!silent.empty())
+		wakeAfterPulse = true;
+
+	bool stayActive = wakeAfterPulse;
+	wakeAfterPulse = false;
+	if(!duty.enabled)
+		dutyPhase = kDutyActive;
+	else if(stayActive)
+		EnterActive();
+	else
+		EnterIdle();
+
+	for(auto &info : silent)
 	{
-		info->addresses.push_back(buff);
+		Instance *instance = FindInstance(info.get());
+		if(instance)
+			LoseInstance(*instance);
 	}
-
+}
+
+void ServiceBrowser::Suspend()
+{
+	owner->EventLoop().CancelTimer(dutyTimer);
+	dutyTimer = 0;
+	if(dutyPhase == kDutyIdle)
+		DNS_TIMELINE_ASYNC_END("browse idle", this);
+
+	// resolving instances stay in that state and are resolved again by Revalidate()
+	for(auto &instance : instances)
+	{
+		CancelResolve(instance);
+	}
+
+	owner->EventLoop().TerminateRef(browserRef);
+	browserRef = 0;
+}
+
+bool ServiceBrowser::Revalidate()
+{
+	// The restarted daemon announces every instance again, so the restart is
+	// handled like a pulse: whatever stays silent for pulseMs is lost.
+	vector< shared_ptr<ServiceInfo> > pending;
+	for(auto &instance : instances)
+	{
+		instance.adds = 0;
+		if(instance.state == kInstanceResolving)
+			pending.push_back(instance.info);
+	}
+
+	dutyPhase = kDutyPulse;
+	wakeAfterPulse = false;
+	if(!StartBrowsing())
+		return false;
+
+	dutyTimer = owner->EventLoop().ScheduleTimer(duty.pulseMs, [this](){
+		dutyTimer = 0;
+		EndPulse();
+	});
+
+	for(auto &info : pending)
+	{
+		Instance *instance = FindInstance(info.get());
+		if(instance == nullptr)
+			continue;
+		info->addresses.clear();
+		info->port = -1;
+		StartResolve(*instance);
+	}
+	return true;
+}
+
+ServiceInfo *ServiceBrowser::FindResolving(const char *name, const char *regtype, const char *replyDomain) const
+{
+	for(const auto &instance : instances)
+	{
+		if(instance.state == kInstanceResolving && instance.info->sameInstance(name, regtype, replyDomain))
+			return instance.info.get();
+	}
+	return nullptr;
+}
+
+ServiceBrowser::Instance *ServiceBrowser::FindInstance(const char *name, const char *regtype, const char *replyDomain)
+{
+	for(auto &instance : instances)
+	{
+		if(instance.info->sameInstance(name, regtype, replyDomain))
+			return &instance;
+	}
+	return nullptr;
+}
+
+ServiceBrowser::Instance *ServiceBrowser::FindInstance(const ServiceInfo *info)
+{
+	for(auto &instance : instances)
+	{
+		if(instance.info.get() == info)
+			return &instance;
+	}
+	return nullptr;
+}
+
+void ServiceBrowser::RemoveInstance(const ServiceInfo *info)
+{
+	instances.remove_if([info](const Instance &i){
+		return i.info.get()==info;
+	});
+}
+
+void ServiceBrowser::StartResolve(Instance &instance)
+{
+	ServiceInfo *info = instance.info.get();
+
+	if(live)
+	{
+		DNSServiceErrorType ret = DNSServiceResolve(&info->ref, 0, 0, info->name(), info->type(), info->domain(), &Self::callbackResolve, info);
+		if(ret != kDNSServiceErr_NoError)
+		{
+			RemoveInstance(info);
+			return;
+		}
+		owner->EventLoop().RegisterRef(info->ref);
+	}
+
+	DNS_TIMELINE_ASYNC_BEGIN("instance", info);
+	DNS_TIMELINE_ASYNC_BEGIN("resolve", info);
+	instance.state = kInstanceResolving;
+}
+
+void ServiceBrowser::CancelResolve(Instance &instance)
+{
+	ServiceInfo *info = instance.info.get();
+
+	if(instance.state == kInstanceResolving)
+	{
+		// port is only set once the resolve has answered
+		if(info->port == -1)
+			DNS_TIMELINE_ASYNC_END("resolve", info);
+		DNS_TIMELINE_ASYNC_END("instance", info);
+	}
+	else if(instance.state == kInstanceProbing)
+	{
+		DNS_TIMELINE_ASYNC_END("probe", info);
+		DNS_TIMELINE_ASYNC_END("instance", info);
+		// nothing went out for this resolve yet, so it counts as still resolving
+		instance.state = kInstanceResolving;
+	}
+
+	owner->HostCache().Cancel(instance.lookup);
+	instance.lookup = 0;
+	if(instance.probing)
+		owner->Prober().Cancel(instance.probing);
+	instance.probing = 0;
+	owner->EventLoop().TerminateRef(info->ref);
+	info->ref = 0;
+}
+
+void ServiceBrowser::HandleBrowse(DNSServiceFlags flags,
+								  uint32_t interfaceIndex,
+								  DNSServiceErrorType errorCode,
+								  const char *serviceName,
+								  const char *regtype,
+								  const char *replyDomain)
+{
+	if(errorCode == kDNSServiceErr_ServiceNotRunning && live)
+	{
+		owner->daemonLost();
+		return;
+	}
+
+	if (errorCode!=kDNSServiceErr_NoError)
+	{
+		ServiceInfo failed;
+		if(serviceName)
+			failed.setName(serviceName);
+		if(regtype)
+			failed.setType(regtype);
+		if(replyDomain)
+			failed.setDomain(replyDomain);
+		failed.browser = this;
+
+		if(bus)
+			bus->Message(failed, errorCode, "browseError");
+		if(owner)
+			owner->browseFailed(this);
+		return;
+	}
+
+	Instance *instance = FindInstance(serviceName, regtype, replyDomain);
+
+	if(flags & kDNSServiceFlagsAdd)
+	{
+		if(instance)
+		{
+			// another interface, or back before it was lost for good; whatever
+			// is in flight still holds
+			instance->adds++;
+			instance->info->addInterface(interfaceIndex);
+			owner->Freshness().Touch(instance->info->instanceId());
+
+			// A re-announcement of something already reported may carry new
+			// details, so it is resolved again and only reported if it changed.
+			// Pulses of a duty cycled browser just confirm what is known.
+			if(instance->state == kInstanceResolved && dutyPhase != kDutyPulse)
+			{
+				instance->info->addresses.clear();
+				instance->info->port = -1;
+				StartResolve(*instance);
+			}
+			return;
+		}
+
+		Instance added;
+		added.info = make_shared<ServiceInfo>();
+		if(serviceName)
+			added.info->setName(serviceName);
+		if(regtype)
+			added.info->setType(regtype);
+		if(replyDomain)
+			added.info->setDomain(replyDomain);
+		added.info->browser = this;
+		added.info->addInterface(interfaceIndex);
+		added.state = kInstanceDiscovered;
+		added.adds = 1;
+		added.lookup = 0;
+		added.probing = 0;
+		added.reported = false;
+		added.hash = 0;
+
+		instances.push_back(added);
+		NoteChurn();
+		StartResolve(instances.back());
+	}
+	else
+	{
+		if(instance == nullptr || --instance->adds > 0)
+			return;
+
+		NoteChurn();
+		LoseInstance(*instance);
+	}
+}
+
+void ServiceBrowser::LoseInstance(Instance &instance)
+{
+	// only instances that went out as "found" are reported lost, pending
+	// work for the others is dropped silently
+	bool reported = instance.reported;
+	CancelResolve(instance);
+	instance.state = kInstanceLost;
+
+	shared_ptr<ServiceInfo> info = instance.info;
+	RemoveInstance(info.get());
+
+	if(reported)
+		owner->Freshness().Forget(*info);
+	if(reported && bus)
+		bus->Message(*info, kDNSServiceErr_NoError, "lost");
+}
+
+void ServiceBrowser::HandleResolve(ServiceInfo *info,
+								   DNSServiceFlags flags,
+								   uint32_t interfaceIndex,
+								   DNSServiceErrorType errorCode,
+								   const char *hosttarget,
+								   uint16_t port,
+								   uint16_t txtLen,
+								   const unsigned char *txtRecord)
+{
+	// repeated answers while the addresses are being looked up change nothing
+	Instance *instance = FindInstance(info);
+	if(instance == nullptr || instance->state != kInstanceResolving || instance->lookup)
+		return;
+
+	DNS_TIMELINE_ASYNC_END("resolve", info);
+
+	info->ReadTXT(txtRecord, txtLen);
+	info->setHostname(hosttarget);
+	info->port = port;
+	info->addInterface(interfaceIndex);
+
+	if(errorCode == kDNSServiceErr_NoError && live)
+	{
+		HostLookupHandle lookup = owner->HostCache().Lookup(hosttarget, [this, info](const AddressList &addresses){
+			Instance *instance = FindInstance(info);
+			if(instance)
+				instance->lookup = 0;
+
+			DNSTraceRecorder *recorder = owner->Recorder();
+			for(const auto &addr : addresses)
+			{
+				if(recorder)
+					recorder->RecordAddr(this, *info, info->hostname(), addr);
+				info->addresses.push_back(addr);
+			}
+			FinishResolve(info, kDNSServiceErr_NoError);
+		});
+
+		// 0 means the cache answered right away and the instance is resolved already
+		if(lookup)
+			instance->lookup = lookup;
+	}
+}
+
+void ServiceBrowser::HandleAddr(ServiceInfo *info,
+								DNSServiceFlags flags,
+								uint32_t interfaceIndex,
+								DNSServiceErrorType errorCode,
+								const char *hostname,
+								const struct sockaddr *address,
+								uint32_t ttl)
+{
+	ServiceAddress addr = ServiceAddress::FromSockaddr(address, ttl, interfaceIndex);
+	if(addr.family)
+	{
+		info->addresses.push_back(addr);
+	}
+}
+
+void ServiceBrowser::HandleResolveDone(ServiceInfo *info, DNSServiceErrorType errorCode)
+{
+	Instance *instance = FindInstance(info);
+	if(instance == nullptr || instance->state != kInstanceResolving)
+		return;
+
+	owner->HostCache().Cancel(instance->lookup);
+	instance->lookup = 0;
+	owner->EventLoop().TerminateRef(info->ref);
+	info->ref = 0;
+
+	if(errorCode == kDNSServiceErr_NoError && probe.enabled && !info->addresses.empty())
+	{
+		StartProbe(*instance);
+		return;
+	}
+
+	DNS_TIMELINE_ASYNC_END("instance", info);
+	Report(*instance, errorCode);
+}
+
+void ServiceBrowser::StartProbe(Instance &instance)
+{
+	ServiceInfo *info = instance.info.get();
+	instance.state = kInstanceProbing;
+	DNS_TIMELINE_ASYNC_BEGIN("probe", info);
+
+	ProbeHandle probing = owner->Prober().Probe(info->addresses, (uint16_t)info->port, probe.timeoutMs, [this, info](const AddressList &addresses){
+		Instance *instance = FindInstance(info);
+		if(instance == nullptr || instance->state != kInstanceProbing)
+			return;
+		instance->probing = 0;
+		info->addresses = addresses;
+
+		// Nothing accepted a connection, so the peer may be gone without a
+		// goodbye. Probe results stand for a while, which keeps this from
+		// repeating with every re-announcement.
+		if(addresses[0].reachability == ServiceAddress::kUnreachable)
+			DNSFreshness::ReconfirmRecords(*info);
+
+		DNS_TIMELINE_ASYNC_END("probe", info);
+		DNS_TIMELINE_ASYNC_END("instance", info);
+		Report(*instance, kDNSServiceErr_NoError);
+	});
+
+	// 0 means every address had a recent result and the instance is reported already
+	if(probing)
+		instance.probing = probing;
+}
+
+void ServiceBrowser::Report(Instance &instance, DNSServiceErrorType errorCode)
+{
+	ServiceInfo *info = instance.info.get();
+	shared_ptr<ServiceInfo> keep = instance.info;
+	const char *phase = "found";
+	if(errorCode == kDNSServiceErr_NoError)
+	{
+		instance.state = kInstanceResolved;
+		owner->Freshness().Seen(*info);
+
+		uint64_t hash = info->contentHash();
+		if(instance.reported)
+		{
+			// re-announced without any change
+			if(hash == instance.hash)
+				return;
+			phase = "updated";
+		}
+		instance.reported = true;
+		instance.hash = hash;
+	}
+	else if(instance.reported)
+	{
+		// what went out before still stands, the next announcement tries again
+		instance.state = kInstanceResolved;
+		return;
+	}
+	else
+	{
+		// a failed instance is forgotten so that the next add resolves it again
+		instance.state = kInstanceLost;
+		RemoveInstance(info);
+	}
+
+	if(bus)
+	{
+		bus->Message(*keep, errorCode, phase);
+	}
+}
+
+void ServiceBrowser::FinishResolve(ServiceInfo *info, DNSServiceErrorType errorCode)
+{
+	if(owner->Recorder())
+		owner->Recorder()->RecordResolveDone(this, *info, errorCode);
+
+	HandleResolveDone(info, errorCode);
+}
+
+void ServiceBrowser::callbackBrowse(DNSServiceRef sdRef,
+									DNSServiceFlags flags,
+									uint32_t interfaceIndex,
+									DNSServiceErrorType errorCode,
+									const char *serviceName,
+									const char *regtype,
+									const char *replyDomain,
+									void *context
+									)
+{
+	DNS_TIMELINE_SPAN("browse callback");
+
+	Self *browser = (ServiceBrowser*)context;
+	if(browser->owner->Recorder())
+		browser->owner->Recorder()->RecordBrowse(browser, flags, interfaceIndex, errorCode, serviceName, regtype, replyDomain);
+
+	browser->HandleBrowse(flags, interfaceIndex, errorCode, serviceName, regtype, replyDomain);
+}
+
+void DNSSD_API ServiceBrowser::callbackResolve(DNSServiceRef sdRef,
+											   DNSServiceFlags flags,
+											   uint32_t interfaceIndex,
+											   DNSServiceErrorType errorCode,
+											   const char *fullname,
+											   const char *hosttarget,
+											   uint16_t port,
+											   uint16_t txtLen,
+											   const unsigned char *txtRecord,
+											   void *context
+											   )
+{
+	DNS_TIMELINE_SPAN("resolve callback");
+
+	ServiceInfo *info = (ServiceInfo*)context;
+	ServiceBrowser *browser = (ServiceBrowser*)info->browser;
+	DNSTraceRecorder *recorder = browser ? browser->owner->Recorder() : nullptr;
+
+	if(recorder)
+		recorder->RecordResolve(browser, *info, flags, interfaceIndex, errorCode, hosttarget, port, txtLen, txtRecord);
+
+	if(browser == nullptr)
+		return;
+
+	if(errorCode == kDNSServiceErr_ServiceNotRunning)
+	{
+		browser->owner->daemonLost();
+		return;
+	}
+
+	browser->HandleResolve(info, flags, interfaceIndex, errorCode, hosttarget, port, txtLen, txtRecord);
+
+	// successful resolves finish once the host cache delivers the addresses
+	if(errorCode != kDNSServiceErr_NoError)
+		browser->FinishResolve(info, errorCode);
+}
+
+
+
+ServiceResolver::ServiceResolver(DSNMessageBusBase *bus, DNSServiceManager *owner)
+: bus(bus)
+, owner(owner)
+, timeoutMs(0)
+, timeout(0)
+, lookup(0)
+{
+
+}
+
+bool ServiceResolver::resolve()
+{
+	if(!Start())
+		return false;
+
+	DNS_TIMELINE_ASYNC_BEGIN("resolve", this);
+
+	if(timeoutMs)
+	{
+		timeout = owner->EventLoop().ScheduleTimer(timeoutMs, [this](){
+			timeout = 0;
+			Finish(DNSServiceManager::kErrorTimeout);
+		});
+	}
+	return true;
+}
+
+bool ServiceResolver::Start()
+{
+	const char* cDomain = ServiceInfo::kDefaultDomain;
+	if(info.domainLength())
+		cDomain = info.domain();
+
+	DNSServiceErrorType ret = DNSServiceResolve(&info.ref, 0, 0, info.name(), info.type(), cDomain, &Self::callbackResolve, this);
+
+	if(ret != kDNSServiceErr_NoError)
+		return false;
+
+	owner->EventLoop().RegisterRef(info.ref);
+	return true;
+}
+
+void ServiceResolver::Suspend()
+{
+	owner->HostCache().Cancel(lookup);
+	lookup = 0;
+	owner->EventLoop().TerminateRef(info.ref);
+	info.ref = 0;
+}
+
+void ServiceResolver::Restart()
+{
+	info.addresses.clear();
+	if(!Start())
+		Finish(kDNSServiceErr_ServiceNotRunning);
+}
+
+void ServiceResolver::stop()
+{
+	owner->HostCache().Cancel(lookup);
+	lookup = 0;
+	owner->EventLoop().CancelTimer(timeout);
+	timeout = 0;
+	owner->EventLoop().TerminateRef(info.ref);
+	info.ref = 0;
+}
+
+void ServiceResolver::Finish(DNSServiceErrorType errorCode)
+{
+	DNS_TIMELINE_ASYNC_END("resolve", this);
+	stop();
+
+	// resolveFinished() deletes this resolver, so the result is reported from a copy
+	DSNMessageBusBase *messageBus = bus;
+	ServiceInfo result(std::move(info));
+	owner->resolveFinished(this);
+
+	if(messageBus)
+		messageBus->Message(result, errorCode, errorCode == kDNSServiceErr_NoError ? "resolved" : "resolveError");
+}
+
+void DNSSD_API ServiceResolver::callbackResolve(DNSServiceRef sdRef,
+												DNSServiceFlags flags,
+												uint32_t interfaceIndex,
+												DNSServiceErrorType errorCode,
+												const char *fullname,
+												const char *hosttarget,
+												uint16_t port,
+												uint16_t txtLen,
+												const unsigned char *txtRecord,
+												void *context
+												)
+{
+	DNS_TIMELINE_SPAN("resolve callback");
+
+	Self *resolver = (Self*)context;
+
+	if(errorCode == kDNSServiceErr_ServiceNotRunning)
+	{
+		resolver->owner->daemonLost();
+		return;
+	}
+
+	if(errorCode == kDNSServiceErr_NoError)
+	{
+		resolver->info.ReadTXT(txtRecord, txtLen);
+		if(hosttarget)
+			resolver->info.setHostname(hosttarget);
+		resolver->info.port = port;
+
+		if(resolver->lookup == 0)
+		{
+			HostLookupHandle lookup = resolver->owner->HostCache().Lookup(hosttarget, [resolver](const AddressList &addresses){
+				resolver->lookup = 0;
+				for(const auto &addr : addresses)
+				{
+					resolver->info.addresses.push_back(addr);
+				}
+				resolver->Finish(kDNSServiceErr_NoError);
+			});
+
+			// 0 means the cache answered right away and the resolver is already gone
+			if(lookup)
+				resolver->lookup = lookup;
+		}
+	}
+	else
+	{
+		resolver->Finish(errorCode);
+	}
+}
+
+
+
+const int DNSServiceManager::kErrorTimeout = kDNSServiceErr_Timeout;
+
+ServiceWaiter::ServiceWaiter(DNSServiceManager *owner, const WaitRequest &request, const WaitCompletion &completion)
+: owner(owner)
+, request(request)
+, completion(completion)
+, timeout(0)
+, finish(0)
+, done(false)
+{
+
+}
+
+ServiceWaiter::~ServiceWaiter()
+{
+
+}
+
+bool ServiceWaiter::start()
+{
+	browser = owner->startBrowser(request.query, this);
+	if(!browser)
+		return false;
+
+	if(request.timeoutMs)
+	{
+		timeout = owner->EventLoop().ScheduleTimer(request.timeoutMs, [this](){
+			timeout = 0;
+			Finish(DNSServiceManager::kErrorTimeout);
+		});
+	}
+	return true;
+}
+
+void ServiceWaiter::cancel()
+{
+	done = true;
+	owner->EventLoop().CancelTimer(timeout);
+	owner->EventLoop().CancelTimer(finish);
+	timeout = finish = 0;
+	if(browser)
+	{
+		browser->bus = nullptr;
+		browser->stop();
+		browser.reset();
+	}
+}
+
+bool ServiceWaiter::Matches(const ServiceInfo &info) const
+{
+	if(request.query.nameLength() && strcmp(request.query.name(), info.name()) != 0)
+		return false;
+
+	for(const auto &m : request.match)
+	{
+		const char *value;
+		size_t valueLength;
+		if(!info.getData(m.first.c_str(), &value, &valueLength))
+			return false;
+		if(valueLength != m.second.length() || memcmp(value, m.second.data(), valueLength) != 0)
+			return false;
+	}
+	return true;
+}
+
+void ServiceWaiter::Message(const ServiceInfo &srv, int errorCode, const char* phase)
+{
+	if(done)
+		return;
+
+	if(strcmp(phase, "browseError") == 0)
+	{
+		Finish(errorCode);
+	}
+	else if(strcmp(phase, "lost") == 0)
+	{
+		for(auto it = found.begin(); it != found.end(); ++it)
+		{
+			if(it->sameInstance(srv.name(), srv.type(), srv.domain()))
+			{
+				found.erase(it);
+				break;
+			}
+		}
+	}
+	else if(strcmp(phase, "updated") == 0)
+	{
+		// the new details may or may not match anymore
+		for(auto it = found.begin(); it != found.end(); ++it)
+		{
+			if(it->sameInstance(srv.name(), srv.type(), srv.domain()))
+			{
+				found.erase(it);
+				break;
+			}
+		}
+		if(Matches(srv))
+		{
+			found.push_back(srv);
+			found.back().browser = nullptr;
+			if(found.size() >= request.count)
+				Finish(0);
+		}
+	}
+	else if(strcmp(phase, "found") == 0 && errorCode == 0 && Matches(srv))
+	{
+		found.push_back(srv);
+		found.back().browser = nullptr;
+		if(found.size() >= request.count)
+			Finish(0);
+	}
+}
+
+void ServiceWaiter::Finish(int errorCode)
+{
+	if(done)
+		return;
+	done = true;
+
+	owner->EventLoop().CancelTimer(timeout);
+	timeout = 0;
+
+	// Called from browser callbacks, so tear down on the next loop turn instead.
+	finish = owner->EventLoop().ScheduleTimer(0, [this, errorCode](){
+		finish = 0;
+		browser->bus = nullptr;
+		browser->stop();
+		browser.reset();
+
+		// waitFinished() deletes this waiter
+		WaitCompletion callback = completion;
+		std::vector<ServiceInfo> result;
+		result.swap(found);
+		owner->waitFinished(this);
+		callback(result, errorCode);
+	});
 }
 
 
 DNSServiceManager::DNSServiceManager(DSNMessageBusBase *m)
-: bus(m)
-, eventLoop(nullptr)
+: DNSServiceManager(m, new PlatformEventLoop())
 {
 
 }
 
+DNSServiceManager::DNSServiceManager(DSNMessageBusBase *m, BaseDNSEventLoop *loop)
+: bus(m)
+, eventLoop(loop)
+, hostCache(nullptr)
+, prober(nullptr)
+, freshness(nullptr)
+, recorder(nullptr)
+, recovering(false)
+, recoveryDelayMs(0)
+, recoveryTimer(0)
+, passive(nullptr)
+{
+	eventLoop->SetDaemonLostHandler([this](){
+		daemonLost();
+	});
+}
+
 DNSServiceManager::~DNSServiceManager()
 {
 	stop();
+	delete passive;
+	delete freshness;
+	delete prober;
+	delete hostCache;
 	delete eventLoop;
 }
 
-BaseDNSEventLoop&
-DNSServiceManager::EventLoop()
+DNSHostCache&
+DNSServiceManager::HostCache()
+{
+	if (hostCache == nullptr) {
+		hostCache = new DNSHostCache(this);
+	}
+	return *hostCache;
+}
+
+DNSProber&
+DNSServiceManager::Prober()
+{
+	if (prober == nullptr) {
+		prober = new DNSProber(this);
+	}
+	return *prober;
+}
+
+DNSFreshness&
+DNSServiceManager::Freshness()
 {
-	if (eventLoop == nullptr) {
-		eventLoop = new PlatformEventLoop();
+	if (freshness == nullptr) {
+		freshness = new DNSFreshness(this);
 	}
-	return *eventLoop;
+	return *freshness;
 }
 
 PublisherHandle
 DNSServiceManager::publish(const ServiceInfo &info)
+{
+	return publish(ServiceInfo(info));
+}
+
+PublisherHandle
+DNSServiceManager::publish(ServiceInfo &&info)
 {
 	shared_ptr<ServicePublisher> pub = make_shared<ServicePublisher>(bus, this);
-	pub->info = info;
+	pub->info = std::move(info);
 	if(pub->publish())
 	{
 		publishers.push_back(pub);
@@ -547,12 +1622,25 @@ DNSServiceManager::unpublishAll()
 
 
 PublisherHandle
-DNSServiceManager::browse(const ServiceInfo &info)
+DNSServiceManager::browse(const ServiceInfo &info, const BrowseDuty &duty, const BrowseProbe &probe)
 {
-	shared_ptr<ServiceBrowser> browser = make_shared<ServiceBrowser>(bus, this);
-	browser->domain = info.domain;
-	browser->type = info.type;
-	if(browser->browse())
+	if(!shards.empty())
+	{
+		// the least busy shard takes the new browser
+		DNSShard *shard = shards.front().get();
+		for(auto &candidate : shards)
+		{
+			if(candidate->Load() < shard->Load())
+				shard = candidate.get();
+		}
+
+		BrowserHandle handle = shard->Browse(info, duty, probe);
+		shardedBrowsers[handle] = shard;
+		return handle;
+	}
+
+	shared_ptr<ServiceBrowser> browser = startBrowser(info, bus, duty, probe);
+	if(browser)
 	{
 		browsers.push_back(browser);
 		return browser.get();
@@ -563,17 +1651,152 @@ DNSServiceManager::browse(const ServiceInfo &info)
 	}
 }
 
+shared_ptr<ServiceBrowser>
+DNSServiceManager::startBrowser(const ServiceInfo &info, DSNMessageBusBase *browserBus, const BrowseDuty &duty, const BrowseProbe &probe)
+{
+	shared_ptr<ServiceBrowser> browser = make_shared<ServiceBrowser>(browserBus, this);
+	browser->domain = info.domain();
+	browser->type = info.type();
+	browser->duty = duty;
+	browser->probe = probe;
+	if(browser->browse())
+	{
+		return browser;
+	}
+	else
+	{
+		return nullptr;
+	}
+}
+
+ServiceBrowser *
+DNSServiceManager::replayBrowser(const ServiceInfo &info)
+{
+	shared_ptr<ServiceBrowser> browser = make_shared<ServiceBrowser>(bus, this);
+	browser->domain = info.domain();
+	browser->type = info.type();
+	browser->live = false;
+	browsers.push_back(browser);
+	return browser.get();
+}
+
+BrowserHandle
+DNSServiceManager::passiveBrowse(const ServiceInfo &info, const BrowseProbe &probe)
+{
+	if(passive == nullptr)
+		passive = new DNSPassiveListener(this);
+
+	shared_ptr<ServiceBrowser> browser = make_shared<ServiceBrowser>(bus, this);
+	browser->domain = info.domain();
+	browser->type = info.type();
+	browser->live = false;
+	browser->probe = probe;
+	browsers.push_back(browser);
+
+	if(!passive->AddBrowser(browser.get()))
+	{
+		browsers.remove(browser);
+		return nullptr;
+	}
+	return browser.get();
+}
+
+BrowserHandle
+DNSServiceManager::sharedBrowse(const ServiceInfo &info, const BrowseDuty &duty, const BrowseProbe &probe)
+{
+	shared_ptr<DNSRegistry> registry = make_shared<DNSRegistry>(this, bus);
+	if(!registry->Start(info, duty, probe))
+		return nullptr;
+
+	registries.push_back(registry);
+	return registry.get();
+}
+
+ResolverHandle
+DNSServiceManager::resolve(const ServiceInfo &info, uint32_t timeoutMs)
+{
+	shared_ptr<ServiceResolver> resolver = make_shared<ServiceResolver>(bus, this);
+	resolver->info = info;
+	resolver->info.browser = nullptr;
+	resolver->info.publisher = nullptr;
+	resolver->timeoutMs = timeoutMs;
+	if(resolver->resolve())
+	{
+		resolvers.push_back(resolver);
+		return resolver.get();
+	}
+	else
+	{
+		return nullptr;
+	}
+}
+
+bool
+DNSServiceManager::stopResolve(ResolverHandle resolverHandle)
+{
+	if(resolverHandle == nullptr)
+		return false;
+
+	bool found = false;
+	for(auto &resolver : resolvers)
+	{
+		if(resolver.get() == resolverHandle)
+		{
+			resolver->bus = nullptr;
+			resolver->stop();
+			found = true;
+		}
+	}
+
+	resolvers.remove_if([resolverHandle](const shared_ptr<ServiceResolver> &i){
+		return i.get()==resolverHandle;
+	});
+
+	return found;
+}
+
+void
+DNSServiceManager::stopAllResolvers()
+{
+	for(auto &resolver : resolvers)
+	{
+		resolver->bus = nullptr;
+		resolver->stop();
+	}
+
+	resolvers.clear();
+}
+
+void
+DNSServiceManager::resolveFinished(ResolverHandle resolverHandle)
+{
+	resolvers.remove_if([resolverHandle](const shared_ptr<ServiceResolver> &i){
+		return i.get()==resolverHandle;
+	});
+}
+
 bool
 DNSServiceManager::stopBrowser(BrowserHandle browserHandle)
 {
 	if(browserHandle == nullptr)
 		return false;
 
+	auto sharded = shardedBrowsers.find(browserHandle);
+	if(sharded != shardedBrowsers.end())
+	{
+		DNSShard *shard = sharded->second;
+		shardedBrowsers.erase(sharded);
+		Freshness().ForgetBrowser(browserHandle);
+		return shard->StopBrowser(browserHandle);
+	}
+
 	bool found = false;
 	for(auto &browser : browsers)
 	{
 		if(browser.get() == browserHandle)
 		{
+			if(passive)
+				passive->RemoveBrowser(browser.get());
 			browser->bus = nullptr;
 			browser->stop();
 			found = true;
@@ -584,19 +1807,173 @@ DNSServiceManager::stopBrowser(BrowserHandle browserHandle)
 		return i.get()==browserHandle;
 	});
 
+	for(auto &registry : registries)
+	{
+		if(registry.get() == browserHandle)
+		{
+			registry->Stop();
+			found = true;
+		}
+	}
+
+	registries.remove_if([browserHandle](const shared_ptr<DNSRegistry> &i){
+		return i.get()==browserHandle;
+	});
+
 	return found;
 }
 
+bool
+DNSServiceManager::wakeBrowser(BrowserHandle browserHandle)
+{
+	auto sharded = shardedBrowsers.find(browserHandle);
+	if(sharded != shardedBrowsers.end())
+		return sharded->second->WakeBrowser(browserHandle);
+
+	for(auto &browser : browsers)
+	{
+		if(browser.get() == browserHandle)
+		{
+			browser->wake();
+			return true;
+		}
+	}
+	for(auto &registry : registries)
+	{
+		if(registry.get() == browserHandle)
+		{
+			if(registry->Browser())
+				registry->Browser()->wake();
+			return true;
+		}
+	}
+	return false;
+}
+
 void
 DNSServiceManager::stopAllBrowsers()
 {
 	for(auto &browser : browsers)
 	{
+		if(passive)
+			passive->RemoveBrowser(browser.get());
 		browser->bus = nullptr;
 		browser->stop();
 	}
 
 	browsers.clear();
+
+	for(auto &registry : registries)
+	{
+		registry->Stop();
+	}
+	registries.clear();
+
+	for(auto &sharded : shardedBrowsers)
+	{
+		Freshness().ForgetBrowser(sharded.first);
+		sharded.second->StopBrowser(sharded.first);
+	}
+	shardedBrowsers.clear();
+}
+
+bool
+DNSServiceManager::setShards(size_t count)
+{
+	if(!shardedBrowsers.empty())
+		return false;
+
+	stopShards();
+	if(count == 0)
+		return true;
+
+	shardInbox = make_shared<DNSShardInbox>(this);
+	for(size_t i = 0; i < count; i++)
+	{
+		shared_ptr<DNSShard> shard = make_shared<DNSShard>(shardInbox);
+		if(!shard->Start())
+		{
+			stopShards();
+			return false;
+		}
+		shards.push_back(shard);
+	}
+	return true;
+}
+
+void
+DNSServiceManager::stopShards()
+{
+	// detached first, so that nothing is delivered while the workers wind down
+	if(shardInbox)
+		shardInbox->Detach();
+	shardedBrowsers.clear();
+	shards.clear();
+	shardInbox.reset();
+}
+
+void
+DNSServiceManager::shardMessage(const ServiceInfo &info, int errorCode, const char *phase)
+{
+	// messages of browsers stopped in the meantime are dropped
+	auto sharded = shardedBrowsers.find(info.browser);
+	if(sharded == shardedBrowsers.end())
+		return;
+
+	// the shard's own manager tracks its browsers, but reconfirmation is asked for here
+	if(errorCode == 0 && (strcmp(phase, "found") == 0 || strcmp(phase, "updated") == 0))
+		Freshness().Seen(info);
+	else if(strcmp(phase, "lost") == 0)
+		Freshness().Forget(info);
+
+	if(bus)
+		bus->Message(info, errorCode, phase);
+
+	if(strcmp(phase, "browseError") == 0)
+		browseFailed(info.browser);
+}
+
+WaiterHandle
+DNSServiceManager::waitFor(const WaitRequest &request, const WaitCompletion &completion)
+{
+	shared_ptr<ServiceWaiter> waiter = make_shared<ServiceWaiter>(this, request, completion);
+	if(waiter->start())
+	{
+		waiters.push_back(waiter);
+		return waiter.get();
+	}
+	else
+	{
+		return nullptr;
+	}
+}
+
+bool
+DNSServiceManager::cancelWait(WaiterHandle waiterHandle)
+{
+	bool found = false;
+	for(auto &waiter : waiters)
+	{
+		if(waiter.get() == waiterHandle)
+		{
+			waiter->cancel();
+			found = true;
+		}
+	}
+
+	waiters.remove_if([waiterHandle](const shared_ptr<ServiceWaiter> &i){
+		return i.get()==waiterHandle;
+	});
+
+	return found;
+}
+
+void
+DNSServiceManager::waitFinished(ServiceWaiter *waiter)
+{
+	waiters.remove_if([waiter](const shared_ptr<ServiceWaiter> &i){
+		return i.get()==waiter;
+	});
 }
 
 void
@@ -611,10 +1988,169 @@ DNSServiceManager::publishFailed(PublisherHandle publisher)
 	unpublish(publisher);
 }
 
+void
+DNSServiceManager::daemonLost()
+{
+	// every ref reports the same loss, only the first one counts
+	if(recovering)
+		return;
+	recovering = true;
+	recoveryDelayMs = kRecoveryMinDelayMs;
+	DNS_TIMELINE_ASYNC_BEGIN("daemon recovery", this);
+
+	for(auto &browser : browsers)
+	{
+		if(browser->live)
+			browser->Suspend();
+	}
+	for(auto &waiter : waiters)
+	{
+		if(waiter->Browser())
+			waiter->Browser()->Suspend();
+	}
+	for(auto &registry : registries)
+	{
+		if(registry->Browser())
+			registry->Browser()->Suspend();
+	}
+	for(auto &resolver : resolvers)
+	{
+		resolver->Suspend();
+	}
+	for(auto &pub : publishers)
+	{
+		pub->unpublish();
+	}
+	if(hostCache)
+		hostCache->CancelQueries();
+
+	scheduleRecovery();
+}
+
+void
+DNSServiceManager::scheduleRecovery()
+{
+	recoveryTimer = this->EventLoop().ScheduleTimer(recoveryDelayMs, [this](){
+		recoveryTimer = 0;
+		probeDaemon();
+	});
+}
+
+void
+DNSServiceManager::probeDaemon()
+{
+	DNSServiceRef probe = 0;
+	if(DNSServiceCreateConnection(&probe) != kDNSServiceErr_NoError)
+	{
+		// back off exponentially while the daemon is still down
+		recoveryDelayMs *= 2;
+		if(recoveryDelayMs > kRecoveryMaxDelayMs)
+			recoveryDelayMs = kRecoveryMaxDelayMs;
+		scheduleRecovery();
+		return;
+	}
+	DNSServiceRefDeallocate(probe);
+
+	recovering = false;
+	DNS_TIMELINE_ASYNC_END("daemon recovery", this);
+
+	// Everything is restarted in this one turn of the loop. The lists are
+	// copied since a failure removes its entry, and a failure that is the
+	// daemon going away again starts over from daemonLost().
+	auto pubs = publishers;
+	for(auto &pub : pubs)
+	{
+		if(recovering)
+			return;
+		if(!pub->publish())
+			publishFailed(pub.get());
+	}
+
+	auto browsing = browsers;
+	for(auto &browser : browsing)
+	{
+		if(recovering)
+			return;
+		if(browser->live && !browser->Revalidate())
+		{
+			ServiceInfo failed;
+			failed.setType(browser->type.c_str());
+			failed.setDomain(browser->domain.c_str());
+			failed.browser = browser.get();
+			if(browser->bus)
+				browser->bus->Message(failed, kDNSServiceErr_ServiceNotRunning, "browseError");
+			browseFailed(browser.get());
+		}
+	}
+
+	auto waiting = waiters;
+	for(auto &waiter : waiting)
+	{
+		if(recovering)
+			return;
+		if(waiter->Browser() && !waiter->Browser()->Revalidate())
+			waiter->Message(ServiceInfo(), kDNSServiceErr_ServiceNotRunning, "browseError");
+	}
+
+	auto sharing = registries;
+	for(auto &registry : sharing)
+	{
+		if(recovering)
+			return;
+		if(registry->Browser() && !registry->Browser()->Revalidate())
+			registry->Message(ServiceInfo(), kDNSServiceErr_ServiceNotRunning, "browseError");
+	}
+
+	auto pending = resolvers;
+	for(auto &resolver : pending)
+	{
+		if(recovering)
+			return;
+		resolver->Restart();
+	}
+}
+
+void
+DNSServiceManager::setRecorder(DNSTraceRecorder *traceRecorder)
+{
+	recorder = traceRecorder;
+	if(recorder == nullptr)
+		return;
+
+	for(auto &browser : browsers)
+	{
+		if(browser->live)
+			recorder->RecordBrowseStart(browser.get(), browser->type.c_str(), browser->domain.c_str(), false);
+	}
+}
+
 void
 DNSServiceManager::stop()
 {
+	if(recovering)
+	{
+		this->EventLoop().CancelTimer(recoveryTimer);
+		recoveryTimer = 0;
+		recovering = false;
+		DNS_TIMELINE_ASYNC_END("daemon recovery", this);
+	}
+
+	for(auto &waiter : waiters)
+	{
+		waiter->cancel();
+	}
+	waiters.clear();
+
+	stopAllResolvers();
 	stopAllBrowsers();
+	stopShards();
 	unpublishAll();
+
+	if(hostCache)
+		hostCache->Clear();
+	if(prober)
+		prober->Clear();
+	if(freshness)
+		freshness->Clear();
 }
 
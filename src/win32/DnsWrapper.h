@@ -10,19 +10,58 @@
 #ifndef DnsWrapper_h
 #define DnsWrapper_h
 
+#include <stdint.h>
+#include <string.h>
 #include <string>
 #include <unordered_map>
 #include <list>
 #include <vector>
 #include <memory>
+#include <functional>
+
+#include "SmallVector.h"
 
 
 
 typedef void* PublisherHandle;
 typedef void* BrowserHandle;
+typedef void* WaiterHandle;
+typedef void* ResolverHandle;
 
 typedef struct _DNSServiceRef_t *DNSServiceRef;
+struct sockaddr;
+
+struct ServiceAddress
+{
+	uint8_t family;
+	uint8_t bytes[16];
+	// kReachabilityUnknown unless the browser probes its addresses
+	uint8_t reachability;
+	uint32_t ttl;
+	// connect time of a reachable address, in microseconds
+	uint32_t rttUs;
+	// interface the address was found on, 0 if unknown; a link-local IPv6
+	// address is only reached through it
+	uint32_t interfaceIndex;
+
+	// family is AF_UNSPEC if the address is neither IPv4 nor IPv6; an IPv6
+	// scope in the sockaddr wins over interfaceIndex
+	static ServiceAddress FromSockaddr(const struct sockaddr *address, uint32_t ttl, uint32_t interfaceIndex);
+
+	size_t Length() const { return family == kFamilyIPv6 ? 16 : 4; }
+
+	// writes the printable form into buff, which must hold kMaxString bytes
+	const char *ToString(char *buff) const;
+
+	enum { kFamilyIPv4 = 4, kFamilyIPv6 = 6, kMaxString = 46 };
+	enum { kReachabilityUnknown = 0, kReachable = 1, kUnreachable = 2 };
+};
+
+typedef SmallVector<ServiceAddress, 4> AddressList;
 
+// Everything variable sized lives in one buffer: the NUL terminated type,
+// name, domain and hostname, and the raw TXT record bytes. Pointers returned
+// by the accessors stay valid until the next setter call.
 class ServiceInfo
 {
 public:
@@ -30,12 +69,10 @@ public:
 	static const char * kDefaultDomain;
 public:
 	int port;
-	std::string type;
-	std::string name;
-	std::string domain;
-	std::string hostname;
-	std::unordered_map<std::string, std::string> data;
-	std::list<std::string> addresses;
+	AddressList addresses;
+	// interfaces the instance was browsed or resolved on; the daemon only
+	// reconfirms records cached on a given interface
+	SmallVector<uint32_t, 2> interfaces;
 
 	DNSServiceRef ref;
 
@@ -43,14 +80,152 @@ public:
 	PublisherHandle publisher;
 
 	ServiceInfo();
-	
-	void setData(const char *key, const char *value);
+	ServiceInfo(const ServiceInfo &other);
+	ServiceInfo(ServiceInfo &&other);
+	ServiceInfo &operator=(const ServiceInfo &other);
+	ServiceInfo &operator=(ServiceInfo &&other);
+
+	const char *type() const { return str(fType); }
+	const char *name() const { return str(fName); }
+	const char *domain() const { return str(fDomain); }
+	const char *hostname() const { return str(fHostname); }
+
+	size_t typeLength() const { return fType.length; }
+	size_t nameLength() const { return fName.length; }
+	size_t domainLength() const { return fDomain.length; }
+	size_t hostnameLength() const { return fHostname.length; }
+
+	void setType(const char *value) { set(fType, value); }
+	void setName(const char *value) { set(fName, value); }
+	void setDomain(const char *value) { set(fDomain, value); }
+	void setHostname(const char *value) { set(fHostname, value); }
+
+	bool sameInstance(const char *name, const char *type, const char *domain) const;
+
+	// adds index to interfaces unless it is there already or 0
+	void addInterface(uint32_t index);
+
+	// Stable 64-bit id of the instance: a hash of name, type and domain that
+	// ignores ASCII case and trailing dots, so browse and resolve agree.
+	uint64_t instanceId() const;
+	// Hash of what a "found" event reports: port, hostname, the addresses in
+	// sorted order with their reachability and the raw TXT bytes. Equal
+	// hashes mean nothing changed.
+	uint64_t contentHash() const;
+
+	// Value may be binary. A pair longer than a TXT string allows goes on in
+	// "key*1", "key*2" and so on, which getValue() and forEachValue() join
+	// again. False, with the record left as it was, for an empty key, a key
+	// too long to leave room for the value or its numbered continuations, or
+	// when the record would grow beyond kMaxTXTLength.
+	bool setData(const char *key, const char *value);
+	bool setData(const char *key, const char *value, size_t valueLength);
+
+	// dns_sd passes TXT records with a 16-bit length
+	static const size_t kMaxTXTLength = 65535;
+
+	// looks up a TXT key, value is not NUL terminated
+	bool getData(const char *key, const char **value, size_t *valueLength) const;
+	// looks up a TXT key and joins its continuations to the value
+	bool getValue(const char *key, std::string &value) const;
+	// false if the key has no continuation, otherwise the whole value, that
+	// getData() gave for it, in joined
+	bool joinValue(const char *key, size_t keyLength, const char *value, size_t valueLength, std::string &joined) const;
+
+	// number of key/value pairs in the TXT record
+	size_t dataCount() const;
+
+	// calls f(key, keyLength, value, valueLength) for every TXT pair
+	template<typename F>
+	void forEachData(F f) const;
+	// same for every value, with continuations joined to it and not passed on their own
+	template<typename F>
+	void forEachValue(F f) const;
+
+	const uint8_t *txtBytes() const { return (const uint8_t*)storage.data() + fTXT.offset; }
+	size_t txtLength() const { return fTXT.length; }
 
 	std::vector<uint8_t> TXTData() const;
 
 	void ReadTXT(const unsigned char *sz, int len);
+
+private:
+	struct Span
+	{
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	const char *str(const Span &span) const { return storage.data() + span.offset; }
+	void set(Span &span, const char *value);
+	void setTXT(const char *bytes, size_t len);
+	void compact();
+
+	// "key*N", N > 0, continues the value of "key"
+	static bool isContinuation(const char *key, size_t keyLength, size_t *baseLength);
+	bool hasKey(const char *key, size_t keyLength) const;
+	std::string storage;
+	size_t garbage;
+	Span fType;
+	Span fName;
+	Span fDomain;
+	Span fHostname;
+	Span fTXT;
 };
 
+template<typename F>
+void ServiceInfo::forEachData(F f) const
+{
+	const uint8_t *txt = txtBytes();
+	size_t len = txtLength();
+	size_t c = 0;
+	while(c < len)
+	{
+		size_t pairLen = txt[c++];
+		if(pairLen == 0 || c + pairLen > len)
+		{
+			c += pairLen;
+			continue;
+		}
+
+		const char *pair = (const char*)txt + c;
+		const char *eq = (const char*)memchr(pair, '=', pairLen);
+		if(eq)
+			f(pair, (size_t)(eq - pair), eq + 1, pairLen - (eq - pair) - 1);
+		else
+			f(pair, pairLen, pair + pairLen, (size_t)0);
+
+		c += pairLen;
+	}
+}
+
+template<typename F>
+void ServiceInfo::forEachValue(F f) const
+{
+	size_t baseLength;
+	bool continued = false;
+	forEachData([&](const char *key, size_t keyLength, const char *, size_t) {
+		if(isContinuation(key, keyLength, &baseLength))
+			continued = true;
+	});
+	if(!continued)
+	{
+		forEachData(f);
+		return;
+	}
+
+	std::string joined;
+	forEachData([&](const char *key, size_t keyLength, const char *value, size_t valueLength) {
+		// a continuation without the key it continues is an ordinary key
+		if(isContinuation(key, keyLength, &baseLength) && hasKey(key, baseLength))
+			return;
+		if(joinValue(key, keyLength, value, valueLength, joined))
+			f(key, keyLength, joined.data(), joined.size());
+		else
+			f(key, keyLength, value, valueLength);
+	});
+}
+
 
 
 class DSNMessageBusBase
@@ -63,13 +238,89 @@ public:
 
 class ServiceBrowser;
 class ServicePublisher;
+class ServiceWaiter;
+class ServiceResolver;
+class DNSTraceRecorder;
+class DNSHostCache;
+class DNSShard;
+class DNSShardInbox;
+class DNSPassiveListener;
+class DNSProber;
+class DNSRegistry;
+class DNSFreshness;
+
+struct WaitRequest
+{
+	// type, domain and, if not empty, the exact service name to wait for
+	ServiceInfo query;
+	// TXT pairs a service must carry to count
+	std::vector< std::pair<std::string, std::string> > match;
+	size_t count;
+	// 0 waits until enough services are found
+	uint32_t timeoutMs;
+
+	WaitRequest() : count(1), timeoutMs(0) {}
+};
+
+// Duty cycling for battery and thermally limited devices. Once no instance
+// has appeared or disappeared for stableMs the browser stops listening and
+// only browses for pulseMs every intervalMs, keeping what it found. Churn
+// seen during a pulse, or wakeBrowser(), brings back continuous browsing.
+struct BrowseDuty
+{
+	bool enabled;
+	uint32_t stableMs;
+	uint32_t pulseMs;
+	uint32_t intervalMs;
+
+	BrowseDuty() : enabled(false), stableMs(30000), pulseMs(3000), intervalMs(60000) {}
+};
+
+// Reachability probing after resolve. Every resolved address gets a TCP
+// connect to the service port, all of them at once, and the instance is
+// reported when they have answered or timeoutMs passed, with each address
+// marked reachable or not and the reachable ones ordered fastest first.
+struct BrowseProbe
+{
+	bool enabled;
+	uint32_t timeoutMs;
+
+	BrowseProbe() : enabled(false), timeoutMs(250) {}
+};
+
+// errorCode is 0 once count services matched, DNSServiceManager::kErrorTimeout or a browse error otherwise
+typedef std::function<void(const std::vector<ServiceInfo> &found, int errorCode)> WaitCompletion;
+
+typedef uint32_t TimerHandle;
 
 class BaseDNSEventLoop
 {
 public:
 	virtual void RegisterRef(DNSServiceRef ref) = 0;
 	virtual void TerminateRef(DNSServiceRef ref) = 0;
+
+	// one-shot timer on the thread that processes refs; 0 ms runs it on the next turn of the loop
+	virtual TimerHandle ScheduleTimer(uint32_t milliseconds, const std::function<void()> &callback) = 0;
+	virtual void CancelTimer(TimerHandle timer) = 0;
+
+	// the only call that may come from another thread: runs task on the loop's thread
+	virtual void Post(const std::function<void()> &task) = 0;
+
+	// For hosts that drive the loop themselves: runs ready refs, due timers
+	// and posted tasks, at most maxEvents of them and for about maxMs, 0 for
+	// no limit. Returns how many ran; what is left runs on the next call.
+	// Loops the platform drives on its own run nothing.
+	virtual size_t Poll(uint32_t, uint32_t) { return 0; }
+	// readable whenever Poll() has something to run, -1 if there is no such descriptor
+	virtual int Descriptor() const { return -1; }
+
+	// called when processing a ref finds the daemon gone, for loops that see it before any callback does
+	void SetDaemonLostHandler(const std::function<void()> &handler) { daemonLost = handler; }
+
 	virtual ~BaseDNSEventLoop(){};
+
+protected:
+	std::function<void()> daemonLost;
 };
 
 class DNSServiceManager
@@ -79,27 +330,120 @@ private:
 
 	std::list< std::shared_ptr<ServicePublisher> > publishers;
 	std::list< std::shared_ptr<ServiceBrowser> > browsers;
+	std::list< std::shared_ptr<ServiceWaiter> > waiters;
+	std::list< std::shared_ptr<ServiceResolver> > resolvers;
+	std::list< std::shared_ptr<DNSRegistry> > registries;
 
 	BaseDNSEventLoop *eventLoop;
+	DNSHostCache *hostCache;
+	DNSProber *prober;
+	DNSFreshness *freshness;
+
+	DNSTraceRecorder *recorder;
+
+	// set from the first kDNSServiceErr_ServiceNotRunning until the daemon answers again
+	bool recovering;
+	uint32_t recoveryDelayMs;
+	TimerHandle recoveryTimer;
+
+	void scheduleRecovery();
+	void probeDaemon();
+
+	// worker shards browse() spreads over, and the browsers placed on them
+	std::vector< std::shared_ptr<DNSShard> > shards;
+	std::shared_ptr<DNSShardInbox> shardInbox;
+	std::unordered_map<BrowserHandle, DNSShard*> shardedBrowsers;
+
+	void stopShards();
+
+	// feeds the passive browsers, created with the first one
+	DNSPassiveListener *passive;
 public:
+	static const int kErrorTimeout;
+
+	// first and longest wait between attempts to reach a restarted daemon
+	static const uint32_t kRecoveryMinDelayMs = 100;
+	static const uint32_t kRecoveryMaxDelayMs = 5000;
 
 	DNSServiceManager(DSNMessageBusBase *m);
+	// takes ownership of loop, which has to be of the platform's loop type
+	DNSServiceManager(DSNMessageBusBase *m, BaseDNSEventLoop *loop);
 	~DNSServiceManager();
 
 	PublisherHandle publish(const ServiceInfo &info);
+	PublisherHandle publish(ServiceInfo &&info);
 	bool unpublish(PublisherHandle publisher);
 	void unpublishAll();
 
-	BrowserHandle browse(const ServiceInfo &info);
+	BrowserHandle browse(const ServiceInfo &info, const BrowseDuty &duty = BrowseDuty(), const BrowseProbe &probe = BrowseProbe());
+	// browser that reports to browserBus and is not tracked by stopAllBrowsers()
+	std::shared_ptr<ServiceBrowser> startBrowser(const ServiceInfo &info, DSNMessageBusBase *browserBus, const BrowseDuty &duty = BrowseDuty(), const BrowseProbe &probe = BrowseProbe());
+	// Browser that never queries: instances are put together from the
+	// responses other hosts multicast anyway. Nothing is reported until a
+	// service announces itself or another host asks for it, but the network
+	// carries no traffic on this host's behalf. Always on this thread.
+	BrowserHandle passiveBrowse(const ServiceInfo &info, const BrowseProbe &probe = BrowseProbe());
+	// Browser shared with the other processes of this host that browse the
+	// same type and domain this way: one of them browses and resolves for
+	// all, through shared memory, and another one takes over when it quits.
+	// duty and probe only apply while this process is the one browsing.
+	BrowserHandle sharedBrowse(const ServiceInfo &info, const BrowseDuty &duty = BrowseDuty(), const BrowseProbe &probe = BrowseProbe());
 	bool stopBrowser(BrowserHandle browser);
+	// returns a duty cycled browser to continuous browsing
+	bool wakeBrowser(BrowserHandle browser);
 	void stopAllBrowsers();
 
+	// Spreads browse() over count worker shards, each with its own daemon
+	// connection and event loop thread. Their messages still reach the bus on
+	// this thread, in the order they arrived. Only possible while no browser
+	// runs on a shard; 0 browses on this thread again.
+	bool setShards(size_t count);
+	size_t shardCount() const { return shards.size(); }
+	// delivers a message merged from a shard
+	void shardMessage(const ServiceInfo &info, int errorCode, const char *phase);
+
+	// Browses privately and only reports matching services, once, through completion.
+	// The completion runs from the event loop, never from inside a dns_sd callback.
+	WaiterHandle waitFor(const WaitRequest &request, const WaitCompletion &completion);
+	bool cancelWait(WaiterHandle waiter);
+	void waitFinished(ServiceWaiter *waiter);
+
+	// Resolves a known instance name without browsing. Reports a single
+	// "resolved" or "resolveError" message; 0 ms never times out.
+	ResolverHandle resolve(const ServiceInfo &info, uint32_t timeoutMs);
+	bool stopResolve(ResolverHandle resolver);
+	void stopAllResolvers();
+	void resolveFinished(ResolverHandle resolver);
+
 	void stop();
 
 	void publishFailed(PublisherHandle publisher);
 	void browseFailed(BrowserHandle browser);
 
-	BaseDNSEventLoop &EventLoop();
+	// The daemon went away, taking every ref with it. Browsers, publishers and
+	// resolvers are kept and restarted together once it answers again, and
+	// known instances are confirmed rather than reported lost and found again.
+	void daemonLost();
+	bool Recovering() const { return recovering; }
+
+	BaseDNSEventLoop &EventLoop() { return *eventLoop; }
+
+	// address lookups of every browser and resolver go through this cache
+	DNSHostCache &HostCache();
+	// reachability probes of every probing browser, with their recent results
+	DNSProber &Prober();
+	// when the instances browsers report were last heard of, and their reconfirmation
+	DNSFreshness &Freshness();
+
+	// where browse() reports; a browser with a bus of its own serves a waiter or a registry
+	DSNMessageBusBase *Bus() const { return bus; }
+
+	// callbacks of live browsers are logged to the recorder while one is set; not owned
+	void setRecorder(DNSTraceRecorder *traceRecorder);
+	DNSTraceRecorder *Recorder() const { return recorder; }
+
+	// browser that is fed from a recorded trace instead of the daemon
+	ServiceBrowser *replayBrowser(const ServiceInfo &info);
 
 };
 
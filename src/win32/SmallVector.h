@@ -0,0 +1,161 @@
+//
+//  SmallVector.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+
+#ifndef SmallVector_h
+#define SmallVector_h
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+
+// Vector that keeps up to N elements inline and only allocates past that.
+// Elements are moved with memcpy, so T must be trivially copyable.
+template<typename T, size_t N>
+class SmallVector
+{
+public:
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
+	SmallVector()
+	: items(inlineItems)
+	, count(0)
+	, capacity(N)
+	{
+	}
+
+	SmallVector(const SmallVector &other)
+	: items(inlineItems)
+	, count(0)
+	, capacity(N)
+	{
+		assign(other.begin(), other.end());
+	}
+
+	SmallVector(SmallVector &&other)
+	: items(inlineItems)
+	, count(0)
+	, capacity(N)
+	{
+		take(other);
+	}
+
+	~SmallVector()
+	{
+		release();
+	}
+
+	SmallVector &operator=(const SmallVector &other)
+	{
+		if(this != &other)
+			assign(other.begin(), other.end());
+		return *this;
+	}
+
+	SmallVector &operator=(SmallVector &&other)
+	{
+		if(this != &other)
+		{
+			release();
+			take(other);
+		}
+		return *this;
+	}
+
+	void assign(const T *first, const T *last)
+	{
+		size_t n = last - first;
+		count = 0;
+		reserve(n);
+		memcpy(items, first, n * sizeof(T));
+		count = n;
+	}
+
+	void push_back(const T &item)
+	{
+		if(count == capacity)
+			reserve(capacity * 2);
+		memcpy(items + count, &item, sizeof(T));
+		count++;
+	}
+
+	void erase(iterator it)
+	{
+		size_t index = it - items;
+		memmove(items + index, items + index + 1, (count - index - 1) * sizeof(T));
+		count--;
+	}
+
+	void reserve(size_t n)
+	{
+		if(n <= capacity)
+			return;
+
+		T *grown = (T*)malloc(n * sizeof(T));
+		if(grown == nullptr)
+			throw std::bad_alloc();
+		memcpy(grown, items, count * sizeof(T));
+		if(items != inlineItems)
+			free(items);
+		items = grown;
+		capacity = n;
+	}
+
+	void clear() { count = 0; }
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T &operator[](size_t i) { return items[i]; }
+	const T &operator[](size_t i) const { return items[i]; }
+
+	iterator begin() { return items; }
+	iterator end() { return items + count; }
+	const_iterator begin() const { return items; }
+	const_iterator end() const { return items + count; }
+
+private:
+	void release()
+	{
+		if(items != inlineItems)
+			free(items);
+		items = inlineItems;
+		count = 0;
+		capacity = N;
+	}
+
+	void take(SmallVector &other)
+	{
+		if(other.items == other.inlineItems)
+		{
+			memcpy(inlineItems, other.inlineItems, other.count * sizeof(T));
+			items = inlineItems;
+			capacity = N;
+		}
+		else
+		{
+			items = other.items;
+			capacity = other.capacity;
+		}
+		count = other.count;
+
+		other.items = other.inlineItems;
+		other.count = 0;
+		other.capacity = N;
+	}
+
+	T *items;
+	size_t count;
+	size_t capacity;
+	T inlineItems[N];
+};
+
+
+#endif /* SmallVector_h */
@@ -12,10 +12,25 @@
 #include "CoronaEvent.h"
 
 #include "DnsWrapper.h"
+#include "DNSTrace.h"
+#include "DNSTimeline.h"
+#include "DNSBenchmark.h"
+#include "DNSPicker.h"
+#include "DNSSimulator.h"
+#include "DNSFreshness.h"
+#include "DNSSchema.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
 
 // ----------------------------------------------------------------------------
 
 
+class LuaMessenger;
+
 class PluginZeroConf
 {
 public:
@@ -53,14 +68,41 @@ public:
 	static int browse(lua_State *L);
 	static int stopBrowse(lua_State *L);
 	static int stopBrowseAll(lua_State *L);
+	static int wakeBrowse(lua_State *L);
+
+	static int waitFor(lua_State *L);
+	static int resolve(lua_State *L);
+	static int pick(lua_State *L);
+	static int reportUnreachable(lua_State *L);
+
+	static int startRecording(lua_State *L);
+	static int stopRecording(lua_State *L);
+	static int replayRecording(lua_State *L);
+	static int runBenchmark(lua_State *L);
+	static int simulate(lua_State *L);
+
+	static int setDispatchBudget(lua_State *L);
+	static int getDispatchStats(lua_State *L);
+	static int setBrowseShards(lua_State *L);
+	static int setFreshnessDeadline(lua_State *L);
+
+	static int poll(lua_State *L);
+	static int getFd(lua_State *L);
+
+	static int enableTracing(lua_State *L);
+	static int dumpTrace(lua_State *L);
 
 private:
 	DNSServiceManager *Manager(lua_State *L);
 
 private:
 	CoronaLuaRef fListener;
-	DSNMessageBusBase *fMessanger;
+	LuaMessenger *fMessanger;
 	DNSServiceManager *fManager;
+	DNSTraceRecorder *fRecorder;
+	DNSTraceReplayer *fReplayer;
+	DNSBenchmark *fBenchmark;
+	DNSSimulator *fSimulator;
 };
 
 class LuaMessenger : public DSNMessageBusBase
@@ -71,6 +113,96 @@ public:
 	LuaMessenger(lua_State *L, PluginZeroConf *plugin);
 	virtual void Message(const ServiceInfo &srv, int errorCode, const char* phase) override;
 	virtual ~LuaMessenger();
+
+	// leaves a PluginZeroConfEvent table describing the service on top of the stack,
+	// TXT values the schema names are decoded to numbers and booleans
+	static void PushEvent(lua_State *L, const ServiceInfo &info, int errorCode, const char* phase, const DNSSchema *schema = nullptr);
+
+	// Events are dispatched as they arrive unless a budget is set. Then they
+	// are queued and drained from enterFrame, at most count events or timeMs
+	// worth of listener calls per frame (0 for no limit), but at least one.
+	void SetBudget(lua_State *L, uint32_t timeMs, uint32_t count);
+	void PushStats(lua_State *L) const;
+	// Drains queued events within limits of its own, 0 for none, for hosts
+	// that call zeroconf.poll() rather than run enterFrame. Returns how many
+	// went out.
+	size_t Pump(uint32_t count, uint32_t timeMs);
+
+	// keeps how long the listener took for each event of one browser, null to stop
+	void TimeListener(BrowserHandle browser);
+	std::vector<double> &ListenerTimes() { return listenerTimes; }
+
+	// removes the enterFrame listener and drops whatever is still queued
+	void Shutdown(lua_State *L);
+
+	// Instances each browser currently reports, kept as events arrive rather
+	// than as they are dispatched; null for browsers that reported nothing.
+	DNSPicker *Picker(BrowserHandle browser);
+	// how the TXT values of a browser's events are decoded, an empty schema for none
+	void SetSchema(BrowserHandle browser, const DNSSchema &schema);
+	// Events of a browser or publisher with a listener of its own go to that
+	// listener instead of the one given to init(). The messenger owns the
+	// ref, NULL for none. Both are set for every new handle, since one that
+	// failed and went away by itself may come back with whatever it had.
+	void SetListener(BrowserHandle browser, CoronaLuaRef listener);
+	void SetPublisherListener(PublisherHandle publisher, CoronaLuaRef listener);
+	// A stopped browser's handle may be reused by the next one. Its events
+	// still queued by the budget are dropped, as they were never dispatched.
+	void ForgetBrowser(BrowserHandle browser);
+	// every browser but keep, which stopBrowseAll() leaves running
+	void ForgetBrowsers(BrowserHandle keep = nullptr);
+	void ForgetPublisher(PublisherHandle publisher);
+	void ForgetPublishers();
+
+private:
+	struct QueuedEvent
+	{
+		ServiceInfo info;
+		int errorCode;
+		const char *phase;
+	};
+
+	void Dispatch(const ServiceInfo &info, int errorCode, const char* phase);
+	void ReleasePublisherListener(PublisherHandle publisher);
+	// removes the queued events drop(info) is true for
+	template<typename F>
+	void DropQueued(F drop);
+	void Enqueue(const ServiceInfo &info, int errorCode, const char* phase);
+	size_t Drain(uint32_t count, uint32_t timeMs);
+	void Flush();
+
+	static int OnEnterFrame(lua_State *L);
+
+	// "lost" goes out ahead of everything else, it never has a "found" of
+	// the same service queued behind it
+	std::deque<QueuedEvent> lostQueue;
+	std::deque<QueuedEvent> queue;
+
+	std::unordered_map<BrowserHandle, DNSPicker> pickers;
+	std::unordered_map<BrowserHandle, DNSSchema> schemas;
+	std::unordered_map<BrowserHandle, CoronaLuaRef> browserListeners;
+	std::unordered_map<PublisherHandle, CoronaLuaRef> publisherListeners;
+
+	BrowserHandle timedBrowser;
+	std::vector<double> listenerTimes;
+
+	bool queueing;
+	uint32_t budgetMs;
+	uint32_t budgetCount;
+	CoronaLuaRef enterFrame;
+
+	struct Stats
+	{
+		double queued;
+		double dispatched;
+		double coalesced;
+		size_t maxBacklog;
+		size_t lastFrameEvents;
+		double lastFrameTime;
+		double listenerTime;
+		double listenerMax;
+	};
+	Stats stats;
 };
 
 // ----------------------------------------------------------------------------
@@ -79,85 +211,524 @@ const char PluginZeroConf::kName[] = "plugin.zeroconf";
 const char PluginZeroConf::kEvent[] = "PluginZeroConfEvent";
 
 LuaMessenger::LuaMessenger(lua_State *L, PluginZeroConf *plugin)
-: plugin(plugin)
-, L(L)
+: L(L)
+, plugin(plugin)
+, timedBrowser(nullptr)
+, queueing(false)
+, budgetMs(0)
+, budgetCount(0)
+, enterFrame(NULL)
 {
-
+	memset(&stats, 0, sizeof(stats));
 }
 
-void LuaMessenger::Message(const ServiceInfo &info, int errorCode, const char* phase)
+void LuaMessenger::PushEvent(lua_State *L, const ServiceInfo &info, int errorCode, const char* phase, const DNSSchema *schema)
 {
-	if(plugin->GetListener())
+	CoronaLuaNewEvent( L, PluginZeroConf::kEvent);
+
+	lua_pushboolean(L, errorCode!=0);
+	lua_setfield(L, -2, CoronaEventIsErrorKey());
+
+	lua_pushstring( L, phase);
+	lua_setfield(L, -2, CoronaEventPhaseKey());
+
+	if (errorCode)
 	{
-		CoronaLuaNewEvent( L, PluginZeroConf::kEvent);
+		lua_pushinteger(L, errorCode);
+		lua_setfield(L, -2, CoronaEventErrorCodeKey());
+	}
 
-		lua_pushboolean(L, errorCode!=0);
-		lua_setfield(L, -2, CoronaEventIsErrorKey());
+	if (info.browser)
+	{
+		lua_pushlightuserdata(L, info.browser);
+		lua_setfield(L, -2, "browser");
+	}
 
-		lua_pushstring( L, phase);
-		lua_setfield(L, -2, CoronaEventPhaseKey());
+	if (info.publisher)
+	{
+		lua_pushlightuserdata(L, info.publisher);
+		lua_setfield(L, -2, "publisher");
+	}
 
-		if (errorCode)
-		{
-			lua_pushinteger(L, errorCode);
-			lua_setfield(L, -2, CoronaEventErrorCodeKey());
-		}
+	if(info.nameLength())
+	{
+		lua_pushlstring(L, info.name(), info.nameLength());
+		lua_setfield(L, -2, "serviceName");
+	}
+
+	if(info.nameLength())
+	{
+		// 64 bits don't fit a Lua number, so the id travels as 16 hex digits
+		char id[17];
+		sprintf(id, "%016llx", (unsigned long long)info.instanceId());
+		lua_pushlstring(L, id, 16);
+		lua_setfield(L, -2, "instanceId");
+	}
+
+	if(info.typeLength())
+	{
+		lua_pushlstring(L, info.type(), info.typeLength());
+		lua_setfield(L, -2, "type");
+	}
+
+	if(info.port != -1)
+	{
+		lua_pushinteger(L, info.port);
+		lua_setfield(L, -2, "port");
+	}
+
+	if (info.hostnameLength())
+	{
+		lua_pushlstring(L, info.hostname(), info.hostnameLength());
+		lua_setfield(L, -2, "hostname");
+	}
+
+	lua_createtable(L, (int)info.addresses.size(), 0);
+	int index = 1;
+	for(auto &addr : info.addresses)
+	{
+		char buff[ServiceAddress::kMaxString];
+		lua_pushstring(L, addr.ToString(buff));
+		lua_rawseti(L, -2, index++);
+	}
+	lua_setfield(L, -2, "addresses");
 
-		if (info.browser)
+	// probing browsers tell how each address answered, in the same order
+	bool probed = false;
+	for(auto &addr : info.addresses)
+	{
+		if(addr.reachability != ServiceAddress::kReachabilityUnknown)
+			probed = true;
+	}
+	if(probed)
+	{
+		lua_createtable(L, (int)info.addresses.size(), 0);
+		index = 1;
+		for(auto &addr : info.addresses)
 		{
-			lua_pushlightuserdata(L, info.browser);
-			lua_setfield(L, -2, "browser");
+			char buff[ServiceAddress::kMaxString];
+			lua_createtable(L, 0, 3);
+			lua_pushstring(L, addr.ToString(buff));
+			lua_setfield(L, -2, "address");
+			lua_pushboolean(L, addr.reachability == ServiceAddress::kReachable);
+			lua_setfield(L, -2, "reachable");
+			if(addr.reachability == ServiceAddress::kReachable)
+			{
+				lua_pushnumber(L, addr.rttUs / 1000.0);
+				lua_setfield(L, -2, "rtt");
+			}
+			lua_rawseti(L, -2, index++);
 		}
+		lua_setfield(L, -2, "probes");
+	}
+
+	lua_createtable(L, 0, (int)info.dataCount());
+	info.forEachValue([L, schema](const char *key, size_t keyLength, const char *value, size_t valueLength) {
+		lua_pushlstring(L, key, keyLength);
+		DNSSchema::Type type = schema ? schema->TypeOf(key, keyLength) : DNSSchema::kString;
+		double number;
+		if(!DNSSchema::Decode(type, value, valueLength, number))
+			lua_pushlstring(L, value, valueLength);
+		else if(type == DNSSchema::kBool)
+			lua_pushboolean(L, number != 0);
+		else
+			lua_pushnumber(L, number);
+		lua_rawset(L, -3);
+	});
+	lua_setfield(L, -2, "data");
+}
 
-		if (info.publisher)
+void LuaMessenger::Message(const ServiceInfo &info, int errorCode, const char* phase)
+{
+	if(info.browser)
+	{
+		if(strcmp(phase, "found") == 0 || strcmp(phase, "updated") == 0)
 		{
-			lua_pushlightuserdata(L, info.publisher);
-			lua_setfield(L, -2, "publisher");
+			if(errorCode == 0)
+			{
+				auto picker = pickers.find(info.browser);
+				if(picker == pickers.end())
+				{
+					picker = pickers.emplace(info.browser, DNSPicker()).first;
+					auto schema = schemas.find(info.browser);
+					if(schema != schemas.end())
+						picker->second.SetSchema(&schema->second);
+				}
+				picker->second.Update(info);
+			}
 		}
-
-		if(info.name.length())
+		else if(strcmp(phase, "lost") == 0)
 		{
-			lua_pushstring(L, info.name.c_str());
-			lua_setfield(L, -2, "serviceName");
+			auto picker = pickers.find(info.browser);
+			if(picker != pickers.end())
+				picker->second.Remove(info);
 		}
-
-		if(info.type.length())
+		else if(strcmp(phase, "browseError") == 0)
 		{
-			lua_pushstring(L, info.name.c_str());
-			lua_setfield(L, -2, "type");
+			pickers.erase(info.browser);
 		}
+	}
+
+	if(queueing)
+		Enqueue(info, errorCode, phase);
+	else
+		Dispatch(info, errorCode, phase);
+}
 
-		if(info.port != -1)
+void LuaMessenger::Dispatch(const ServiceInfo &info, int errorCode, const char* phase)
+{
+	stats.dispatched++;
+
+	CoronaLuaRef listener = plugin->GetListener();
+	auto own = info.browser ? browserListeners.find(info.browser) : browserListeners.end();
+	if(own != browserListeners.end())
+	{
+		listener = own->second;
+	}
+	else if(info.publisher)
+	{
+		auto publisher = publisherListeners.find(info.publisher);
+		if(publisher != publisherListeners.end())
+			listener = publisher->second;
+	}
+
+	if(listener)
+	{
 		{
-			lua_pushinteger(L, info.port);
-			lua_setfield(L, -2, "port");
+			DNS_TIMELINE_SPAN("marshal event");
+			auto schema = info.browser ? schemas.find(info.browser) : schemas.end();
+			PushEvent(L, info, errorCode, phase, schema == schemas.end() ? nullptr : &schema->second);
 		}
 
-		if (info.hostname.length())
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 		{
-			lua_pushstring(L, info.hostname.c_str());
-			lua_setfield(L, -2, "hostname");
+			DNS_TIMELINE_SPAN("dispatch event");
+			CoronaLuaDispatchEvent(L, listener, 0);
 		}
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-		lua_createtable(L, (int)info.addresses.size(), 0);
-		int index = 1;
-		for(auto &addr : info.addresses)
+		stats.listenerTime += elapsed;
+		stats.listenerMax = std::max(stats.listenerMax, elapsed);
+		if(info.browser && info.browser == timedBrowser)
+			listenerTimes.push_back(elapsed);
+	}
+}
+
+void LuaMessenger::TimeListener(BrowserHandle browser)
+{
+	timedBrowser = browser;
+	listenerTimes.clear();
+}
+
+void LuaMessenger::Enqueue(const ServiceInfo &info, int errorCode, const char* phase)
+{
+	stats.queued++;
+
+	bool lost = (strcmp(phase, "lost") == 0);
+	if(lost || strcmp(phase, "found") == 0 || strcmp(phase, "updated") == 0)
+	{
+		for(auto it = queue.begin(); it != queue.end(); ++it)
 		{
-			lua_pushstring(L, addr.c_str());
-			lua_rawseti(L, -2, index++);
+			if((strcmp(it->phase, "found") != 0 && strcmp(it->phase, "updated") != 0)
+			   || it->info.browser != info.browser
+			   || !it->info.sameInstance(info.name(), info.type(), info.domain()))
+				continue;
+
+			if(lost)
+			{
+				bool unseen = (strcmp(it->phase, "found") == 0);
+				queue.erase(it);
+				stats.coalesced++;
+
+				// the listener never heard of it, so it doesn't need to hear it is gone
+				if(unseen)
+				{
+					stats.coalesced++;
+					return;
+				}
+			}
+			else
+			{
+				// newer details for a service that is still waiting its turn,
+				// a queued "found" stays a "found"
+				it->info = info;
+				it->errorCode = errorCode;
+				stats.coalesced++;
+				return;
+			}
+			break;
 		}
-		lua_setfield(L, -2, "addresses");
+	}
+
+	QueuedEvent event;
+	event.info = info;
+	event.errorCode = errorCode;
+	event.phase = phase;
+	(lost ? lostQueue : queue).push_back(std::move(event));
+
+	stats.maxBacklog = std::max(stats.maxBacklog, lostQueue.size() + queue.size());
+}
+
+size_t LuaMessenger::Drain(uint32_t maxCount, uint32_t maxMs)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::duration<double, std::milli> elapsed(0);
+	size_t count = 0;
+
+	while(!lostQueue.empty() || !queue.empty())
+	{
+		if(count > 0 && ((maxCount && count >= maxCount) || (maxMs && elapsed.count() >= maxMs)))
+			break;
+
+		std::deque<QueuedEvent> &from = lostQueue.empty() ? queue : lostQueue;
+		QueuedEvent event = std::move(from.front());
+		from.pop_front();
+
+		Dispatch(event.info, event.errorCode, event.phase);
+		count++;
+		elapsed = std::chrono::steady_clock::now() - start;
+	}
+
+	stats.lastFrameEvents = count;
+	stats.lastFrameTime = elapsed.count();
+	return count;
+}
+
+void LuaMessenger::Flush()
+{
+	Drain(0, 0);
+}
+
+size_t LuaMessenger::Pump(uint32_t count, uint32_t timeMs)
+{
+	if(lostQueue.empty() && queue.empty())
+		return 0;
+	return Drain(count, timeMs);
+}
+
+int LuaMessenger::OnEnterFrame(lua_State *L)
+{
+	LuaMessenger *messenger = (LuaMessenger*)lua_touserdata(L, lua_upvalueindex(1));
+	if(messenger->queueing)
+		messenger->Drain(messenger->budgetCount, messenger->budgetMs);
+	return 0;
+}
+
+void LuaMessenger::SetBudget(lua_State *L, uint32_t timeMs, uint32_t count)
+{
+	budgetMs = timeMs;
+	budgetCount = count;
+
+	if(timeMs == 0 && count == 0)
+	{
+		queueing = false;
+		Flush();
+		return;
+	}
+
+	queueing = true;
+	if(enterFrame == NULL)
+	{
+		CoronaLuaPushRuntime(L);
+		lua_getfield(L, -1, "addEventListener");
+		lua_pushvalue(L, -2);
+		lua_pushstring(L, "enterFrame");
+		lua_pushlightuserdata(L, this);
+		lua_pushcclosure(L, &LuaMessenger::OnEnterFrame, 1);
+		enterFrame = CoronaLuaNewRef(L, -1);
+		lua_call(L, 3, 0);
+		lua_pop(L, 1);
+	}
+}
+
+void LuaMessenger::PushStats(lua_State *L) const
+{
+	lua_createtable(L, 0, 9);
+
+	lua_pushnumber(L, (lua_Number)(lostQueue.size() + queue.size()));
+	lua_setfield(L, -2, "backlog");
+
+	lua_pushnumber(L, (lua_Number)stats.maxBacklog);
+	lua_setfield(L, -2, "maxBacklog");
+
+	lua_pushnumber(L, stats.queued);
+	lua_setfield(L, -2, "queued");
+
+	lua_pushnumber(L, stats.dispatched);
+	lua_setfield(L, -2, "dispatched");
+
+	lua_pushnumber(L, stats.coalesced);
+	lua_setfield(L, -2, "coalesced");
+
+	lua_pushnumber(L, (lua_Number)stats.lastFrameEvents);
+	lua_setfield(L, -2, "lastFrameEvents");
+
+	lua_pushnumber(L, stats.lastFrameTime);
+	lua_setfield(L, -2, "lastFrameTime");
+
+	lua_pushnumber(L, stats.listenerTime);
+	lua_setfield(L, -2, "listenerTime");
+
+	lua_pushnumber(L, stats.listenerMax);
+	lua_setfield(L, -2, "listenerMax");
+}
+
+void LuaMessenger::Shutdown(lua_State *L)
+{
+	queueing = false;
+	lostQueue.clear();
+	queue.clear();
+	ForgetBrowsers();
+	ForgetPublishers();
+
+	if(enterFrame)
+	{
+		CoronaLuaPushRuntime(L);
+		lua_getfield(L, -1, "removeEventListener");
+		lua_pushvalue(L, -2);
+		lua_pushstring(L, "enterFrame");
+		CoronaLuaPushRef(L, enterFrame);
+		lua_call(L, 3, 0);
+		lua_pop(L, 1);
+
+		CoronaLuaDeleteRef(L, enterFrame);
+		enterFrame = NULL;
+	}
+}
+
+DNSPicker *LuaMessenger::Picker(BrowserHandle browser)
+{
+	auto picker = pickers.find(browser);
+	return picker == pickers.end() ? nullptr : &picker->second;
+}
+
+void LuaMessenger::SetSchema(BrowserHandle browser, const DNSSchema &schema)
+{
+	if(schema.Empty())
+	{
+		schemas.erase(browser);
+		auto picker = pickers.find(browser);
+		if(picker != pickers.end())
+			picker->second.SetSchema(nullptr);
+		return;
+	}
+
+	DNSSchema &stored = schemas[browser];
+	stored = schema;
+	auto picker = pickers.find(browser);
+	if(picker != pickers.end())
+		picker->second.SetSchema(&stored);
+}
+
+void LuaMessenger::SetListener(BrowserHandle browser, CoronaLuaRef listener)
+{
+	auto stored = browserListeners.find(browser);
+	if(stored != browserListeners.end())
+	{
+		CoronaLuaDeleteRef(L, stored->second);
+		browserListeners.erase(stored);
+	}
+	if(listener)
+		browserListeners[browser] = listener;
+}
+
+void LuaMessenger::SetPublisherListener(PublisherHandle publisher, CoronaLuaRef listener)
+{
+	ReleasePublisherListener(publisher);
+	if(listener)
+		publisherListeners[publisher] = listener;
+}
+
+template<typename F>
+void LuaMessenger::DropQueued(F drop)
+{
+	lostQueue.erase(std::remove_if(lostQueue.begin(), lostQueue.end(), [&drop](const QueuedEvent &event) {
+		return drop(event.info);
+	}), lostQueue.end());
+	queue.erase(std::remove_if(queue.begin(), queue.end(), [&drop](const QueuedEvent &event) {
+		return drop(event.info);
+	}), queue.end());
+}
+
+void LuaMessenger::ForgetBrowser(BrowserHandle browser)
+{
+	pickers.erase(browser);
+	schemas.erase(browser);
+
+	auto listener = browserListeners.find(browser);
+	if(listener != browserListeners.end())
+	{
+		CoronaLuaDeleteRef(L, listener->second);
+		browserListeners.erase(listener);
+	}
+
+	DropQueued([browser](const ServiceInfo &info) {
+		return info.browser == browser;
+	});
+}
 
-		lua_createtable(L, 0, (int)info.data.size());
-		for(auto &dataEntry : info.data)
+void LuaMessenger::ForgetBrowsers(BrowserHandle keep)
+{
+	for(auto picker = pickers.begin(); picker != pickers.end(); )
+	{
+		if(picker->first == keep)
+			++picker;
+		else
+			picker = pickers.erase(picker);
+	}
+	for(auto schema = schemas.begin(); schema != schemas.end(); )
+	{
+		if(schema->first == keep)
+			++schema;
+		else
+			schema = schemas.erase(schema);
+	}
+	for(auto listener = browserListeners.begin(); listener != browserListeners.end(); )
+	{
+		if(listener->first == keep)
 		{
-			lua_pushstring(L, dataEntry.second.c_str());
-			lua_setfield(L, -2, dataEntry.first.c_str());
+			++listener;
+			continue;
 		}
-		lua_setfield(L, -2, "data");
+		CoronaLuaDeleteRef(L, listener->second);
+		listener = browserListeners.erase(listener);
+	}
+
+	DropQueued([keep](const ServiceInfo &info) {
+		return info.browser != nullptr && info.browser != keep;
+	});
+}
+
+void LuaMessenger::ReleasePublisherListener(PublisherHandle publisher)
+{
+	auto listener = publisherListeners.find(publisher);
+	if(listener != publisherListeners.end())
+	{
+		CoronaLuaDeleteRef(L, listener->second);
+		publisherListeners.erase(listener);
+	}
+}
 
-		CoronaLuaDispatchEvent(L, plugin->GetListener(), 0);
+void LuaMessenger::ForgetPublisher(PublisherHandle publisher)
+{
+	ReleasePublisherListener(publisher);
+
+	DropQueued([publisher](const ServiceInfo &info) {
+		return info.publisher == publisher;
+	});
+}
+
+void LuaMessenger::ForgetPublishers()
+{
+	for(auto &listener : publisherListeners)
+	{
+		CoronaLuaDeleteRef(L, listener.second);
 	}
+	publisherListeners.clear();
+
+	DropQueued([](const ServiceInfo &info) {
+		return info.publisher != nullptr;
+	});
 }
 
 LuaMessenger::~LuaMessenger()
@@ -171,13 +742,22 @@ PluginZeroConf::PluginZeroConf()
 : fListener(NULL)
 , fMessanger(nullptr)
 , fManager(nullptr)
+, fRecorder(nullptr)
+, fReplayer(nullptr)
+, fBenchmark(nullptr)
+, fSimulator(nullptr)
 {
 }
 
 PluginZeroConf::~PluginZeroConf()
 {
+	// the replay, the benchmark and the simulation run their timers on the manager's loop
+	delete fReplayer;
+	delete fBenchmark;
+	delete fSimulator;
 	delete fManager;
 	delete fMessanger;
+	delete fRecorder;
 }
 
 DNSServiceManager *
@@ -217,6 +797,29 @@ PluginZeroConf::Open(lua_State *L)
 		{ "browse", browse },
 		{ "stopBrowse", stopBrowse },
 		{ "stopBrowseAll", stopBrowseAll },
+		{ "wakeBrowse", wakeBrowse },
+
+		{ "waitFor", waitFor },
+		{ "resolve", resolve },
+		{ "pick", pick },
+		{ "reportUnreachable", reportUnreachable },
+
+		{ "startRecording", startRecording },
+		{ "stopRecording", stopRecording },
+		{ "replayRecording", replayRecording },
+		{ "runBenchmark", runBenchmark },
+		{ "simulate", simulate },
+
+		{ "setDispatchBudget", setDispatchBudget },
+		{ "getDispatchStats", getDispatchStats },
+		{ "setBrowseShards", setBrowseShards },
+		{ "setFreshnessDeadline", setFreshnessDeadline },
+
+		{ "poll", poll },
+		{ "getFd", getFd },
+
+		{ "enableTracing", enableTracing },
+		{ "dumpTrace", dumpTrace },
 
 		{ NULL, NULL }
 	};
@@ -236,6 +839,9 @@ PluginZeroConf::Finalizer(lua_State *L)
 
 	CoronaLuaDeleteRef(L, plugin->GetListener());
 
+	if(plugin->fMessanger)
+		plugin->fMessanger->Shutdown(L);
+
 	delete plugin;
 	return 0;
 }
@@ -264,26 +870,59 @@ PluginZeroConf::init( lua_State *L )
 	return 0;
 }
 
+// a new ref to the 'listener' field, NULL if there is none
+static CoronaLuaRef GetOwnListener(lua_State *L, int idx)
+{
+	CoronaLuaRef listener = NULL;
+	lua_getfield(L, idx, "listener");
+	if( CoronaLuaIsListener(L, -1, PluginZeroConf::kEvent) )
+	{
+		listener = CoronaLuaNewRef(L, -1);
+	}
+	lua_pop(L, 1);
+	return listener;
+}
+
+// reads a { key = "type" } table, values are left alone if the field is missing
+static void GetSchema(lua_State *L, int idx, const char *function, DNSSchema &schema)
+{
+	lua_getfield(L, idx, "schema");
+	if( lua_istable(L, -1) )
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			if(lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING || !schema.Add(lua_tostring(L, -2), lua_tostring(L, -1)))
+			{
+				CoronaLuaWarning(L, "zeroconf.%s(): 'schema' entry for '%s' is not a known type, the value stays a string", function,
+								 lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : "?");
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+}
+
 int
 PluginZeroConf::publish( lua_State *L )
 {
 	int idx = 1;
 
 	ServiceInfo si;
+	DNSSchema schema;
 
 	if(lua_istable(L, 1))
 	{
 		lua_getfield(L, idx, "name");
 		if( lua_type(L, -1) == LUA_TSTRING )
 		{
-			si.name = lua_tostring(L, -1);
+			si.setName(lua_tostring(L, -1));
 		}
 		lua_pop(L, 1);
 
 		lua_getfield(L, idx, "serviceName");
 		if( lua_type(L, -1) == LUA_TSTRING )
 		{
-			si.name = lua_tostring(L, -1);
+			si.setName(lua_tostring(L, -1));
 		}
 		lua_pop(L, 1);
 
@@ -291,27 +930,59 @@ PluginZeroConf::publish( lua_State *L )
 		lua_getfield(L, idx, "type");
 		if( lua_type(L, -1) == LUA_TSTRING )
 		{
-			si.type = lua_tostring(L, -1);
+			si.setType(lua_tostring(L, -1));
 		}
 		lua_pop(L, 1);
 
 		lua_getfield(L, idx, "domain");
 		if( lua_type(L, -1) == LUA_TSTRING )
 		{
-			si.domain = lua_tostring(L, -1);
+			si.setDomain(lua_tostring(L, -1));
 		}
 		lua_pop(L, 1);
 
+		GetSchema(L, idx, "publish", schema);
+
 		lua_getfield(L, -1, "data");
 		if(lua_istable(L, -1))
 		{
+			std::string encoded;
 			lua_pushnil(L);
 			while (lua_next(L, -2) != 0) {
-				if(lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1))
+				if(lua_type(L, -2) != LUA_TSTRING)
 				{
-					const char* key = lua_tostring(L, -2);
-					const char* value = lua_tostring(L, -1);
-					si.setData(key, value);
+					lua_pop(L, 1);
+					continue;
+				}
+
+				const char* key = lua_tostring(L, -2);
+				DNSSchema::Type type = schema.TypeOf(key, strlen(key));
+				if(type != DNSSchema::kString)
+				{
+					// numeric strings count as numbers, booleans as 0 and 1
+					bool isBoolean = lua_type(L, -1) == LUA_TBOOLEAN;
+					double number = isBoolean ? (lua_toboolean(L, -1) ? 1 : 0) : lua_tonumber(L, -1);
+					encoded.clear();
+					if((isBoolean || lua_isnumber(L, -1)) && DNSSchema::Encode(type, number, encoded))
+					{
+						if(!si.setData(key, encoded.data(), encoded.size()))
+						{
+							CoronaLuaWarning(L, "zeroconf.publish(): '%s' does not fit the TXT record and is left out", key);
+						}
+					}
+					else
+					{
+						CoronaLuaWarning(L, "zeroconf.publish(): value of '%s' does not fit its schema type and is left out", key);
+					}
+				}
+				else if(lua_isstring(L, -1))
+				{
+					size_t length;
+					const char* value = lua_tolstring(L, -1, &length);
+					if(!si.setData(key, value, length))
+					{
+						CoronaLuaWarning(L, "zeroconf.publish(): '%s' does not fit the TXT record and is left out", key);
+					}
 				}
 				lua_pop(L, 1);
 			}
@@ -334,10 +1005,11 @@ PluginZeroConf::publish( lua_State *L )
 		CoronaLuaError(L, "zeroconf.publish(): did not receive parameters table" );
 	}
 
-	PublisherHandle publisher = ToManager(L)->publish(si);
+	PublisherHandle publisher = ToManager(L)->publish(std::move(si));
 	
 	if(publisher)
 	{
+		ToPlugin(L)->fMessanger->SetPublisherListener(publisher, GetOwnListener(L, idx));
 		lua_pushlightuserdata(L, publisher);
 	}
 	else
@@ -369,6 +1041,7 @@ PluginZeroConf::unpublish( lua_State *L )
 	{
 		CoronaLuaWarning(L, "zeroconf.unpublish(): unable to find specified service!" );
 	}
+	ToPlugin(L)->fMessanger->ForgetPublisher(publisher);
 
 	return 0;
 }
@@ -378,6 +1051,7 @@ int
 PluginZeroConf::unpublishAll( lua_State *L )
 {
 	ToManager(L)->unpublishAll();
+	ToPlugin(L)->fMessanger->ForgetPublishers();
 	return 0;
 }
 
@@ -388,49 +1062,150 @@ PluginZeroConf::browse( lua_State *L )
 	int idx = 1;
 
 	ServiceInfo si;
+	BrowseDuty duty;
+	BrowseProbe probe;
+	DNSSchema schema;
+	bool passive = false;
+	bool shared = false;
 
 	if(lua_istable(L, 1))
 	{
+		GetSchema(L, idx, "browse", schema);
+
 		lua_getfield(L, idx, "type");
 		if( lua_type(L, -1) == LUA_TSTRING )
 		{
-			si.type = lua_tostring(L, -1);
+			si.setType(lua_tostring(L, -1));
 		}
 		lua_pop(L, 1);
 
 		lua_getfield(L, idx, "domain");
 		if( lua_type(L, -1) == LUA_TSTRING )
 		{
-			si.domain = lua_tostring(L, -1);
+			si.setDomain(lua_tostring(L, -1));
 		}
 		lua_pop(L, 1);
-	}
 
-	ToManager(L)->browse(si);
+		lua_getfield(L, idx, "duty");
+		if( lua_type(L, -1) == LUA_TBOOLEAN )
+		{
+			duty.enabled = lua_toboolean(L, -1) != 0;
+		}
+		else if( lua_istable(L, -1) )
+		{
+			duty.enabled = true;
 
-	return 1;
-}
+			lua_getfield(L, -1, "stableTime");
+			if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+			{
+				duty.stableMs = (uint32_t)lua_tonumber(L, -1);
+			}
+			lua_pop(L, 1);
 
+			lua_getfield(L, -1, "pulseTime");
+			if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+			{
+				duty.pulseMs = (uint32_t)lua_tonumber(L, -1);
+			}
+			lua_pop(L, 1);
 
-int
-PluginZeroConf::stopBrowse( lua_State *L )
-{
-	int idx = 1;
-	PublisherHandle browser = nullptr;
+			lua_getfield(L, -1, "pulseInterval");
+			if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+			{
+				duty.intervalMs = (uint32_t)lua_tonumber(L, -1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
 
-	if(lua_type(L, idx) == LUA_TLIGHTUSERDATA)
-	{
-		browser = lua_touserdata(L, -1);
-	}
-	else
-	{
-		CoronaLuaError(L, "zeroconf.stopBrowse(): did not receive browser type as first parameter");
-	}
+		lua_getfield(L, idx, "passive");
+		if( lua_type(L, -1) == LUA_TBOOLEAN )
+		{
+			passive = lua_toboolean(L, -1) != 0;
+		}
+		lua_pop(L, 1);
 
-	if(!ToManager(L)->stopBrowser(browser))
-	{
-		CoronaLuaWarning(L, "zeroconf.stopBrowse(): unable to find specified browser!" );
+		lua_getfield(L, idx, "shared");
+		if( lua_type(L, -1) == LUA_TBOOLEAN )
+		{
+			shared = lua_toboolean(L, -1) != 0;
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "probe");
+		if( lua_type(L, -1) == LUA_TBOOLEAN )
+		{
+			probe.enabled = lua_toboolean(L, -1) != 0;
+		}
+		else if( lua_istable(L, -1) )
+		{
+			probe.enabled = true;
+
+			lua_getfield(L, -1, "timeout");
+			if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+			{
+				probe.timeoutMs = (uint32_t)lua_tonumber(L, -1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+
+	if(passive && duty.enabled)
+	{
+		// a passive browser sends nothing, so there is nothing to cycle
+		CoronaLuaWarning(L, "zeroconf.browse(): 'duty' is ignored for passive browsers");
+	}
+
+	if(passive && shared)
+	{
+		// listening costs nothing, so there is no traffic to share
+		CoronaLuaWarning(L, "zeroconf.browse(): 'shared' is ignored for passive browsers");
+		shared = false;
+	}
+
+	BrowserHandle browser;
+	if(passive)
+		browser = ToManager(L)->passiveBrowse(si, probe);
+	else if(shared)
+		browser = ToManager(L)->sharedBrowse(si, duty, probe);
+	else
+		browser = ToManager(L)->browse(si, duty, probe);
+	if(browser)
+	{
+		ToPlugin(L)->fMessanger->SetSchema(browser, schema);
+		ToPlugin(L)->fMessanger->SetListener(browser, lua_istable(L, idx) ? GetOwnListener(L, idx) : NULL);
+		lua_pushlightuserdata(L, browser);
+	}
+	else
+	{
+		lua_pushnil(L);
+	}
+
+	return 1;
+}
+
+
+int
+PluginZeroConf::stopBrowse( lua_State *L )
+{
+	int idx = 1;
+	PublisherHandle browser = nullptr;
+
+	if(lua_type(L, idx) == LUA_TLIGHTUSERDATA)
+	{
+		browser = lua_touserdata(L, -1);
+	}
+	else
+	{
+		CoronaLuaError(L, "zeroconf.stopBrowse(): did not receive browser type as first parameter");
+	}
+
+	if(!ToManager(L)->stopBrowser(browser))
+	{
+		CoronaLuaWarning(L, "zeroconf.stopBrowse(): unable to find specified browser!" );
 	}
+	ToPlugin(L)->fMessanger->ForgetBrowser(browser);
 
 
 	return 0;
@@ -440,10 +1215,1043 @@ int
 PluginZeroConf::stopBrowseAll( lua_State *L )
 {
 	ToManager(L)->stopAllBrowsers();
+	// the simulation is not a browser stopBrowseAll() stops
+	Self *plugin = ToPlugin(L);
+	plugin->fMessanger->ForgetBrowsers(plugin->fSimulator ? plugin->fSimulator->Handle() : nullptr);
+	return 0;
+}
+
+// [Lua] zeroconf.wakeBrowse( browser )
+int
+PluginZeroConf::wakeBrowse( lua_State *L )
+{
+	int idx = 1;
+	BrowserHandle browser = nullptr;
+
+	if(lua_type(L, idx) == LUA_TLIGHTUSERDATA)
+	{
+		browser = lua_touserdata(L, idx);
+	}
+	else
+	{
+		CoronaLuaError(L, "zeroconf.wakeBrowse(): did not receive browser type as first parameter");
+		return 0;
+	}
+
+	if(!ToManager(L)->wakeBrowser(browser))
+	{
+		CoronaLuaWarning(L, "zeroconf.wakeBrowse(): unable to find specified browser!" );
+	}
+
 	return 0;
 }
 
 
+// A yielded coroutine is not necessarily still in the wait that yielded it:
+// someone else may have resumed it, and it may be yielding for something
+// else by now. Each wait leaves a token of its own under the thread, and
+// the completion resumes the coroutine only while that token is there.
+static const char kWaitTokens = 0;	// its address keys the token table in the registry
+static lua_Integer sLastWaitToken = 0;
+
+static lua_Integer BeginWait(lua_State *L)
+{
+	lua_pushlightuserdata(L, (void*)&kWaitTokens);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if(!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlightuserdata(L, (void*)&kWaitTokens);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_Integer token = ++sLastWaitToken;
+	lua_pushthread(L);
+	lua_pushinteger(L, token);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	return token;
+}
+
+// drops the token and tells whether the coroutine still waits for it
+static bool EndWait(lua_State *thread, lua_Integer token)
+{
+	bool current = false;
+	lua_pushlightuserdata(thread, (void*)&kWaitTokens);
+	lua_rawget(thread, LUA_REGISTRYINDEX);
+	if(lua_istable(thread, -1))
+	{
+		lua_pushthread(thread);
+		lua_rawget(thread, -2);
+		current = lua_tointeger(thread, -1) == token;
+		lua_pop(thread, 1);
+		if(current)
+		{
+			lua_pushthread(thread);
+			lua_pushnil(thread);
+			lua_rawset(thread, -3);
+		}
+	}
+	lua_pop(thread, 1);
+	return current && lua_status(thread) == LUA_YIELD;
+}
+
+// [Lua] local services, err = zeroconf.waitFor( params )
+int
+PluginZeroConf::waitFor( lua_State *L )
+{
+	int idx = 1;
+
+	WaitRequest request;
+
+	if(lua_istable(L, idx))
+	{
+		lua_getfield(L, idx, "type");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			request.query.setType(lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "domain");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			request.query.setDomain(lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "name");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			request.query.setName(lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "match");
+		if(lua_istable(L, -1))
+		{
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				if(lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1))
+				{
+					size_t len;
+					const char* key = lua_tostring(L, -2);
+					const char* value = lua_tolstring(L, -1, &len);
+					request.match.push_back(std::make_pair(std::string(key), std::string(value, len)));
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "count");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) > 0 )
+		{
+			request.count = (size_t)lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "timeout");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+		{
+			request.timeoutMs = (uint32_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	else
+	{
+		CoronaLuaError(L, "zeroconf.waitFor(): did not receive parameters table" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	if(lua_pushthread(L))
+	{
+		lua_pop(L, 1);
+		CoronaLuaError(L, "zeroconf.waitFor(): must be called from a coroutine" );
+		lua_pushnil( L );
+		return 1;
+	}
+	int threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_State *thread = L;
+	lua_Integer token = BeginWait(L);
+
+	WaiterHandle waiter = ToManager(L)->waitFor(request, [thread, threadRef, token](const std::vector<ServiceInfo> &found, int errorCode) {
+		// the coroutine may have been resumed by someone else in the meantime
+		if(EndWait(thread, token))
+		{
+			lua_createtable(thread, (int)found.size(), 0);
+			int index = 1;
+			for(const auto &info : found)
+			{
+				LuaMessenger::PushEvent(thread, info, 0, "found");
+				lua_rawseti(thread, -2, index++);
+			}
+
+			if(errorCode == 0)
+				lua_pushnil(thread);
+			else if(errorCode == DNSServiceManager::kErrorTimeout)
+				lua_pushstring(thread, "timeout");
+			else
+				lua_pushinteger(thread, errorCode);
+
+			int status = lua_resume(thread, 2);
+			if(status != 0 && status != LUA_YIELD)
+			{
+				CoronaLuaError(thread, "zeroconf.waitFor(): error in resumed coroutine: %s", lua_tostring(thread, -1));
+				lua_pop(thread, 1);
+			}
+		}
+		luaL_unref(thread, LUA_REGISTRYINDEX, threadRef);
+	});
+
+	if(waiter == nullptr)
+	{
+		EndWait(L, token);
+		luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+		CoronaLuaWarning(L, "zeroconf.waitFor(): failed to start browsing!" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	return lua_yield(L, 0);
+}
+
+// [Lua] zeroconf.resolve( params )
+int
+PluginZeroConf::resolve( lua_State *L )
+{
+	int idx = 1;
+
+	ServiceInfo si;
+	uint32_t timeoutMs = 5000;
+
+	if(lua_istable(L, idx))
+	{
+		lua_getfield(L, idx, "name");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			si.setName(lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "type");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			si.setType(lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "domain");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			si.setDomain(lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "timeout");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0 )
+		{
+			timeoutMs = (uint32_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	else
+	{
+		CoronaLuaError(L, "zeroconf.resolve(): did not receive parameters table" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	if(si.nameLength() == 0)
+	{
+		CoronaLuaError(L, "zeroconf.resolve(): service name is required" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	if(ToManager(L)->resolve(si, timeoutMs) == nullptr)
+	{
+		CoronaLuaWarning(L, "zeroconf.resolve(): failed to start resolving!" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	lua_pushboolean( L, 1 );
+	return 1;
+}
+
+// [Lua] local name, address, port, hostname = zeroconf.pick( params )
+int
+PluginZeroConf::pick( lua_State *L )
+{
+	int idx = 1;
+
+	BrowserHandle browser = nullptr;
+	const char *weightKey = "weight";
+	const char *loadKey = "load";
+	DNSPicker::Strategy strategy = DNSPicker::kLeastLoaded;
+
+	if(lua_istable(L, idx))
+	{
+		lua_getfield(L, idx, "browser");
+		if( lua_type(L, -1) == LUA_TLIGHTUSERDATA )
+		{
+			browser = lua_touserdata(L, -1);
+		}
+		lua_pop(L, 1);
+
+		// the strings stay referenced by the parameters table until this returns
+		lua_getfield(L, idx, "weightKey");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			weightKey = lua_tostring(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "loadKey");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			loadKey = lua_tostring(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "strategy");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			const char *name = lua_tostring(L, -1);
+			if(strcmp(name, "leastLoaded") == 0)
+			{
+				strategy = DNSPicker::kLeastLoaded;
+			}
+			else if(strcmp(name, "weightedRandom") == 0)
+			{
+				strategy = DNSPicker::kWeightedRandom;
+			}
+			else if(strcmp(name, "p2c") == 0)
+			{
+				strategy = DNSPicker::kPowerOfTwoChoices;
+			}
+			else
+			{
+				CoronaLuaError(L, "zeroconf.pick(): unknown strategy '%s'", name);
+				lua_pop(L, 1);
+				lua_pushnil( L );
+				return 1;
+			}
+		}
+		lua_pop(L, 1);
+	}
+	else
+	{
+		CoronaLuaError(L, "zeroconf.pick(): did not receive parameters table" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	if(browser == nullptr)
+	{
+		CoronaLuaError(L, "zeroconf.pick(): parameters table does not contain 'browser' field" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	Self *plugin = ToPlugin(L);
+	plugin->Manager(L);
+	DNSPicker *picker = plugin->fMessanger->Picker(browser);
+	const ServiceInfo *info = picker ? picker->Pick(weightKey, loadKey, strategy) : nullptr;
+	if(info == nullptr)
+	{
+		lua_pushnil( L );
+		return 1;
+	}
+
+	lua_pushlstring(L, info->name(), info->nameLength());
+
+	if(info->addresses.size())
+	{
+		char buff[ServiceAddress::kMaxString];
+		lua_pushstring(L, info->addresses[0].ToString(buff));
+	}
+	else
+	{
+		lua_pushnil(L);
+	}
+
+	lua_pushinteger(L, info->port);
+	lua_pushlstring(L, info->hostname(), info->hostnameLength());
+	return 4;
+}
+
+// [Lua] zeroconf.reportUnreachable( instanceId )
+int
+PluginZeroConf::reportUnreachable( lua_State *L )
+{
+	int idx = 1;
+	unsigned long long instanceId = 0;
+
+	// the 16 hex digits events carry as instanceId
+	const char *id = lua_type(L, idx) == LUA_TSTRING ? lua_tostring(L, idx) : nullptr;
+	char *end = nullptr;
+	if(id)
+		instanceId = strtoull(id, &end, 16);
+
+	if(id == nullptr || strlen(id) != 16 || end != id + 16)
+	{
+		CoronaLuaError(L, "zeroconf.reportUnreachable(): did not receive instanceId of an event as first parameter");
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	lua_pushboolean( L, ToManager(L)->Freshness().Reconfirm((uint64_t)instanceId) );
+	return 1;
+}
+
+// [Lua] zeroconf.setDispatchBudget( [params] )
+int
+PluginZeroConf::setDispatchBudget( lua_State *L )
+{
+	int idx = 1;
+	uint32_t timeMs = 0;
+	uint32_t count = 0;
+
+	if(lua_istable(L, idx))
+	{
+		lua_getfield(L, idx, "time");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+		{
+			timeMs = (uint32_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "count");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+		{
+			count = (uint32_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	else if(!lua_isnoneornil(L, idx))
+	{
+		CoronaLuaError(L, "zeroconf.setDispatchBudget(): expected parameters table or nil" );
+		return 0;
+	}
+
+	Self *plugin = ToPlugin(L);
+	plugin->Manager(L);
+	plugin->fMessanger->SetBudget(L, timeMs, count);
+
+	return 0;
+}
+
+// [Lua] zeroconf.setBrowseShards( count )
+int
+PluginZeroConf::setBrowseShards( lua_State *L )
+{
+	int idx = 1;
+	size_t count = 0;
+
+	if( lua_type(L, idx) == LUA_TNUMBER && lua_tonumber(L, idx) >= 0 )
+	{
+		count = (size_t)lua_tonumber(L, idx);
+	}
+	else if(!lua_isnoneornil(L, idx))
+	{
+		CoronaLuaError(L, "zeroconf.setBrowseShards(): expected number of shards or nil" );
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	if(!ToManager(L)->setShards(count))
+	{
+		CoronaLuaWarning(L, "zeroconf.setBrowseShards(): stop browsing before changing the number of shards!" );
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	lua_pushboolean( L, 1 );
+	return 1;
+}
+
+// [Lua] zeroconf.setFreshnessDeadline( milliseconds )
+int
+PluginZeroConf::setFreshnessDeadline( lua_State *L )
+{
+	int idx = 1;
+	uint32_t deadlineMs = 0;
+
+	if( lua_type(L, idx) == LUA_TNUMBER && lua_tonumber(L, idx) >= 0 )
+	{
+		deadlineMs = (uint32_t)lua_tonumber(L, idx);
+	}
+	else if(!lua_isnoneornil(L, idx))
+	{
+		CoronaLuaError(L, "zeroconf.setFreshnessDeadline(): expected number of milliseconds or nil" );
+		return 0;
+	}
+
+	ToManager(L)->Freshness().SetDeadline(deadlineMs);
+	return 0;
+}
+
+// [Lua] local count = zeroconf.poll( [params] )
+int
+PluginZeroConf::poll( lua_State *L )
+{
+	int idx = 1;
+	uint32_t maxEvents = 0;
+	uint32_t maxMs = 0;
+
+	if( lua_istable(L, idx) )
+	{
+		lua_getfield(L, idx, "maxEvents");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+		{
+			maxEvents = (uint32_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "maxMillis");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+		{
+			maxMs = (uint32_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	else if(!lua_isnoneornil(L, idx))
+	{
+		CoronaLuaError(L, "zeroconf.poll(): expected parameters table or nil" );
+		return 0;
+	}
+
+	Self *plugin = ToPlugin(L);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t count = plugin->Manager(L)->EventLoop().Poll(maxEvents, maxMs);
+
+	// what the loop left of the budget goes to events a dispatch budget queued
+	uint32_t elapsedMs = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	bool spent = (maxEvents && count >= maxEvents) || (maxMs && elapsedMs >= maxMs);
+	if(!spent)
+	{
+		count += plugin->fMessanger->Pump(maxEvents ? maxEvents - (uint32_t)count : 0, maxMs ? maxMs - elapsedMs : 0);
+	}
+
+	lua_pushinteger(L, (lua_Integer)count);
+	return 1;
+}
+
+// [Lua] local fd = zeroconf.getFd()
+int
+PluginZeroConf::getFd( lua_State *L )
+{
+	int fd = ToManager(L)->EventLoop().Descriptor();
+	if(fd < 0)
+	{
+		lua_pushnil(L);
+	}
+	else
+	{
+		lua_pushinteger(L, fd);
+	}
+	return 1;
+}
+
+// [Lua] zeroconf.getDispatchStats()
+int
+PluginZeroConf::getDispatchStats( lua_State *L )
+{
+	Self *plugin = ToPlugin(L);
+	plugin->Manager(L);
+	plugin->fMessanger->PushStats(L);
+	return 1;
+}
+
+// [Lua] zeroconf.startRecording( path )
+int
+PluginZeroConf::startRecording( lua_State *L )
+{
+	if(lua_type(L, 1) != LUA_TSTRING)
+	{
+		CoronaLuaError(L, "zeroconf.startRecording(): did not receive file path as first parameter");
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	Self *plugin = ToPlugin(L);
+	DNSServiceManager *manager = plugin->Manager(L);
+	if(plugin->fRecorder == nullptr)
+		plugin->fRecorder = new DNSTraceRecorder();
+
+	manager->setRecorder(nullptr);
+	bool opened = plugin->fRecorder->Open(lua_tostring(L, 1));
+	if(opened)
+	{
+		manager->setRecorder(plugin->fRecorder);
+	}
+	else
+	{
+		CoronaLuaWarning(L, "zeroconf.startRecording(): unable to open '%s' for writing", lua_tostring(L, 1));
+	}
+
+	lua_pushboolean(L, opened);
+	return 1;
+}
+
+int
+PluginZeroConf::stopRecording( lua_State *L )
+{
+	Self *plugin = ToPlugin(L);
+	if(plugin->fRecorder)
+	{
+		plugin->Manager(L)->setRecorder(nullptr);
+		plugin->fRecorder->Close();
+	}
+	return 0;
+}
+
+// [Lua] zeroconf.replayRecording( params )
+int
+PluginZeroConf::replayRecording( lua_State *L )
+{
+	int idx = 1;
+	const char *path = nullptr;
+	double speed = 1;
+
+	if(lua_istable(L, idx))
+	{
+		lua_getfield(L, idx, "path");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			path = lua_tostring(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "speed");
+		if( lua_type(L, -1) == LUA_TNUMBER )
+		{
+			speed = lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+
+	if(path == nullptr)
+	{
+		CoronaLuaError(L, "zeroconf.replayRecording(): parameters table does not contain 'path' field");
+		lua_pushnil(L);
+		return 1;
+	}
+
+	Self *plugin = ToPlugin(L);
+	if(speed <= 0)
+	{
+		DNSTraceReplayer replayer(*plugin->Manager(L));
+		replayer.SetBrowserStoppedHandler([plugin](BrowserHandle browser) {
+			plugin->fMessanger->ForgetBrowser(browser);
+		});
+		if(!replayer.Open(path))
+		{
+			CoronaLuaWarning(L, "zeroconf.replayRecording(): '%s' is not a ZeroConf recording", path);
+			lua_pushnil(L);
+			return 1;
+		}
+
+		lua_pushinteger(L, (lua_Integer)replayer.Run());
+		return 1;
+	}
+
+	if(plugin->fReplayer)
+	{
+		CoronaLuaWarning(L, "zeroconf.replayRecording(): a recording is already being replayed!" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	if(lua_pushthread(L))
+	{
+		lua_pop(L, 1);
+		CoronaLuaError(L, "zeroconf.replayRecording(): must be called from a coroutine unless speed is 0" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	plugin->fReplayer = new DNSTraceReplayer(*plugin->Manager(L));
+	plugin->fReplayer->SetBrowserStoppedHandler([plugin](BrowserHandle browser) {
+		plugin->fMessanger->ForgetBrowser(browser);
+	});
+	if(!plugin->fReplayer->Open(path))
+	{
+		lua_pop(L, 1);
+		delete plugin->fReplayer;
+		plugin->fReplayer = nullptr;
+		CoronaLuaWarning(L, "zeroconf.replayRecording(): '%s' is not a ZeroConf recording", path);
+		lua_pushnil(L);
+		return 1;
+	}
+
+	int threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_State *thread = L;
+	lua_Integer token = BeginWait(L);
+
+	// records are dispatched from timers of the manager's loop, the coroutine resumes after the last
+	plugin->fReplayer->Play(speed, [plugin, thread, threadRef, token](size_t replayed) {
+		delete plugin->fReplayer;
+		plugin->fReplayer = nullptr;
+
+		if(EndWait(thread, token))
+		{
+			lua_pushinteger(thread, (lua_Integer)replayed);
+			int status = lua_resume(thread, 1);
+			if(status != 0 && status != LUA_YIELD)
+			{
+				CoronaLuaError(thread, "zeroconf.replayRecording(): error in resumed coroutine: %s", lua_tostring(thread, -1));
+				lua_pop(thread, 1);
+			}
+		}
+		luaL_unref(thread, LUA_REGISTRYINDEX, threadRef);
+	});
+
+	return lua_yield(L, 0);
+}
+
+// reads a number or an array of numbers; values are left alone if the field is missing
+template<typename T>
+static void GetSweep(lua_State *L, int idx, const char *field, std::vector<T> &values)
+{
+	lua_getfield(L, idx, field);
+	if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0 )
+	{
+		values.assign(1, (T)lua_tonumber(L, -1));
+	}
+	else if( lua_istable(L, -1) && lua_objlen(L, -1) > 0 )
+	{
+		values.clear();
+		int count = (int)lua_objlen(L, -1);
+		for(int i = 1; i <= count; i++)
+		{
+			lua_rawgeti(L, -1, i);
+			if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0 )
+			{
+				values.push_back((T)lua_tonumber(L, -1));
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+static void PushLatency(lua_State *L, const LatencySummary &summary, const char *field)
+{
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer)summary.count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, summary.p50Ms);
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, summary.p99Ms);
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, summary.maxMs);
+	lua_setfield(L, -2, "max");
+	lua_setfield(L, -2, field);
+}
+
+// [Lua] local results = zeroconf.runBenchmark( params )
+int
+PluginZeroConf::runBenchmark( lua_State *L )
+{
+	int idx = 1;
+	BenchmarkConfig config;
+	std::string path;
+	std::string label;
+
+	if(lua_istable(L, idx))
+	{
+		lua_getfield(L, idx, "type");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			config.type = lua_tostring(L, -1);
+		}
+		lua_pop(L, 1);
+
+		GetSweep(L, idx, "services", config.serviceCounts);
+		GetSweep(L, idx, "txtSize", config.txtSizes);
+		GetSweep(L, idx, "churn", config.churnIntervals);
+
+		lua_getfield(L, idx, "samples");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1 )
+		{
+			config.samples = (size_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "timeout");
+		if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+		{
+			config.timeoutMs = (uint32_t)lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "path");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			path = lua_tostring(L, -1);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "label");
+		if( lua_type(L, -1) == LUA_TSTRING )
+		{
+			label = lua_tostring(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	else if(!lua_isnoneornil(L, idx))
+	{
+		CoronaLuaError(L, "zeroconf.runBenchmark(): expected parameters table or nil" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	Self *plugin = ToPlugin(L);
+	if(plugin->fBenchmark)
+	{
+		CoronaLuaWarning(L, "zeroconf.runBenchmark(): a benchmark is already running!" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	if(lua_pushthread(L))
+	{
+		lua_pop(L, 1);
+		CoronaLuaError(L, "zeroconf.runBenchmark(): must be called from a coroutine" );
+		lua_pushnil( L );
+		return 1;
+	}
+	int threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_State *thread = L;
+	lua_Integer token = BeginWait(L);
+
+	plugin->fBenchmark = new DNSBenchmark(config, plugin->Manager(L)->EventLoop(), [plugin, thread, threadRef, token, path, label](const std::vector<BenchmarkResult> &results) {
+		delete plugin->fBenchmark;
+		plugin->fBenchmark = nullptr;
+
+		if(!path.empty())
+		{
+			// appended, so that runs of several releases end up side by side
+			FILE *file = fopen(path.c_str(), "a");
+			if(file)
+			{
+				for(const auto &result : results)
+				{
+					fprintf(file, "%s\n", result.ToJSON(label).c_str());
+				}
+				fclose(file);
+			}
+			else
+			{
+				CoronaLuaWarning(thread, "zeroconf.runBenchmark(): unable to write '%s'", path.c_str());
+			}
+		}
+
+		if(EndWait(thread, token))
+		{
+			lua_createtable(thread, (int)results.size(), 0);
+			int index = 1;
+			for(const auto &result : results)
+			{
+				lua_createtable(thread, 0, 8);
+				lua_pushinteger(thread, (lua_Integer)result.services);
+				lua_setfield(thread, -2, "services");
+				lua_pushinteger(thread, (lua_Integer)result.txtSize);
+				lua_setfield(thread, -2, "txtSize");
+				lua_pushinteger(thread, (lua_Integer)result.churnMs);
+				lua_setfield(thread, -2, "churn");
+				lua_pushinteger(thread, (lua_Integer)result.samples);
+				lua_setfield(thread, -2, "samples");
+				lua_pushinteger(thread, (lua_Integer)result.timeouts);
+				lua_setfield(thread, -2, "timeouts");
+				PushLatency(thread, result.registered, "registered");
+				PushLatency(thread, result.found, "found");
+				PushLatency(thread, result.lost, "lost");
+				lua_rawseti(thread, -2, index++);
+			}
+
+			int status = lua_resume(thread, 1);
+			if(status != 0 && status != LUA_YIELD)
+			{
+				CoronaLuaError(thread, "zeroconf.runBenchmark(): error in resumed coroutine: %s", lua_tostring(thread, -1));
+				lua_pop(thread, 1);
+			}
+		}
+		luaL_unref(thread, LUA_REGISTRYINDEX, threadRef);
+	});
+
+	plugin->fBenchmark->Start();
+
+	return lua_yield(L, 0);
+}
+
+// [Lua] local simulation = zeroconf.simulate( params )
+// [Lua] local results = zeroconf.simulate()
+int
+PluginZeroConf::simulate( lua_State *L )
+{
+	int idx = 1;
+	Self *plugin = ToPlugin(L);
+	DNSServiceManager *manager = plugin->Manager(L);
+
+	if(!lua_istable(L, idx))
+	{
+		if(!lua_isnoneornil(L, idx) && !(lua_isboolean(L, idx) && !lua_toboolean(L, idx)))
+		{
+			CoronaLuaError(L, "zeroconf.simulate(): expected parameters table, false or nil" );
+			lua_pushnil( L );
+			return 1;
+		}
+
+		DNSSimulator *simulator = plugin->fSimulator;
+		if(simulator == nullptr)
+		{
+			CoronaLuaWarning(L, "zeroconf.simulate(): no simulation is running!" );
+			lua_pushnil( L );
+			return 1;
+		}
+		plugin->fSimulator = nullptr;
+		simulator->Stop();
+
+		std::vector<double> &times = plugin->fMessanger->ListenerTimes();
+		double total = 0;
+		for(double time : times)
+		{
+			total += time;
+		}
+
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, (lua_Integer)simulator->Found());
+		lua_setfield(L, -2, "found");
+		lua_pushinteger(L, (lua_Integer)simulator->Lost());
+		lua_setfield(L, -2, "lost");
+		lua_pushinteger(L, (lua_Integer)simulator->Updated());
+		lua_setfield(L, -2, "updated");
+		lua_pushnumber(L, total);
+		lua_setfield(L, -2, "listenerTime");
+		PushLatency(L, DNSBenchmark::Summarize(times), "listener");
+
+		plugin->fMessanger->TimeListener(nullptr);
+		plugin->fMessanger->ForgetBrowser(simulator->Handle());
+		delete simulator;
+		return 1;
+	}
+
+	SimulationConfig config;
+
+	lua_getfield(L, idx, "services");
+	if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0 )
+	{
+		config.services = (size_t)lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "churnPerSec");
+	if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0 )
+	{
+		config.churnPerSec = lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "txtBytes");
+	if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0 )
+	{
+		config.txtBytes = (size_t)lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "seed");
+	if( lua_type(L, -1) == LUA_TNUMBER )
+	{
+		config.seed = (uint32_t)lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "duration");
+	if( lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0 )
+	{
+		config.durationMs = (uint32_t)lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "type");
+	if( lua_type(L, -1) == LUA_TSTRING )
+	{
+		config.type = lua_tostring(L, -1);
+	}
+	lua_pop(L, 1);
+
+	if(plugin->fSimulator)
+	{
+		CoronaLuaWarning(L, "zeroconf.simulate(): a simulation is already running!" );
+		lua_pushnil( L );
+		return 1;
+	}
+
+	plugin->fSimulator = new DNSSimulator(config, manager->EventLoop(), plugin->fMessanger);
+	plugin->fMessanger->TimeListener(plugin->fSimulator->Handle());
+	plugin->fSimulator->Start();
+
+	lua_pushlightuserdata(L, plugin->fSimulator->Handle());
+	return 1;
+}
+
+// [Lua] zeroconf.enableTracing( enabled [, capacity] )
+int
+PluginZeroConf::enableTracing( lua_State *L )
+{
+	if( lua_type(L, 2) == LUA_TNUMBER && lua_tonumber(L, 2) >= 1 )
+	{
+		DNSTimeline::SetCapacity((uint32_t)std::min(lua_tonumber(L, 2), 1048576.0));
+	}
+	DNSTimeline::SetEnabled(lua_isnone(L, 1) || lua_toboolean(L, 1));
+	return 0;
+}
+
+// [Lua] zeroconf.dumpTrace( path [, format] )
+int
+PluginZeroConf::dumpTrace( lua_State *L )
+{
+	if(lua_type(L, 1) != LUA_TSTRING)
+	{
+		CoronaLuaError(L, "zeroconf.dumpTrace(): did not receive file path as first parameter");
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	std::string path = lua_tostring(L, 1);
+	std::string format;
+	if(lua_type(L, 2) == LUA_TSTRING)
+	{
+		format = lua_tostring(L, 2);
+	}
+	else
+	{
+		std::string::size_type dot = path.rfind('.');
+		if(dot != std::string::npos)
+			format = path.substr(dot + 1);
+	}
+
+	DNSTimeline::Format traceFormat = DNSTimeline::kFormatChromeJSON;
+	if(format == "perfetto" || format == "pftrace" || format == "perfetto-trace" || format == "pb")
+		traceFormat = DNSTimeline::kFormatPerfetto;
+
+	bool written = DNSTimeline::Dump(path.c_str(), traceFormat);
+	if(!written)
+	{
+		CoronaLuaWarning(L, "zeroconf.dumpTrace(): unable to write '%s'", path.c_str());
+	}
+
+	lua_pushboolean(L, written);
+	return 1;
+}
+
 
 // ----------------------------------------------------------------------------
 
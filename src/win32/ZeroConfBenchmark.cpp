@@ -0,0 +1,153 @@
+//
+//  ZeroConfBenchmark.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Stand-alone runner for DNSBenchmark. Built with ZEROCONF_EMBEDDED_MDNS,
+//  its publishing and browsing managers talk through the embedded responder
+//  on a private loopback port, so neither a daemon nor the network nor any
+//  other responder on the host takes part in the numbers. Every combination
+//  measured is printed as one line of JSON.
+//
+//  zeroconf_benchmark [--services 0,10,100] [--txt 0,1000] [--churn 0,500]
+//                     [--samples 20] [--timeout 5000] [--port 53531] [--label text]
+//
+
+
+#include "DNSBenchmark.h"
+#include "DNSEmbedded.h"
+#include "DnsServices.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if !defined(ZEROCONF_EMBEDDED_MDNS)
+	#error "the benchmark runs against the embedded responder, define ZEROCONF_EMBEDDED_MDNS"
+#endif
+
+#if !_WINDOWS
+	#ifdef ZEROCONF_POLL_LOOP
+		#include <poll.h>
+	#else
+		#error "the benchmark pumps its own loop, which takes the Windows or the poll loop"
+	#endif
+#endif
+
+using namespace std;
+
+
+// well away from 5353, so that the responder of the host never answers
+static const uint16_t kDefaultPort = 53531;
+
+
+// "1,10,100" into values; false if any of it is not a number
+template<typename T>
+static bool ParseList(const char *text, vector<T> &values)
+{
+	values.clear();
+	while(*text)
+	{
+		char *end;
+		unsigned long value = strtoul(text, &end, 10);
+		if(end == text || (*end != ',' && *end != 0))
+			return false;
+		values.push_back((T)value);
+		text = *end ? end + 1 : end;
+	}
+	return !values.empty();
+}
+
+static void Usage()
+{
+	fprintf(stderr, "usage: zeroconf_benchmark [--services 0,10,100] [--txt 0,1000] [--churn 0,500]\n"
+					"                          [--samples 20] [--timeout 5000] [--port %u] [--label text]\n",
+			(unsigned)kDefaultPort);
+}
+
+// runs what is due on the loop, waiting for it if nothing is
+static void Pump(PlatformEventLoop &loop)
+{
+#if _WINDOWS
+	// every loop of this thread has a window of its own, the thread's queue holds them all
+	MSG msg;
+	if(GetMessage(&msg, NULL, 0, 0) > 0)
+	{
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
+#else
+	pollfd fd = { loop.Descriptor(), POLLIN, 0 };
+	poll(&fd, 1, -1);
+	loop.Poll(0, 0);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	BenchmarkConfig config;
+	DNSEmbeddedConfig embedded;
+	embedded.interfaceAddress = "127.0.0.1";
+	embedded.port = kDefaultPort;
+	embedded.hostLabel = "zcbench";
+	string label;
+
+	for(int i = 1; i < argc; i++)
+	{
+		const char *option = argv[i];
+		const char *value = i + 1 < argc ? argv[++i] : nullptr;
+		bool ok = value != nullptr;
+		if(!ok)
+			;
+		else if(strcmp(option, "--services") == 0)
+			ok = ParseList(value, config.serviceCounts);
+		else if(strcmp(option, "--txt") == 0)
+			ok = ParseList(value, config.txtSizes);
+		else if(strcmp(option, "--churn") == 0)
+			ok = ParseList(value, config.churnIntervals);
+		else if(strcmp(option, "--samples") == 0)
+			ok = (config.samples = (size_t)atoi(value)) > 0;
+		else if(strcmp(option, "--timeout") == 0)
+			ok = (config.timeoutMs = (uint32_t)atoi(value)) > 0;
+		else if(strcmp(option, "--port") == 0)
+			ok = (embedded.port = (uint16_t)atoi(value)) != 0;
+		else if(strcmp(option, "--label") == 0)
+			label = value;
+		else
+			ok = false;
+
+		if(!ok)
+		{
+			Usage();
+			return 2;
+		}
+	}
+
+	// before the first ref, which starts the engine
+	DNSEmbeddedConfigure(embedded);
+
+	PlatformEventLoop loop;
+	bool done = false;
+	size_t timeouts = 0;
+	DNSBenchmark benchmark(config, loop, [&](const vector<BenchmarkResult> &results) {
+		for(const auto &result : results)
+		{
+			printf("%s\n", result.ToJSON(label).c_str());
+			timeouts += result.timeouts;
+		}
+		fflush(stdout);
+		done = true;
+	});
+	benchmark.Start();
+
+	while(!done)
+	{
+		Pump(loop);
+	}
+
+	// samples that timed out say the responder is broken rather than slow
+	return timeouts ? 1 : 0;
+}
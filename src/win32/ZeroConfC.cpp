@@ -0,0 +1,231 @@
+//
+//  ZeroConfC.cpp
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+
+#include "ZeroConfC.h"
+#include "DnsWrapper.h"
+
+#include <stddef.h>
+#include <list>
+#include <string>
+
+#if _WINDOWS
+	#include <Winsock2.h>
+#else
+	#include <arpa/inet.h>
+#endif
+
+
+static_assert(sizeof(zeroconf_address) == sizeof(ServiceAddress), "zeroconf_address must match ServiceAddress");
+static_assert(offsetof(zeroconf_address, bytes) == offsetof(ServiceAddress, bytes), "zeroconf_address must match ServiceAddress");
+static_assert(offsetof(zeroconf_address, ttl) == offsetof(ServiceAddress, ttl), "zeroconf_address must match ServiceAddress");
+static_assert(offsetof(zeroconf_address, reachability) == offsetof(ServiceAddress, reachability), "zeroconf_address must match ServiceAddress");
+static_assert(offsetof(zeroconf_address, rtt_us) == offsetof(ServiceAddress, rttUs), "zeroconf_address must match ServiceAddress");
+static_assert(offsetof(zeroconf_address, interface_index) == offsetof(ServiceAddress, interfaceIndex), "zeroconf_address must match ServiceAddress");
+
+
+// what a view refers back to, it lives on the stack of the callback
+struct zeroconf_service_private
+{
+	const ServiceInfo *info;
+	// values joined from continuations, kept until the callback returns
+	std::list<std::string> joined;
+};
+
+
+// Hands messages to the C callback as views of the ServiceInfo they came with.
+class CMessageBus : public DSNMessageBusBase
+{
+public:
+	CMessageBus(zeroconf_callback callback, void *context)
+	: callback(callback)
+	, context(context)
+	{
+	}
+
+	virtual void Message(const ServiceInfo &srv, int errorCode, const char* phase) override
+	{
+		if(callback == nullptr)
+			return;
+
+		zeroconf_service service;
+		service.name = srv.name();
+		service.type = srv.type();
+		service.domain = srv.domain();
+		service.hostname = srv.hostname();
+		// dns_sd hands the port over in network byte order
+		service.port = srv.port == -1 ? -1 : ntohs((uint16_t)srv.port);
+		service.addresses = (const zeroconf_address*)srv.addresses.begin();
+		service.address_count = srv.addresses.size();
+		service.txt = srv.txtBytes();
+		service.txt_length = srv.txtLength();
+		service.instance_id = srv.instanceId();
+		service.browser = (zeroconf_browser*)srv.browser;
+		service.publisher = (zeroconf_publisher*)srv.publisher;
+
+		zeroconf_service_private internal;
+		internal.info = &srv;
+		service.internal = &internal;
+
+		callback(&service, errorCode, phase, context);
+	}
+
+	zeroconf_callback callback;
+	void *context;
+};
+
+struct zeroconf_manager
+{
+	CMessageBus bus;
+	DNSServiceManager manager;
+
+	zeroconf_manager(zeroconf_callback callback, void *context)
+	: bus(callback, context)
+	, manager(&bus)
+	{
+	}
+};
+
+
+static void SetInstance(ServiceInfo &info, const char *name, const char *type, const char *domain)
+{
+	if(name)
+		info.setName(name);
+	if(type)
+		info.setType(type);
+	if(domain)
+		info.setDomain(domain);
+}
+
+CORONA_EXPORT zeroconf_manager *zeroconf_manager_create(zeroconf_callback callback, void *context)
+{
+	return new zeroconf_manager(callback, context);
+}
+
+CORONA_EXPORT void zeroconf_manager_destroy(zeroconf_manager *manager)
+{
+	if(manager == nullptr)
+		return;
+
+	manager->bus.callback = nullptr;
+	manager->manager.stop();
+	delete manager;
+}
+
+CORONA_EXPORT zeroconf_publisher *zeroconf_manager_publish(zeroconf_manager *manager,
+														   const char *name,
+														   const char *type,
+														   const char *domain,
+														   int port,
+														   const zeroconf_txt_pair *txt,
+														   size_t txt_count)
+{
+	if(manager == nullptr || port < 0 || port > 0xFFFF)
+		return nullptr;
+
+	ServiceInfo si;
+	SetInstance(si, name, type, domain);
+	si.port = htons((uint16_t)port);
+	for(size_t i = 0; i < txt_count; i++)
+	{
+		if(txt[i].key && txt[i].value && !si.setData(txt[i].key, txt[i].value))
+			return nullptr;
+	}
+
+	return (zeroconf_publisher*)manager->manager.publish(std::move(si));
+}
+
+CORONA_EXPORT int zeroconf_manager_unpublish(zeroconf_manager *manager, zeroconf_publisher *publisher)
+{
+	if(manager == nullptr)
+		return 0;
+	return manager->manager.unpublish(publisher) ? 1 : 0;
+}
+
+CORONA_EXPORT zeroconf_browser *zeroconf_manager_browse(zeroconf_manager *manager, const char *type, const char *domain)
+{
+	if(manager == nullptr)
+		return nullptr;
+
+	ServiceInfo si;
+	SetInstance(si, nullptr, type, domain);
+	return (zeroconf_browser*)manager->manager.browse(si);
+}
+
+CORONA_EXPORT int zeroconf_manager_stop_browse(zeroconf_manager *manager, zeroconf_browser *browser)
+{
+	if(manager == nullptr)
+		return 0;
+	return manager->manager.stopBrowser(browser) ? 1 : 0;
+}
+
+CORONA_EXPORT zeroconf_resolver *zeroconf_manager_resolve(zeroconf_manager *manager,
+														  const char *name,
+														  const char *type,
+														  const char *domain,
+														  uint32_t timeout_ms)
+{
+	if(manager == nullptr || name == nullptr || *name == '\0')
+		return nullptr;
+
+	ServiceInfo si;
+	SetInstance(si, name, type, domain);
+	return (zeroconf_resolver*)manager->manager.resolve(si, timeout_ms);
+}
+
+CORONA_EXPORT int zeroconf_manager_stop_resolve(zeroconf_manager *manager, zeroconf_resolver *resolver)
+{
+	if(manager == nullptr)
+		return 0;
+	return manager->manager.stopResolve(resolver) ? 1 : 0;
+}
+
+CORONA_EXPORT void zeroconf_manager_stop(zeroconf_manager *manager)
+{
+	if(manager)
+		manager->manager.stop();
+}
+
+CORONA_EXPORT size_t zeroconf_manager_poll(zeroconf_manager *manager, uint32_t max_events, uint32_t max_ms)
+{
+	if(manager == nullptr)
+		return 0;
+	return manager->manager.EventLoop().Poll(max_events, max_ms);
+}
+
+CORONA_EXPORT int zeroconf_manager_fd(zeroconf_manager *manager)
+{
+	if(manager == nullptr)
+		return -1;
+	return manager->manager.EventLoop().Descriptor();
+}
+
+CORONA_EXPORT int zeroconf_service_txt(const zeroconf_service *service, const char *key, const char **value, size_t *value_length)
+{
+	if(service == nullptr || key == nullptr || service->internal == nullptr)
+		return 0;
+
+	const ServiceInfo &info = *service->internal->info;
+	const char *v;
+	size_t vLen;
+	if(!info.getData(key, &v, &vLen))
+		return 0;
+
+	std::string joined;
+	if(info.joinValue(key, strlen(key), v, vLen, joined))
+	{
+		std::list<std::string> &kept = service->internal->joined;
+		kept.push_back(std::move(joined));
+		v = kept.back().data();
+		vLen = kept.back().size();
+	}
+
+	if(value)
+		*value = v;
+	if(value_length)
+		*value_length = vLen;
+	return 1;
+}
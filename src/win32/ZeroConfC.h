@@ -0,0 +1,142 @@
+//
+//  ZeroConfC.h
+//  ZeroConf plugin for Corona
+//
+//  Copyright © 2016 Corona Labs. All rights reserved.
+//
+//  Plain C interface to DNSServiceManager for native modules that consume
+//  discovery directly instead of going through Lua events.
+//
+
+
+#ifndef ZeroConfC_h
+#define ZeroConfC_h
+
+#include "CoronaMacros.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct zeroconf_manager zeroconf_manager;
+typedef struct zeroconf_browser zeroconf_browser;
+typedef struct zeroconf_publisher zeroconf_publisher;
+typedef struct zeroconf_resolver zeroconf_resolver;
+
+enum
+{
+	ZEROCONF_FAMILY_IPV4 = 4,
+	ZEROCONF_FAMILY_IPV6 = 6,
+};
+
+enum
+{
+	ZEROCONF_REACHABILITY_UNKNOWN = 0,
+	ZEROCONF_REACHABLE = 1,
+	ZEROCONF_UNREACHABLE = 2,
+};
+
+// same layout as the addresses kept by the manager, so they are handed out in place
+typedef struct zeroconf_address
+{
+	uint8_t family;
+	uint8_t bytes[16];
+	// unknown unless the browser probes reachability
+	uint8_t reachability;
+	uint32_t ttl;
+	// connect time of a reachable address, in microseconds
+	uint32_t rtt_us;
+	// interface the address was found on, 0 if unknown
+	uint32_t interface_index;
+} zeroconf_address;
+
+struct zeroconf_service_private;
+
+// Points into the manager's own service data. Nothing is copied, so none of
+// it may be kept past the callback it was passed to.
+typedef struct zeroconf_service
+{
+	const char *name;
+	const char *type;
+	const char *domain;
+	const char *hostname;
+	// in host byte order, -1 while unknown
+	int port;
+
+	const zeroconf_address *addresses;
+	size_t address_count;
+
+	// raw TXT record, see zeroconf_service_txt()
+	const uint8_t *txt;
+	size_t txt_length;
+
+	uint64_t instance_id;
+
+	// whichever of these the event belongs to, the others are NULL
+	zeroconf_browser *browser;
+	zeroconf_publisher *publisher;
+
+	// used by zeroconf_service_txt(), not to be touched
+	struct zeroconf_service_private *internal;
+} zeroconf_service;
+
+typedef struct zeroconf_txt_pair
+{
+	const char *key;
+	const char *value;
+} zeroconf_txt_pair;
+
+// phase is the same string Lua events carry in event.phase: "found", "lost",
+// "updated", "published", "browseError", "resolved" or "resolveError".
+// error is 0 or a dns_sd error code.
+typedef void (*zeroconf_callback)(const zeroconf_service *service, int error, const char *phase, void *context);
+
+// Every manager runs its own event loop and calls back on the thread that
+// created it; on Windows that thread has to pump messages. Calls into a
+// manager must come from that thread as well.
+CORONA_EXPORT zeroconf_manager *zeroconf_manager_create(zeroconf_callback callback, void *context);
+// stops everything without further callbacks
+CORONA_EXPORT void zeroconf_manager_destroy(zeroconf_manager *manager);
+
+// NULL type and domain select the plugin defaults; results are NULL on
+// failure. port is in host byte order, 0 to 65535. Publishing fails if a
+// TXT key is empty or 255 bytes or longer, or all pairs exceed 65535 bytes.
+CORONA_EXPORT zeroconf_publisher *zeroconf_manager_publish(zeroconf_manager *manager,
+														   const char *name,
+														   const char *type,
+														   const char *domain,
+														   int port,
+														   const zeroconf_txt_pair *txt,
+														   size_t txt_count);
+CORONA_EXPORT int zeroconf_manager_unpublish(zeroconf_manager *manager, zeroconf_publisher *publisher);
+
+CORONA_EXPORT zeroconf_browser *zeroconf_manager_browse(zeroconf_manager *manager, const char *type, const char *domain);
+CORONA_EXPORT int zeroconf_manager_stop_browse(zeroconf_manager *manager, zeroconf_browser *browser);
+
+// timeout_ms of 0 never times out
+CORONA_EXPORT zeroconf_resolver *zeroconf_manager_resolve(zeroconf_manager *manager,
+														  const char *name,
+														  const char *type,
+														  const char *domain,
+														  uint32_t timeout_ms);
+CORONA_EXPORT int zeroconf_manager_stop_resolve(zeroconf_manager *manager, zeroconf_resolver *resolver);
+
+// stops every publisher, browser and resolver of the manager
+CORONA_EXPORT void zeroconf_manager_stop(zeroconf_manager *manager);
+
+// For builds with ZEROCONF_POLL_LOOP, where nothing happens unless the host
+// polls: runs at most max_events ready events for about max_ms, 0 for no
+// limit, and returns how many ran. Elsewhere it returns 0, except that on
+// Windows it pumps the manager's own messages.
+CORONA_EXPORT size_t zeroconf_manager_poll(zeroconf_manager *manager, uint32_t max_events, uint32_t max_ms);
+// readable whenever zeroconf_manager_poll() has something to run; -1 where the platform drives the manager
+CORONA_EXPORT int zeroconf_manager_fd(zeroconf_manager *manager);
+
+// Looks up key in the TXT record of service. Returns 0 if it is missing;
+// otherwise value points at value_length bytes that are not NUL terminated.
+// A value continued in "key*1", "key*2" and so on comes back joined, and
+// like the rest of the service it is only valid during the callback.
+CORONA_EXPORT int zeroconf_service_txt(const zeroconf_service *service, const char *key, const char **value, size_t *value_length);
+
+
+#endif /* ZeroConfC_h */